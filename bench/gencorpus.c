@@ -0,0 +1,340 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * bench/gencorpus.c
+ *
+ * Generate a reproducible synthetic source tree for mkfs benchmarks.
+ * The same options and seed always produce the same tree.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define ARRAY_SIZE(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+enum {
+	CONTENT_RANDOM,		/* incompressible */
+	CONTENT_TEXT,		/* text-like, moderately compressible */
+	CONTENT_ZERO,		/* runs of a few bytes, highly compressible */
+	CONTENT_MAX
+};
+
+static struct {
+	unsigned int nfiles;
+	unsigned long long minsize, maxsize;
+	unsigned int fanout;
+	unsigned int files_per_dir;
+	unsigned int mix[CONTENT_MAX];
+	unsigned int hardlink_pct;
+	unsigned int xattr_pct;
+	unsigned long long seed;
+	const char *root;
+} opts = {
+	.nfiles = 1000,
+	.minsize = 0,
+	.maxsize = 1 << 20,
+	.fanout = 4,
+	.files_per_dir = 32,
+	.mix = { 30, 50, 20 },
+	.hardlink_pct = 2,
+	.xattr_pct = 10,
+	.seed = 1,
+};
+
+static unsigned long long rng_state;
+
+/* xorshift64*, good enough and identical everywhere */
+static unsigned long long rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned long long rng_range(unsigned long long lo,
+				    unsigned long long hi)
+{
+	return lo + rng() % (hi - lo + 1);
+}
+
+static const char *const words[] = {
+	"erofs", "block", "inode", "cluster", "compress", "lz4", "data",
+	"the", "of", "and", "read", "only", "file", "system", "image",
+	"kernel", "page", "cache", "xattr", "dirent", "super", "index",
+	"android", "partition", "mount", "offset", "length", "buffer",
+};
+
+static void fill_buffer(char *buf, size_t len, int type)
+{
+	size_t i = 0;
+
+	switch (type) {
+	case CONTENT_RANDOM:
+		for (; i + 8 <= len; i += 8) {
+			unsigned long long v = rng();
+
+			memcpy(buf + i, &v, 8);
+		}
+		for (; i < len; ++i)
+			buf[i] = rng();
+		break;
+	case CONTENT_TEXT:
+		while (i < len) {
+			const char *w = words[rng() % ARRAY_SIZE(words)];
+			size_t n = strlen(w);
+
+			if (n > len - i)
+				n = len - i;
+			memcpy(buf + i, w, n);
+			i += n;
+			if (i < len)
+				buf[i++] = (rng() & 15) ? ' ' : '\n';
+		}
+		break;
+	default:
+		while (i < len) {
+			size_t n = rng_range(64, 4096);
+			char c = (rng() & 3) ? 0 : rng();
+
+			if (n > len - i)
+				n = len - i;
+			memset(buf + i, c, n);
+			i += n;
+		}
+		break;
+	}
+}
+
+static int pick_content_type(void)
+{
+	unsigned int total = 0, r, i;
+
+	for (i = 0; i < CONTENT_MAX; ++i)
+		total += opts.mix[i];
+	if (!total)
+		return CONTENT_ZERO;
+	r = rng() % total;
+	for (i = 0; i < CONTENT_MAX; ++i) {
+		if (r < opts.mix[i])
+			break;
+		r -= opts.mix[i];
+	}
+	return i;
+}
+
+/* log-uniform, so that small files dominate as in real trees */
+static unsigned long long pick_size(void)
+{
+	double lo = opts.minsize + 1, hi = opts.maxsize + 1, v;
+
+	v = lo * exp(log(hi / lo) * ((rng() >> 11) * 0x1.0p-53));
+	return (unsigned long long)v - 1;
+}
+
+static int write_file(const char *path, unsigned long long size, int type)
+{
+	static char buf[65536];
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		return -errno;
+
+	while (size) {
+		size_t n = size < sizeof(buf) ? size : sizeof(buf);
+
+		fill_buffer(buf, n, type);
+		if (write(fd, buf, n) != (ssize_t)n) {
+			close(fd);
+			return -EIO;
+		}
+		size -= n;
+	}
+	return close(fd) ? -errno : 0;
+}
+
+static bool xattr_supported = true;
+
+static void add_xattrs(const char *path)
+{
+	/* a few common values, so that some of them can be shared */
+	static const char *const values[] = {
+		"u:object_r:system_file:s0", "u:object_r:vendor_file:s0",
+		"security.capability-like", "generated by gencorpus",
+	};
+	unsigned int n = rng_range(1, 3), i;
+	char name[32], value[64];
+
+	for (i = 0; i < n && xattr_supported; ++i) {
+		const char *v;
+
+		snprintf(name, sizeof(name), "user.bench%u", i);
+		if (rng() & 1) {
+			v = values[rng() % ARRAY_SIZE(values)];
+		} else {
+			snprintf(value, sizeof(value), "%016llx", rng());
+			v = value;
+		}
+
+		if (lsetxattr(path, name, v, strlen(v), 0)) {
+			fprintf(stderr, "user xattrs are unsupported in %s: %s\n",
+				opts.root, strerror(errno));
+			xattr_supported = false;
+		}
+	}
+}
+
+static int generate(void)
+{
+	unsigned int ndirs = (opts.nfiles + opts.files_per_dir - 1) /
+		opts.files_per_dir;
+	unsigned int i, regular = 0;
+	char (*dirs)[PATH_MAX];
+	char path[PATH_MAX];
+	int ret = 0;
+
+	if (!ndirs)
+		ndirs = 1;
+	strcpy(path, opts.root);
+	dirs = malloc(ndirs * sizeof(*dirs));
+	if (!dirs)
+		return -ENOMEM;
+
+	/* build the directory tree breadth-first with the given fan-out */
+	if (mkdir(opts.root, 0755) && errno != EEXIST) {
+		ret = -errno;
+		goto out;
+	}
+	strcpy(dirs[0], opts.root);
+	for (i = 1; i < ndirs; ++i) {
+		const unsigned int parent = (i - 1) / opts.fanout;
+
+		if (snprintf(dirs[i], PATH_MAX, "%s/d%u", dirs[parent], i) >=
+		    PATH_MAX) {
+			ret = -ENAMETOOLONG;
+			goto out;
+		}
+		if (mkdir(dirs[i], 0755) && errno != EEXIST) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < opts.nfiles; ++i) {
+		const char *dir = dirs[i / opts.files_per_dir];
+
+		snprintf(path, sizeof(path), "%s/f%u", dir, i);
+		if (regular && rng() % 100 < opts.hardlink_pct) {
+			const unsigned int t = rng() % i;
+			char target[PATH_MAX];
+
+			/* link to an earlier file, which could be a link too */
+			snprintf(target, sizeof(target), "%s/f%u",
+				 dirs[t / opts.files_per_dir], t);
+			if (link(target, path)) {
+				ret = -errno;
+				goto out;
+			}
+			continue;
+		}
+
+		ret = write_file(path, pick_size(), pick_content_type());
+		if (ret)
+			goto out;
+		++regular;
+
+		if (rng() % 100 < opts.xattr_pct)
+			add_xattrs(path);
+	}
+out:
+	if (ret)
+		fprintf(stderr, "failed to generate %s: %s\n",
+			path, strerror(-ret));
+	free(dirs);
+	return ret;
+}
+
+static void usage(void)
+{
+	fputs("usage: [options] DIRECTORY\n\n"
+	      "Generate a reproducible synthetic tree in DIRECTORY, and [options] are:\n"
+	      " -n #              number of files (default 1000)\n"
+	      " -s X[,Y]          file sizes from X to Y bytes, log-uniform (default 0,1048576)\n"
+	      " -f #              subdirectories per directory (default 4)\n"
+	      " -p #              files per directory (default 32)\n"
+	      " -m X,Y,Z          weights of random, text and zero-run contents (default 30,50,20)\n"
+	      " -l #              percentage of hardlinks (default 2)\n"
+	      " -x #              percentage of files with user xattrs (default 10)\n"
+	      " -r #              random seed (default 1)\n"
+	      " -h                display this help and exit\n", stderr);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:p:m:l:x:r:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.nfiles = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if (sscanf(optarg, "%llu,%llu", &opts.minsize,
+				   &opts.maxsize) < 1)
+				goto err;
+			if (!strchr(optarg, ','))
+				opts.maxsize = opts.minsize;
+			if (opts.maxsize < opts.minsize)
+				goto err;
+			break;
+		case 'f':
+			opts.fanout = strtoul(optarg, NULL, 0);
+			if (!opts.fanout)
+				goto err;
+			break;
+		case 'p':
+			opts.files_per_dir = strtoul(optarg, NULL, 0);
+			if (!opts.files_per_dir)
+				goto err;
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u,%u,%u", &opts.mix[0],
+				   &opts.mix[1], &opts.mix[2]) != 3)
+				goto err;
+			break;
+		case 'l':
+			opts.hardlink_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			opts.xattr_pct = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			goto err;
+		}
+	}
+
+	if (optind + 1 != argc || strlen(argv[optind]) > PATH_MAX / 2)
+		goto err;
+	opts.root = argv[optind];
+	/* xorshift must not start from zero */
+	rng_state = opts.seed ? opts.seed : 0x9E3779B97F4A7C15ULL;
+	return generate() ? 1 : 0;
+err:
+	usage();
+	return 1;
+}
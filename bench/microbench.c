@@ -0,0 +1,358 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * bench/microbench.c
+ *
+ * Micro-benchmarks of the mkfs hot paths, linked against lib/ directly.
+ * Each benchmark reports ns/op, MB/s (if it processes data) and heap
+ * allocations per op, which are counted by wrapping malloc() & co at
+ * link time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "erofs/config.h"
+#include "erofs/cache.h"
+#include "erofs/inode.h"
+#include "compress_internal.h"
+
+static u64 nr_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	++nr_allocs;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	++nr_allocs;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	++nr_allocs;
+	return __real_realloc(ptr, size);
+}
+
+static unsigned int scale = 1;
+static const char *filter;
+static unsigned long long rng_state = 1;
+
+static unsigned long long rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* accumulated over one or more timed sections */
+struct bench_stat {
+	u64 ns, ops, bytes, allocs;
+	u64 t0, a0;
+};
+
+static inline void bench_start(struct bench_stat *s)
+{
+	s->a0 = nr_allocs;
+	s->t0 = now_ns();
+}
+
+static inline void bench_stop(struct bench_stat *s)
+{
+	s->ns += now_ns() - s->t0;
+	s->allocs += nr_allocs - s->a0;
+}
+
+static bool bench_wanted(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static void bench_report(const char *name, const struct bench_stat *s)
+{
+	printf("%-40s %10llu %12.1f", name, s->ops | 0ULL,
+	       s->ops ? (double)s->ns / s->ops : 0);
+	if (s->bytes && s->ns)
+		printf(" %10.1f", s->bytes * 1e3 / s->ns);
+	else
+		printf(" %10s", "-");
+	printf(" %10.2f\n", s->ops ? (double)s->allocs / s->ops : 0);
+}
+
+/* text-like data compresses as real files do, random data doesn't */
+static void fill_data(u8 *buf, unsigned int len, bool text)
+{
+	static const char *const words[] = {
+		"erofs", "block", "inode", "cluster", "compress", "the",
+		"of", "and", "read", "only", "file", "system", "image",
+	};
+	unsigned int i = 0, n;
+
+	while (i < len) {
+		const char *w;
+
+		if (!text) {
+			buf[i++] = rng();
+			continue;
+		}
+		w = words[rng() % ARRAY_SIZE(words)];
+		n = min_t(unsigned int, strlen(w), len - i);
+		memcpy(buf + i, w, n);
+		i += n;
+		if (i < len)
+			buf[i++] = (rng() & 15) ? ' ' : '\n';
+	}
+}
+
+static void bench_compress_destsize(void)
+{
+	/* the same window as vle_compress_one() sees */
+	static u8 src[EROFS_CONFIG_COMPR_MAX_SZ * 2];
+	static u8 dst[EROFS_MAX_BLOCK_SIZE];
+	const unsigned int window = EROFS_CONFIG_COMPR_MAX_SZ;
+	const char *alg;
+	unsigned int i, t, n;
+
+	for (i = 0; (alg = z_erofs_list_available_compressors(i)); ++i) {
+		struct erofs_compress c;
+		char name[64];
+		int level;
+
+		if (erofs_compressor_init(&c, (char *)alg))
+			continue;
+		level = cfg.c_compr_level_master < 0 ?
+			c.alg->default_level : cfg.c_compr_level_master;
+
+		for (t = 0; t < 2; ++t) {
+			struct bench_stat s = {0};
+			unsigned int off = 0;
+
+			snprintf(name, sizeof(name),
+				 "compress_destsize/%s,%d/%s", alg, level,
+				 t ? "random" : "text");
+			if (!bench_wanted(name))
+				continue;
+			fill_data(src, sizeof(src), !t);
+
+			for (n = 0; n < 500 * scale; ++n) {
+				unsigned int count = window;
+				int ret;
+
+				bench_start(&s);
+				ret = erofs_compress_destsize(&c, level,
+						src + off, &count,
+						dst, EROFS_BLKSIZ);
+				bench_stop(&s);
+				/* incompressible data is stored raw instead */
+				if (ret <= 0)
+					count = EROFS_BLKSIZ;
+				s.bytes += count;
+				++s.ops;
+				off = (off + count) % window;
+			}
+			bench_report(name, &s);
+		}
+		erofs_compressor_exit(&c);
+	}
+}
+
+static void bench_indexes(void)
+{
+	static struct z_erofs_vle_compress_ctx ctx;
+	const erofs_off_t filesize = 16 << 20;
+	struct erofs_inode inode = {
+		.i_size = filesize,
+		.inode_isize = sizeof(struct erofs_inode_compact),
+	};
+	unsigned int i, t;
+
+	for (t = 0; t < 2; ++t) {
+		const char *name = t ? "vle_write_indexes/compacted" :
+			"vle_write_indexes/legacy";
+		struct bench_stat s = {0};
+
+		if (!bench_wanted(name))
+			continue;
+		cfg.c_legacy_compress = !t;
+
+		for (i = 0; i < 50 * scale; ++i) {
+			erofs_off_t pos = 0;
+
+			ctx.clusterofs = 0;
+			ctx.blkaddr = 1;
+
+			/* pclusters of up to 4 blocks of decompressed data */
+			bench_start(&s);
+			if (vle_init_indexes(&inode, &ctx, 0))
+				return;
+			while (pos < filesize) {
+				bool raw = !(rng() & 7);
+				unsigned int count = raw ? EROFS_BLKSIZ :
+					EROFS_BLKSIZ + rng() % (3 * EROFS_BLKSIZ);
+
+				count = min_t(erofs_off_t, count,
+					      filesize - pos);
+				vle_write_indexes(&ctx, count, raw);
+				++ctx.blkaddr;
+				pos += count;
+				++s.ops;
+			}
+			vle_write_indexes_final(&ctx);
+			bench_stop(&s);
+			free(ctx.metabuf);
+			s.bytes += filesize;
+		}
+		bench_report(name, &s);
+	}
+	cfg.c_legacy_compress = false;
+}
+
+static void bench_balloc(void)
+{
+	const unsigned int nr = 20000 * scale;
+	struct bench_stat s = {0};
+	struct erofs_buffer_head *bh;
+	unsigned int i;
+
+	if (bench_wanted("erofs_balloc/inode")) {
+		/* inodes with inline xattrs and tail-end data */
+		for (i = 0; i < nr; ++i) {
+			unsigned int isize = (rng() & 1) ?
+				sizeof(struct erofs_inode_compact) :
+				sizeof(struct erofs_inode_extended);
+
+			bench_start(&s);
+			bh = erofs_balloc(INODE, isize + (rng() & 3) * 32, 0,
+					  rng() % 2048);
+			bench_stop(&s);
+			if (IS_ERR(bh))
+				return;
+			++s.ops;
+		}
+		bench_report("erofs_balloc/inode", &s);
+	}
+
+	if (bench_wanted("erofs_balloc/data+mapbh")) {
+		memset(&s, 0, sizeof(s));
+		for (i = 0; i < nr; ++i) {
+			bench_start(&s);
+			bh = erofs_balloc(DATA,
+					  blknr_to_addr(1 + rng() % 64), 0, 0);
+			if (IS_ERR(bh))
+				return;
+			erofs_mapbh(bh->block, true);
+			bench_stop(&s);
+			++s.ops;
+		}
+		bench_report("erofs_balloc/data+mapbh", &s);
+	}
+}
+
+static void bench_dentries(void)
+{
+	const unsigned int nr = 20000 * scale;
+	struct bench_stat s = {0};
+	struct erofs_inode *dir;
+	unsigned int i;
+	char name[32];
+
+	if (!bench_wanted("erofs_d_alloc") &&
+	    !bench_wanted("erofs_prepare_dir_file"))
+		return;
+
+	dir = erofs_new_inode();
+	if (IS_ERR(dir))
+		return;
+	dir->i_parent = dir;
+
+	/* names come in readdir() order, i.e. unsorted */
+	for (i = 0; i < nr; ++i) {
+		snprintf(name, sizeof(name), "f%016llx", rng());
+		bench_start(&s);
+		erofs_d_alloc(dir, name);
+		bench_stop(&s);
+		++s.ops;
+	}
+	bench_report("erofs_d_alloc (dentry_add_sorted)", &s);
+
+	memset(&s, 0, sizeof(s));
+	bench_start(&s);
+	erofs_prepare_dir_file(dir);
+	bench_stop(&s);
+	s.ops = nr;
+	bench_report("erofs_prepare_dir_file (per dentry)", &s);
+}
+
+static void usage(void)
+{
+	fputs("usage: [options] [FILTER]\n\n"
+	      "Run micro-benchmarks whose names contain FILTER, and [options] are:\n"
+	      " -s #              scale the number of operations by # (default 1)\n"
+	      " -l #              compression level (default: default level)\n"
+	      " -r #              random seed (default 1)\n"
+	      " -h                display this help and exit\n", stderr);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	erofs_init_configure();
+
+	while ((opt = getopt(argc, argv, "s:l:r:h")) != -1) {
+		switch (opt) {
+		case 's':
+			scale = strtoul(optarg, NULL, 0);
+			if (!scale)
+				scale = 1;
+			break;
+		case 'l':
+			cfg.c_compr_level_master = atoi(optarg);
+			break;
+		case 'r':
+			rng_state = strtoull(optarg, NULL, 0);
+			if (!rng_state)
+				rng_state = 1;
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind < argc)
+		filter = argv[optind];
+
+	if (IS_ERR(erofs_buffer_init())) {
+		fprintf(stderr, "failed to initialize buffers\n");
+		return 1;
+	}
+	erofs_inode_manager_init();
+
+	printf("%-40s %10s %12s %10s %10s\n", "benchmark", "ops", "ns/op",
+	       "MB/s", "allocs/op");
+	bench_compress_destsize();
+	bench_indexes();
+	bench_balloc();
+	bench_dentries();
+	erofs_exit_configure();
+	return 0;
+}
@@ -0,0 +1,205 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0+
+#
+# bench/mkfs-bench.sh
+#
+# Run mkfs.erofs over reproducible synthetic corpora with several
+# compression configurations, and record wall/CPU time, peak RSS, image
+# size and syscall counts into a tab-separated results file.
+# Two results files can be compared with -d.
+
+MKFS=../mkfs/mkfs.erofs
+GENCORPUS=./gencorpus
+WORKDIR=./bench-work
+RESULTS=./bench-results.tsv
+CONFIGS=
+RUNS=3
+LABEL=
+KEEP=no
+
+# name:gencorpus options;...
+CORPORA="small:-n 20000 -s 0,16384 -f 8 -p 64 -x 30 -l 5;\
+mixed:-n 1000 -s 0,1048576;\
+large:-n 16 -s 1048576,16777216 -m 60,30,10 -x 0 -l 0"
+
+FIELDS="label	corpus	config	run	wall_s	user_s	sys_s	maxrss_kb	image_bytes	tree_walk_s	compress_s	bflush_s	dev_writes	pclusters	raw_fallbacks	syscalls"
+
+usage() {
+	cat >&2 <<EOF
+usage: $0 [options]
+       $0 -d OLD NEW
+
+Benchmark mkfs.erofs, and [options] are:
+ -m X              mkfs.erofs binary (default $MKFS)
+ -g X              gencorpus binary (default $GENCORPUS)
+ -w X              work directory for corpora and images (default $WORKDIR)
+ -o X              append results to file X (default $RESULTS)
+ -c "X ..."        compression configs, e.g. "none lz4 lz4hc,9"
+                   (default: none and every available compressor)
+ -C "N:OPTS;..."   corpora as name:gencorpus options (default: small, mixed, large)
+ -n #              runs for each corpus and config (default $RUNS)
+ -l X              label of this build in the results (default: git describe)
+ -k                keep generated corpora and images
+ -d OLD NEW        compare medians of two results files
+EOF
+	exit 1
+}
+
+# get a phase time, counter or rusage value from the JSON report
+jget() {
+	sed -n "s/.*\"$1\": \({ \"seconds\": \)\{0,1\}\([0-9.e+-]*\).*/\2/p" "$2" |
+		head -n 1
+}
+
+compare() {
+	[ -r "$1" ] && [ -r "$2" ] || usage
+	awk -F '\t' '
+	function median(key, file,    n, i, j, t, a) {
+		n = cnt[file, key]
+		for (i = 1; i <= n; i++)
+			a[i] = val[file, key, i]
+		for (i = 2; i <= n; i++)
+			for (j = i; j > 1 && a[j - 1] > a[j]; j--) {
+				t = a[j]; a[j] = a[j - 1]; a[j - 1] = t
+			}
+		return n % 2 ? a[(n + 1) / 2] : (a[n / 2] + a[n / 2 + 1]) / 2
+	}
+	function ratio(a, b) {
+		return a ? sprintf("%+.1f%%", (b - a) * 100 / a) : "-"
+	}
+	FNR == 1 {
+		file = (NR == 1) ? 0 : 1
+		for (i = 1; i <= NF; i++)
+			col[$i] = i
+		next
+	}
+	{
+		key = $col["corpus"] "\t" $col["config"]
+		if (!((0, key) in seen) && !((1, key) in seen))
+			order[++nkeys] = key
+		seen[file, key] = 1
+		n = ++cnt[file, key]
+		val[file, "wall", key, n] = $col["wall_s"]
+		val[file, "cpu", key, n] = $col["user_s"] + $col["sys_s"]
+		val[file, "rss", key, n] = $col["maxrss_kb"]
+		val[file, "size", key, n] = $col["image_bytes"]
+		cnt[file, "wall", key] = cnt[file, "cpu", key] = n
+		cnt[file, "rss", key] = cnt[file, "size", key] = n
+	}
+	END {
+		printf "%-10s %-12s %20s %20s %20s %20s\n", "corpus", "config",
+			"wall_s", "cpu_s", "maxrss_kb", "image_bytes"
+		for (k = 1; k <= nkeys; k++) {
+			key = order[k]
+			if (!((0, key) in seen) || !((1, key) in seen))
+				continue
+			split(key, kc, "\t")
+			line = sprintf("%-10s %-12s", kc[1], kc[2])
+			split("wall cpu rss size", m, " ")
+			for (i = 1; i <= 4; i++) {
+				a = median(m[i] SUBSEP key, 0)
+				b = median(m[i] SUBSEP key, 1)
+				fmt = i <= 2 ? "%.6f" : "%.0f"
+				line = line sprintf(" %12s %7s",
+						    sprintf(fmt, b), ratio(a, b))
+			}
+			print line
+		}
+	}' "$1" "$2"
+}
+
+while getopts "m:g:w:o:c:C:n:l:kd" opt; do
+	case $opt in
+	m) MKFS=$OPTARG ;;
+	g) GENCORPUS=$OPTARG ;;
+	w) WORKDIR=$OPTARG ;;
+	o) RESULTS=$OPTARG ;;
+	c) CONFIGS=$OPTARG ;;
+	C) CORPORA=$OPTARG ;;
+	n) RUNS=$OPTARG ;;
+	l) LABEL=$OPTARG ;;
+	k) KEEP=yes ;;
+	d) shift $((OPTIND - 1)); compare "$@"; exit ;;
+	*) usage ;;
+	esac
+done
+
+[ -x "$MKFS" ] || { echo "$MKFS is not executable" >&2; exit 1; }
+[ -x "$GENCORPUS" ] || { echo "$GENCORPUS is not executable" >&2; exit 1; }
+
+if [ -z "$CONFIGS" ]; then
+	CONFIGS="none $("$MKFS" --help 2>&1 |
+		sed -n 's/^Available compressors are: //p' | tr -d ',')"
+fi
+[ -n "$LABEL" ] || LABEL=$(git describe --always --dirty 2>/dev/null || echo unknown)
+command -v strace >/dev/null 2>&1 && STRACE=yes || STRACE=no
+
+mkdir -p "$WORKDIR" || exit 1
+[ -s "$RESULTS" ] || echo "$FIELDS" > "$RESULTS"
+
+IFS_SAVED=$IFS
+IFS=';'
+for corpus in $CORPORA; do
+	IFS=$IFS_SAVED
+	name=${corpus%%:*}
+	genopts=${corpus#*:}
+	src=$WORKDIR/$name
+
+	# regenerate only if the corpus options have changed
+	if [ "$(cat "$src.opts" 2>/dev/null)" != "$genopts" ]; then
+		echo "generating corpus $name ($genopts)" >&2
+		rm -rf "$src" "$src.opts"
+		"$GENCORPUS" $genopts "$src" || exit 1
+		echo "$genopts" > "$src.opts"
+	fi
+
+	for config in $CONFIGS; do
+		case $config in
+		none) zopt= ;;
+		*) zopt=-z$config ;;
+		esac
+		img=$WORKDIR/$name.img
+		report=$WORKDIR/$name.json
+
+		syscalls=-
+		if [ $STRACE = yes ]; then
+			rm -f "$img"
+			strace -f -c -o "$WORKDIR/strace.out" \
+				"$MKFS" -T0 $zopt "$img" "$src" >/dev/null 2>&1
+			syscalls=$(awk '$NF == "total" { print $4 }' \
+				   "$WORKDIR/strace.out")
+		fi
+
+		run=1
+		while [ $run -le "$RUNS" ]; do
+			rm -f "$img" "$report"
+			if ! "$MKFS" -T0 $zopt --report="$report" "$img" "$src" \
+			     >/dev/null 2>"$WORKDIR/mkfs.err"; then
+				echo "mkfs.erofs failed on $name ($config):" >&2
+				cat "$WORKDIR/mkfs.err" >&2
+				exit 1
+			fi
+
+			printf '%s\t' "$LABEL" "$name" "$config" "$run" \
+				"$(jget total "$report")" \
+				"$(jget user_seconds "$report")" \
+				"$(jget system_seconds "$report")" \
+				"$(jget max_rss_kb "$report")" \
+				"$(stat -c %s "$img")" \
+				"$(jget tree_walk "$report")" \
+				"$(jget compress "$report")" \
+				"$(jget bflush "$report")" \
+				"$(jget dev_writes "$report")" \
+				"$(jget pclusters "$report")" \
+				"$(jget raw_fallbacks "$report")" >> "$RESULTS"
+			echo "$syscalls" >> "$RESULTS"
+			echo "$name $config run $run: $(jget total "$report")s" >&2
+			run=$((run + 1))
+		done
+		[ $KEEP = yes ] || rm -f "$img" "$report"
+	done
+	[ $KEEP = yes ] || rm -rf "$src" "$src.opts"
+	IFS=';'
+done
+IFS=$IFS_SAVED
+echo "results appended to $RESULTS" >&2
@@ -0,0 +1,943 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/dump/main.c
+ *
+ * Report how an EROFS image turned out: its superblock, and statistics of
+ * compression ratios, raw fallbacks, metadata blocks and their padding,
+ * inline tails, shared xattrs and the placement of inodes, so that mkfs
+ * options can be tuned by numbers.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "erofs/config.h"
+#include "erofs/print.h"
+#include "erofs/stats.h"
+#include "erofs/reader.h"
+#include "replay.h"
+
+/* file extensions listed separately, the others are summed up */
+#define DUMP_TOP_EXTS		10
+#define DUMP_EXT_LEN		15
+
+static struct erofsdump_config {
+	const char *image, *trace;
+	u64 cache_size;
+	bool superblock, statistics, json;
+} dcfg;
+
+static struct erofs_image *img;
+
+enum {
+	DUMP_BLK_OTHER,		/* the superblock, shared xattrs or padding */
+	DUMP_BLK_META,		/* inodes, inline xattrs, indexes and tails */
+	DUMP_BLK_DIR,
+	DUMP_BLK_DATA,
+	DUMP_BLK_PCLUSTER,
+	DUMP_BLK_MAX
+};
+
+static const char *blk_names[DUMP_BLK_MAX] = {
+	"other", "metadata", "directory", "data", "pcluster",
+};
+
+/* the kind of each block, and the bytes used in each metadata block */
+static u8 *blk_kind;
+static u32 *blk_used;
+
+struct erofsdump_ratio {
+	u64 files, bytes, stored;
+};
+
+static const char *size_names[] = {
+	"0", "<4K", "<16K", "<64K", "<256K", "<1M", "<16M", ">=16M",
+};
+#define DUMP_SIZE_BUCKETS	ARRAY_SIZE(size_names)
+
+/* stored bytes per 100 bytes of compressed files */
+static const unsigned int ratio_limits[] = { 10, 25, 50, 75, 90, 100 };
+#define DUMP_RATIO_BUCKETS	(ARRAY_SIZE(ratio_limits) + 1)
+
+/* blocks between a dirent and the inode it points to */
+static const unsigned int dist_limits[] = { 0, 1, 4, 16, 64, 256 };
+#define DUMP_DIST_BUCKETS	(ARRAY_SIZE(dist_limits) + 1)
+
+static const char *type_names[EROFS_FT_MAX] = {
+	"unknown", "regular", "directory", "chrdev", "blkdev", "fifo",
+	"socket", "symlink",
+};
+
+static const char *layout_names[EROFS_INODE_DATALAYOUT_MAX] = {
+	"flat_plain", "compressed_legacy", "flat_inline", "compressed",
+};
+
+static struct {
+	u64 inodes, hardlinks;
+	u64 types[EROFS_FT_MAX];
+	u64 layouts[EROFS_INODE_DATALAYOUT_MAX];
+	struct erofsdump_ratio sizes[DUMP_SIZE_BUCKETS];
+	u64 ratios[DUMP_RATIO_BUCKETS];
+	u64 pclusters, plain, pcluster_bytes, plain_bytes;
+	u64 inline_files, inline_bytes, slack_files, slack_bytes;
+	u64 xattrs, shared_xattrs, unique_xattrs, unique_shared_xattrs;
+	u64 repeated_inline_xattrs, repeated_inline_bytes;
+	u64 dirs, dirents, distances[DUMP_DIST_BUCKETS], distance_sum;
+	u64 dir_meta_blocks;
+} st;
+
+struct erofsdump_ext {
+	struct hlist_node node;
+	char name[DUMP_EXT_LEN + 1];
+	struct erofsdump_ratio r;
+};
+
+/* xattrs are told apart by their names and values */
+struct erofsdump_xattr {
+	struct hlist_node node;
+	u64 hash;
+	unsigned int len, size;
+	u64 refs, shared;
+	char data[];			/* the name, '\0' and the value */
+};
+
+#define DUMP_HASHBITS		12
+static struct hlist_head ext_hash[1 << DUMP_HASHBITS];
+static struct hlist_head xattr_hash[1 << DUMP_HASHBITS];
+static struct hlist_head *nid_hash;
+static unsigned int nid_hashbits;
+
+struct erofsdump_nid {
+	struct hlist_node node;
+	erofs_nid_t nid;
+};
+
+struct erofsdump_dir {
+	struct list_head list;
+	erofs_nid_t nid;
+};
+
+static LIST_HEAD(dirs);
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 1},
+	{"json", no_argument, NULL, 2},
+	{"replay", required_argument, NULL, 3},
+	{"cache-size", required_argument, NULL, 4},
+	{0, 0, 0, 0},
+};
+
+static void usage(void)
+{
+	fputs("usage: [options] IMAGE\n\n"
+	      "Dump the superblock and statistics of the erofs IMAGE, and [options] are:\n"
+	      " -d#               set output message level to # (maximum 9)\n"
+	      " -s                show the superblock only\n"
+	      " -S                show the statistics only\n"
+	      " --json            print JSON rather than text\n"
+	      " --replay=X        replay the access trace X and report the cost of reads\n"
+	      " --cache-size=#    replay with a page cache of # MiB (default 32)\n"
+	      " --help            display this help and exit\n", stderr);
+}
+
+static int erofsdump_parse_options(int argc, char **argv)
+{
+	char *endptr;
+	int opt, i;
+
+	dcfg.cache_size = EROFS_READER_CACHE_SIZE;
+	while ((opt = getopt_long(argc, argv, "d:sS", long_options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			i = atoi(optarg);
+			if (i < EROFS_MSG_MIN || i > EROFS_MSG_MAX) {
+				erofs_err("invalid debug level %d", i);
+				return -EINVAL;
+			}
+			cfg.c_dbg_lvl = i;
+			break;
+		case 's':
+			dcfg.superblock = true;
+			break;
+		case 'S':
+			dcfg.statistics = true;
+			break;
+		case 2:
+			dcfg.json = true;
+			break;
+		case 3:
+			dcfg.trace = optarg;
+			break;
+		case 4:
+			dcfg.cache_size = strtoull(optarg, &endptr, 0);
+			if (*endptr || dcfg.cache_size > (1ULL << 44) >> 20) {
+				erofs_err("invalid cache size %s", optarg);
+				return -EINVAL;
+			}
+			dcfg.cache_size <<= 20;
+			break;
+		case 1:
+		default:
+			return -EINVAL;
+		}
+	}
+	if (optind + 1 != argc) {
+		erofs_err("expected IMAGE");
+		return -EINVAL;
+	}
+	dcfg.image = argv[optind];
+	/* replaying a trace shows nothing else unless asked to */
+	if (!dcfg.superblock && !dcfg.statistics && !dcfg.trace)
+		dcfg.superblock = dcfg.statistics = true;
+	return 0;
+}
+
+/* FNV-1a, which is good enough for names and short values */
+static u64 erofsdump_hash(const void *data, size_t len, u64 h)
+{
+	const u8 *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * 0x100000001b3ULL;
+	return h;
+}
+
+/* return true if @nid hasn't been seen yet */
+static int erofsdump_mark_nid(erofs_nid_t nid)
+{
+	struct hlist_head *head = &nid_hash[hash_64(nid, nid_hashbits)];
+	struct erofsdump_nid *n;
+
+	hlist_for_each_entry(n, head, node)
+		if (n->nid == nid)
+			return 0;
+	n = malloc(sizeof(*n));
+	if (!n)
+		return -ENOMEM;
+	n->nid = nid;
+	hlist_add_head(&n->node, head);
+	return 1;
+}
+
+static void erofsdump_mark(erofs_off_t pos, erofs_off_t len, u8 kind)
+{
+	while (len) {
+		const erofs_blk_t blk = pos >> img->blkszbits;
+		const unsigned int n = min_t(u64, len,
+					     img->blksz - (pos & (img->blksz - 1)));
+
+		/* it must have been reported by the reader */
+		if (blk >= img->blocks)
+			return;
+		blk_kind[blk] = kind;
+		blk_used[blk] = min(blk_used[blk] + n, img->blksz);
+		pos += n;
+		len -= n;
+	}
+}
+
+static void erofsdump_mark_blocks(erofs_blk_t blkaddr, erofs_off_t size,
+				  u8 kind)
+{
+	erofsdump_mark((erofs_off_t)blkaddr << img->blkszbits, size, kind);
+}
+
+static int erofsdump_xattr(void *arg, const char *name, const void *value,
+			   unsigned int size, bool shared)
+{
+	const unsigned int namelen = strlen(name) + 1;
+	const u64 hash = erofsdump_hash(value, size,
+			erofsdump_hash(name, namelen, 0xcbf29ce484222325ULL));
+	struct hlist_head *head = &xattr_hash[hash_64(hash, DUMP_HASHBITS)];
+	struct erofsdump_xattr *x;
+
+	++st.xattrs;
+	if (shared)
+		++st.shared_xattrs;
+	hlist_for_each_entry(x, head, node) {
+		if (x->hash == hash && x->len == namelen + size &&
+		    !memcmp(x->data, name, namelen) &&
+		    !memcmp(x->data + namelen, value, size))
+			goto found;
+	}
+	x = malloc(sizeof(*x) + namelen + size);
+	if (!x)
+		return -ENOMEM;
+	x->hash = hash;
+	x->len = namelen + size;
+	x->size = size;
+	x->refs = x->shared = 0;
+	memcpy(x->data, name, namelen);
+	memcpy(x->data + namelen, value, size);
+	hlist_add_head(&x->node, head);
+found:
+	++x->refs;
+	if (shared)
+		++x->shared;
+	return 0;
+}
+
+static struct erofsdump_ext *erofsdump_get_ext(const char *name,
+					       unsigned int namelen)
+{
+	const char *dot = memrchr(name, '.', namelen);
+	char ext[DUMP_EXT_LEN + 1] = "(none)";
+	struct erofsdump_ext *e;
+	struct hlist_head *head;
+
+	/* not for hidden files such as ".profile" */
+	if (dot && dot != name && dot + 1 < name + namelen &&
+	    name + namelen - dot - 1 <= DUMP_EXT_LEN) {
+		memcpy(ext, dot + 1, name + namelen - dot - 1);
+		ext[name + namelen - dot - 1] = '\0';
+	}
+	head = &ext_hash[hash_64(erofsdump_hash(ext, strlen(ext),
+				 0xcbf29ce484222325ULL), DUMP_HASHBITS)];
+	hlist_for_each_entry(e, head, node)
+		if (!strcmp(e->name, ext))
+			return e;
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	strcpy(e->name, ext);
+	hlist_add_head(&e->node, head);
+	return e;
+}
+
+static void erofsdump_add_ratio(struct erofsdump_ratio *r, u64 bytes,
+				u64 stored)
+{
+	++r->files;
+	r->bytes += bytes;
+	r->stored += stored;
+}
+
+static int erofsdump_regular(struct erofs_rinode *vi, const char *name,
+			     unsigned int namelen)
+{
+	const unsigned int tail = vi->i_size & (img->blksz - 1);
+	struct erofsdump_ext *e;
+	unsigned int i, b;
+	u64 stored;
+
+	switch (vi->datalayout) {
+	case EROFS_INODE_FLAT_PLAIN:
+		stored = round_up(vi->i_size, img->blksz);
+		if (tail) {
+			++st.slack_files;
+			st.slack_bytes += img->blksz - tail;
+		}
+		break;
+	case EROFS_INODE_FLAT_INLINE:
+		stored = vi->i_size;
+		if (tail) {
+			++st.inline_files;
+			st.inline_bytes += tail;
+		}
+		break;
+	default:
+		stored = (u64)vi->nr_extents << img->blkszbits;
+		for (i = 0; i < vi->nr_extents; ++i) {
+			const unsigned int len = erofs_extent_length(vi, i);
+
+			if (vi->extents[i].type ==
+			    Z_EROFS_VLE_CLUSTER_TYPE_PLAIN) {
+				++st.plain;
+				st.plain_bytes += len;
+			} else {
+				++st.pclusters;
+				st.pcluster_bytes += len;
+			}
+		}
+		if (vi->i_size) {
+			for (b = 0; b < ARRAY_SIZE(ratio_limits); ++b)
+				if (stored * 100 <= vi->i_size * ratio_limits[b])
+					break;
+			++st.ratios[b];
+		}
+		break;
+	}
+
+	for (b = 0; b < DUMP_SIZE_BUCKETS - 1; ++b)
+		if (vi->i_size < (b ? 1ULL << (10 + 2 * b) : 1))
+			break;
+	/* 1M and 16M don't follow the others */
+	if (b == 5 && vi->i_size >= (1ULL << 20))
+		b = vi->i_size < (16ULL << 20) ? 6 : 7;
+	erofsdump_add_ratio(&st.sizes[b], vi->i_size, stored);
+
+	e = erofsdump_get_ext(name, namelen);
+	if (!e)
+		return -ENOMEM;
+	erofsdump_add_ratio(&e->r, vi->i_size, stored);
+	return 0;
+}
+
+/* account an inode, which is visited once even if it's hardlinked */
+static int erofsdump_inode(struct erofs_rinode *vi, const char *name,
+			   unsigned int namelen)
+{
+	const erofs_off_t iend = vi->iloc + vi->inode_isize + vi->xattr_isize;
+	const unsigned int tail = vi->i_size & (img->blksz - 1);
+	const u8 kind = S_ISDIR(vi->i_mode) ? DUMP_BLK_DIR : DUMP_BLK_DATA;
+	unsigned int i;
+	int ret;
+
+	++st.inodes;
+	++st.types[erofs_mode_to_ftype(vi->i_mode)];
+	++st.layouts[vi->datalayout];
+
+	ret = erofs_xattr_iterate(vi, erofsdump_xattr, NULL);
+	if (ret < 0)
+		return ret;
+
+	if (S_ISCHR(vi->i_mode) || S_ISBLK(vi->i_mode) ||
+	    S_ISFIFO(vi->i_mode) || S_ISSOCK(vi->i_mode)) {
+		erofsdump_mark(vi->iloc, iend - vi->iloc, DUMP_BLK_META);
+		return 0;
+	}
+
+	switch (vi->datalayout) {
+	case EROFS_INODE_FLAT_PLAIN:
+		erofsdump_mark(vi->iloc, iend - vi->iloc, DUMP_BLK_META);
+		erofsdump_mark_blocks(vi->u.i_blkaddr, vi->i_size, kind);
+		break;
+	case EROFS_INODE_FLAT_INLINE:
+		erofsdump_mark(vi->iloc, iend - vi->iloc + tail, DUMP_BLK_META);
+		erofsdump_mark_blocks(vi->u.i_blkaddr, vi->i_size - tail, kind);
+		break;
+	default:
+		erofsdump_mark(vi->iloc, round_up(iend, 8) + vi->z_idxsize -
+			       vi->iloc, DUMP_BLK_META);
+		for (i = 0; i < vi->nr_extents; ++i)
+			erofsdump_mark_blocks(vi->extents[i].blkaddr,
+					      img->blksz, DUMP_BLK_PCLUSTER);
+		break;
+	}
+	if (S_ISREG(vi->i_mode))
+		return erofsdump_regular(vi, name, namelen);
+	return 0;
+}
+
+struct erofsdump_dirctx {
+	struct erofs_rinode *dir;
+	erofs_blk_t *blocks;		/* inode blocks of the children */
+	unsigned int nr, max;
+	int err;
+};
+
+/* where the data of a directory at @off is on the disk */
+static erofs_off_t erofsdump_dir_addr(struct erofs_rinode *dir,
+				      erofs_off_t off)
+{
+	const erofs_off_t tailstart = round_down(dir->i_size, img->blksz);
+
+	if (dir->datalayout == EROFS_INODE_FLAT_INLINE && off >= tailstart)
+		return dir->iloc + dir->inode_isize + dir->xattr_isize +
+			off - tailstart;
+	return ((erofs_off_t)dir->u.i_blkaddr << img->blkszbits) + off;
+}
+
+static int erofsdump_push_dir(erofs_nid_t nid)
+{
+	struct erofsdump_dir *d = malloc(sizeof(*d));
+
+	if (!d)
+		return -ENOMEM;
+	d->nid = nid;
+	list_add(&d->list, &dirs);
+	return 0;
+}
+
+static int erofsdump_dirent(void *arg, const struct erofs_rdirent *de)
+{
+	struct erofsdump_dirctx *ctx = arg;
+	const erofs_blk_t dblk =
+		erofsdump_dir_addr(ctx->dir, de->off) >> img->blkszbits;
+	const erofs_blk_t iblk = (((erofs_off_t)img->meta_blkaddr <<
+				   img->blkszbits) +
+				  (de->nid << EROFS_ISLOTBITS)) >>
+				 img->blkszbits;
+	const erofs_blk_t dist = dblk > iblk ? dblk - iblk : iblk - dblk;
+	struct erofs_rinode vi;
+	unsigned int b;
+	int ret;
+
+	if ((de->namelen == 1 && de->name[0] == '.') ||
+	    (de->namelen == 2 && !memcmp(de->name, "..", 2)))
+		return 0;
+
+	++st.dirents;
+	st.distance_sum += dist;
+	for (b = 0; b < ARRAY_SIZE(dist_limits); ++b)
+		if (dist <= dist_limits[b])
+			break;
+	++st.distances[b];
+
+	if (ctx->nr >= ctx->max) {
+		erofs_blk_t *blocks;
+
+		ctx->max = max(ctx->max * 2, 64U);
+		blocks = realloc(ctx->blocks, ctx->max * sizeof(*blocks));
+		if (!blocks)
+			goto err_nomem;
+		ctx->blocks = blocks;
+	}
+	ctx->blocks[ctx->nr++] = iblk;
+
+	ret = erofsdump_mark_nid(de->nid);
+	if (ret <= 0) {
+		if (!ret)
+			++st.hardlinks;
+		ctx->err = ret;
+		return ret;
+	}
+	ret = erofs_read_inode(img, de->nid, &vi);
+	if (ret) {
+		erofs_err("failed to read inode %llu (%.*s): %s",
+			  de->nid | 0ULL, (int)de->namelen, de->name,
+			  erofs_strerror(ret));
+		ctx->err = ret;
+		return ret;
+	}
+	ret = erofsdump_inode(&vi, de->name, de->namelen);
+	if (!ret && S_ISDIR(vi.i_mode))
+		ret = erofsdump_push_dir(de->nid);
+	erofs_put_inode(&vi);
+	ctx->err = ret;
+	return ret;
+
+err_nomem:
+	ctx->err = -ENOMEM;
+	return ctx->err;
+}
+
+static int erofsdump_cmp_blk(const void *a, const void *b)
+{
+	const erofs_blk_t x = *(const erofs_blk_t *)a;
+	const erofs_blk_t y = *(const erofs_blk_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int erofsdump_dir(erofs_nid_t nid)
+{
+	struct erofsdump_dirctx ctx = {};
+	struct erofs_rinode vi;
+	unsigned int i;
+	int ret;
+
+	ret = erofs_read_inode(img, nid, &vi);
+	if (ret)
+		return ret;
+	ctx.dir = &vi;
+	++st.dirs;
+	ret = erofs_readdir(&vi, 0, erofsdump_dirent, &ctx);
+	if (ret > 0)
+		ret = ctx.err;
+	erofs_put_inode(&vi);
+
+	/* the metadata blocks read by listing the directory with stat() */
+	if (ctx.nr) {
+		qsort(ctx.blocks, ctx.nr, sizeof(*ctx.blocks),
+		      erofsdump_cmp_blk);
+		for (i = 0; i < ctx.nr; ++i)
+			if (!i || ctx.blocks[i] != ctx.blocks[i - 1])
+				++st.dir_meta_blocks;
+	}
+	free(ctx.blocks);
+	return ret;
+}
+
+static int erofsdump_walk(void)
+{
+	struct erofsdump_dir *d, *tmp;
+	struct erofsdump_nid *n;
+	struct erofs_rinode root;
+	struct hlist_node *pos;
+	unsigned int i;
+	u64 nr;
+	int ret;
+
+	nr = img->inos ? img->inos : img->blocks;
+	nid_hashbits = 10;
+	while (nid_hashbits < 20 && (nr >> nid_hashbits))
+		++nid_hashbits;
+	nid_hash = calloc(1U << nid_hashbits, sizeof(*nid_hash));
+	blk_kind = calloc(img->blocks, sizeof(*blk_kind));
+	blk_used = calloc(img->blocks, sizeof(*blk_used));
+	if (!nid_hash || !blk_kind || !blk_used)
+		return -ENOMEM;
+
+	ret = erofs_read_inode(img, img->root_nid, &root);
+	if (ret)
+		return ret;
+	ret = erofsdump_inode(&root, "", 0);
+	erofs_put_inode(&root);
+	if (!ret)
+		ret = erofsdump_mark_nid(img->root_nid);
+	if (ret >= 0)
+		ret = erofsdump_push_dir(img->root_nid);
+
+	while (!ret && !list_empty(&dirs)) {
+		d = list_first_entry(&dirs, struct erofsdump_dir, list);
+		list_del(&d->list);
+		ret = erofsdump_dir(d->nid);
+		free(d);
+	}
+	list_for_each_entry_safe(d, tmp, &dirs, list)
+		free(d);
+	for (i = 0; i < 1U << nid_hashbits; ++i)
+		hlist_for_each_entry_safe(n, pos, &nid_hash[i], node)
+			free(n);
+	free(nid_hash);
+	return ret;
+}
+
+static void erofsdump_sum_xattrs(void)
+{
+	struct erofsdump_xattr *x;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xattr_hash); ++i) {
+		hlist_for_each_entry(x, &xattr_hash[i], node) {
+			++st.unique_xattrs;
+			if (x->shared)
+				++st.unique_shared_xattrs;
+			/* inlined copies which could have been shared */
+			if (x->refs > 1 && x->refs > x->shared) {
+				st.repeated_inline_xattrs += x->refs - x->shared;
+				st.repeated_inline_bytes +=
+					(x->refs - x->shared) * x->len;
+			}
+		}
+	}
+}
+
+static int erofsdump_cmp_ext(const void *a, const void *b)
+{
+	const struct erofsdump_ext *x = *(struct erofsdump_ext **)a;
+	const struct erofsdump_ext *y = *(struct erofsdump_ext **)b;
+
+	if (x->r.bytes != y->r.bytes)
+		return x->r.bytes < y->r.bytes ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+/* the largest extensions by bytes, and the others summed in @other */
+static struct erofsdump_ext **erofsdump_top_exts(unsigned int *nr,
+						 struct erofsdump_ext *other)
+{
+	struct erofsdump_ext *e, **exts = NULL;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ext_hash); ++i)
+		hlist_for_each_entry(e, &ext_hash[i], node)
+			++n;
+	exts = malloc(max(n, 1U) * sizeof(*exts));
+	if (!exts)
+		return NULL;
+	n = 0;
+	for (i = 0; i < ARRAY_SIZE(ext_hash); ++i)
+		hlist_for_each_entry(e, &ext_hash[i], node)
+			exts[n++] = e;
+	qsort(exts, n, sizeof(*exts), erofsdump_cmp_ext);
+
+	memset(other, 0, sizeof(*other));
+	strcpy(other->name, "(other)");
+	for (i = DUMP_TOP_EXTS; i < n; ++i) {
+		other->r.files += exts[i]->r.files;
+		other->r.bytes += exts[i]->r.bytes;
+		other->r.stored += exts[i]->r.stored;
+	}
+	*nr = min(n, (unsigned int)DUMP_TOP_EXTS);
+	return exts;
+}
+
+static double erofsdump_pct(u64 part, u64 total)
+{
+	return total ? 100.0 * part / total : 0;
+}
+
+static void erofsdump_print_superblock(void)
+{
+	char uuid[37];
+	time_t t = img->build_time;
+	char tbuf[64];
+	unsigned int i;
+
+	for (i = 0; i < 16; ++i)
+		sprintf(uuid + i * 2 + (i >= 4) + (i >= 6) + (i >= 8) +
+			(i >= 10), "%02x", img->uuid[i]);
+	uuid[8] = uuid[13] = uuid[18] = uuid[23] = '-';
+	strftime(tbuf, sizeof(tbuf), "%F %T UTC", gmtime(&t));
+
+	if (dcfg.json) {
+		printf("\t\"superblock\": {\n"
+		       "\t\t\"block_size\": %u,\n"
+		       "\t\t\"blocks\": %u,\n"
+		       "\t\t\"inodes\": %llu,\n"
+		       "\t\t\"root_nid\": %llu,\n"
+		       "\t\t\"meta_blkaddr\": %u,\n"
+		       "\t\t\"xattr_blkaddr\": %u,\n"
+		       "\t\t\"feature_compat\": %u,\n"
+		       "\t\t\"feature_incompat\": %u,\n"
+		       "\t\t\"checksum\": %u,\n"
+		       "\t\t\"build_time\": %llu,\n"
+		       "\t\t\"uuid\": \"%s\",\n"
+		       "\t\t\"volume_name\": ",
+		       img->blksz, img->blocks, img->inos | 0ULL,
+		       img->root_nid | 0ULL, img->meta_blkaddr,
+		       img->xattr_blkaddr, img->feature_compat,
+		       img->feature_incompat, img->checksum,
+		       img->build_time | 0ULL, uuid);
+		erofs_json_write_string(stdout, img->volume_name);
+		printf("\n\t}");
+		return;
+	}
+	printf("Filesystem block size:        %u\n"
+	       "Filesystem blocks:            %u\n"
+	       "Filesystem inode count:       %llu\n"
+	       "Filesystem root nid:          %llu\n"
+	       "Filesystem meta_blkaddr:      %u\n"
+	       "Filesystem xattr_blkaddr:     %u\n"
+	       "Filesystem features:          compat 0x%x, incompat 0x%x%s%s\n"
+	       "Filesystem checksum:          0x%08x\n"
+	       "Filesystem created:           %s\n"
+	       "Filesystem UUID:              %s\n"
+	       "Filesystem volume name:       %s\n",
+	       img->blksz, img->blocks, img->inos | 0ULL,
+	       img->root_nid | 0ULL, img->meta_blkaddr, img->xattr_blkaddr,
+	       img->feature_compat, img->feature_incompat,
+	       img->feature_compat & EROFS_FEATURE_COMPAT_SB_CHKSUM ?
+			" sb_csum" : "",
+	       img->feature_incompat & EROFS_FEATURE_INCOMPAT_LZ4_0PADDING ?
+			" 0padding" : "",
+	       img->checksum, tbuf, uuid, img->volume_name);
+}
+
+static void erofsdump_print_ratio(const char *indent, const char *name,
+				  const struct erofsdump_ratio *r, bool last)
+{
+	if (dcfg.json) {
+		printf("%s", indent);
+		erofs_json_write_string(stdout, name);
+		printf(": { \"files\": %llu, \"bytes\": %llu, \"stored\": %llu }%s\n",
+		       r->files | 0ULL, r->bytes | 0ULL, r->stored | 0ULL,
+		       last ? "" : ",");
+		return;
+	}
+	printf("  %-16s %10llu %14llu %14llu %7.2f%%\n", name,
+	       r->files | 0ULL, r->bytes | 0ULL, r->stored | 0ULL,
+	       erofsdump_pct(r->stored, r->bytes));
+}
+
+static void erofsdump_print_counts(const char *title, const char **names,
+				   const u64 *counts, unsigned int n)
+{
+	unsigned int i;
+
+	if (dcfg.json) {
+		printf(",\n\t\t\"%s\": {", title);
+		for (i = 0; i < n; ++i)
+			printf("%s \"%s\": %llu", i ? "," : "", names[i],
+			       counts[i] | 0ULL);
+		printf(" }");
+		return;
+	}
+	printf("%s:\n", title);
+	for (i = 0; i < n; ++i)
+		if (counts[i])
+			printf("  %-18s %llu\n", names[i], counts[i] | 0ULL);
+}
+
+static int erofsdump_print_statistics(void)
+{
+	static const char *ratio_names[DUMP_RATIO_BUCKETS] = {
+		"<=10%", "<=25%", "<=50%", "<=75%", "<=90%", "<=100%", ">100%",
+	};
+	static const char *dist_names[DUMP_DIST_BUCKETS] = {
+		"0", "1", "2-4", "5-16", "17-64", "65-256", ">256",
+	};
+	u64 blocks[DUMP_BLK_MAX] = {}, meta_used = 0;
+	struct erofsdump_ext **exts, other;
+	unsigned int i, nr;
+	erofs_blk_t b;
+
+	for (b = 0; b < img->blocks; ++b) {
+		++blocks[blk_kind[b]];
+		if (blk_kind[b] == DUMP_BLK_META)
+			meta_used += blk_used[b];
+	}
+	erofsdump_sum_xattrs();
+	exts = erofsdump_top_exts(&nr, &other);
+	if (!exts)
+		return -ENOMEM;
+
+	if (dcfg.json) {
+		printf("\t\"statistics\": {\n"
+		       "\t\t\"inodes\": %llu,\n\t\t\"hardlinks\": %llu",
+		       st.inodes | 0ULL, st.hardlinks | 0ULL);
+		erofsdump_print_counts("file_types", type_names, st.types,
+				       EROFS_FT_MAX);
+		erofsdump_print_counts("data_layouts", layout_names,
+				       st.layouts, EROFS_INODE_DATALAYOUT_MAX);
+		erofsdump_print_counts("blocks", blk_names, blocks,
+				       DUMP_BLK_MAX);
+		printf(",\n\t\t\"metadata\": { \"blocks\": %llu, \"used_bytes\": %llu, \"padding_bytes\": %llu }",
+		       blocks[DUMP_BLK_META] | 0ULL, meta_used | 0ULL,
+		       (blocks[DUMP_BLK_META] * img->blksz - meta_used) |
+		       0ULL);
+		printf(",\n\t\t\"file_sizes\": {\n");
+		for (i = 0; i < DUMP_SIZE_BUCKETS; ++i)
+			erofsdump_print_ratio("\t\t\t", size_names[i],
+					      &st.sizes[i],
+					      i == DUMP_SIZE_BUCKETS - 1);
+		printf("\t\t},\n\t\t\"file_extensions\": {\n");
+		for (i = 0; i < nr; ++i)
+			erofsdump_print_ratio("\t\t\t", exts[i]->name,
+					      &exts[i]->r, false);
+		erofsdump_print_ratio("\t\t\t", other.name, &other.r, true);
+		printf("\t\t}");
+		erofsdump_print_counts("compression_ratios", ratio_names,
+				       st.ratios, DUMP_RATIO_BUCKETS);
+		printf(",\n\t\t\"pclusters\": { \"compressed\": %llu, \"compressed_bytes\": %llu, \"plain\": %llu, \"plain_bytes\": %llu }",
+		       st.pclusters | 0ULL, st.pcluster_bytes | 0ULL,
+		       st.plain | 0ULL, st.plain_bytes | 0ULL);
+		printf(",\n\t\t\"tails\": { \"inline_files\": %llu, \"inline_bytes\": %llu, \"block_files\": %llu, \"slack_bytes\": %llu }",
+		       st.inline_files | 0ULL, st.inline_bytes | 0ULL,
+		       st.slack_files | 0ULL, st.slack_bytes | 0ULL);
+		printf(",\n\t\t\"xattrs\": { \"references\": %llu, \"shared_references\": %llu, \"unique\": %llu, \"unique_shared\": %llu, \"repeated_inline\": %llu, \"repeated_inline_bytes\": %llu }",
+		       st.xattrs | 0ULL, st.shared_xattrs | 0ULL,
+		       st.unique_xattrs | 0ULL, st.unique_shared_xattrs | 0ULL,
+		       st.repeated_inline_xattrs | 0ULL,
+		       st.repeated_inline_bytes | 0ULL);
+		printf(",\n\t\t\"placement\": { \"directories\": %llu, \"dirents\": %llu, \"distance_blocks\": %llu, \"metadata_blocks_per_directory\": %.3f",
+		       st.dirs | 0ULL, st.dirents | 0ULL,
+		       st.distance_sum | 0ULL, st.dirs ?
+		       (double)st.dir_meta_blocks / st.dirs : 0);
+		printf(", \"distances\": {");
+		for (i = 0; i < DUMP_DIST_BUCKETS; ++i)
+			printf("%s \"%s\": %llu", i ? "," : "", dist_names[i],
+			       st.distances[i] | 0ULL);
+		printf(" } }\n\t}");
+		free(exts);
+		return 0;
+	}
+
+	printf("Inodes:               %llu (%llu hardlinks)\n",
+	       st.inodes | 0ULL, st.hardlinks | 0ULL);
+	erofsdump_print_counts("File types", type_names, st.types,
+			       EROFS_FT_MAX);
+	erofsdump_print_counts("Data layouts", layout_names, st.layouts,
+			       EROFS_INODE_DATALAYOUT_MAX);
+	erofsdump_print_counts("Blocks", blk_names, blocks, DUMP_BLK_MAX);
+	printf("Metadata:             %llu blocks, %llu bytes used, %llu bytes (%.2f%%) padding\n",
+	       blocks[DUMP_BLK_META] | 0ULL, meta_used | 0ULL,
+	       (blocks[DUMP_BLK_META] * img->blksz - meta_used) | 0ULL,
+	       100 - erofsdump_pct(meta_used,
+				   blocks[DUMP_BLK_META] * img->blksz));
+
+	printf("File sizes:\n  %-16s %10s %14s %14s %8s\n", "size", "files",
+	       "bytes", "stored", "ratio");
+	for (i = 0; i < DUMP_SIZE_BUCKETS; ++i)
+		if (st.sizes[i].files)
+			erofsdump_print_ratio("", size_names[i],
+					      &st.sizes[i], false);
+	printf("File extensions:\n  %-16s %10s %14s %14s %8s\n",
+	       "extension", "files", "bytes", "stored", "ratio");
+	for (i = 0; i < nr; ++i)
+		erofsdump_print_ratio("", exts[i]->name, &exts[i]->r, false);
+	if (other.r.files)
+		erofsdump_print_ratio("", other.name, &other.r, false);
+	erofsdump_print_counts("Compression ratios of compressed files",
+			       ratio_names, st.ratios, DUMP_RATIO_BUCKETS);
+
+	printf("Pclusters:            %llu compressed (%llu bytes), %llu plain (%llu bytes), %.2f%% raw fallbacks\n",
+	       st.pclusters | 0ULL, st.pcluster_bytes | 0ULL,
+	       st.plain | 0ULL, st.plain_bytes | 0ULL,
+	       erofsdump_pct(st.plain, st.pclusters + st.plain));
+	printf("Tail-end data:        %llu files inline (%llu bytes), %llu files in blocks (%llu bytes slack)\n",
+	       st.inline_files | 0ULL, st.inline_bytes | 0ULL,
+	       st.slack_files | 0ULL, st.slack_bytes | 0ULL);
+	printf("Xattrs:               %llu references, %.2f%% shared, %llu unique (%llu shared)\n",
+	       st.xattrs | 0ULL, erofsdump_pct(st.shared_xattrs, st.xattrs),
+	       st.unique_xattrs | 0ULL, st.unique_shared_xattrs | 0ULL);
+	printf("                      %llu repeated xattrs inline (%llu bytes)\n",
+	       st.repeated_inline_xattrs | 0ULL,
+	       st.repeated_inline_bytes | 0ULL);
+	printf("Inode placement:      %llu dirents, %.2f blocks from dirents to inodes on average,\n"
+	       "                      %.3f metadata blocks per directory\n",
+	       st.dirents | 0ULL,
+	       st.dirents ? (double)st.distance_sum / st.dirents : 0,
+	       st.dirs ? (double)st.dir_meta_blocks / st.dirs : 0);
+	erofsdump_print_counts("Blocks from dirents to inodes", dist_names,
+			       st.distances, DUMP_DIST_BUCKETS);
+	free(exts);
+	return 0;
+}
+
+static void erofsdump_cleanup(void)
+{
+	struct erofsdump_xattr *x;
+	struct erofsdump_ext *e;
+	struct hlist_node *n;
+	unsigned int i;
+
+	for (i = 0; i < 1U << DUMP_HASHBITS; ++i) {
+		hlist_for_each_entry_safe(x, n, &xattr_hash[i], node)
+			free(x);
+		hlist_for_each_entry_safe(e, n, &ext_hash[i], node)
+			free(e);
+	}
+	free(blk_kind);
+	free(blk_used);
+}
+
+int main(int argc, char **argv)
+{
+	int err;
+
+	erofs_init_configure();
+	err = erofsdump_parse_options(argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			usage();
+		return 1;
+	}
+
+	img = erofs_image_open(dcfg.image, EROFS_READER_CACHE_SIZE, 0);
+	if (IS_ERR(img))
+		return 1;
+	if (dcfg.statistics) {
+		err = erofsdump_walk();
+		if (err) {
+			erofs_err("failed to walk %s: %s", dcfg.image,
+				  erofs_strerror(err));
+			goto exit;
+		}
+	}
+
+	if (dcfg.json)
+		printf("{\n");
+	if (dcfg.superblock)
+		erofsdump_print_superblock();
+	if (dcfg.superblock && dcfg.statistics)
+		printf(dcfg.json ? ",\n" : "\n");
+	if (dcfg.statistics)
+		err = erofsdump_print_statistics();
+	if (!err && dcfg.trace) {
+		if (dcfg.superblock || dcfg.statistics)
+			printf(dcfg.json ? ",\n" : "\n");
+		err = erofsdump_replay(img, dcfg.trace, dcfg.cache_size,
+				       dcfg.json);
+	}
+	if (dcfg.json)
+		printf("\n}\n");
+exit:
+	erofsdump_cleanup();
+	erofs_image_close(img);
+	erofs_exit_configure();
+	return err ? 1 : 0;
+}
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/dump/replay.c
+ *
+ * Replay an access trace against an image to estimate what the workload
+ * costs on it: device I/Os, bytes read and bytes decompressed.
+ *
+ * Reads are modeled as the kernel does them, a page (block) at a time
+ * through an LRU page cache shared by file pages and metadata blocks:
+ *  - a missed page of an uncompressed file reads its block, and inline
+ *    tail-end data is read with the inode block;
+ *  - a missed page of a compressed file reads every pcluster overlapping
+ *    it and decompresses the whole extents, and all pages fully inside the
+ *    extents are filled, but a pcluster is read once per access;
+ *  - the first lookup of a path reads the inode blocks (with compression
+ *    indexes) along it and all blocks of the directories, and resolved
+ *    paths are never evicted, as in the dcache;
+ *  - blocks read one after another by an access are merged into one I/O.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include "erofs/print.h"
+#include "erofs/trace.h"
+#include "replay.h"
+
+#define REPLAY_HASHBITS		16
+
+/* metadata blocks are cached in the page cache of the block device */
+#define REPLAY_BDEV_NID		(~0ULL)
+
+struct replay_page {
+	struct list_head lru;
+	struct hlist_node node;
+	erofs_nid_t nid;
+	u64 index;
+};
+
+struct replay_file {
+	struct hlist_node node;
+	char *path;
+	int err;			/* a negative dentry if non-zero */
+	bool warned;
+	struct erofs_rinode vi;
+};
+
+static struct erofs_image *img;
+static struct hlist_head page_hash[1 << REPLAY_HASHBITS];
+static struct hlist_head file_hash[1 << REPLAY_HASHBITS];
+static LIST_HEAD(page_lru);
+static u64 nr_pages, max_pages;
+
+/* the block following the last one read by this access, to merge I/Os */
+static u64 next_blk;
+
+static struct {
+	u64 accesses, skipped, bytes;
+	u64 hits, misses;
+	u64 ios, data_blocks, meta_blocks;
+	u64 pclusters, plain_pclusters, decompressed;
+} rs;
+
+static u32 replay_page_hash(erofs_nid_t nid, u64 index)
+{
+	return hash_64(nid * 0x9e3779b97f4a7c15ULL + index, REPLAY_HASHBITS);
+}
+
+/* look up a page, and make it the most recently used one */
+static bool replay_lookup_page(erofs_nid_t nid, u64 index)
+{
+	struct hlist_head *head = &page_hash[replay_page_hash(nid, index)];
+	struct replay_page *p;
+
+	hlist_for_each_entry(p, head, node) {
+		if (p->nid == nid && p->index == index) {
+			list_del(&p->lru);
+			list_add(&p->lru, &page_lru);
+			return true;
+		}
+	}
+	return false;
+}
+
+static int replay_add_page(erofs_nid_t nid, u64 index)
+{
+	struct replay_page *p;
+
+	if (!max_pages || replay_lookup_page(nid, index))
+		return 0;
+	if (nr_pages < max_pages) {
+		p = malloc(sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		++nr_pages;
+	} else {
+		/* evict the least recently used page */
+		p = list_last_entry(&page_lru, struct replay_page, lru);
+		list_del(&p->lru);
+		hlist_del(&p->node);
+	}
+	p->nid = nid;
+	p->index = index;
+	list_add(&p->lru, &page_lru);
+	hlist_add_head(&p->node, &page_hash[replay_page_hash(nid, index)]);
+	return 0;
+}
+
+static void replay_read_block(erofs_blk_t blk)
+{
+	if (blk != next_blk)
+		++rs.ios;
+	next_blk = blk + 1ULL;
+}
+
+/* read metadata in [@pos, @pos + @len) through the page cache */
+static int replay_read_meta(erofs_off_t pos, erofs_off_t len)
+{
+	erofs_blk_t blk = pos >> img->blkszbits;
+	const erofs_blk_t end = DIV_ROUND_UP(pos + len, img->blksz);
+	int ret;
+
+	for (; blk < end; ++blk) {
+		if (replay_lookup_page(REPLAY_BDEV_NID, blk)) {
+			++rs.hits;
+			continue;
+		}
+		++rs.misses;
+		++rs.meta_blocks;
+		replay_read_block(blk);
+		ret = replay_add_page(REPLAY_BDEV_NID, blk);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int replay_read_inode(struct erofs_rinode *vi)
+{
+	erofs_off_t end = vi->iloc + vi->inode_isize + vi->xattr_isize;
+
+	if (vi->datalayout == EROFS_INODE_FLAT_COMPRESSION ||
+	    vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY)
+		end = round_up(end, 8) + vi->z_idxsize;
+	return replay_read_meta(vi->iloc, end - vi->iloc);
+}
+
+static int replay_read_dir(struct erofs_rinode *dir)
+{
+	const erofs_off_t tail = dir->i_size & (img->blksz - 1);
+	const erofs_off_t iend = dir->iloc + dir->inode_isize +
+		dir->xattr_isize;
+	int ret;
+
+	if (dir->datalayout != EROFS_INODE_FLAT_INLINE)
+		return replay_read_meta((erofs_off_t)dir->u.i_blkaddr <<
+					img->blkszbits, dir->i_size);
+	ret = replay_read_meta((erofs_off_t)dir->u.i_blkaddr <<
+			       img->blkszbits, dir->i_size - tail);
+	if (!ret && tail)
+		ret = replay_read_meta(iend, tail);
+	return ret;
+}
+
+static u32 replay_path_hash(const char *path, unsigned int len)
+{
+	u32 hash = 0;
+
+	while (len--)
+		hash = hash * 131 + (unsigned char)*path++;
+	return hash_32(hash, REPLAY_HASHBITS);
+}
+
+/* resolve the first @len bytes of @path as the kernel would do it */
+static struct replay_file *replay_lookup(const char *path, unsigned int len)
+{
+	struct hlist_head *head = &file_hash[replay_path_hash(path, len)];
+	const char *name = memrchr(path, '/', len);
+	struct replay_file *f, *parent = NULL;
+	erofs_nid_t nid = img->root_nid;
+
+	hlist_for_each_entry(f, head, node)
+		if (!strncmp(f->path, path, len) && !f->path[len])
+			return f;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return ERR_PTR(-ENOMEM);
+	f->path = strndup(path, len);
+	if (!f->path) {
+		free(f);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	name = name ? name + 1 : path;
+	if (len) {
+		parent = replay_lookup(path, name == path ? 0 : name - path - 1);
+		if (IS_ERR(parent)) {
+			free(f->path);
+			free(f);
+			return parent;
+		}
+		f->err = parent->err;
+		if (!f->err && !S_ISDIR(parent->vi.i_mode))
+			f->err = -ENOTDIR;
+		if (!f->err)
+			f->err = replay_read_dir(&parent->vi);
+		if (!f->err)
+			f->err = erofs_namei(&parent->vi, name,
+					     path + len - name, &nid, NULL);
+	}
+	if (!f->err) {
+		f->err = erofs_read_inode(img, nid, &f->vi);
+		if (!f->err) {
+			f->err = replay_read_inode(&f->vi);
+			if (f->err)
+				erofs_put_inode(&f->vi);
+		}
+	}
+	/* only out of memory is fatal */
+	if (f->err == -ENOMEM) {
+		free(f->path);
+		free(f);
+		return ERR_PTR(-ENOMEM);
+	}
+	hlist_add_head(&f->node, head);
+	return f;
+}
+
+/* read @page of a compressed file, starting from the extent @*next */
+static int replay_read_zpage(struct erofs_rinode *vi, u64 page,
+			     unsigned int *next)
+{
+	const erofs_off_t start = page << img->blkszbits;
+	const erofs_off_t end = min(start + img->blksz, vi->i_size);
+	unsigned int i = max(erofs_find_extent(vi, start), *next);
+	int ret;
+
+	for (; i < vi->nr_extents && vi->extents[i].lstart < end; ++i) {
+		const erofs_off_t lstart = vi->extents[i].lstart;
+		const erofs_off_t lend = lstart + erofs_extent_length(vi, i);
+		u64 p;
+
+		++rs.data_blocks;
+		replay_read_block(vi->extents[i].blkaddr);
+		if (vi->extents[i].type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN) {
+			++rs.plain_pclusters;
+		} else {
+			++rs.pclusters;
+			rs.decompressed += lend - lstart;
+		}
+
+		/* pages partially decompressed are dropped */
+		for (p = DIV_ROUND_UP(lstart, img->blksz);
+		     (p + 1) << img->blkszbits <= lend ||
+		     ((p << img->blkszbits) < lend && lend == vi->i_size);
+		     ++p) {
+			ret = replay_add_page(vi->nid, p);
+			if (ret)
+				return ret;
+		}
+	}
+	*next = i;
+	return replay_add_page(vi->nid, page);
+}
+
+static int replay_access(const char *path, u64 start, u64 end)
+{
+	struct erofs_rinode *vi;
+	struct replay_file *f;
+	unsigned int next = 0;
+	u64 page;
+	int ret;
+
+	++rs.accesses;
+	next_blk = ~0ULL;
+	f = replay_lookup(path, strlen(path));
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+	if (f->err || !S_ISREG(f->vi.i_mode)) {
+		++rs.skipped;
+		if (!f->warned)
+			erofs_warn("skipped /%s: %s", path,
+				   erofs_strerror(f->err ? f->err : -EISDIR));
+		f->warned = true;
+		return 0;
+	}
+
+	vi = &f->vi;
+	end = min(end, vi->i_size);
+	if (start >= end)
+		return 0;
+	rs.bytes += end - start;
+
+	for (page = start >> img->blkszbits;
+	     page < DIV_ROUND_UP(end, img->blksz); ++page) {
+		if (replay_lookup_page(vi->nid, page)) {
+			++rs.hits;
+			continue;
+		}
+		++rs.misses;
+
+		switch (vi->datalayout) {
+		case EROFS_INODE_FLAT_INLINE:
+			if (page == vi->i_size >> img->blkszbits) {
+				/* it's in the inode block which is cached */
+				ret = replay_read_inode(vi);
+				if (!ret)
+					ret = replay_add_page(vi->nid, page);
+				break;
+			}
+			/* fallthrough */
+		case EROFS_INODE_FLAT_PLAIN:
+			++rs.data_blocks;
+			replay_read_block(vi->u.i_blkaddr + page);
+			ret = replay_add_page(vi->nid, page);
+			break;
+		default:
+			ret = replay_read_zpage(vi, page, &next);
+			break;
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void replay_cleanup(void)
+{
+	struct replay_page *p, *n;
+	struct replay_file *f;
+	struct hlist_node *pos;
+	unsigned int i;
+
+	list_for_each_entry_safe(p, n, &page_lru, lru)
+		free(p);
+	for (i = 0; i < ARRAY_SIZE(file_hash); ++i) {
+		hlist_for_each_entry_safe(f, pos, &file_hash[i], node) {
+			if (!f->err)
+				erofs_put_inode(&f->vi);
+			free(f->path);
+			free(f);
+		}
+	}
+}
+
+static double replay_ratio(u64 a, u64 b)
+{
+	return b ? (double)a / b : 0;
+}
+
+static void replay_print(u64 cache_size, bool json)
+{
+	const u64 read = (rs.data_blocks + rs.meta_blocks) << img->blkszbits;
+
+	if (json) {
+		printf("\t\"replay\": {\n"
+		       "\t\t\"cache_size\": %llu,\n"
+		       "\t\t\"accesses\": %llu,\n"
+		       "\t\t\"skipped\": %llu,\n"
+		       "\t\t\"requested_bytes\": %llu,\n"
+		       "\t\t\"page_hits\": %llu,\n"
+		       "\t\t\"page_misses\": %llu,\n"
+		       "\t\t\"device_ios\": %llu,\n"
+		       "\t\t\"data_blocks\": %llu,\n"
+		       "\t\t\"metadata_blocks\": %llu,\n"
+		       "\t\t\"bytes_read\": %llu,\n"
+		       "\t\t\"pclusters\": %llu,\n"
+		       "\t\t\"plain_pclusters\": %llu,\n"
+		       "\t\t\"bytes_decompressed\": %llu,\n"
+		       "\t\t\"read_amplification\": %.3f,\n"
+		       "\t\t\"decompression_amplification\": %.3f\n"
+		       "\t}",
+		       cache_size | 0ULL, rs.accesses | 0ULL,
+		       rs.skipped | 0ULL, rs.bytes | 0ULL, rs.hits | 0ULL,
+		       rs.misses | 0ULL, rs.ios | 0ULL, rs.data_blocks | 0ULL,
+		       rs.meta_blocks | 0ULL, read | 0ULL,
+		       rs.pclusters | 0ULL, rs.plain_pclusters | 0ULL,
+		       rs.decompressed | 0ULL, replay_ratio(read, rs.bytes),
+		       replay_ratio(rs.decompressed, rs.bytes));
+		return;
+	}
+	printf("Page cache:           %llu bytes, %llu hits, %llu misses (%.2f%% hit rate)\n"
+	       "Accesses:             %llu (%llu skipped), %llu bytes requested\n"
+	       "Device I/Os:          %llu, %llu bytes read (%llu data blocks, %llu metadata blocks)\n"
+	       "Pclusters:            %llu decompressed (%llu bytes), %llu plain\n"
+	       "Read amplification:   %.3f\n"
+	       "Decompression amplification: %.3f\n",
+	       cache_size | 0ULL, rs.hits | 0ULL, rs.misses | 0ULL,
+	       100 * replay_ratio(rs.hits, rs.hits + rs.misses),
+	       rs.accesses | 0ULL, rs.skipped | 0ULL, rs.bytes | 0ULL,
+	       rs.ios | 0ULL, read | 0ULL, rs.data_blocks | 0ULL,
+	       rs.meta_blocks | 0ULL, rs.pclusters | 0ULL,
+	       rs.decompressed | 0ULL, rs.plain_pclusters | 0ULL,
+	       replay_ratio(read, rs.bytes),
+	       replay_ratio(rs.decompressed, rs.bytes));
+}
+
+int erofsdump_replay(struct erofs_image *image, const char *trace,
+		     u64 cache_size, bool json)
+{
+	unsigned int lineno = 0;
+	char *line = NULL, *path;
+	u64 start, end;
+	size_t n = 0;
+	ssize_t len;
+	int ret = 0;
+	FILE *fp;
+
+	img = image;
+	max_pages = cache_size >> img->blkszbits;
+	fp = fopen(trace, "r");
+	if (!fp) {
+		ret = -errno;
+		erofs_err("failed to open access trace %s: %s", trace,
+			  erofs_strerror(ret));
+		return ret;
+	}
+
+	while ((len = getline(&line, &n, fp)) >= 0) {
+		char *p = line;
+
+		++lineno;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		p += strspn(p, " \t");
+		if (!*p || *p == '#')
+			continue;
+
+		ret = erofs_trace_parse_entry(p, &path, &start, &end);
+		if (ret) {
+			erofs_err("invalid access trace entry at line %u: %s",
+				  lineno, erofs_strerror(ret));
+			break;
+		}
+		ret = replay_access(path, start, end);
+		if (ret) {
+			erofs_err("failed to replay line %u: %s", lineno,
+				  erofs_strerror(ret));
+			break;
+		}
+	}
+	if (!ret && ferror(fp)) {
+		erofs_err("failed to read access trace %s", trace);
+		ret = -EIO;
+	}
+	free(line);
+	fclose(fp);
+	if (!ret)
+		replay_print(cache_size, json);
+	replay_cleanup();
+	return ret;
+}
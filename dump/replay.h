@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/dump/replay.h
+ */
+#ifndef __EROFSDUMP_REPLAY_H
+#define __EROFSDUMP_REPLAY_H
+
+#include "erofs/reader.h"
+
+int erofsdump_replay(struct erofs_image *img, const char *trace,
+		     u64 cache_size, bool json);
+
+#endif
@@ -0,0 +1,1022 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/fsck/main.c
+ *
+ * Check an EROFS image without mounting it, and optionally extract it.  The
+ * tree is walked by the main thread, which checks the superblock, inodes,
+ * xattrs, directories and compression indexes, and queues the compressed
+ * data of each file to a pool of threads, which decompress every pcluster
+ * and write the data of extracted files.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include "erofs/config.h"
+#include "erofs/print.h"
+#include "erofs/crc32c.h"
+#include "erofs/reader.h"
+#include "erofs/workqueue.h"
+
+/* exit codes of fsck(8) */
+#define FSCK_OK			0
+#define FSCK_ERRORS_LEFT	4
+#define FSCK_ERROR		8
+#define FSCK_USAGE		16
+
+/* the number of extents of a file decompressed by one work */
+#define FSCK_EXTENTS_PER_WORK	64
+/* the bytes of an uncompressed file extracted by one work */
+#define FSCK_BYTES_PER_WORK	(4U << 20)
+
+static struct erofsfsck_config {
+	const char *image;
+	const char *extract;
+	unsigned int extractlen;	/* without trailing '/' */
+	unsigned int threads;
+	bool nodata, overwrite, preserve_owner;
+} fcfg;
+
+static struct erofs_image *img;
+static struct erofs_workqueue wq;
+
+static struct {
+	pthread_mutex_t lock;
+	u64 errors;
+	u64 dirs, files, hardlinks, xattrs;
+	u64 pclusters, plain;
+	u64 compressed_bytes, decompressed_bytes;
+	u64 written_bytes, hole_bytes;
+} fsck = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define fsck_err(fmt, ...) do {				\
+	pthread_mutex_lock(&fsck.lock);			\
+	++fsck.errors;					\
+	pthread_mutex_unlock(&fsck.lock);		\
+	erofs_err(fmt, ##__VA_ARGS__);			\
+} while (0)
+
+/* every inode reached, to check hardlinks and loops */
+struct erofsfsck_inode {
+	struct hlist_node node;
+	erofs_nid_t nid;
+	u32 nlink, refs;
+	bool dir;
+	char *path;			/* extracted, for later hardlinks */
+};
+
+static struct hlist_head *inode_hash;
+static unsigned int inode_hashbits;
+static u64 nr_inodes;
+
+/* directories to be walked, in depth-first order */
+struct erofsfsck_dir {
+	struct list_head list;
+	erofs_nid_t nid, pnid;
+	char *path;
+};
+
+static LIST_HEAD(dirs);
+
+/*
+ * extracted directories, whose attributes are set once all files in them
+ * are written, the deepest first
+ */
+struct erofsfsck_xdir {
+	struct list_head list;
+	char *path;
+	umode_t mode;
+	u32 uid, gid;
+	struct timespec mtime;
+};
+
+static LIST_HEAD(xdirs);
+
+struct erofsfsck_file {
+	struct erofs_rinode vi;
+	char *path;
+	int fd;				/* the extracted file, or -1 */
+	unsigned int refs;		/* works which aren't done yet */
+};
+
+/* extents [start, end), or bytes if the file isn't compressed */
+struct erofsfsck_work {
+	struct erofs_work work;
+	struct erofsfsck_file *f;
+	u64 start, end;
+};
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 1},
+	{"threads", required_argument, NULL, 't'},
+	{"no-data", no_argument, NULL, 2},
+	{"extract", required_argument, NULL, 3},
+	{"overwrite", no_argument, NULL, 4},
+	{0, 0, 0, 0},
+};
+
+static void usage(void)
+{
+	fputs("usage: [options] IMAGE\n\n"
+	      "Check the erofs IMAGE, and [options] are:\n"
+	      " -d#               set output message level to # (maximum 9)\n"
+	      " -t, --threads=#   decompress with # threads (default: online CPUs)\n"
+	      " --no-data         skip decompressing file data\n"
+	      " --extract=X       extract the filesystem to directory X as well\n"
+	      " --overwrite       replace existing files when extracting\n"
+	      " --help            display this help and exit\n", stderr);
+}
+
+static int erofsfsck_parse_options(int argc, char **argv)
+{
+	char *endptr;
+	int opt, i;
+
+	fcfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt_long(argc, argv, "d:t:", long_options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			i = atoi(optarg);
+			if (i < EROFS_MSG_MIN || i > EROFS_MSG_MAX) {
+				erofs_err("invalid debug level %d", i);
+				return -EINVAL;
+			}
+			cfg.c_dbg_lvl = i;
+			break;
+		case 't':
+			fcfg.threads = strtoul(optarg, &endptr, 0);
+			if (*endptr || fcfg.threads > 1024) {
+				erofs_err("invalid number of threads %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 2:
+			fcfg.nodata = true;
+			break;
+		case 3:
+			fcfg.extract = optarg;
+			break;
+		case 4:
+			fcfg.overwrite = true;
+			break;
+		case 1:
+		default:
+			return -EINVAL;
+		}
+	}
+	if (optind + 1 != argc) {
+		erofs_err("expected IMAGE");
+		return -EINVAL;
+	}
+	fcfg.image = argv[optind];
+	if (fcfg.extract) {
+		unsigned int len = strlen(fcfg.extract);
+
+		while (len && fcfg.extract[len - 1] == '/')
+			--len;
+		fcfg.extractlen = len;
+	}
+	if (fcfg.extract && fcfg.nodata) {
+		erofs_err("--extract can't be used with --no-data");
+		return -EINVAL;
+	}
+	if (fcfg.overwrite && !fcfg.extract) {
+		erofs_err("--overwrite is only for --extract");
+		return -EINVAL;
+	}
+	fcfg.preserve_owner = !geteuid();
+	return 0;
+}
+
+static int erofsfsck_check_sb_csum(void)
+{
+	u8 *buf;
+	u32 crc;
+	int ret;
+
+	if (!(img->feature_compat & EROFS_FEATURE_COMPAT_SB_CHKSUM))
+		return 0;
+	buf = malloc(img->blksz);
+	if (!buf)
+		return -ENOMEM;
+	ret = erofs_image_read(img, buf, img->blksz, 0);
+	if (!ret) {
+		struct erofs_super_block *sb =
+			(void *)(buf + EROFS_SUPER_OFFSET);
+
+		/* it's calculated with the checksum field zeroed */
+		sb->checksum = 0;
+		crc = erofs_crc32c(~0, (u8 *)sb,
+				   img->blksz - EROFS_SUPER_OFFSET);
+		if (crc != img->checksum)
+			fsck_err("superblock checksum 0x%08x mismatches, 0x%08x expected",
+				 crc, img->checksum);
+	}
+	free(buf);
+	return ret;
+}
+
+static struct erofsfsck_inode *erofsfsck_inode_get(erofs_nid_t nid,
+						   bool *created)
+{
+	struct hlist_head *head = &inode_hash[hash_64(nid, inode_hashbits)];
+	struct erofsfsck_inode *fi;
+
+	hlist_for_each_entry(fi, head, node) {
+		if (fi->nid == nid) {
+			*created = false;
+			return fi;
+		}
+	}
+	fi = calloc(1, sizeof(*fi));
+	if (!fi)
+		return ERR_PTR(-ENOMEM);
+	fi->nid = nid;
+	hlist_add_head(&fi->node, head);
+	++nr_inodes;
+	*created = true;
+	return fi;
+}
+
+static void erofsfsck_set_times(int fd, const char *path,
+				struct erofs_rinode *vi)
+{
+	const struct timespec times[2] = {
+		{ .tv_sec = vi->i_mtime, .tv_nsec = vi->i_mtime_nsec },
+		{ .tv_sec = vi->i_mtime, .tv_nsec = vi->i_mtime_nsec },
+	};
+	int ret;
+
+	if (fd >= 0)
+		ret = futimens(fd, times);
+	else
+		ret = utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+	if (ret)
+		erofs_warn("failed to set times of %s: %s", path,
+			   erofs_strerror(-errno));
+}
+
+/* drop @n references of works to @f */
+static void erofsfsck_put_file(struct erofsfsck_file *f, unsigned int n)
+{
+	bool last;
+
+	pthread_mutex_lock(&fsck.lock);
+	f->refs -= n;
+	last = !f->refs;
+	pthread_mutex_unlock(&fsck.lock);
+
+	if (!last)
+		return;
+	if (f->fd >= 0) {
+		erofsfsck_set_times(f->fd, f->path, &f->vi);
+		if (close(f->fd))
+			fsck_err("failed to write %s: %s", f->path,
+				 erofs_strerror(-errno));
+	}
+	erofs_put_inode(&f->vi);
+	free(f->path);
+	free(f);
+}
+
+static bool erofsfsck_is_zero(const u8 *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * write @len bytes at @off of an extracted file, which has been truncated to
+ * its size, so all-zero blocks are left as holes.
+ */
+static int erofsfsck_write(int fd, const u8 *buf, size_t len, u64 off,
+			   u64 *holes)
+{
+	size_t pos = 0, start, n;
+	ssize_t ret;
+
+	while (pos < len) {
+		n = min_t(u64, len - pos, img->blksz - (off + pos) % img->blksz);
+		if (erofsfsck_is_zero(buf + pos, n)) {
+			*holes += n;
+			pos += n;
+			continue;
+		}
+		/* write all adjacent blocks with data at once */
+		start = pos;
+		do {
+			pos += n;
+			n = min_t(u64, len - pos, img->blksz);
+		} while (pos < len && !erofsfsck_is_zero(buf + pos, n));
+
+		while (start < pos) {
+			ret = pwrite(fd, buf + start, pos - start, off + start);
+			if (ret <= 0)
+				return ret ? -errno : -EIO;
+			start += ret;
+		}
+	}
+	return 0;
+}
+
+static void erofsfsck_data_work(struct erofs_work *work)
+{
+	struct erofsfsck_work *w =
+		container_of(work, struct erofsfsck_work, work);
+	struct erofsfsck_file *f = w->f;
+	struct erofs_rinode *vi = &f->vi;
+	const bool compressed =
+		erofs_inode_is_data_compressed(vi->datalayout);
+	u64 pclusters = 0, plain = 0, bytes = 0, holes = 0;
+	erofs_off_t off, len;
+	unsigned int i;
+	bool failed = false;
+	ssize_t ret;
+	u8 *buf;
+
+	if (compressed) {
+		off = vi->extents[w->start].lstart;
+		len = w->end < vi->nr_extents ?
+			vi->extents[w->end].lstart - off : vi->i_size - off;
+	} else {
+		off = w->start;
+		len = w->end - w->start;
+	}
+	buf = malloc(len);
+	if (!buf) {
+		fsck_err("failed to allocate %llu bytes for %s", len | 0ULL,
+			 f->path);
+		goto out;
+	}
+
+	if (!compressed) {
+		ret = erofs_pread(vi, buf, len, off);
+		if (ret != (ssize_t)len) {
+			fsck_err("failed to read %s at %llu", f->path,
+				 off | 0ULL);
+			goto out_free;
+		}
+	}
+	/*
+	 * extents are contiguous, so they're decompressed in place, and all of
+	 * them are verified even if some fail.
+	 */
+	for (i = w->start; compressed && i < w->end; ++i) {
+		const struct erofs_rextent *e = &vi->extents[i];
+		const erofs_off_t end = i + 1 < vi->nr_extents ?
+			e[1].lstart : vi->i_size;
+
+		if (erofs_verify_extent(vi, i, buf + e->lstart - off)) {
+			fsck_err("failed to decompress extent %u (pcluster %u) of %s",
+				 i, e->blkaddr, f->path);
+			failed = true;
+			continue;
+		}
+		if (e->type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN)
+			++plain;
+		else
+			++pclusters;
+		bytes += end - e->lstart;
+	}
+	if (!compressed)
+		bytes = len;
+
+	/* don't extract garbage, and the error has been reported */
+	if (f->fd >= 0 && !failed) {
+		ret = erofsfsck_write(f->fd, buf, len, off, &holes);
+		if (ret)
+			fsck_err("failed to write %s: %s", f->path,
+				 erofs_strerror(ret));
+	}
+out_free:
+	free(buf);
+out:
+	pthread_mutex_lock(&fsck.lock);
+	fsck.pclusters += pclusters;
+	fsck.plain += plain;
+	fsck.compressed_bytes += (pclusters + plain) << img->blkszbits;
+	if (compressed)
+		fsck.decompressed_bytes += bytes;
+	if (f->fd >= 0 && !failed) {
+		fsck.written_bytes += bytes - holes;
+		fsck.hole_bytes += holes;
+	}
+	pthread_mutex_unlock(&fsck.lock);
+
+	erofsfsck_put_file(f, 1);
+	free(w);
+}
+
+/*
+ * queue the data of a regular file to be decompressed and/or written to
+ * @fd, which is closed once it's done.
+ */
+static int erofsfsck_queue_data(struct erofs_rinode *vi, const char *path,
+				int fd)
+{
+	const bool compressed =
+		erofs_inode_is_data_compressed(vi->datalayout);
+	struct erofsfsck_file *f;
+	u64 nr = 0, i, step;
+
+	if (compressed && !fcfg.nodata)
+		nr = DIV_ROUND_UP(vi->nr_extents, FSCK_EXTENTS_PER_WORK);
+	else if (!compressed && fd >= 0)
+		nr = DIV_ROUND_UP(vi->i_size, FSCK_BYTES_PER_WORK);
+	step = compressed ? FSCK_EXTENTS_PER_WORK : FSCK_BYTES_PER_WORK;
+	if (!nr && fd < 0)
+		return 0;
+
+	f = malloc(sizeof(*f));
+	if (!f) {
+		if (fd >= 0)
+			close(fd);
+		return -ENOMEM;
+	}
+	f->path = strdup(path);
+	if (!f->path) {
+		free(f);
+		if (fd >= 0)
+			close(fd);
+		return -ENOMEM;
+	}
+	/* the file is owned by its works from now on */
+	f->vi = *vi;
+	f->fd = fd;
+	f->refs = nr + 1;
+	vi->extents = NULL;
+	vi->nr_extents = 0;
+
+	for (i = 0; i < nr; ++i) {
+		struct erofsfsck_work *w = malloc(sizeof(*w));
+
+		if (!w) {
+			erofsfsck_put_file(f, nr - i + 1);
+			return -ENOMEM;
+		}
+		w->work.fn = erofsfsck_data_work;
+		w->f = f;
+		w->start = i * step;
+		w->end = min_t(u64, w->start + step, compressed ?
+			       f->vi.nr_extents : f->vi.i_size);
+		erofs_queue_work(&wq, &w->work);
+	}
+	erofsfsck_put_file(f, 1);
+	return 0;
+}
+
+static void erofsfsck_check_blocks(struct erofs_rinode *vi, const char *path,
+				   erofs_blk_t blkaddr, erofs_blk_t nblocks)
+{
+	if (blkaddr > img->blocks || nblocks > img->blocks - blkaddr)
+		fsck_err("blocks [%u, +%u) of %s are beyond the image (%u blocks)",
+			 blkaddr, nblocks, path, img->blocks);
+}
+
+static int erofsfsck_count_xattr(void *arg, const char *name,
+				 const void *value, unsigned int size,
+				 bool shared)
+{
+	++*(u64 *)arg;
+	return 0;
+}
+
+static int erofsfsck_check_inode(struct erofs_rinode *vi, const char *path,
+				 int fd)
+{
+	erofs_blk_t nblocks;
+	unsigned int i;
+	u64 xattrs = 0;
+	int ret;
+
+	ret = erofs_xattr_iterate(vi, erofsfsck_count_xattr, &xattrs);
+	if (ret < 0)
+		fsck_err("failed to read xattrs of %s: %s", path,
+			 erofs_strerror(ret));
+	fsck.xattrs += xattrs;
+
+	switch (vi->datalayout) {
+	case EROFS_INODE_FLAT_PLAIN:
+		nblocks = DIV_ROUND_UP(vi->i_size, img->blksz);
+		if (nblocks)
+			erofsfsck_check_blocks(vi, path, vi->u.i_blkaddr,
+					       nblocks);
+		break;
+	case EROFS_INODE_FLAT_INLINE:
+		nblocks = vi->i_size >> img->blkszbits;
+		if (nblocks)
+			erofsfsck_check_blocks(vi, path, vi->u.i_blkaddr,
+					       nblocks);
+		break;
+	default:
+		if (!S_ISREG(vi->i_mode) && !S_ISLNK(vi->i_mode))
+			break;
+		/* each pcluster is one block */
+		if (vi->u.i_blocks != vi->nr_extents)
+			fsck_err("%s has %u pclusters, but i_blocks is %u",
+				 path, vi->nr_extents, vi->u.i_blocks);
+		for (i = 0; i < vi->nr_extents; ++i)
+			erofsfsck_check_blocks(vi, path,
+					       vi->extents[i].blkaddr, 1);
+		break;
+	}
+
+	if (S_ISREG(vi->i_mode))
+		return erofsfsck_queue_data(vi, path, fd);
+
+	if (S_ISLNK(vi->i_mode)) {
+		char target[PATH_MAX];
+		ssize_t len;
+
+		if (!vi->i_size || vi->i_size >= PATH_MAX) {
+			fsck_err("bogus symlink size %llu of %s",
+				 vi->i_size | 0ULL, path);
+			return 0;
+		}
+		len = erofs_pread(vi, target, vi->i_size, 0);
+		if (len != (ssize_t)vi->i_size)
+			fsck_err("failed to read symlink %s", path);
+	}
+	return 0;
+}
+
+static int erofsfsck_set_xattr(void *arg, const char *name,
+			       const void *value, unsigned int size,
+			       bool shared)
+{
+	const char *path = arg;
+
+	if (!lsetxattr(path, name, value, size, 0))
+		return 0;
+	/* e.g. trusted.* xattrs without CAP_SYS_ADMIN */
+	if (errno == EPERM || errno == EOPNOTSUPP)
+		erofs_warn("failed to set xattr %s of %s: %s", name, path,
+			   erofs_strerror(-errno));
+	else
+		fsck_err("failed to set xattr %s of %s: %s", name, path,
+			 erofs_strerror(-errno));
+	return 0;
+}
+
+/* set the owner, the mode and xattrs of an extracted file */
+static void erofsfsck_set_attrs(struct erofs_rinode *vi, const char *path,
+				int fd)
+{
+	int ret;
+
+	/* chown() may clear setuid bits, so it goes first */
+	if (fcfg.preserve_owner) {
+		ret = fd >= 0 ? fchown(fd, vi->i_uid, vi->i_gid) :
+			lchown(path, vi->i_uid, vi->i_gid);
+		if (ret)
+			erofs_warn("failed to set owner of %s: %s", path,
+				   erofs_strerror(-errno));
+	}
+	if (!S_ISLNK(vi->i_mode) && !S_ISDIR(vi->i_mode)) {
+		ret = fd >= 0 ? fchmod(fd, vi->i_mode & 07777) :
+			chmod(path, vi->i_mode & 07777);
+		if (ret)
+			fsck_err("failed to set mode of %s: %s", path,
+				 erofs_strerror(-errno));
+	}
+	erofs_xattr_iterate(vi, erofsfsck_set_xattr, (void *)path);
+}
+
+/* remove an existing non-directory @path if --overwrite is given */
+static int erofsfsck_make_room(const char *path, int err)
+{
+	struct stat st;
+
+	if (err != -EEXIST || !fcfg.overwrite)
+		return err;
+	if (lstat(path, &st))
+		return -errno;
+	if (S_ISDIR(st.st_mode))
+		return -EISDIR;
+	return unlink(path) ? -errno : 0;
+}
+
+static int erofsfsck_extract_dir(struct erofs_rinode *vi, const char *path)
+{
+	struct erofsfsck_xdir *d;
+	struct stat st;
+	int ret = 0;
+
+	/* stay writable until all files in it are extracted */
+	if (mkdir(path, 0700)) {
+		ret = -errno;
+		if (ret == -EEXIST && !lstat(path, &st) &&
+		    S_ISDIR(st.st_mode))
+			ret = 0;
+	}
+	if (ret) {
+		fsck_err("failed to create directory %s: %s", path,
+			 erofs_strerror(ret));
+		return ret;
+	}
+
+	d = malloc(sizeof(*d));
+	if (!d)
+		return -ENOMEM;
+	d->path = strdup(path);
+	if (!d->path) {
+		free(d);
+		return -ENOMEM;
+	}
+	d->mode = vi->i_mode;
+	d->uid = vi->i_uid;
+	d->gid = vi->i_gid;
+	d->mtime.tv_sec = vi->i_mtime;
+	d->mtime.tv_nsec = vi->i_mtime_nsec;
+	list_add(&d->list, &xdirs);
+	erofs_xattr_iterate(vi, erofsfsck_set_xattr, (void *)path);
+	return 0;
+}
+
+static void erofsfsck_fixup_dirs(void)
+{
+	struct erofsfsck_xdir *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &xdirs, list) {
+		const struct timespec times[2] = { d->mtime, d->mtime };
+
+		if (fcfg.preserve_owner && lchown(d->path, d->uid, d->gid))
+			erofs_warn("failed to set owner of %s: %s", d->path,
+				   erofs_strerror(-errno));
+		if (chmod(d->path, d->mode & 07777))
+			fsck_err("failed to set mode of %s: %s", d->path,
+				 erofs_strerror(-errno));
+		if (utimensat(AT_FDCWD, d->path, times, AT_SYMLINK_NOFOLLOW))
+			erofs_warn("failed to set times of %s: %s", d->path,
+				   erofs_strerror(-errno));
+		list_del(&d->list);
+		free(d->path);
+		free(d);
+	}
+}
+
+/* create a non-directory, and open it as @fd if it's a regular file */
+static int erofsfsck_extract(struct erofs_rinode *vi, const char *path,
+			     int *fd)
+{
+	char target[PATH_MAX];
+	ssize_t len;
+	int ret;
+
+	do {
+		ret = 0;
+		switch (vi->i_mode & S_IFMT) {
+		case S_IFREG:
+			*fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+				   0600);
+			if (*fd < 0)
+				ret = -errno;
+			break;
+		case S_IFLNK:
+			if (!vi->i_size || vi->i_size >= PATH_MAX)
+				return -EFSCORRUPTED;
+			len = erofs_pread(vi, target, vi->i_size, 0);
+			if (len != (ssize_t)vi->i_size)
+				return len < 0 ? len : -EIO;
+			target[len] = '\0';
+			if (symlink(target, path))
+				ret = -errno;
+			break;
+		case S_IFCHR:
+		case S_IFBLK:
+			if (mknod(path, vi->i_mode, makedev(
+					(vi->u.i_rdev & 0xfff00) >> 8,
+					(vi->u.i_rdev & 0xff) |
+					((vi->u.i_rdev >> 12) & 0xfff00))))
+				ret = -errno;
+			break;
+		default:
+			if (mknod(path, vi->i_mode, 0))
+				ret = -errno;
+			break;
+		}
+	} while (ret && !erofsfsck_make_room(path, ret));
+	if (ret)
+		return ret;
+
+	/* preallocate nothing, so that unwritten blocks are holes */
+	if (*fd >= 0 && ftruncate(*fd, vi->i_size)) {
+		ret = -errno;
+		close(*fd);
+		*fd = -1;
+		return ret;
+	}
+	erofsfsck_set_attrs(vi, path, *fd);
+	if (*fd < 0)
+		erofsfsck_set_times(-1, path, vi);
+	return 0;
+}
+
+struct erofsfsck_dirctx {
+	struct erofsfsck_dir *dir;
+	char prev[EROFS_NAME_LEN];
+	unsigned int prevlen;
+	u64 count;
+	bool dot, dotdot;
+};
+
+/* the root directory is "/", which paths under it shouldn't repeat */
+static const char *erofsfsck_parent(const char *path)
+{
+	return strcmp(path, "/") ? path : "";
+}
+
+static int erofsfsck_push_dir(erofs_nid_t nid, erofs_nid_t pnid,
+			      const char *parent, const char *name,
+			      unsigned int namelen)
+{
+	struct erofsfsck_dir *d = malloc(sizeof(*d));
+
+	if (!d)
+		return -ENOMEM;
+	if (asprintf(&d->path, "%s/%.*s", erofsfsck_parent(parent),
+		     (int)namelen, name) < 0) {
+		free(d);
+		return -ENOMEM;
+	}
+	d->nid = nid;
+	d->pnid = pnid;
+	list_add(&d->list, &dirs);
+	return 0;
+}
+
+static int erofsfsck_dirent(void *arg, const struct erofs_rdirent *de)
+{
+	struct erofsfsck_dirctx *ctx = arg;
+	struct erofsfsck_dir *dir = ctx->dir;
+	struct erofsfsck_inode *fi;
+	struct erofs_rinode vi;
+	char path[PATH_MAX], xpath[PATH_MAX];
+	bool created;
+	int ret, fd = -1;
+
+	/* names are sorted so that they can be looked up by binary search */
+	if (ctx->count++) {
+		ret = memcmp(ctx->prev, de->name, min(ctx->prevlen,
+						       de->namelen));
+		if (ret > 0 || (!ret && ctx->prevlen >= de->namelen))
+			fsck_err("dirent %.*s of %s isn't sorted",
+				 (int)de->namelen, de->name, dir->path);
+	}
+	memcpy(ctx->prev, de->name, de->namelen);
+	ctx->prevlen = de->namelen;
+
+	if (de->namelen == 1 && de->name[0] == '.') {
+		ctx->dot = true;
+		if (de->nid != dir->nid)
+			fsck_err("'.' of %s points to nid %llu", dir->path,
+				 de->nid | 0ULL);
+		return 0;
+	}
+	if (de->namelen == 2 && !memcmp(de->name, "..", 2)) {
+		ctx->dotdot = true;
+		if (de->nid != dir->pnid)
+			fsck_err("'..' of %s points to nid %llu rather than %llu",
+				 dir->path, de->nid | 0ULL, dir->pnid | 0ULL);
+		return 0;
+	}
+	/* never follow it, which could escape the extracted tree */
+	if (memchr(de->name, '/', de->namelen)) {
+		fsck_err("dirent %.*s of %s contains '/'", (int)de->namelen,
+			 de->name, dir->path);
+		return 0;
+	}
+	snprintf(path, sizeof(path), "%s/%.*s", erofsfsck_parent(dir->path),
+		 (int)de->namelen, de->name);
+
+	if (fcfg.extract && snprintf(xpath, sizeof(xpath), "%.*s%s",
+				     fcfg.extractlen, fcfg.extract,
+				     path) >= PATH_MAX) {
+		fsck_err("path %s is too long to be extracted", path);
+		return 0;
+	}
+
+	fi = erofsfsck_inode_get(de->nid, &created);
+	if (IS_ERR(fi))
+		return PTR_ERR(fi);
+	if (!created) {
+		if (fi->dir || de->file_type == EROFS_FT_DIR) {
+			fsck_err("directory nid %llu is linked again as %s",
+				 de->nid | 0ULL, path);
+			return 0;
+		}
+		++fi->refs;
+		++fsck.hardlinks;
+		if (!fi->path)
+			return 0;
+		do {
+			ret = link(fi->path, xpath) ? -errno : 0;
+		} while (ret && !erofsfsck_make_room(xpath, ret));
+		if (ret)
+			fsck_err("failed to link %s to %s: %s", xpath,
+				 fi->path, erofs_strerror(ret));
+		return 0;
+	}
+	fi->refs = 1;
+
+	ret = erofs_read_inode(img, de->nid, &vi);
+	if (ret) {
+		fsck_err("failed to read inode %llu of %s: %s",
+			 de->nid | 0ULL, path, erofs_strerror(ret));
+		return 0;
+	}
+	fi->nlink = vi.i_nlink;
+	fi->dir = S_ISDIR(vi.i_mode);
+	if (erofs_mode_to_ftype(vi.i_mode) != de->file_type)
+		fsck_err("file type %u of %s mismatches mode %o", de->file_type,
+			 path, vi.i_mode);
+	if (fi->dir) {
+		erofs_put_inode(&vi);
+		return erofsfsck_push_dir(de->nid, dir->nid, dir->path,
+					  de->name, de->namelen);
+	}
+	++fsck.files;
+	if (fcfg.extract) {
+		ret = erofsfsck_extract(&vi, xpath, &fd);
+		if (ret) {
+			fsck_err("failed to extract %s: %s", xpath,
+				 erofs_strerror(ret));
+		} else if (vi.i_nlink > 1) {
+			fi->path = strdup(xpath);
+			if (!fi->path)
+				ret = -ENOMEM;
+		}
+		if (ret == -ENOMEM) {
+			if (fd >= 0)
+				close(fd);
+			erofs_put_inode(&vi);
+			return ret;
+		}
+	}
+	ret = erofsfsck_check_inode(&vi, path, fd);
+	erofs_put_inode(&vi);
+	return ret;
+}
+
+static int erofsfsck_check_dir(struct erofsfsck_dir *dir)
+{
+	struct erofsfsck_dirctx ctx = { .dir = dir };
+	struct erofs_rinode vi;
+	int ret;
+
+	ret = erofs_read_inode(img, dir->nid, &vi);
+	if (ret) {
+		fsck_err("failed to read directory %s: %s", dir->path,
+			 erofs_strerror(ret));
+		return 0;
+	}
+	++fsck.dirs;
+	ret = erofsfsck_check_inode(&vi, dir->path, -1);
+	if (!ret && fcfg.extract) {
+		char xpath[PATH_MAX];
+
+		if (snprintf(xpath, sizeof(xpath), "%.*s%s", fcfg.extractlen,
+			     fcfg.extract, dir->path) >= PATH_MAX) {
+			fsck_err("path %s is too long to be extracted",
+				 dir->path);
+			ret = -ENAMETOOLONG;
+		} else {
+			ret = erofsfsck_extract_dir(&vi, xpath);
+		}
+		/* skip its children, and the error has been reported */
+		if (ret && ret != -ENOMEM) {
+			erofs_put_inode(&vi);
+			return 0;
+		}
+	}
+	if (!ret)
+		ret = erofs_readdir(&vi, 0, erofsfsck_dirent, &ctx);
+	erofs_put_inode(&vi);
+	/* out of memory */
+	if (ret == -ENOMEM)
+		return ret;
+	if (ret) {
+		fsck_err("failed to read directory %s: %s", dir->path,
+			 erofs_strerror(ret));
+		return 0;
+	}
+	if (!ctx.dot || !ctx.dotdot)
+		fsck_err("directory %s lacks '.' or '..'", dir->path);
+	return 0;
+}
+
+static int erofsfsck_walk(void)
+{
+	struct erofsfsck_dir *dir, *tmp;
+	struct erofsfsck_inode *fi;
+	struct hlist_node *n;
+	bool created;
+	unsigned int i;
+	u64 nr;
+	int ret;
+
+	/* about one bucket for each inode, or each block if it's unknown */
+	nr = img->inos ? img->inos : img->blocks;
+	inode_hashbits = 10;
+	while (inode_hashbits < 20 && (nr >> inode_hashbits))
+		++inode_hashbits;
+	inode_hash = calloc(1U << inode_hashbits, sizeof(*inode_hash));
+	if (!inode_hash)
+		return -ENOMEM;
+
+	fi = erofsfsck_inode_get(img->root_nid, &created);
+	if (IS_ERR(fi))
+		return PTR_ERR(fi);
+	fi->dir = true;
+	ret = erofsfsck_push_dir(img->root_nid, img->root_nid, "", NULL, 0);
+
+	while (!ret && !list_empty(&dirs)) {
+		dir = list_first_entry(&dirs, struct erofsfsck_dir, list);
+		list_del(&dir->list);
+		ret = erofsfsck_check_dir(dir);
+		free(dir->path);
+		free(dir);
+	}
+	list_for_each_entry_safe(dir, tmp, &dirs, list) {
+		free(dir->path);
+		free(dir);
+	}
+
+	for (i = 0; i < 1U << inode_hashbits; ++i) {
+		hlist_for_each_entry_safe(fi, n, &inode_hash[i], node) {
+			if (!ret && !fi->dir && fi->refs != fi->nlink)
+				fsck_err("nid %llu is linked %u times, but i_nlink is %u",
+					 fi->nid | 0ULL, fi->refs, fi->nlink);
+			free(fi->path);
+			free(fi);
+		}
+	}
+	free(inode_hash);
+	/* older mkfs leaves it 0 */
+	if (!ret && img->inos && nr_inodes != img->inos)
+		fsck_err("%llu inodes are reachable, but the superblock has %llu",
+			 nr_inodes | 0ULL, img->inos | 0ULL);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec start, end;
+	int err;
+
+	erofs_init_configure();
+	err = erofsfsck_parse_options(argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			usage();
+		return FSCK_USAGE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	img = erofs_image_open(fcfg.image, EROFS_READER_CACHE_SIZE, 0);
+	if (IS_ERR(img))
+		return FSCK_ERROR;
+	err = erofs_workqueue_init(&wq, fcfg.threads, fcfg.threads * 4);
+	if (err)
+		goto exit;
+
+	err = erofsfsck_check_sb_csum();
+	if (!err)
+		err = erofsfsck_walk();
+	erofs_workqueue_exit(&wq);
+	erofsfsck_fixup_dirs();
+	if (err) {
+		erofs_err("failed to check %s: %s", fcfg.image,
+			  erofs_strerror(err));
+		goto exit;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	fprintf(stdout, "%s: %llu directories, %llu files, %llu hardlinks, %llu xattrs\n",
+		fcfg.image, fsck.dirs | 0ULL, fsck.files | 0ULL,
+		fsck.hardlinks | 0ULL, fsck.xattrs | 0ULL);
+	if (!fcfg.nodata)
+		fprintf(stdout, "%llu pclusters and %llu plain lclusters verified (%llu -> %llu bytes)\n",
+			fsck.pclusters | 0ULL, fsck.plain | 0ULL,
+			fsck.compressed_bytes | 0ULL,
+			fsck.decompressed_bytes | 0ULL);
+	if (fcfg.extract)
+		fprintf(stdout, "%llu bytes extracted to %s, %llu bytes left as holes\n",
+			fsck.written_bytes | 0ULL, fcfg.extract,
+			fsck.hole_bytes | 0ULL);
+	fprintf(stdout, "%llu errors found in %.3f seconds\n",
+		fsck.errors | 0ULL, end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9);
+exit:
+	erofs_image_close(img);
+	erofs_exit_configure();
+	if (err)
+		return FSCK_ERROR;
+	return fsck.errors ? FSCK_ERRORS_LEFT : FSCK_OK;
+}
@@ -0,0 +1,792 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/fuse/main.c
+ *
+ * Serve an EROFS image through FUSE where the kernel module isn't
+ * available.  It speaks the FUSE kernel protocol on /dev/fuse directly,
+ * and requests are handled by a pool of threads sharing one image reader,
+ * whose striped LRU cache keeps decompressed pclusters.  Uncompressed data
+ * is spliced from the mmap()ed image to /dev/fuse without being copied in
+ * userspace.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <getopt.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mount.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fuse.h>
+#include "erofs/config.h"
+#include "erofs/print.h"
+#include "erofs/reader.h"
+
+/* the image never changes, so lookups and attributes can be cached long */
+#define EROFSFUSE_TIMEOUT	86400
+
+/* the largest READ request is max_pages, see erofsfuse_init() */
+#define EROFSFUSE_MAX_PAGES	256
+#define EROFSFUSE_IN_BUFSIZE	(64 * 1024)
+/* segments of uncompressed data spliced at once */
+#define EROFSFUSE_MAX_SEGS	16
+
+static struct erofsfuse_config {
+	const char *image, *mountpoint;
+	unsigned int threads;
+	u64 cache_size;
+	bool allow_other, nosplice;
+} fcfg;
+
+static struct erofs_image *img;
+
+struct erofsfuse_worker {
+	pthread_t th;
+	int fd;				/* a clone of /dev/fuse, or itself */
+	int pipefd[2];			/* for splice(), or -1 */
+	unsigned int pipesz;
+	u8 *in;
+	u8 *out;			/* data of replies */
+	size_t outsz;
+};
+
+static struct option long_options[] = {
+	{"help", no_argument, 0, 1},
+	{"threads", required_argument, NULL, 't'},
+	{"cache-size", required_argument, NULL, 2},
+	{"allow-other", no_argument, NULL, 3},
+	{"no-splice", no_argument, NULL, 4},
+	{0, 0, 0, 0},
+};
+
+static void usage(void)
+{
+	fputs("usage: [options] IMAGE MOUNTPOINT\n\n"
+	      "Mount the erofs IMAGE at MOUNTPOINT through FUSE until it's unmounted\n"
+	      "or interrupted, and [options] are:\n"
+	      " -d#               set output message level to # (maximum 9)\n"
+	      " -t, --threads=#   handle requests with # threads (default: online CPUs)\n"
+	      " --cache-size=#    cache # MiB of blocks and decompressed data (default 32)\n"
+	      " --allow-other     allow other users to access the filesystem\n"
+	      " --no-splice       copy uncompressed data instead of splicing it\n"
+	      " --help            display this help and exit\n", stderr);
+}
+
+static int erofsfuse_parse_options(int argc, char **argv)
+{
+	char *endptr;
+	int opt, i;
+
+	fcfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	fcfg.cache_size = EROFS_READER_CACHE_SIZE;
+	while ((opt = getopt_long(argc, argv, "d:t:", long_options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			i = atoi(optarg);
+			if (i < EROFS_MSG_MIN || i > EROFS_MSG_MAX) {
+				erofs_err("invalid debug level %d", i);
+				return -EINVAL;
+			}
+			cfg.c_dbg_lvl = i;
+			break;
+		case 't':
+			fcfg.threads = strtoul(optarg, &endptr, 0);
+			if (*endptr || !fcfg.threads || fcfg.threads > 1024) {
+				erofs_err("invalid number of threads %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 2:
+			fcfg.cache_size = strtoull(optarg, &endptr, 0);
+			if (*endptr || fcfg.cache_size > (1ULL << 44) >> 20) {
+				erofs_err("invalid cache size %s", optarg);
+				return -EINVAL;
+			}
+			fcfg.cache_size <<= 20;
+			break;
+		case 3:
+			fcfg.allow_other = true;
+			break;
+		case 4:
+			fcfg.nosplice = true;
+			break;
+		case 1:
+		default:
+			return -EINVAL;
+		}
+	}
+	if (optind + 2 != argc) {
+		erofs_err("expected IMAGE and MOUNTPOINT");
+		return -EINVAL;
+	}
+	fcfg.image = argv[optind];
+	fcfg.mountpoint = argv[optind + 1];
+	if (!fcfg.threads)
+		fcfg.threads = 1;
+	return 0;
+}
+
+/* nodeid 1 is always the root */
+static erofs_nid_t erofsfuse_nid(u64 nodeid)
+{
+	return nodeid == FUSE_ROOT_ID ? img->root_nid : nodeid - 2;
+}
+
+static u64 erofsfuse_nodeid(erofs_nid_t nid)
+{
+	return nid == img->root_nid ? FUSE_ROOT_ID : nid + 2;
+}
+
+static void erofsfuse_fill_attr(struct fuse_attr *attr,
+				struct erofs_rinode *vi)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = vi->nid;
+	attr->size = vi->i_size;
+	if (erofs_inode_is_data_compressed(vi->datalayout))
+		attr->blocks = (u64)vi->u.i_blocks << (img->blkszbits - 9);
+	else
+		attr->blocks = round_up(vi->i_size, img->blksz) >> 9;
+	attr->atime = attr->mtime = attr->ctime = vi->i_mtime;
+	attr->atimensec = attr->mtimensec = attr->ctimensec =
+		vi->i_mtime_nsec;
+	attr->mode = vi->i_mode;
+	attr->nlink = vi->i_nlink;
+	attr->uid = vi->i_uid;
+	attr->gid = vi->i_gid;
+	if (S_ISCHR(vi->i_mode) || S_ISBLK(vi->i_mode))
+		attr->rdev = vi->u.i_rdev;
+	attr->blksize = img->blksz;
+}
+
+/* @iov[0] is filled with the header, and @err is a negative errno */
+static int erofsfuse_reply_iov(struct erofsfuse_worker *w,
+			       const struct fuse_in_header *ih, int err,
+			       struct iovec *iov, unsigned int cnt)
+{
+	struct fuse_out_header oh = {
+		.error = err,
+		.unique = ih->unique,
+	};
+	unsigned int i;
+
+	iov[0].iov_base = &oh;
+	iov[0].iov_len = sizeof(oh);
+	oh.len = 0;
+	for (i = 0; i < cnt; ++i)
+		oh.len += iov[i].iov_len;
+
+	if (writev(w->fd, iov, cnt) < 0) {
+		/* the request has been interrupted */
+		if (errno == ENOENT)
+			return 0;
+		erofs_err("failed to reply to request %llu: %s",
+			  ih->unique | 0ULL, erofs_strerror(-errno));
+		return -errno;
+	}
+	return 0;
+}
+
+static int erofsfuse_reply_err(struct erofsfuse_worker *w,
+			       const struct fuse_in_header *ih, int err)
+{
+	struct iovec iov[1];
+
+	return erofsfuse_reply_iov(w, ih, err, iov, 1);
+}
+
+static int erofsfuse_reply(struct erofsfuse_worker *w,
+			   const struct fuse_in_header *ih,
+			   const void *arg, size_t size)
+{
+	struct iovec iov[2] = {
+		[1] = { .iov_base = (void *)arg, .iov_len = size },
+	};
+
+	return erofsfuse_reply_iov(w, ih, 0, iov, 2);
+}
+
+static int erofsfuse_reserve(struct erofsfuse_worker *w, size_t size)
+{
+	u8 *out;
+
+	if (size <= w->outsz)
+		return 0;
+	out = realloc(w->out, size);
+	if (!out)
+		return -ENOMEM;
+	w->out = out;
+	w->outsz = size;
+	return 0;
+}
+
+static int erofsfuse_init(struct erofsfuse_worker *w,
+			  const struct fuse_in_header *ih, const void *arg)
+{
+	const struct fuse_init_in *in = arg;
+	struct fuse_init_out out = {
+		.major = FUSE_KERNEL_VERSION,
+		.minor = FUSE_KERNEL_MINOR_VERSION,
+	};
+	size_t size = sizeof(out);
+
+	/* a newer kernel will retry with our version */
+	if (in->major > FUSE_KERNEL_VERSION)
+		return erofsfuse_reply(w, ih, &out, FUSE_COMPAT_INIT_OUT_SIZE);
+	if (in->major < FUSE_KERNEL_VERSION || in->minor < 12) {
+		erofs_err("unsupported FUSE protocol %u.%u", in->major,
+			  in->minor);
+		return erofsfuse_reply_err(w, ih, -EPROTO);
+	}
+	if (in->minor < 23)
+		size = FUSE_COMPAT_22_INIT_OUT_SIZE;
+
+	out.max_readahead = in->max_readahead;
+	out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_SPLICE_WRITE);
+#ifdef FUSE_PARALLEL_DIROPS
+	out.flags |= in->flags & FUSE_PARALLEL_DIROPS;
+#endif
+#ifdef FUSE_CACHE_SYMLINKS
+	out.flags |= in->flags & FUSE_CACHE_SYMLINKS;
+#endif
+#ifdef FUSE_MAX_PAGES
+	if (in->flags & FUSE_MAX_PAGES) {
+		out.flags |= FUSE_MAX_PAGES;
+		out.max_pages = EROFSFUSE_MAX_PAGES;
+	}
+#endif
+	out.max_background = 64;
+	out.congestion_threshold = 48;
+	out.max_write = 4096;
+	out.time_gran = 1;
+	erofs_info("FUSE protocol %u.%u, flags %x", in->major, in->minor,
+		   out.flags);
+	return erofsfuse_reply(w, ih, &out, size);
+}
+
+static int erofsfuse_lookup(struct erofsfuse_worker *w,
+			    const struct fuse_in_header *ih, const char *name)
+{
+	struct fuse_entry_out out = {
+		.entry_valid = EROFSFUSE_TIMEOUT,
+		.attr_valid = EROFSFUSE_TIMEOUT,
+	};
+	struct erofs_rinode dir, vi;
+	erofs_nid_t nid;
+	int ret;
+
+	ret = erofs_read_inode_meta(img, erofsfuse_nid(ih->nodeid), &dir);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	ret = erofs_namei(&dir, name, strlen(name), &nid, NULL);
+	/* nodeid 0 caches the negative lookup */
+	if (ret == -ENOENT)
+		return erofsfuse_reply(w, ih, &out, sizeof(out));
+	if (!ret)
+		ret = erofs_read_inode_meta(img, nid, &vi);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	out.nodeid = erofsfuse_nodeid(nid);
+	erofsfuse_fill_attr(&out.attr, &vi);
+	return erofsfuse_reply(w, ih, &out, sizeof(out));
+}
+
+static int erofsfuse_getattr(struct erofsfuse_worker *w,
+			     const struct fuse_in_header *ih)
+{
+	struct fuse_attr_out out = {
+		.attr_valid = EROFSFUSE_TIMEOUT,
+	};
+	struct erofs_rinode vi;
+	int ret;
+
+	ret = erofs_read_inode_meta(img, erofsfuse_nid(ih->nodeid), &vi);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	erofsfuse_fill_attr(&out.attr, &vi);
+	return erofsfuse_reply(w, ih, &out, sizeof(out));
+}
+
+static int erofsfuse_readlink(struct erofsfuse_worker *w,
+			      const struct fuse_in_header *ih)
+{
+	struct erofs_rinode vi;
+	ssize_t ret;
+
+	ret = erofs_read_inode(img, erofsfuse_nid(ih->nodeid), &vi);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	if (!S_ISLNK(vi.i_mode) || vi.i_size > PATH_MAX)
+		ret = -EINVAL;
+	else
+		ret = erofsfuse_reserve(w, vi.i_size);
+	if (!ret)
+		ret = erofs_pread(&vi, w->out, vi.i_size, 0);
+	erofs_put_inode(&vi);
+	if (ret < 0)
+		return erofsfuse_reply_err(w, ih, ret);
+	return erofsfuse_reply(w, ih, w->out, ret);
+}
+
+/* the inode is kept as the file handle until it's released */
+static int erofsfuse_open(struct erofsfuse_worker *w,
+			  const struct fuse_in_header *ih, const void *arg,
+			  bool dir)
+{
+	const struct fuse_open_in *in = arg;
+	struct fuse_open_out out = {
+		.open_flags = FOPEN_KEEP_CACHE,
+	};
+	struct erofs_rinode *vi;
+	int ret;
+
+	if ((in->flags & O_ACCMODE) != O_RDONLY)
+		return erofsfuse_reply_err(w, ih, -EROFS);
+	vi = malloc(sizeof(*vi));
+	if (!vi)
+		return erofsfuse_reply_err(w, ih, -ENOMEM);
+	ret = erofs_read_inode(img, erofsfuse_nid(ih->nodeid), vi);
+	if (!ret && dir != S_ISDIR(vi->i_mode)) {
+		erofs_put_inode(vi);
+		ret = dir ? -ENOTDIR : -EISDIR;
+	}
+	if (ret) {
+		free(vi);
+		return erofsfuse_reply_err(w, ih, ret);
+	}
+	out.fh = (uintptr_t)vi;
+	return erofsfuse_reply(w, ih, &out, sizeof(out));
+}
+
+static int erofsfuse_release(struct erofsfuse_worker *w,
+			     const struct fuse_in_header *ih, const void *arg)
+{
+	const struct fuse_release_in *in = arg;
+	struct erofs_rinode *vi = (void *)(uintptr_t)in->fh;
+
+	erofs_put_inode(vi);
+	free(vi);
+	return erofsfuse_reply_err(w, ih, 0);
+}
+
+/* reply with the spliced header and mmap()ed data in @iov */
+static int erofsfuse_splice(struct erofsfuse_worker *w,
+			    const struct fuse_in_header *ih,
+			    struct iovec *iov, unsigned int cnt)
+{
+	struct fuse_out_header oh = {
+		.unique = ih->unique,
+	};
+	unsigned int i;
+	ssize_t ret;
+
+	iov[0].iov_base = &oh;
+	iov[0].iov_len = sizeof(oh);
+	oh.len = 0;
+	for (i = 0; i < cnt; ++i)
+		oh.len += iov[i].iov_len;
+
+	ret = vmsplice(w->pipefd[1], iov, cnt, 0);
+	if (ret == (ssize_t)oh.len) {
+		ret = splice(w->pipefd[0], NULL, w->fd, NULL, oh.len,
+			     SPLICE_F_MOVE);
+		if (ret == (ssize_t)oh.len)
+			return 0;
+		if (ret < 0 && errno == ENOENT)
+			return 0;
+	}
+	/* the pipe may be dirty, so drop it and don't try again */
+	erofs_dbg("failed to splice %u bytes, fall back to copy", oh.len);
+	close(w->pipefd[0]);
+	close(w->pipefd[1]);
+	w->pipefd[0] = w->pipefd[1] = -1;
+	return erofsfuse_reply_iov(w, ih, 0, iov, cnt);
+}
+
+/* hand the mmap()ed uncompressed data over without copying it here */
+static int erofsfuse_read_mapped(struct erofsfuse_worker *w,
+				 const struct fuse_in_header *ih,
+				 struct erofs_rinode *vi, erofs_off_t off,
+				 size_t size)
+{
+	struct iovec iov[EROFSFUSE_MAX_SEGS + 1];
+	unsigned int cnt = 1;
+	size_t done = 0;
+
+	while (done < size) {
+		const void *ptr;
+		ssize_t n = erofs_map_data(vi, off + done, size - done, &ptr);
+
+		if (n <= 0 || cnt > EROFSFUSE_MAX_SEGS)
+			return 1;
+		iov[cnt].iov_base = (void *)ptr;
+		iov[cnt++].iov_len = n;
+		done += n;
+	}
+	/* a segment could touch one more page in the pipe */
+	if (w->pipefd[0] >= 0 && sizeof(struct fuse_out_header) + size +
+	    cnt * 2 * getpagesize() <= w->pipesz)
+		return erofsfuse_splice(w, ih, iov, cnt);
+	return erofsfuse_reply_iov(w, ih, 0, iov, cnt);
+}
+
+static int erofsfuse_read(struct erofsfuse_worker *w,
+			  const struct fuse_in_header *ih, const void *arg)
+{
+	const struct fuse_read_in *in = arg;
+	struct erofs_rinode *vi = (void *)(uintptr_t)in->fh;
+	size_t size = in->size;
+	ssize_t ret;
+
+	if (in->offset >= vi->i_size)
+		return erofsfuse_reply(w, ih, NULL, 0);
+	size = min_t(u64, size, vi->i_size - in->offset);
+
+	if (img->map) {
+		ret = erofsfuse_read_mapped(w, ih, vi, in->offset, size);
+		if (ret <= 0)
+			return ret;
+	}
+	ret = erofsfuse_reserve(w, size);
+	if (!ret)
+		ret = erofs_pread(vi, w->out, size, in->offset);
+	if (ret < 0)
+		return erofsfuse_reply_err(w, ih, ret);
+	return erofsfuse_reply(w, ih, w->out, ret);
+}
+
+struct erofsfuse_readdir_ctx {
+	u8 *buf;
+	size_t size, len;
+};
+
+static int erofsfuse_fill_dirent(void *arg, const struct erofs_rdirent *de)
+{
+	static const u8 dtypes[EROFS_FT_MAX] = {
+		[EROFS_FT_UNKNOWN] = DT_UNKNOWN,
+		[EROFS_FT_REG_FILE] = DT_REG,
+		[EROFS_FT_DIR] = DT_DIR,
+		[EROFS_FT_CHRDEV] = DT_CHR,
+		[EROFS_FT_BLKDEV] = DT_BLK,
+		[EROFS_FT_FIFO] = DT_FIFO,
+		[EROFS_FT_SOCK] = DT_SOCK,
+		[EROFS_FT_SYMLINK] = DT_LNK,
+	};
+	struct erofsfuse_readdir_ctx *ctx = arg;
+	struct fuse_dirent *d = (void *)(ctx->buf + ctx->len);
+	const size_t size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + de->namelen);
+
+	if (ctx->len + size > ctx->size)
+		return 1;
+	d->ino = de->nid;
+	d->off = de->pos + 1;
+	d->namelen = de->namelen;
+	d->type = de->file_type < EROFS_FT_MAX ? dtypes[de->file_type] :
+		DT_UNKNOWN;
+	memcpy(d->name, de->name, de->namelen);
+	memset(d->name + de->namelen, 0, size - FUSE_NAME_OFFSET -
+	       de->namelen);
+	ctx->len += size;
+	return 0;
+}
+
+static int erofsfuse_readdir(struct erofsfuse_worker *w,
+			     const struct fuse_in_header *ih, const void *arg)
+{
+	const struct fuse_read_in *in = arg;
+	struct erofs_rinode *dir = (void *)(uintptr_t)in->fh;
+	struct erofsfuse_readdir_ctx ctx = { .size = in->size };
+	int ret;
+
+	ret = erofsfuse_reserve(w, ctx.size);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	ctx.buf = w->out;
+	ret = erofs_readdir(dir, in->offset, erofsfuse_fill_dirent, &ctx);
+	if (ret < 0)
+		return erofsfuse_reply_err(w, ih, ret);
+	return erofsfuse_reply(w, ih, ctx.buf, ctx.len);
+}
+
+static int erofsfuse_statfs(struct erofsfuse_worker *w,
+			    const struct fuse_in_header *ih)
+{
+	struct fuse_statfs_out out = {
+		.st = {
+			.blocks = img->blocks,
+			.files = img->inos,
+			.bsize = img->blksz,
+			.namelen = EROFS_NAME_LEN,
+			.frsize = img->blksz,
+		},
+	};
+
+	return erofsfuse_reply(w, ih, &out, sizeof(out));
+}
+
+/* both getxattr and listxattr only return the size if @in->size is 0 */
+static int erofsfuse_xattr(struct erofsfuse_worker *w,
+			   const struct fuse_in_header *ih, const void *arg,
+			   bool list)
+{
+	const struct fuse_getxattr_in *in = arg;
+	struct fuse_getxattr_out out = {};
+	struct erofs_rinode vi;
+	ssize_t ret;
+
+	ret = erofs_read_inode_meta(img, erofsfuse_nid(ih->nodeid), &vi);
+	if (!ret)
+		ret = erofsfuse_reserve(w, in->size);
+	if (ret)
+		return erofsfuse_reply_err(w, ih, ret);
+	if (list)
+		ret = erofs_listxattr(&vi, (char *)w->out, in->size);
+	else
+		ret = erofs_getxattr(&vi, (const char *)(in + 1), w->out,
+				     in->size);
+	if (ret < 0)
+		return erofsfuse_reply_err(w, ih, ret);
+	if (in->size)
+		return erofsfuse_reply(w, ih, w->out, ret);
+	out.size = ret;
+	return erofsfuse_reply(w, ih, &out, sizeof(out));
+}
+
+static int erofsfuse_dispatch(struct erofsfuse_worker *w,
+			      const struct fuse_in_header *ih)
+{
+	const void *arg = ih + 1;
+
+	switch (ih->opcode) {
+	case FUSE_INIT:
+		return erofsfuse_init(w, ih, arg);
+	case FUSE_LOOKUP:
+		return erofsfuse_lookup(w, ih, arg);
+	case FUSE_GETATTR:
+		return erofsfuse_getattr(w, ih);
+	case FUSE_READLINK:
+		return erofsfuse_readlink(w, ih);
+	case FUSE_OPEN:
+		return erofsfuse_open(w, ih, arg, false);
+	case FUSE_OPENDIR:
+		return erofsfuse_open(w, ih, arg, true);
+	case FUSE_READ:
+		return erofsfuse_read(w, ih, arg);
+	case FUSE_READDIR:
+		return erofsfuse_readdir(w, ih, arg);
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+		return erofsfuse_release(w, ih, arg);
+	case FUSE_STATFS:
+		return erofsfuse_statfs(w, ih);
+	case FUSE_GETXATTR:
+		return erofsfuse_xattr(w, ih, arg, false);
+	case FUSE_LISTXATTR:
+		return erofsfuse_xattr(w, ih, arg, true);
+	case FUSE_DESTROY:
+		return erofsfuse_reply_err(w, ih, 0);
+	/* no reply is expected, and nodeids are stateless */
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+		return 0;
+	default:
+		/* the filesystem is mounted read-only */
+		return erofsfuse_reply_err(w, ih, -ENOSYS);
+	}
+}
+
+static void *erofsfuse_worker_fn(void *arg)
+{
+	struct erofsfuse_worker *w = arg;
+
+	while (1) {
+		const struct fuse_in_header *ih = (void *)w->in;
+		ssize_t n = read(w->fd, w->in, EROFSFUSE_IN_BUFSIZE);
+
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == ENOENT)
+				continue;
+			/* unmounted */
+			if (errno != ENODEV)
+				erofs_err("failed to read requests: %s",
+					  erofs_strerror(-errno));
+			break;
+		}
+		if (n < (ssize_t)sizeof(*ih) || ih->len != n) {
+			erofs_err("short request of %zd bytes", n);
+			break;
+		}
+		if (erofsfuse_dispatch(w, ih) == -ENODEV)
+			break;
+	}
+	return NULL;
+}
+
+static int erofsfuse_worker_init(struct erofsfuse_worker *w, int fuse_fd,
+				 bool clone)
+{
+	w->fd = fuse_fd;
+	w->pipefd[0] = w->pipefd[1] = -1;
+	w->outsz = EROFSFUSE_MAX_PAGES * getpagesize();
+	w->in = malloc(EROFSFUSE_IN_BUFSIZE);
+	w->out = malloc(w->outsz);
+	if (!w->in || !w->out)
+		return -ENOMEM;
+
+#ifdef FUSE_DEV_IOC_CLONE
+	/* each clone has its own queue of requests being processed */
+	if (clone) {
+		u32 master = fuse_fd;
+		int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+
+		if (fd >= 0 && !ioctl(fd, FUSE_DEV_IOC_CLONE, &master))
+			w->fd = fd;
+		else if (fd >= 0)
+			close(fd);
+	}
+#endif
+	if (!fcfg.nosplice && img->map && !pipe2(w->pipefd, O_CLOEXEC)) {
+		int sz = fcntl(w->pipefd[0], F_SETPIPE_SZ,
+			       w->outsz + 2 * getpagesize());
+
+		if (sz < 0)
+			sz = fcntl(w->pipefd[0], F_GETPIPE_SZ);
+		w->pipesz = max(sz, 0);
+	}
+	return 0;
+}
+
+static void erofsfuse_worker_exit(struct erofsfuse_worker *w, int fuse_fd)
+{
+	if (w->pipefd[0] >= 0) {
+		close(w->pipefd[0]);
+		close(w->pipefd[1]);
+	}
+	if (w->fd >= 0 && w->fd != fuse_fd)
+		close(w->fd);
+	free(w->in);
+	free(w->out);
+}
+
+static void *erofsfuse_signal_fn(void *arg)
+{
+	sigset_t *set = arg;
+	int sig;
+
+	if (!sigwait(set, &sig)) {
+		erofs_info("unmounting %s on signal %d", fcfg.mountpoint, sig);
+		umount2(fcfg.mountpoint, MNT_DETACH);
+	}
+	return NULL;
+}
+
+static int erofsfuse_mount(int fuse_fd)
+{
+	struct erofs_rinode root;
+	char opts[256];
+	int ret;
+
+	ret = erofs_read_inode_meta(img, img->root_nid, &root);
+	if (ret)
+		return ret;
+	if (!S_ISDIR(root.i_mode)) {
+		erofs_err("the root of %s isn't a directory", fcfg.image);
+		return -EFSCORRUPTED;
+	}
+	snprintf(opts, sizeof(opts),
+		 "fd=%d,rootmode=%o,user_id=%u,group_id=%u,default_permissions%s",
+		 fuse_fd, root.i_mode & S_IFMT, getuid(), getgid(),
+		 fcfg.allow_other ? ",allow_other" : "");
+	if (mount(fcfg.image, fcfg.mountpoint, "fuse.erofs",
+		  MS_RDONLY | MS_NOSUID | MS_NODEV, opts)) {
+		ret = -errno;
+		erofs_err("failed to mount %s at %s: %s", fcfg.image,
+			  fcfg.mountpoint, erofs_strerror(ret));
+		return ret;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct erofsfuse_worker *workers;
+	pthread_t sigthread;
+	unsigned int i;
+	sigset_t set;
+	int fuse_fd, err;
+
+	erofs_init_configure();
+	err = erofsfuse_parse_options(argc, argv);
+	if (err) {
+		if (err == -EINVAL)
+			usage();
+		return 1;
+	}
+
+	img = erofs_image_open(fcfg.image, fcfg.cache_size, 0);
+	if (IS_ERR(img))
+		return 1;
+	workers = calloc(fcfg.threads, sizeof(*workers));
+	if (!workers) {
+		err = -ENOMEM;
+		goto err_close;
+	}
+
+	fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fuse_fd < 0) {
+		err = -errno;
+		erofs_err("failed to open /dev/fuse: %s", erofs_strerror(err));
+		goto err_free;
+	}
+	err = erofsfuse_mount(fuse_fd);
+	if (err)
+		goto err_fuse;
+
+	/* only the signal thread handles them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	err = -pthread_create(&sigthread, NULL, erofsfuse_signal_fn, &set);
+	if (err)
+		goto err_umount;
+
+	for (i = 0; i < fcfg.threads; ++i) {
+		err = erofsfuse_worker_init(&workers[i], fuse_fd, i > 0);
+		if (!err)
+			err = -pthread_create(&workers[i].th, NULL,
+					      erofsfuse_worker_fn, &workers[i]);
+		if (err) {
+			erofs_err("failed to start worker %u: %s", i,
+				  erofs_strerror(err));
+			umount2(fcfg.mountpoint, MNT_DETACH);
+			break;
+		}
+	}
+	erofs_info("%s mounted at %s with %u threads", fcfg.image,
+		   fcfg.mountpoint, i);
+
+	while (i)
+		pthread_join(workers[--i].th, NULL);
+	pthread_cancel(sigthread);
+	pthread_join(sigthread, NULL);
+	for (i = 0; i < fcfg.threads; ++i)
+		erofsfuse_worker_exit(&workers[i], fuse_fd);
+	goto err_fuse;
+
+err_umount:
+	umount2(fcfg.mountpoint, MNT_DETACH);
+err_fuse:
+	close(fuse_fd);
+err_free:
+	free(workers);
+err_close:
+	erofs_image_close(img);
+	erofs_exit_configure();
+	return err ? 1 : 0;
+}
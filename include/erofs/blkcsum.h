@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/blkcsum.h
+ */
+#ifndef __EROFS_BLKCSUM_H
+#define __EROFS_BLKCSUM_H
+
+#include "internal.h"
+
+#define EROFS_BLKCSUM_MAGIC	0xE0F5C5C5
+#define EROFS_BLKCSUM_CRC32C	1
+
+/*
+ * external block checksum table, which is followed by
+ * `blocks' __le32 crc32c (standard, i.e. ~crc32c(~0, ...)) values
+ * of every EROFS_BLKSIZ image block.
+ */
+struct erofs_blkcsum_header {
+	__le32 magic;
+	__u8 blkszbits;
+	__u8 csumtype;
+	__le16 reserved;
+	__le32 blocks;
+	__le32 reserved2;
+};
+
+extern bool erofs_blkcsum_enabled;
+
+void erofs_blkcsum_update(const void *buf, u64 offset, size_t len);
+void erofs_blkcsum_revoke(erofs_blk_t blkaddr, erofs_blk_t nblocks);
+int erofs_blkcsum_write(const char *path, erofs_blk_t blocks);
+void erofs_blkcsum_exit(void);
+
+#endif
+
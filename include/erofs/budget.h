@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/budget.h
+ */
+#ifndef __EROFS_BUDGET_H
+#define __EROFS_BUDGET_H
+
+#include "internal.h"
+
+extern bool erofs_budget_enabled;
+
+const char *erofs_budget_heaviest_compressor(void);
+int erofs_budget_plan(const char *srcpath, u64 maxsize);
+void erofs_budget_lookup(struct erofs_inode *inode,
+			 const char **alg, int *level);
+void erofs_budget_exit(void);
+
+#endif
+
@@ -94,6 +94,9 @@ struct erofs_buffer_head *erofs_balloc(int type, erofs_off_t size,
 				       unsigned int inline_ext);
 struct erofs_buffer_head *erofs_battach(struct erofs_buffer_head *bh,
 					int type, unsigned int size);
+void erofs_bcluster_begin(unsigned int size);
+void erofs_bcluster_end(void);
+int erofs_balign_data(erofs_blk_t nblocks);
 
 erofs_blk_t erofs_mapbh(struct erofs_buffer_block *bb, bool end);
 bool erofs_bflush(struct erofs_buffer_block *bb);
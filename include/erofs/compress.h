@@ -16,7 +16,23 @@
 #define EROFS_CONFIG_COMPR_MAX_SZ           (900  * 1024)
 #define EROFS_CONFIG_COMPR_MIN_SZ           (32   * 1024)
 
-int erofs_write_compressed_file(struct erofs_inode *inode);
+/* size estimation samples segments of large files instead */
+#define Z_EROFS_ESTIMATE_SEGMENT_SIZE       (128  * 1024)
+#define Z_EROFS_ESTIMATE_MIN_SAMPLES        4
+
+struct z_erofs_estimate {
+	u64 sampled;	/* bytes actually compressed */
+	u64 total;	/* bytes of all files to be compressed */
+	double var;	/* variance of the estimated number of blocks */
+};
+
+extern struct z_erofs_estimate z_erofs_estimate;
+
+int erofs_write_compressed_file(struct erofs_inode *inode, int fd,
+				const char *alg, int level);
+int z_erofs_measure_file(const char *path, erofs_off_t size,
+			 const char *alg, int level, erofs_blk_t *blocks);
+int z_erofs_write_compressmeta(struct erofs_inode *inode, erofs_off_t off);
 
 int z_erofs_compress_init(void);
 int z_erofs_compress_exit(void);
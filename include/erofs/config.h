@@ -21,11 +21,35 @@ struct erofs_configure {
 	int c_dbg_lvl;
 	bool c_dry_run;
 	bool c_legacy_compress;
+	/* allocate inodes of siblings together, see erofs_bcluster_begin() */
+	bool c_cluster_inodes;
+	/* allocate inodes of siblings in the best-fit-decreasing order */
+	bool c_pack_inodes;
 
 	/* related arguments for mkfs.erofs */
 	char *c_img_path;
 	char *c_src_path;
+	/* build from this tar archive ("-" for stdin) instead of c_src_path */
+	char *c_tar_path;
+	/* build from this manifest ("-" for stdin), see lib/manifest.c */
+	char *c_manifest_path;
 	char *c_compr_alg_master;
+	/* write per-block checksums of the image to this file if set */
+	char *c_blkcsum_path;
+	/* write a JSON report of phase timings and counters to this file */
+	char *c_report_path;
+	/* write the cache index of compressed files to this file if set */
+	char *c_cache_index_path;
+	/* lay out files in this access trace first, see lib/trace.c */
+	char *c_access_trace_path;
+	/* estimate the image size by compressing c_estimate_pct% of data */
+	unsigned int c_estimate_pct;
+	/* pick per-file compression so that the image fits c_max_size */
+	u64 c_max_size;
+	/* flush finalized inodes early to keep them under c_max_memory */
+	u64 c_max_memory;
+	/* align file data to I/O units of c_data_align bytes, 0 if disabled */
+	u32 c_data_align;
 	int c_compr_level_master;
 	int c_force_inodeversion;
 	/* < 0, xattr disabled and INT_MAX, always use inline xattrs */
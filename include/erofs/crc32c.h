@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/crc32c.h
+ */
+#ifndef __EROFS_CRC32C_H
+#define __EROFS_CRC32C_H
+
+#include "defs.h"
+
+/*
+ * raw crc32c (Castagnoli) update, no pre/post-inversion is done here
+ * so that the caller could chain it as the kernel crc32c_le() does.
+ */
+u32 erofs_crc32c(u32 crc, const void *in, size_t len);
+const char *erofs_crc32c_impl(void);
+
+#endif
+
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/incremental.h
+ */
+#ifndef __EROFS_INCREMENTAL_H
+#define __EROFS_INCREMENTAL_H
+
+#include "internal.h"
+#include "hashtable.h"
+#include "sha256.h"
+
+#define EROFS_ZCACHE_MAGIC	0xE0F5CAC4
+#define EROFS_ZCACHE_VERSION	1
+
+/*
+ * cache index of compressed files in an image, which lets the next build
+ * reuse their pclusters.  The header is followed by `files' records.
+ */
+struct erofs_zcache_header {
+	__le32 magic;
+	__u8 version;
+	__u8 blkszbits;
+	__u8 lz4_0padding;
+	__u8 reserved;
+	__u8 uuid[16];		/* of the image described */
+	__le32 files;
+	__le32 reserved2;
+};
+
+/*
+ * each record is followed by `pathlen' bytes of the path in the image,
+ * `alglen' bytes of the algorithm name and `pclusters' __le32, which are
+ * the decompressed bytes of each one-block pcluster from `blkaddr' on.
+ */
+struct erofs_zcache_record {
+	__le64 size;
+	__le64 mtime;
+	__le32 mtime_nsec;
+	__le32 blkaddr;
+	__le32 pclusters;
+	__le32 level;
+	__le16 pathlen;
+	__u8 alglen;
+	__u8 reserved;
+	__u8 digest[EROFS_SHA256_DIGEST_SIZE];	/* sha256 of the data */
+};
+
+/* the pcluster is stored uncompressed */
+#define EROFS_ZCACHE_PCLUSTER_RAW	(1U << 31)
+/* clusterofs was reset to 0 before, see write_uncompressed_block() */
+#define EROFS_ZCACHE_PCLUSTER_RESET	(1U << 30)
+#define EROFS_ZCACHE_PCLUSTER_COUNT(x)	((x) & (EROFS_ZCACHE_PCLUSTER_RESET - 1))
+
+struct erofs_zcache_file {
+	struct hlist_node node;
+	char *path, *alg;
+	int level;
+	u64 size, mtime;
+	u32 mtime_nsec;
+	erofs_blk_t blkaddr;
+	unsigned int nr_pclusters;
+	u32 *pclusters;
+	u8 digest[EROFS_SHA256_DIGEST_SIZE];
+};
+
+extern bool erofs_incremental_enabled, erofs_cache_index_enabled;
+
+int erofs_incremental_open(const char *imgpath, const char *indexpath);
+int erofs_cache_index_open(const char *path);
+struct erofs_zcache_file *erofs_incremental_find(struct erofs_inode *inode,
+						 const char *alg, int level);
+int erofs_incremental_digest(int fd, erofs_off_t size, u8 *digest);
+int erofs_incremental_copy(erofs_blk_t from, erofs_blk_t to,
+			   erofs_blk_t nblocks);
+int erofs_cache_index_add(struct erofs_inode *inode, const u8 *digest,
+			  const char *alg, int level, erofs_blk_t blkaddr,
+			  const u32 *pclusters, unsigned int nr_pclusters);
+int erofs_cache_index_close(void);
+void erofs_incremental_exit(void);
+
+#endif
+
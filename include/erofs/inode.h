@@ -12,9 +12,23 @@
 
 #include "erofs/internal.h"
 
+struct stat64;
+
 void erofs_inode_manager_init(void);
 unsigned int erofs_iput(struct erofs_inode *inode);
 erofs_nid_t erofs_lookupnid(struct erofs_inode *inode);
+struct erofs_inode *erofs_new_inode(void);
+struct erofs_inode *erofs_iget_from_path(const char *path, bool is_src);
+struct erofs_dentry *erofs_d_alloc(struct erofs_inode *parent,
+				   const char *name);
+int erofs_prepare_dir_file(struct erofs_inode *dir);
+int erofs_fill_inode(struct erofs_inode *inode, struct stat64 *st,
+		     const char *path);
+int erofs_write_file_from_buffer(struct erofs_inode *inode, char *buf);
+int erofs_write_file_from_fd(struct erofs_inode *inode, int fd);
+int erofs_write_file(struct erofs_inode *inode);
+int erofs_settle_file_data(struct erofs_inode *inode);
+struct erofs_inode *erofs_mkfs_write_tree(struct erofs_inode *dir);
 struct erofs_inode *erofs_mkfs_build_tree_from_path(struct erofs_inode *parent,
 						    const char *path);
 
@@ -26,9 +26,15 @@ typedef unsigned short umode_t;
 #define PAGE_SHIFT		(12)
 #define PAGE_SIZE		(1U << PAGE_SHIFT)
 
-#define LOG_BLOCK_SIZE          (12)
+/* the block size is chosen at runtime, see sbi.blkszbits */
+#define LOG_BLOCK_SIZE          (sbi.blkszbits)
 #define EROFS_BLKSIZ            (1U << LOG_BLOCK_SIZE)
 
+#define EROFS_DEFAULT_BLKSZBITS	(12)
+#define EROFS_MAX_BLKSZBITS	(16)
+/* for buffers which have to hold a block of any supported size */
+#define EROFS_MAX_BLOCK_SIZE	(1U << EROFS_MAX_BLKSZBITS)
+
 #define EROFS_ISLOTBITS		5
 #define EROFS_SLOTSIZE		(1U << EROFS_ISLOTBITS)
 
@@ -47,6 +53,7 @@ typedef u32 erofs_blk_t;
 #define BLK_ROUND_UP(addr)	DIV_ROUND_UP(addr, EROFS_BLKSIZ)
 
 struct erofs_buffer_head;
+struct inode_xattr_set;
 
 struct erofs_sb_info {
 	erofs_blk_t meta_blkaddr;
@@ -57,6 +64,7 @@ struct erofs_sb_info {
 	u64 build_time;
 	u32 build_time_nsec;
 	u8 uuid[16];
+	u8 blkszbits;
 };
 
 /* global sbi */
@@ -80,7 +88,7 @@ EROFS_FEATURE_FUNCS(lz4_0padding, incompat, INCOMPAT_LZ4_0PADDING)
 EROFS_FEATURE_FUNCS(sb_chksum, compat, COMPAT_SB_CHKSUM)
 
 struct erofs_inode {
-	struct list_head i_hash, i_subdirs, i_xattrs;
+	struct list_head i_hash, i_subdirs;
 
 	unsigned int i_count;
 	struct erofs_inode *i_parent;
@@ -94,6 +102,9 @@ struct erofs_inode {
 	u64 i_ctime;
 	u32 i_ctime_nsec;
 	u32 i_nlink;
+	/* not stored in the image, only a cache key of --incremental */
+	u64 i_mtime;
+	u32 i_mtime_nsec;
 
 	union {
 		u32 i_blkaddr;
@@ -105,11 +116,17 @@ struct erofs_inode {
 
 	unsigned char datalayout;
 	unsigned char inode_isize;
+	/* st_nlink > 1, so it can be found again after being freed */
+	bool i_hardlinked;
+	/* the data has been written ahead of the tree walk (--access-trace) */
+	bool i_data_written;
 	/* inline tail-end packing size */
 	unsigned short idata_size;
 
 	unsigned int xattr_isize;
 	unsigned int extent_isize;
+	/* interned inline xattr ibody, shared with other inodes */
+	struct inode_xattr_set *i_xattrs;
 
 	erofs_nid_t nid;
 	struct erofs_buffer_head *bh;
@@ -117,6 +134,8 @@ struct erofs_inode {
 
 	void *idata;
 	void *compressmeta;
+	/* where compressmeta was spilled to if it's NULL */
+	erofs_off_t compressmeta_spilloff;
 };
 
 static inline bool is_inode_layout_compression(struct erofs_inode *inode)
@@ -24,6 +24,8 @@ int dev_fillzero(u64 offset, size_t len, bool padding);
 int dev_fsync(void);
 int dev_resize(erofs_blk_t nblocks);
 u64 dev_length(void);
+unsigned int dev_optimal_io_size(void);
+ssize_t erofs_read_fully(int fd, void *buf, size_t len);
 
 static inline int blk_write(const void *buf, erofs_blk_t blkaddr,
 			    u32 nblocks)
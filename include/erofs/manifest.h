@@ -0,0 +1,15 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/manifest.h
+ */
+#ifndef __EROFS_MANIFEST_H
+#define __EROFS_MANIFEST_H
+
+#include <stdio.h>
+#include "internal.h"
+
+struct erofs_inode *erofs_mkfs_build_tree_from_manifest(FILE *fp,
+							const char *srcdir);
+
+#endif
+
@@ -0,0 +1,177 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/reader.h
+ *
+ * Read EROFS images from userspace without mounting them.
+ */
+#ifndef __EROFS_READER_H
+#define __EROFS_READER_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "internal.h"
+#include "hashtable.h"
+
+#ifndef EFSCORRUPTED
+#define EFSCORRUPTED	EUCLEAN
+#endif
+
+/* the default byte limit of the block cache */
+#define EROFS_READER_CACHE_SIZE		(32ULL << 20)
+
+/* read through the block cache rather than mmap() */
+#define EROFS_READER_NOMMAP		0x0001
+
+/*
+ * a bounded LRU cache of raw blocks and of decompressed pclusters, which is
+ * only used for raw blocks if the image can't be mmap()ed.  It's split into
+ * stripes by key, each of which has its own lock and LRU list, so that
+ * threads seldom contend.
+ */
+struct erofs_rcache_stripe {
+	pthread_mutex_t lock;
+	struct list_head lru;		/* the head is the most recently used */
+	struct hlist_head *hash;
+	u64 capacity, used;
+	u64 hits, misses;
+};
+
+struct erofs_rcache {
+	struct erofs_rcache_stripe *stripes;
+	unsigned int stripebits, hashbits;
+	u64 capacity;
+};
+
+struct erofs_image {
+	int fd;
+	u64 size;
+	/* the whole image if it's mmap()ed, or NULL */
+	const u8 *map;
+
+	u8 blkszbits;
+	unsigned int blksz;
+	u32 feature_compat, feature_incompat;
+	u32 checksum;
+	erofs_nid_t root_nid;
+	u64 inos;
+	u64 build_time;
+	u32 build_time_nsec;
+	erofs_blk_t blocks;
+	erofs_blk_t meta_blkaddr, xattr_blkaddr;
+	u8 uuid[16];
+	char volume_name[17];
+
+	struct erofs_rcache cache;
+};
+
+/* a logical extent of a compressed file */
+struct erofs_rextent {
+	erofs_off_t lstart;		/* where it starts in the file */
+	erofs_blk_t blkaddr;		/* the pcluster (one block) */
+	u8 type;			/* Z_EROFS_VLE_CLUSTER_TYPE_{PLAIN,HEAD} */
+};
+
+struct erofs_rinode {
+	struct erofs_image *img;
+	erofs_nid_t nid;
+	erofs_off_t iloc;		/* where the on-disk inode is */
+
+	umode_t i_mode;
+	unsigned char datalayout;
+	unsigned char inode_isize;
+	unsigned int xattr_isize;
+	erofs_off_t i_size;
+	u32 i_ino;
+	u32 i_uid, i_gid;
+	u32 i_nlink;
+	u64 i_mtime;
+	u32 i_mtime_nsec;
+	union {
+		u32 i_blkaddr;
+		u32 i_blocks;
+		u32 i_rdev;
+	} u;
+
+	/* compressed files only */
+	u16 z_advise;
+	u8 z_algorithmtype;
+	unsigned int z_idxsize;		/* the map header and indexes */
+	unsigned int nr_extents;
+	struct erofs_rextent *extents;
+};
+
+struct erofs_rdirent {
+	const char *name;		/* not nul-terminated */
+	unsigned int namelen;
+	erofs_nid_t nid;
+	u8 file_type;			/* EROFS_FT_* */
+	u64 pos;			/* the index in the directory */
+	erofs_off_t off;		/* where it is in the directory data */
+};
+
+/* return non-zero to stop iterating */
+typedef int (*erofs_readdir_t)(void *arg, const struct erofs_rdirent *de);
+typedef int (*erofs_xattr_iter_t)(void *arg, const char *name,
+				  const void *value, unsigned int size,
+				  bool shared);
+
+struct erofs_image *erofs_image_open(const char *path, u64 cache_size,
+				     unsigned int flags);
+void erofs_image_close(struct erofs_image *img);
+int erofs_image_read(struct erofs_image *img, void *buf, size_t len,
+		     erofs_off_t off);
+const void *erofs_image_map(struct erofs_image *img, erofs_off_t off,
+			    size_t len);
+void erofs_image_cache_stats(struct erofs_image *img, u64 *hits,
+			     u64 *misses);
+
+int erofs_read_inode(struct erofs_image *img, erofs_nid_t nid,
+		     struct erofs_rinode *vi);
+int erofs_read_inode_meta(struct erofs_image *img, erofs_nid_t nid,
+			  struct erofs_rinode *vi);
+void erofs_put_inode(struct erofs_rinode *vi);
+int erofs_namei(struct erofs_rinode *dir, const char *name,
+		unsigned int namelen, erofs_nid_t *nid, u8 *file_type);
+int erofs_ilookup(struct erofs_image *img, const char *path,
+		  struct erofs_rinode *vi);
+int erofs_readdir(struct erofs_rinode *dir, u64 pos, erofs_readdir_t cb,
+		  void *arg);
+
+ssize_t erofs_pread(struct erofs_rinode *vi, void *buf, size_t len,
+		    erofs_off_t off);
+ssize_t erofs_map_data(struct erofs_rinode *vi, erofs_off_t off,
+		       size_t len, const void **ptr);
+unsigned int erofs_extent_length(struct erofs_rinode *vi, unsigned int i);
+unsigned int erofs_find_extent(struct erofs_rinode *vi, erofs_off_t off);
+int erofs_read_extent(struct erofs_rinode *vi, unsigned int i, void *buf);
+int erofs_verify_extent(struct erofs_rinode *vi, unsigned int i, void *buf);
+
+int erofs_xattr_iterate(struct erofs_rinode *vi, erofs_xattr_iter_t cb,
+			void *arg);
+ssize_t erofs_listxattr(struct erofs_rinode *vi, char *buf, size_t size);
+ssize_t erofs_getxattr(struct erofs_rinode *vi, const char *name,
+		       void *buf, size_t size);
+
+static inline unsigned int erofs_mode_to_ftype(umode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return EROFS_FT_REG_FILE;
+	case S_IFDIR:
+		return EROFS_FT_DIR;
+	case S_IFCHR:
+		return EROFS_FT_CHRDEV;
+	case S_IFBLK:
+		return EROFS_FT_BLKDEV;
+	case S_IFIFO:
+		return EROFS_FT_FIFO;
+	case S_IFSOCK:
+		return EROFS_FT_SOCK;
+	case S_IFLNK:
+		return EROFS_FT_SYMLINK;
+	}
+	return EROFS_FT_UNKNOWN;
+}
+
+#endif
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/rebuild.h
+ */
+#ifndef __EROFS_REBUILD_H
+#define __EROFS_REBUILD_H
+
+#include "internal.h"
+
+struct erofs_inode *erofs_rebuild_make_root(void);
+int erofs_rebuild_fill_inode(struct erofs_inode *inode, const char *path,
+			     umode_t mode, u64 uid, u64 gid, u64 size,
+			     dev_t rdev);
+struct erofs_inode *erofs_rebuild_new_inode(const char *path, umode_t mode,
+					    u64 uid, u64 gid, u64 size,
+					    dev_t rdev);
+int erofs_rebuild_unescape(char *s);
+int erofs_rebuild_normalize_path(char *path);
+bool erofs_rebuild_is_excluded(char *path);
+
+struct erofs_dentry *erofs_rebuild_find(struct erofs_inode *dir,
+					const char *name, unsigned int len);
+struct erofs_dentry *erofs_rebuild_add_dentry(struct erofs_inode *dir,
+					      const char *name,
+					      struct erofs_inode *inode);
+struct erofs_inode *erofs_rebuild_lookup_parent(struct erofs_inode *root,
+						char *path, bool create,
+						const char **name);
+struct erofs_inode *erofs_rebuild_lookup(struct erofs_inode *root, char *path);
+void erofs_rebuild_cleanup(void);
+
+#endif
+
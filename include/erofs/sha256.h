@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/sha256.h
+ */
+#ifndef __EROFS_SHA256_H
+#define __EROFS_SHA256_H
+
+#include "defs.h"
+
+#define EROFS_SHA256_DIGEST_SIZE	32
+
+struct erofs_sha256_state {
+	u64 length;
+	u32 state[8];
+	u32 curlen;
+	u8 buf[64];
+};
+
+void erofs_sha256_init(struct erofs_sha256_state *md);
+void erofs_sha256_process(struct erofs_sha256_state *md,
+			  const void *in, size_t inlen);
+void erofs_sha256_done(struct erofs_sha256_state *md, u8 *out);
+
+#endif
+
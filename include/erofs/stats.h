@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/stats.h
+ */
+#ifndef __EROFS_STATS_H
+#define __EROFS_STATS_H
+
+#include <stdio.h>
+#include "defs.h"
+
+/* wall time is accumulated per phase, nested phases are also counted */
+enum erofs_phase {
+	EROFS_PHASE_TOTAL,
+	EROFS_PHASE_XATTR_PRESCAN,
+	EROFS_PHASE_BUDGET,
+	EROFS_PHASE_HOT_DATA,
+	EROFS_PHASE_TREE_WALK,
+	EROFS_PHASE_COMPRESS,		/* part of HOT_DATA and TREE_WALK */
+	EROFS_PHASE_BFLUSH,
+	EROFS_PHASE_RESIZE,
+	EROFS_PHASE_SB_CHECKSUM,
+	EROFS_PHASE_VERITY,
+	EROFS_PHASE_BLKCSUM,
+	EROFS_PHASE_MAX
+};
+
+enum erofs_stat {
+	EROFS_STAT_BYTES_READ,
+	EROFS_STAT_BYTES_COMPRESSED,	/* input bytes of compressed pclusters */
+	EROFS_STAT_COMPRESSED_SIZE,	/* output bytes of compressed pclusters */
+	EROFS_STAT_PCLUSTERS,
+	EROFS_STAT_RAW_PCLUSTERS,
+	EROFS_STAT_RAW_FALLBACKS,	/* files fallen back to uncompressed */
+	EROFS_STAT_DEV_WRITES,
+	EROFS_STAT_DEV_WRITE_BYTES,
+	EROFS_STAT_BUFFER_BLOCKS,
+	EROFS_STAT_IMAGE_BLOCKS,
+	EROFS_STAT_EARLY_FLUSHES,	/* flushes due to --max-memory */
+	EROFS_STAT_INDEX_SPILLED,	/* index bytes of huge files spilled */
+	EROFS_STAT_REUSED_FILES,	/* files reused by --incremental */
+	EROFS_STAT_REUSED_BLOCKS,
+	EROFS_STAT_HOT_FILES,		/* files laid out by --access-trace */
+	EROFS_STAT_HOT_BYTES,		/* traced bytes of these files */
+	EROFS_STAT_HOT_SEQUENTIAL_BYTES,	/* ... not in inline tails */
+	EROFS_STAT_HOT_BLOCKS,
+	EROFS_STAT_DIRS,
+	EROFS_STAT_DIR_META_BLOCKS,	/* touched by listing each directory */
+	EROFS_STAT_META_BLOCKS,		/* flushed, including padding */
+	EROFS_STAT_ALIGNED_FILES,	/* padded to --align-data */
+	EROFS_STAT_ALIGN_PADDING_BLOCKS,
+	EROFS_STAT_MAX
+};
+
+extern u64 erofs_stats[EROFS_STAT_MAX];
+
+static inline void erofs_stat_add(enum erofs_stat stat, u64 n)
+{
+	erofs_stats[stat] += n;
+}
+
+void erofs_phase_begin(enum erofs_phase phase);
+void erofs_phase_end(enum erofs_phase phase);
+int erofs_stats_report(const char *path, int err);
+
+/* write @s as a quoted JSON string */
+void erofs_json_write_string(FILE *f, const char *s);
+
+#endif
+
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/tar.h
+ */
+#ifndef __EROFS_TAR_H
+#define __EROFS_TAR_H
+
+#include "internal.h"
+
+struct erofs_inode *erofs_mkfs_build_tree_from_tar(int fd);
+
+#endif
+
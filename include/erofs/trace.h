@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/trace.h
+ */
+#ifndef __EROFS_TRACE_H
+#define __EROFS_TRACE_H
+
+#include "internal.h"
+#include "hashtable.h"
+
+/* [start, end) in bytes */
+struct erofs_trace_range {
+	u64 start, end;
+};
+
+/* a traced file, listed in the order of its first access */
+struct erofs_trace_file {
+	struct list_head list;
+	struct hlist_node node;
+	char *path;		/* normalized, relative to the root */
+	struct erofs_trace_range *ranges;
+	unsigned int nr_ranges, max_ranges;
+	/* the inode whose data is written ahead of the tree walk */
+	struct erofs_inode *inode;
+};
+
+extern struct list_head erofs_trace_files;
+
+int erofs_trace_parse_entry(char *line, char **path, u64 *start, u64 *end);
+int erofs_trace_load(const char *path);
+u64 erofs_trace_bytes(struct erofs_trace_file *tf, u64 start, u64 end);
+int erofs_trace_write_hot_files(const char *srcpath);
+void erofs_trace_exit(void);
+
+#endif
+
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/verity.h
+ */
+#ifndef __EROFS_VERITY_H
+#define __EROFS_VERITY_H
+
+#include "internal.h"
+
+#define EROFS_VERITY_MAX_SALT_SIZE	256
+
+/* on-disk dm-verity superblock, the same as `veritysetup format' writes */
+struct erofs_verity_sb {
+	u8 signature[8];	/* "verity\0\0" */
+	__le32 version;		/* superblock version, 1 */
+	__le32 hash_type;	/* 0 - Chrome OS, 1 - normal */
+	u8 uuid[16];
+	u8 algorithm[32];	/* hash algorithm name */
+	__le32 data_block_size;
+	__le32 hash_block_size;
+	__le64 data_blocks;
+	__le16 salt_size;
+	u8 pad1[6];
+	u8 salt[EROFS_VERITY_MAX_SALT_SIZE];
+	u8 pad2[168];
+} __packed;
+
+extern bool erofs_verity_enabled;
+
+/* saltsize < 0 means a random salt of the default size will be used */
+int erofs_verity_init(unsigned int blksize, const u8 *salt, int saltsize);
+void erofs_verity_update(const void *buf, u64 offset, size_t len);
+void erofs_verity_revoke(erofs_blk_t blkaddr, erofs_blk_t nblocks);
+int erofs_verity_write(erofs_blk_t blocks);
+void erofs_verity_exit(void);
+
+#endif
+
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/include/erofs/workqueue.h
+ */
+#ifndef __EROFS_WORKQUEUE_H
+#define __EROFS_WORKQUEUE_H
+
+#include <pthread.h>
+#include "internal.h"
+
+struct erofs_work {
+	struct list_head list;
+	/* called by a worker, which may free @work */
+	void (*fn)(struct erofs_work *work);
+};
+
+/* a fixed pool of threads running queued works in FIFO order */
+struct erofs_workqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond_work, cond_space;
+	struct list_head head;
+	unsigned int nr_queued, max_queued;
+	unsigned int nr_workers;
+	pthread_t *workers;
+	bool shutdown;
+};
+
+int erofs_workqueue_init(struct erofs_workqueue *wq, unsigned int nr_workers,
+			 unsigned int max_queued);
+void erofs_queue_work(struct erofs_workqueue *wq, struct erofs_work *work);
+void erofs_workqueue_exit(struct erofs_workqueue *wq);
+
+#endif
+
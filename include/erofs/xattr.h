@@ -42,8 +42,14 @@
 #define XATTR_NAME_POSIX_ACL_DEFAULT "system.posix_acl_default"
 #endif
 
-int erofs_prepare_xattr_ibody(const char *path, struct list_head *ixattrs);
-char *erofs_export_xattr_ibody(struct list_head *ixattrs, unsigned int size);
+int erofs_prepare_xattr_ibody(struct erofs_inode *inode);
+int erofs_xattr_list_add(struct list_head *ixattrs, const char *key,
+			 const char *value, unsigned int size);
+void erofs_xattr_list_free(struct list_head *ixattrs);
+int erofs_prepare_xattr_ibody_from_list(struct erofs_inode *inode,
+					struct list_head *ixattrs);
+const char *erofs_export_xattr_ibody(struct erofs_inode *inode);
+void erofs_drop_xattr_ibody(struct erofs_inode *inode);
 int erofs_build_shared_xattrs_from_path(const char *path);
 
 #endif
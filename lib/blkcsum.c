@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/blkcsum.c
+ *
+ * Generate the per-block checksum table while the image is being written,
+ * so that it doesn't need another full read of the image afterwards.
+ * Since each physical cluster is one block for now, it also serves as
+ * per-pcluster checksums.
+ */
+#include <stdlib.h>
+#include "erofs/io.h"
+#include "erofs/print.h"
+#include "erofs/crc32c.h"
+#include "erofs/blkcsum.h"
+
+/* the block has been overwritten, so its checksum has to be recalculated */
+#define BLKCSUM_DIRTY	((u32)-1)
+
+struct blkcsum_state {
+	u32 crc;
+	/* bytes which have been written sequentially from the block start */
+	u32 filled;
+	/* revoked after written, so unwritten ranges aren't zeroed anymore */
+	bool stale;
+};
+
+bool erofs_blkcsum_enabled;
+static struct blkcsum_state *blkcsum;
+static erofs_blk_t blkcsum_nr;
+/* tracking failed, so all checksums have to be calculated from the image */
+static bool blkcsum_broken;
+
+static const u8 zeroed[EROFS_MAX_BLOCK_SIZE];
+
+static int blkcsum_grow(erofs_blk_t blkaddr)
+{
+	erofs_blk_t nr = max_t(erofs_blk_t, blkcsum_nr * 2, 256);
+	struct blkcsum_state *n;
+
+	while (nr <= blkaddr)
+		nr *= 2;
+
+	n = realloc(blkcsum, nr * sizeof(*n));
+	if (!n)
+		return -ENOMEM;
+	memset(n + blkcsum_nr, 0, (nr - blkcsum_nr) * sizeof(*n));
+	blkcsum = n;
+	blkcsum_nr = nr;
+	return 0;
+}
+
+static void blkcsum_feed(struct blkcsum_state *s, const u8 *in,
+			 unsigned int off, unsigned int cnt)
+{
+	if (s->filled == BLKCSUM_DIRTY)
+		return;
+
+	/* overwritten, or the hole may still keep revoked data */
+	if (off < s->filled || (s->stale && off > s->filled)) {
+		s->filled = BLKCSUM_DIRTY;
+		return;
+	}
+
+	if (!s->filled)
+		s->crc = ~0;
+	/* holes between two writes are zeroed */
+	if (off > s->filled)
+		s->crc = erofs_crc32c(s->crc, zeroed, off - s->filled);
+	s->crc = erofs_crc32c(s->crc, in ? in : zeroed, cnt);
+	s->filled = off + cnt;
+}
+
+/* called for each dev_write(), NULL buf means zeroed data */
+void erofs_blkcsum_update(const void *buf, u64 offset, size_t len)
+{
+	const u8 *in = buf;
+
+	while (len && !blkcsum_broken) {
+		const erofs_blk_t blkaddr = erofs_blknr(offset);
+		const unsigned int off = erofs_blkoff(offset);
+		const unsigned int cnt = min_t(u64, len, EROFS_BLKSIZ - off);
+
+		if (blkaddr >= blkcsum_nr && blkcsum_grow(blkaddr)) {
+			erofs_warn("out of memory, block checksums will be calculated by reading the image");
+			blkcsum_broken = true;
+			return;
+		}
+
+		blkcsum_feed(blkcsum + blkaddr, in, off, cnt);
+		offset += cnt;
+		len -= cnt;
+		if (in)
+			in += cnt;
+	}
+}
+
+/* blocks written before will be reused, e.g. by the uncompressed fallback */
+void erofs_blkcsum_revoke(erofs_blk_t blkaddr, erofs_blk_t nblocks)
+{
+	struct blkcsum_state *s;
+
+	for (; nblocks && blkaddr < blkcsum_nr; ++blkaddr, --nblocks) {
+		s = blkcsum + blkaddr;
+		if (s->filled) {
+			s->filled = 0;
+			s->stale = true;
+		}
+	}
+}
+
+static int blkcsum_finalize(erofs_blk_t blkaddr, u32 *crc,
+			    unsigned int *reread)
+{
+	struct blkcsum_state *s = blkaddr < blkcsum_nr ?
+		blkcsum + blkaddr : NULL;
+	u8 buf[EROFS_MAX_BLOCK_SIZE];
+	int ret;
+
+	if (blkcsum_broken)
+		goto reread;
+
+	if (s && s->stale && s->filled != EROFS_BLKSIZ)
+		goto reread;
+
+	if (!s || !s->filled) {
+		*crc = ~erofs_crc32c(~0, zeroed, EROFS_BLKSIZ);
+		return 0;
+	}
+
+	if (s->filled != BLKCSUM_DIRTY) {
+		*crc = ~erofs_crc32c(s->crc, zeroed, EROFS_BLKSIZ - s->filled);
+		return 0;
+	}
+
+reread:
+	ret = blk_read(buf, blkaddr, 1);
+	if (ret)
+		return ret;
+	++*reread;
+	*crc = ~erofs_crc32c(~0, buf, EROFS_BLKSIZ);
+	return 0;
+}
+
+int erofs_blkcsum_write(const char *path, erofs_blk_t blocks)
+{
+	struct erofs_blkcsum_header h = {
+		.magic = cpu_to_le32(EROFS_BLKCSUM_MAGIC),
+		.blkszbits = LOG_BLOCK_SIZE,
+		.csumtype = EROFS_BLKCSUM_CRC32C,
+		.blocks = cpu_to_le32(blocks),
+	};
+	unsigned int reread = 0;
+	erofs_blk_t i;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		erofs_err("failed to open %s for block checksums", path);
+		return -errno;
+	}
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		ret = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < blocks; ++i) {
+		u32 crc;
+
+		ret = blkcsum_finalize(i, &crc, &reread);
+		if (ret)
+			goto out;
+
+		crc = cpu_to_le32(crc);
+		if (fwrite(&crc, sizeof(crc), 1, f) != 1) {
+			ret = -EIO;
+			goto out;
+		}
+	}
+	erofs_info("%u block checksums (%s) written to %s, %u blocks re-read",
+		   blocks, erofs_crc32c_impl(), path, reread);
+out:
+	if (fclose(f) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+void erofs_blkcsum_exit(void)
+{
+	free(blkcsum);
+	blkcsum = NULL;
+	blkcsum_nr = 0;
+	blkcsum_broken = false;
+	erofs_blkcsum_enabled = false;
+}
@@ -0,0 +1,459 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/budget.c
+ *
+ * Choose the compression algorithm and level of each file so that the
+ * image fits into a given size, and is as cheap to decompress as possible.
+ * All files start uncompressed, and the file whose next step saves the most
+ * bytes per decompression cost is escalated until the image fits.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+#include "erofs/print.h"
+#include "erofs/hashtable.h"
+#include "erofs/compress.h"
+#include "erofs/exclude.h"
+#include "erofs/budget.h"
+
+struct budget_rung {
+	const char *alg;	/* NULL if uncompressed */
+	int level;
+	/* relative compression effort of the algorithm, to compare with -z */
+	unsigned int weight;
+	/* relative decompression cost per byte */
+	unsigned int cost;
+};
+
+/*
+ * LZ4 decompression speed doesn't depend on the compression level, so
+ * escalating lz4 to lz4hc levels saves space for free.
+ */
+static const struct budget_rung budget_rungs[] = {
+	{ NULL, 0, 0, 0 },
+	{ "lz4", 0, 1, 1 },
+	{ "lz4hc", 4, 2, 1 },
+	{ "lz4hc", 9, 2, 1 },
+	{ "lz4hc", 12, 2, 1 },
+};
+
+struct budget_file {
+	struct hlist_node node;
+	ino_t ino;
+	erofs_off_t size;
+	char *path;
+	/* current rung and the next one which saves space */
+	int rung, next;
+	u64 bytes, next_bytes;
+};
+
+bool erofs_budget_enabled;
+static bool budget_usable[ARRAY_SIZE(budget_rungs)];
+
+#define BUDGET_HASHTABLE_BITS	12
+static DEFINE_HASHTABLE(budget_hashtable, BUDGET_HASHTABLE_BITS);
+
+static struct budget_file **budget_files;
+static unsigned int budget_nr, budget_max;
+/* metadata which doesn't depend on compression */
+static u64 budget_reserved;
+
+static bool budget_compressor_available(const char *alg)
+{
+	const char *name;
+	int i;
+
+	for (i = 0; (name = z_erofs_list_available_compressors(i)); ++i)
+		if (!strcmp(alg, name))
+			return true;
+	return false;
+}
+
+/* the weight of @alg, or -1 if there are no rungs of it */
+static int budget_compressor_weight(const char *alg)
+{
+	unsigned int i;
+
+	for (i = 1; i < ARRAY_SIZE(budget_rungs); ++i)
+		if (!strcmp(budget_rungs[i].alg, alg))
+			return budget_rungs[i].weight;
+	return -1;
+}
+
+const char *erofs_budget_heaviest_compressor(void)
+{
+	const struct budget_rung *heaviest = NULL;
+	unsigned int i;
+
+	for (i = 1; i < ARRAY_SIZE(budget_rungs); ++i) {
+		const struct budget_rung *r = &budget_rungs[i];
+
+		if ((!heaviest || r->weight > heaviest->weight) &&
+		    budget_compressor_available(r->alg))
+			heaviest = r;
+	}
+	return heaviest ? heaviest->alg : NULL;
+}
+
+/*
+ * only use compressors no heavier than the one given by -z, and leave files
+ * uncompressed if there is no compressor at all.
+ */
+static void budget_init_rungs(void)
+{
+	const char *const alg = cfg.c_compr_alg_master;
+	int master;
+	unsigned int i;
+
+	budget_usable[0] = true;
+	if (!alg)
+		return;
+	master = budget_compressor_weight(alg);
+	for (i = 1; i < ARRAY_SIZE(budget_rungs); ++i) {
+		const struct budget_rung *r = &budget_rungs[i];
+
+		if (!budget_compressor_available(r->alg))
+			continue;
+		if (master >= 0 && r->weight > (unsigned int)master)
+			continue;
+		if (!strcmp(r->alg, alg) &&
+		    cfg.c_compr_level_master >= 0 &&
+		    r->level > cfg.c_compr_level_master)
+			continue;
+		budget_usable[i] = true;
+	}
+}
+
+static u64 budget_rung_bytes(struct budget_file *f, erofs_blk_t blocks)
+{
+	const erofs_blk_t lclusters = BLK_ROUND_UP(f->size) + 1;
+	u64 metasize;
+
+	/* compacted indexes take 4 bytes per lcluster at most */
+	if (cfg.c_legacy_compress)
+		metasize = lclusters *
+			sizeof(struct z_erofs_vle_decompressed_index);
+	else
+		metasize = lclusters * 4 + 32;
+	return blknr_to_addr(blocks) + sizeof(struct z_erofs_map_header) +
+		Z_EROFS_VLE_LEGACY_HEADER_PADDING + metasize;
+}
+
+/* find the next usable rung which saves space */
+static int budget_measure_next(struct budget_file *f)
+{
+	int i;
+
+	f->next = -1;
+	for (i = f->rung + 1; i < (int)ARRAY_SIZE(budget_rungs); ++i) {
+		const struct budget_rung *r = &budget_rungs[i];
+		erofs_blk_t blocks;
+		int ret;
+
+		if (!budget_usable[i])
+			continue;
+
+		ret = z_erofs_measure_file(f->path, f->size, r->alg, r->level,
+					   &blocks);
+		if (ret)
+			return ret;
+		/* it would fall back to uncompressed */
+		if (blocks >= BLK_ROUND_UP(f->size))
+			return 0;
+
+		f->next_bytes = budget_rung_bytes(f, blocks);
+		if (f->next_bytes < f->bytes) {
+			f->next = i;
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* whether the next step of @a saves more bytes per cost than @b */
+static bool budget_better(struct budget_file *a, struct budget_file *b)
+{
+	const u64 sa = a->bytes - a->next_bytes, sb = b->bytes - b->next_bytes;
+	const u64 ca = a->size * (budget_rungs[a->next].cost -
+				  budget_rungs[a->rung].cost);
+	const u64 cb = b->size * (budget_rungs[b->next].cost -
+				  budget_rungs[b->rung].cost);
+
+	if (!ca || !cb)
+		return ca == cb ? sa > sb : !ca;
+	return (double)sa / ca > (double)sb / cb;
+}
+
+/* a binary max-heap of the files which can be escalated */
+static void budget_heap_push(struct budget_file **heap, unsigned int *nr,
+			     struct budget_file *f)
+{
+	unsigned int i = (*nr)++;
+
+	while (i && budget_better(f, heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = f;
+}
+
+static struct budget_file *budget_heap_pop(struct budget_file **heap,
+					   unsigned int *nr)
+{
+	struct budget_file *const top = heap[0], *last = heap[--*nr];
+	unsigned int i = 0, child;
+
+	while ((child = 2 * i + 1) < *nr) {
+		if (child + 1 < *nr && budget_better(heap[child + 1],
+						     heap[child]))
+			++child;
+		if (!budget_better(heap[child], last))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+static int budget_add_file(const char *path, struct stat64 *st)
+{
+	struct budget_file *f;
+
+	hash_for_each_possible(budget_hashtable, f, node, st->st_ino)
+		if (f->ino == st->st_ino)
+			return 0;
+
+	if (budget_nr >= budget_max) {
+		struct budget_file **files;
+
+		budget_max = budget_max ? budget_max * 2 : 1024;
+		files = realloc(budget_files, budget_max * sizeof(*files));
+		if (!files)
+			return -ENOMEM;
+		budget_files = files;
+	}
+
+	f = malloc(sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+	f->path = strdup(path);
+	if (!f->path) {
+		free(f);
+		return -ENOMEM;
+	}
+	f->ino = st->st_ino;
+	f->size = st->st_size;
+	f->rung = 0;
+	f->bytes = blknr_to_addr(BLK_ROUND_UP(f->size));
+	hash_add(budget_hashtable, &f->node, f->ino);
+	budget_files[budget_nr++] = f;
+	return 0;
+}
+
+/* an upper bound of the inline xattrs, without name prefixes stripped */
+static u64 budget_xattr_size(const char *path)
+{
+	static char names[XATTR_LIST_MAX];
+	char *name;
+	ssize_t len = llistxattr(path, names, sizeof(names));
+	u64 size = 0;
+
+	if (len <= 0)
+		return 0;
+
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		ssize_t vsize = lgetxattr(path, name, NULL, 0);
+
+		if (vsize >= 0)
+			size += EROFS_XATTR_ALIGN(sizeof(struct erofs_xattr_entry) +
+						  strlen(name) + vsize);
+	}
+	return sizeof(struct erofs_xattr_ibody_header) + size;
+}
+
+static int budget_scan(const char *path)
+{
+	struct stat64 st;
+	u64 dirsize;
+	DIR *_dir;
+	int ret;
+
+	_dir = opendir(path);
+	if (!_dir) {
+		erofs_err("%s, failed to opendir at %s: %s",
+			  __func__, path, erofs_strerror(errno));
+		return -errno;
+	}
+
+	/* "." and ".." */
+	dirsize = 2 * sizeof(struct erofs_dirent) + 3;
+	ret = 0;
+	while (1) {
+		struct dirent *dp;
+		char buf[PATH_MAX];
+
+		/*
+		 * set errno to 0 before calling readdir() in order to
+		 * distinguish end of stream and from an error.
+		 */
+		errno = 0;
+		dp = readdir(_dir);
+		if (!dp)
+			break;
+
+		if (is_dot_dotdot(dp->d_name) ||
+		    !strncmp(dp->d_name, "lost+found", strlen("lost+found")))
+			continue;
+
+		if (erofs_is_exclude_path(path, dp->d_name))
+			continue;
+
+		ret = snprintf(buf, PATH_MAX, "%s/%s", path, dp->d_name);
+		if (ret < 0 || ret >= PATH_MAX) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		ret = lstat64(buf, &st);
+		if (ret) {
+			ret = -errno;
+			goto fail;
+		}
+
+		dirsize += sizeof(struct erofs_dirent) + strlen(dp->d_name);
+		budget_reserved += sizeof(struct erofs_inode_extended) +
+			budget_xattr_size(buf);
+
+		if (S_ISREG(st.st_mode) && st.st_size) {
+			ret = budget_add_file(buf, &st);
+		} else if (S_ISLNK(st.st_mode)) {
+			budget_reserved += st.st_size;
+		} else if (S_ISDIR(st.st_mode)) {
+			ret = budget_scan(buf);
+		}
+		if (ret)
+			goto fail;
+	}
+
+	if (errno)
+		ret = -errno;
+	budget_reserved += blknr_to_addr(BLK_ROUND_UP(dirsize));
+fail:
+	closedir(_dir);
+	return ret;
+}
+
+static void budget_print(u64 maxsize, u64 total)
+{
+	unsigned int count[ARRAY_SIZE(budget_rungs)] = {0};
+	unsigned int i;
+
+	for (i = 0; i < budget_nr; ++i)
+		++count[budget_files[i]->rung];
+
+	fprintf(stdout, "Size budget:\t\t%llu bytes (%llu bytes planned)\n",
+		maxsize | 0ULL, total | 0ULL);
+	for (i = 0; i < ARRAY_SIZE(budget_rungs); ++i) {
+		const struct budget_rung *r = &budget_rungs[i];
+
+		if (!count[i])
+			continue;
+		if (!r->alg)
+			fprintf(stdout, "  uncompressed:\t\t%u files\n",
+				count[i]);
+		else
+			fprintf(stdout, "  %s,%d:\t\t%u files\n",
+				r->alg, r->level, count[i]);
+	}
+}
+
+int erofs_budget_plan(const char *srcpath, u64 maxsize)
+{
+	struct budget_file **heap;
+	unsigned int i, nr = 0;
+	u64 total;
+	int ret;
+
+	budget_init_rungs();
+	/* the superblock and the root directory inode */
+	budget_reserved = EROFS_BLKSIZ + sizeof(struct erofs_inode_extended);
+	ret = budget_scan(srcpath);
+	if (ret)
+		return ret;
+
+	total = budget_reserved;
+	for (i = 0; i < budget_nr; ++i)
+		total += budget_files[i]->bytes;
+
+	heap = malloc((budget_nr + 1) * sizeof(*heap));
+	if (!heap)
+		return -ENOMEM;
+
+	/* nothing needs to be compressed if it already fits */
+	for (i = 0; total > maxsize && i < budget_nr; ++i) {
+		ret = budget_measure_next(budget_files[i]);
+		if (ret)
+			goto out;
+		if (budget_files[i]->next >= 0)
+			budget_heap_push(heap, &nr, budget_files[i]);
+	}
+
+	while (total > maxsize && nr) {
+		struct budget_file *f = budget_heap_pop(heap, &nr);
+
+		total -= f->bytes - f->next_bytes;
+		f->rung = f->next;
+		f->bytes = f->next_bytes;
+
+		ret = budget_measure_next(f);
+		if (ret)
+			goto out;
+		if (f->next >= 0)
+			budget_heap_push(heap, &nr, f);
+	}
+
+	budget_print(maxsize, total);
+	if (total > maxsize) {
+		erofs_err("%s is estimated to need %llu bytes even compressed, more than %llu bytes",
+			  srcpath, total | 0ULL, maxsize | 0ULL);
+		ret = -ENOSPC;
+	}
+	erofs_budget_enabled = true;
+out:
+	free(heap);
+	return ret;
+}
+
+void erofs_budget_lookup(struct erofs_inode *inode,
+			 const char **alg, int *level)
+{
+	struct budget_file *f;
+
+	hash_for_each_possible(budget_hashtable, f, node, inode->i_ino[1]) {
+		if (f->ino != inode->i_ino[1])
+			continue;
+		*alg = budget_rungs[f->rung].alg;
+		*level = budget_rungs[f->rung].level;
+		return;
+	}
+	/* not scanned, e.g. created after the plan */
+	*alg = NULL;
+}
+
+void erofs_budget_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < budget_nr; ++i) {
+		free(budget_files[i]->path);
+		free(budget_files[i]);
+	}
+	free(budget_files);
+	budget_files = NULL;
+	budget_nr = budget_max = 0;
+	erofs_budget_enabled = false;
+}
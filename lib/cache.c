@@ -8,9 +8,11 @@
  * with heavy changes by Gao Xiang <gaoxiang25@huawei.com>
  */
 #include <stdlib.h>
+#include <string.h>
 #include <erofs/cache.h>
 #include "erofs/io.h"
 #include "erofs/print.h"
+#include "erofs/stats.h"
 
 static struct erofs_buffer_block blkh = {
 	.list = LIST_HEAD_INIT(blkh.list),
@@ -18,6 +20,11 @@ static struct erofs_buffer_block blkh = {
 };
 static erofs_blk_t tail_blkaddr;
 
+/* META buffer blocks which inodes of the current cluster go into */
+static struct erofs_buffer_block **cluster_bbs;
+static unsigned int cluster_nr, cluster_max;
+static bool cluster_active;
+
 static bool erofs_bh_flush_drop_directly(struct erofs_buffer_head *bh)
 {
 	return erofs_bh_flush_generic_end(bh);
@@ -71,6 +78,32 @@ struct erofs_buffer_head *erofs_buffer_init(void)
 	return bh;
 }
 
+static bool erofs_bcluster_has(struct erofs_buffer_block *bb)
+{
+	unsigned int i;
+
+	for (i = 0; i < cluster_nr; ++i)
+		if (cluster_bbs[i] == bb)
+			return true;
+	return false;
+}
+
+static int erofs_bcluster_add(struct erofs_buffer_block *bb)
+{
+	if (cluster_nr >= cluster_max) {
+		unsigned int nr = max(cluster_max * 2, 16U);
+		struct erofs_buffer_block **bbs =
+			realloc(cluster_bbs, nr * sizeof(*bbs));
+
+		if (!bbs)
+			return -ENOMEM;
+		cluster_bbs = bbs;
+		cluster_max = nr;
+	}
+	cluster_bbs[cluster_nr++] = bb;
+	return 0;
+}
+
 /* return occupied bytes in specific buffer block if succeed */
 static int __erofs_battach(struct erofs_buffer_block *bb,
 			   struct erofs_buffer_head *bh,
@@ -132,6 +165,7 @@ struct erofs_buffer_head *erofs_balloc(int type, erofs_off_t size,
 	struct erofs_buffer_block *cur, *bb;
 	struct erofs_buffer_head *bh;
 	unsigned int alignsize, used0, usedmax;
+	const bool incluster = cluster_active && type == INODE;
 
 	int ret = get_alignsize(type, &type);
 
@@ -156,6 +190,10 @@ struct erofs_buffer_head *erofs_balloc(int type, erofs_off_t size,
 		if (cur->type != type)
 			continue;
 
+		/* inodes of a cluster only go into its own blocks */
+		if (incluster && !erofs_bcluster_has(cur))
+			continue;
+
 		ret = __erofs_battach(cur, NULL, size, alignsize,
 				      required_ext + inline_ext, true);
 		if (ret < 0)
@@ -200,6 +238,7 @@ struct erofs_buffer_head *erofs_balloc(int type, erofs_off_t size,
 	bb->buffers.off = 0;
 	init_list_head(&bb->buffers.list);
 	list_add_tail(&bb->list, &blkh.list);
+	erofs_stat_add(EROFS_STAT_BUFFER_BLOCKS, 1);
 
 	bh = malloc(sizeof(struct erofs_buffer_head));
 	if (!bh) {
@@ -211,9 +250,102 @@ found:
 			      required_ext + inline_ext, false);
 	if (ret < 0)
 		return ERR_PTR(ret);
+	/* it's still allocated, just not packed as well */
+	if (incluster && !erofs_bcluster_has(bb) && erofs_bcluster_add(bb))
+		erofs_warn("out of memory, inodes may not be clustered");
 	return bh;
 }
 
+/*
+ * allocate the following inodes together until erofs_bcluster_end(), which
+ * take about @size bytes in total.  They start in the fullest META block
+ * which can hold all of them, or in new blocks otherwise, and only go into
+ * the blocks of this cluster, so that they're packed into as few adjacent
+ * blocks as possible.
+ */
+void erofs_bcluster_begin(unsigned int size)
+{
+	const unsigned int alignsize = sizeof(struct erofs_inode_compact);
+	struct erofs_buffer_block *cur, *bb = NULL;
+	unsigned int usedmax = 0;
+
+	cluster_nr = 0;
+	cluster_active = true;
+
+	list_for_each_entry(cur, &blkh.list, list) {
+		const unsigned int used = cur->buffers.off % EROFS_BLKSIZ;
+
+		if (!used || cur->type != META ||
+		    roundup(used, alignsize) + size > EROFS_BLKSIZ)
+			continue;
+		if (usedmax < used) {
+			bb = cur;
+			usedmax = used;
+		}
+	}
+
+	/*
+	 * otherwise, fill up the last block if it's unmapped since new
+	 * blocks will directly follow it.
+	 */
+	if (!bb && !list_empty(&blkh.list)) {
+		cur = list_last_entry(&blkh.list, struct erofs_buffer_block,
+				      list);
+		if (cur->type == META && cur->blkaddr == NULL_ADDR &&
+		    cur->buffers.off % EROFS_BLKSIZ)
+			bb = cur;
+	}
+	if (bb)
+		erofs_bcluster_add(bb);
+}
+
+void erofs_bcluster_end(void)
+{
+	free(cluster_bbs);
+	cluster_bbs = NULL;
+	cluster_nr = cluster_max = 0;
+	cluster_active = false;
+}
+
+/*
+ * skip the data blocks up to the next I/O unit of cfg.c_data_align bytes if
+ * the following @nblocks data blocks would touch fewer units from there, so
+ * that files are aligned with as little padding as possible.  The blocks
+ * skipped are zeroed, and the number of them is returned.
+ */
+int erofs_balign_data(erofs_blk_t nblocks)
+{
+	const erofs_blk_t unit = erofs_blknr(cfg.c_data_align);
+	struct erofs_buffer_head *bh;
+	erofs_blk_t start, pad;
+	int ret;
+
+	if (unit <= 1 || nblocks <= 1)
+		return 0;
+
+	/* metadata blocks pending are mapped before the data anyway */
+	start = erofs_mapbh(NULL, true);
+	pad = (unit - start % unit) % unit;
+	if (!pad || DIV_ROUND_UP(start % unit + nblocks, unit) <=
+	    DIV_ROUND_UP(nblocks, unit))
+		return 0;
+
+	bh = erofs_balloc(DATA, blknr_to_addr(pad), 0, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	bh->op = &erofs_skip_write_bhops;
+	erofs_mapbh(bh->block, true);
+	DBG_BUGON(bh->block->blkaddr != start);
+
+	ret = dev_fillzero(blknr_to_addr(start), blknr_to_addr(pad), false);
+	erofs_bdrop(bh, false);
+	if (ret)
+		return ret;
+	erofs_stat_add(EROFS_STAT_ALIGNED_FILES, 1);
+	erofs_stat_add(EROFS_STAT_ALIGN_PADDING_BLOCKS, pad);
+	return pad;
+}
+
 struct erofs_buffer_head *erofs_battach(struct erofs_buffer_head *bh,
 					int type, unsigned int size)
 {
@@ -309,6 +441,10 @@ bool erofs_bflush(struct erofs_buffer_block *bb)
 
 		DBG_BUGON(!list_empty(&p->buffers.list));
 
+		if (p->type == META)
+			erofs_stat_add(EROFS_STAT_META_BLOCKS,
+				       BLK_ROUND_UP(p->buffers.off));
+
 		erofs_dbg("block %u to %u flushed", p->blkaddr, blkaddr - 1);
 
 		list_del(&p->list);
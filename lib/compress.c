@@ -15,58 +15,337 @@
 #include "erofs/io.h"
 #include "erofs/cache.h"
 #include "erofs/compress.h"
-#include "compressor.h"
+#include "erofs/blkcsum.h"
+#include "erofs/verity.h"
+#include "erofs/stats.h"
+#include "erofs/incremental.h"
+#include "compress_internal.h"
 
 static struct erofs_compress compresshandle;
 static int compressionlevel;
 
-static struct z_erofs_map_header mapheader;
+/* other compressors, which can be chosen per file by --max-size */
+static struct erofs_compress z_erofs_handles[8];
 
-struct z_erofs_vle_compress_ctx {
-	u8 *metacur;
+static struct z_erofs_map_header mapheader;
 
-	u8 queue[EROFS_CONFIG_COMPR_MAX_SZ * 2];
-	unsigned int head, tail;
+/*
+ * on-disk indexes are generated as pclusters are produced.  Once more than
+ * Z_EROFS_INDEX_BUFSZ bytes are pending, they are spilled to a temporary
+ * file until the inode is written, so huge files need bounded memory.
+ */
+#define Z_EROFS_INDEX_BUFSZ	(64 * 1024)
 
-	erofs_blk_t blkaddr;	/* pointing to the next blkaddr */
-	u16 clusterofs;
-};
+static int z_erofs_spillfd = -1;
+static erofs_off_t z_erofs_spillsize;
 
 #define Z_EROFS_LEGACY_MAP_HEADER_SIZE	\
 	(sizeof(struct z_erofs_map_header) + Z_EROFS_VLE_LEGACY_HEADER_PADDING)
 
-static unsigned int vle_compressmeta_capacity(erofs_off_t filesize)
+static int vle_spill_indexes(struct z_erofs_vle_compress_ctx *ctx)
+{
+	ssize_t ret;
+
+	if (z_erofs_spillfd < 0) {
+		const char *tmpdir = getenv("TMPDIR");
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/erofs-index.XXXXXX",
+			 tmpdir ? tmpdir : "/tmp");
+		z_erofs_spillfd = mkstemp(path);
+		if (z_erofs_spillfd < 0) {
+			ret = -errno;
+			erofs_err("failed to create a temporary file for indexes: %s",
+				  erofs_strerror(ret));
+			return ret;
+		}
+		unlink(path);
+	}
+
+	ret = pwrite(z_erofs_spillfd, ctx->metabuf, ctx->metacur,
+		     z_erofs_spillsize + ctx->spilled);
+	if (ret != ctx->metacur)
+		return ret < 0 ? -errno : -EIO;
+	erofs_stat_add(EROFS_STAT_INDEX_SPILLED, ctx->metacur);
+	ctx->spilled += ctx->metacur;
+	ctx->metacur = 0;
+	return 0;
+}
+
+static int vle_index_append(struct z_erofs_vle_compress_ctx *ctx,
+			    const void *src, unsigned int len)
+{
+	int ret;
+
+	if (ctx->metacur + len > ctx->metabufsz) {
+		ret = vle_spill_indexes(ctx);
+		if (ret)
+			return ret;
+	}
+	memcpy(ctx->metabuf + ctx->metacur, src, len);
+	ctx->metacur += len;
+	return 0;
+}
+
+static void *parse_legacy_indexes(struct z_erofs_compressindex_vec *cv,
+				  unsigned int nr, void *metacur)
+{
+	struct z_erofs_vle_decompressed_index *const db = metacur;
+	unsigned int i;
+
+	for (i = 0; i < nr; ++i, ++cv) {
+		struct z_erofs_vle_decompressed_index *const di = db + i;
+		const unsigned int advise = le16_to_cpu(di->di_advise);
+
+		cv->clustertype = (advise >> Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
+			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
+		cv->clusterofs = le16_to_cpu(di->di_clusterofs);
+
+		if (cv->clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
+			cv->u.delta[0] = le16_to_cpu(di->di_u.delta[0]);
+			cv->u.delta[1] = le16_to_cpu(di->di_u.delta[1]);
+		} else {
+			cv->u.blkaddr = le32_to_cpu(di->di_u.blkaddr);
+		}
+	}
+	return db + nr;
+}
+
+static void *write_compacted_indexes(u8 *out,
+				     struct z_erofs_compressindex_vec *cv,
+				     erofs_blk_t *blkaddr_ret,
+				     unsigned int destsize,
+				     unsigned int logical_clusterbits,
+				     bool final)
 {
-	const unsigned int indexsize = BLK_ROUND_UP(filesize) *
-		sizeof(struct z_erofs_vle_decompressed_index);
+	unsigned int vcnt, encodebits, pos, i;
+	erofs_blk_t blkaddr;
+
+	if (destsize == 4) {
+		vcnt = 2;
+	} else if (destsize == 2 && logical_clusterbits == 12) {
+		vcnt = 16;
+	} else {
+		return ERR_PTR(-EINVAL);
+	}
+	encodebits = (vcnt * destsize * 8 - 32) / vcnt;
+	blkaddr = *blkaddr_ret;
+
+	pos = 0;
+	for (i = 0; i < vcnt; ++i) {
+		unsigned int offset, v;
+		u8 ch, rem;
 
-	return Z_EROFS_LEGACY_MAP_HEADER_SIZE + indexsize;
+		if (cv[i].clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
+			if (i + 1 == vcnt)
+				offset = cv[i].u.delta[1];
+			else
+				offset = cv[i].u.delta[0];
+		} else {
+			offset = cv[i].clusterofs;
+			++blkaddr;
+			if (cv[i].u.blkaddr != blkaddr) {
+				if (i + 1 != vcnt)
+					DBG_BUGON(!final);
+				DBG_BUGON(cv[i].u.blkaddr);
+			}
+		}
+		v = (cv[i].clustertype << logical_clusterbits) | offset;
+		rem = pos & 7;
+		ch = out[pos / 8] & ((1 << rem) - 1);
+		out[pos / 8] = (v << rem) | ch;
+		out[pos / 8 + 1] = v >> (8 - rem);
+		out[pos / 8 + 2] = v >> (16 - rem);
+		pos += encodebits;
+	}
+	DBG_BUGON(destsize * vcnt * 8 != pos + 32);
+	*(__le32 *)(out + destsize * vcnt - 4) = cpu_to_le32(*blkaddr_ret);
+	*blkaddr_ret = blkaddr;
+	return out + destsize * vcnt;
 }
 
-static void vle_write_indexes_final(struct z_erofs_vle_compress_ctx *ctx)
+/* write out the pending compacted pack (the final one can be partial) */
+static int vle_write_compacted_pack(struct z_erofs_vle_compress_ctx *ctx,
+				    unsigned int destsize, bool final)
+{
+	u8 pack[32] = {0};
+	u8 *end;
+
+	end = write_compacted_indexes(pack, ctx->cv, &ctx->packaddr,
+				      destsize, LOG_BLOCK_SIZE, final);
+	ctx->ncv = 0;
+	return vle_index_append(ctx, pack, end - pack);
+}
+
+static int vle_emit_index(struct z_erofs_vle_compress_ctx *ctx,
+			  struct z_erofs_vle_decompressed_index *di)
+{
+	unsigned int packstart;
+
+	++ctx->nr;
+	if (!ctx->compacted)
+		return vle_index_append(ctx, di, sizeof(*di));
+
+	parse_legacy_indexes(ctx->cv + ctx->ncv++, 1, di);
+	/* 2B packs are only used between compacted_4b_initial and _end */
+	packstart = ctx->nr - ctx->ncv;
+	if (packstart >= ctx->compacted_4b_initial &&
+	    packstart - ctx->compacted_4b_initial < ctx->compacted_2b) {
+		if (ctx->ncv < 16)
+			return 0;
+		return vle_write_compacted_pack(ctx, 2, false);
+	}
+	if (ctx->ncv < 2)
+		return 0;
+	return vle_write_compacted_pack(ctx, 4, false);
+}
+
+int vle_write_indexes_final(struct z_erofs_vle_compress_ctx *ctx)
 {
 	const unsigned int type = Z_EROFS_VLE_CLUSTER_TYPE_PLAIN;
 	struct z_erofs_vle_decompressed_index di;
+	int ret;
 
-	if (!ctx->clusterofs)
-		return;
+	if (ctx->clusterofs) {
+		di.di_clusterofs = cpu_to_le16(ctx->clusterofs);
+		di.di_u.blkaddr = 0;
+		di.di_advise = cpu_to_le16(type <<
+					   Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
 
-	di.di_clusterofs = cpu_to_le16(ctx->clusterofs);
-	di.di_u.blkaddr = 0;
-	di.di_advise = cpu_to_le16(type << Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
+		ret = vle_emit_index(ctx, &di);
+		if (ret)
+			return ret;
+	}
+
+	DBG_BUGON(ctx->nr != ctx->totalidx);
+	if (!ctx->ncv)
+		return 0;
+	/* generate the final compacted_4b_end */
+	DBG_BUGON(ctx->ncv != 1);
+	memset(ctx->cv + 1, 0, sizeof(ctx->cv[1]));
+	return vle_write_compacted_pack(ctx, 4, true);
+}
+
+/*
+ * the number of lclusters is known in advance, and so is the layout of
+ * compacted indexes, which are generated as pclusters are produced.
+ */
+int vle_init_indexes(struct erofs_inode *inode,
+		     struct z_erofs_vle_compress_ctx *ctx, erofs_blk_t blkaddr)
+{
+	const unsigned int headerpos = Z_EROFS_VLE_EXTENT_ALIGN(
+			inode->inode_isize + inode->xattr_isize) +
+		sizeof(struct z_erofs_map_header);
+	static const u8 legacyheader[Z_EROFS_LEGACY_MAP_HEADER_SIZE];
+	unsigned int initial = 0;
+
+	ctx->totalidx = BLK_ROUND_UP(inode->i_size);
+	ctx->nr = ctx->ncv = 0;
+	ctx->compacted_4b_initial = ctx->compacted_2b = 0;
+	ctx->packaddr = blkaddr;
+	ctx->compacted = !cfg.c_legacy_compress;
+
+	if (!ctx->compacted) {
+		ctx->metasize = sizeof(legacyheader) + ctx->totalidx *
+			sizeof(struct z_erofs_vle_decompressed_index);
+	} else {
+		/* # of 8-byte units so that it can be aligned with 32 bytes */
+		if (LOG_BLOCK_SIZE == 12) {
+			initial = (32 - headerpos % 32) / 4;
+			if (initial == 32 / 4)
+				initial = 0;
+			if (initial <= ctx->totalidx)
+				ctx->compacted_2b = rounddown(ctx->totalidx -
+							      initial, 16);
+			else
+				initial = 0;
+		}
+		ctx->compacted_4b_initial = initial;
+		ctx->metasize = sizeof(mapheader) + ctx->compacted_2b * 2 +
+			round_up(ctx->totalidx - ctx->compacted_2b, 2) * 4;
+	}
+
+	ctx->metabufsz = min_t(unsigned int, ctx->metasize,
+			       Z_EROFS_INDEX_BUFSZ);
+	ctx->metabuf = malloc(ctx->metabufsz);
+	if (!ctx->metabuf)
+		return -ENOMEM;
+	ctx->metacur = ctx->spilled = 0;
+
+	if (ctx->compacted)
+		return vle_index_append(ctx, &mapheader, sizeof(mapheader));
+	return vle_index_append(ctx, legacyheader, sizeof(legacyheader));
+}
+
+/* hand the indexes over to the inode, which will write them out */
+static int vle_detach_indexes(struct erofs_inode *inode,
+			      struct z_erofs_vle_compress_ctx *ctx)
+{
+	int ret;
 
-	memcpy(ctx->metacur, &di, sizeof(di));
-	ctx->metacur += sizeof(di);
+	DBG_BUGON(ctx->spilled + ctx->metacur != ctx->metasize);
+	inode->extent_isize = ctx->metasize;
+	inode->datalayout = ctx->compacted ? EROFS_INODE_FLAT_COMPRESSION :
+		EROFS_INODE_FLAT_COMPRESSION_LEGACY;
+
+	if (!ctx->spilled) {
+		inode->compressmeta = ctx->metabuf;
+		ctx->metabuf = NULL;
+		return 0;
+	}
+
+	ret = vle_spill_indexes(ctx);
+	if (ret)
+		return ret;
+	free(ctx->metabuf);
+	ctx->metabuf = NULL;
+	inode->compressmeta = NULL;
+	inode->compressmeta_spilloff = z_erofs_spillsize;
+	z_erofs_spillsize += ctx->spilled;
+	return 0;
 }
 
-static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
-			      unsigned int count, bool raw)
+/* write the indexes of an inode to the image, either in memory or spilled */
+int z_erofs_write_compressmeta(struct erofs_inode *inode, erofs_off_t off)
+{
+	static u8 buf[Z_EROFS_INDEX_BUFSZ];
+	erofs_off_t pos = inode->compressmeta_spilloff;
+	unsigned int len = inode->extent_isize;
+	ssize_t ret;
+
+	if (inode->compressmeta) {
+		ret = dev_write(inode->compressmeta, off, len);
+		free(inode->compressmeta);
+		inode->compressmeta = NULL;
+		return ret;
+	}
+
+	while (len) {
+		const unsigned int count = min_t(unsigned int, len,
+						 sizeof(buf));
+
+		ret = pread(z_erofs_spillfd, buf, count, pos);
+		if (ret != count)
+			return ret < 0 ? -errno : -EIO;
+		ret = dev_write(buf, off, count);
+		if (ret)
+			return ret;
+		pos += count;
+		off += count;
+		len -= count;
+	}
+	return 0;
+}
+
+int vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
+		      unsigned int count, bool raw)
 {
 	unsigned int clusterofs = ctx->clusterofs;
 	unsigned int d0 = 0, d1 = (clusterofs + count) / EROFS_BLKSIZ;
 	struct z_erofs_vle_decompressed_index di;
 	unsigned int type;
 	__le16 advise;
+	int ret;
 
 	di.di_clusterofs = cpu_to_le16(ctx->clusterofs);
 
@@ -78,12 +357,13 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 
 		di.di_advise = advise;
 		di.di_u.blkaddr = cpu_to_le32(ctx->blkaddr);
-		memcpy(ctx->metacur, &di, sizeof(di));
-		ctx->metacur += sizeof(di);
+		ret = vle_emit_index(ctx, &di);
+		if (ret)
+			return ret;
 
 		/* don't add the final index if the tail-end block exists */
 		ctx->clusterofs = 0;
-		return;
+		return 0;
 	}
 
 	do {
@@ -100,8 +380,9 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 		advise = cpu_to_le16(type << Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
 		di.di_advise = advise;
 
-		memcpy(ctx->metacur, &di, sizeof(di));
-		ctx->metacur += sizeof(di);
+		ret = vle_emit_index(ctx, &di);
+		if (ret)
+			return ret;
 
 		count -= EROFS_BLKSIZ - clusterofs;
 		clusterofs = 0;
@@ -111,6 +392,25 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 	} while (clusterofs + count >= EROFS_BLKSIZ);
 
 	ctx->clusterofs = clusterofs + count;
+	return 0;
+}
+
+static int vle_record_pcluster(struct z_erofs_vle_compress_ctx *ctx,
+			       unsigned int count, bool raw, bool reset)
+{
+	if (ctx->nr_pclusters >= ctx->max_pclusters) {
+		unsigned int nr = max(ctx->max_pclusters * 2, 64U);
+		u32 *p = realloc(ctx->pclusters, nr * sizeof(*p));
+
+		if (!p)
+			return -ENOMEM;
+		ctx->pclusters = p;
+		ctx->max_pclusters = nr;
+	}
+	ctx->pclusters[ctx->nr_pclusters++] = count |
+		(raw ? EROFS_ZCACHE_PCLUSTER_RAW : 0) |
+		(reset ? EROFS_ZCACHE_PCLUSTER_RESET : 0);
+	return 0;
 }
 
 static int write_uncompressed_block(struct z_erofs_vle_compress_ctx *ctx,
@@ -130,6 +430,8 @@ static int write_uncompressed_block(struct z_erofs_vle_compress_ctx *ctx,
 
 	/* write uncompressed data */
 	count = min(EROFS_BLKSIZ, *len);
+	if (ctx->measure)
+		return count;
 
 	memcpy(dst, ctx->queue + ctx->head, count);
 	memset(dst + count, 0, EROFS_BLKSIZ - count);
@@ -146,14 +448,14 @@ static int vle_compress_one(struct erofs_inode *inode,
 			    struct z_erofs_vle_compress_ctx *ctx,
 			    bool final)
 {
-	struct erofs_compress *const h = &compresshandle;
 	unsigned int len = ctx->tail - ctx->head;
 	unsigned int count;
 	int ret;
-	static char dstbuf[EROFS_BLKSIZ * 2];
-	char *const dst = dstbuf + EROFS_BLKSIZ;
+	static char dstbuf[EROFS_MAX_BLOCK_SIZE * 2];
+	char *const dst = dstbuf + EROFS_MAX_BLOCK_SIZE;
 
 	while (len) {
+		const unsigned int clusterofs = ctx->clusterofs;
 		bool raw;
 
 		if (len <= EROFS_BLKSIZ) {
@@ -163,7 +465,7 @@ static int vle_compress_one(struct erofs_inode *inode,
 		}
 
 		count = len;
-		ret = erofs_compress_destsize(h, compressionlevel,
+		ret = erofs_compress_destsize(ctx->handle, ctx->level,
 					      ctx->queue + ctx->head,
 					      &count, dst, EROFS_BLKSIZ);
 		if (ret <= 0) {
@@ -178,10 +480,16 @@ nocompression:
 				return ret;
 			count = ret;
 			raw = true;
+			if (!ctx->measure)
+				erofs_stat_add(EROFS_STAT_RAW_PCLUSTERS, 1);
+		} else if (ctx->measure) {
+			raw = false;
 		} else {
 			/* write compressed data */
 			erofs_dbg("Writing %u compressed data to block %u",
 				  count, ctx->blkaddr);
+			erofs_stat_add(EROFS_STAT_BYTES_COMPRESSED, count);
+			erofs_stat_add(EROFS_STAT_COMPRESSED_SIZE, ret);
 
 			if (erofs_sb_has_lz4_0padding())
 				ret = blk_write(dst - (EROFS_BLKSIZ - ret),
@@ -195,8 +503,20 @@ nocompression:
 		}
 
 		ctx->head += count;
+		if (erofs_cache_index_enabled && !ctx->measure) {
+			ret = vle_record_pcluster(ctx, count, raw,
+						  ctx->clusterofs != clusterofs);
+			if (ret)
+				return ret;
+		}
+
 		/* write compression indexes for this blkaddr */
-		vle_write_indexes(ctx, count, raw);
+		if (!ctx->measure) {
+			ret = vle_write_indexes(ctx, count, raw);
+			if (ret)
+				return ret;
+			erofs_stat_add(EROFS_STAT_PCLUSTERS, 1);
+		}
 
 		++ctx->blkaddr;
 		len -= count;
@@ -215,244 +535,442 @@ nocompression:
 	return 0;
 }
 
-struct z_erofs_compressindex_vec {
-	union {
-		erofs_blk_t blkaddr;
-		u16 delta[2];
-	} u;
-	u16 clusterofs;
-	u8  clustertype;
-};
-
-static void *parse_legacy_indexes(struct z_erofs_compressindex_vec *cv,
-				  unsigned int nr, void *metacur)
+static int vle_compress_file(struct erofs_inode *inode, int fd,
+			     struct z_erofs_vle_compress_ctx *ctx)
 {
-	struct z_erofs_vle_decompressed_index *const db = metacur;
-	unsigned int i;
+	erofs_off_t remaining = inode->i_size;
+	int ret;
 
-	for (i = 0; i < nr; ++i, ++cv) {
-		struct z_erofs_vle_decompressed_index *const di = db + i;
-		const unsigned int advise = le16_to_cpu(di->di_advise);
+	while (remaining) {
+		const u64 readcount = min_t(u64, remaining,
+					    sizeof(ctx->queue) - ctx->tail);
+
+		ret = erofs_read_fully(fd, ctx->queue + ctx->tail, readcount);
+		if (ret != readcount)
+			return ret < 0 ? -errno : -EIO;
+		if (ctx->md)
+			erofs_sha256_process(ctx->md, ctx->queue + ctx->tail,
+					     readcount);
+		remaining -= readcount;
+		ctx->tail += readcount;
+		erofs_stat_add(EROFS_STAT_BYTES_READ, readcount);
 
-		cv->clustertype = (advise >> Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
-			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
-		cv->clusterofs = le16_to_cpu(di->di_clusterofs);
+		/* do one compress round */
+		ret = vle_compress_one(inode, ctx, false);
+		if (ret)
+			return ret;
+	}
 
-		if (cv->clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
-			cv->u.delta[0] = le16_to_cpu(di->di_u.delta[0]);
-			cv->u.delta[1] = le16_to_cpu(di->di_u.delta[1]);
-		} else {
-			cv->u.blkaddr = le32_to_cpu(di->di_u.blkaddr);
+	/* do the final round */
+	return vle_compress_one(inode, ctx, true);
+}
+
+struct z_erofs_estimate z_erofs_estimate;
+
+/*
+ * compress a segment from @pos as vle_compress_one() does, and return the
+ * number of pclusters needed for exactly @segsz bytes of it, where the last
+ * pcluster is counted in proportion to the part which belongs to @segsz.
+ */
+static int z_erofs_sample_segment(struct z_erofs_vle_compress_ctx *ctx,
+				  int fd, erofs_off_t pos, unsigned int segsz,
+				  double *blocks)
+{
+	const unsigned int bufsz = sizeof(ctx->queue) / 2;
+	u8 *const buf = ctx->queue;
+	static char dst[EROFS_MAX_BLOCK_SIZE];
+	unsigned int head = 0, count;
+	ssize_t len;
+	int ret;
+
+	/* also read the lookahead which the compressor will see */
+	len = pread(fd, buf, bufsz, pos);
+	if (len < segsz)
+		return len < 0 ? -errno : -EIO;
+	erofs_stat_add(EROFS_STAT_BYTES_READ, len);
+
+	*blocks = 0;
+	while (head < segsz) {
+		count = len - head;
+		if (count > EROFS_BLKSIZ) {
+			ret = erofs_compress_destsize(ctx->handle, ctx->level,
+						      buf + head, &count,
+						      dst, EROFS_BLKSIZ);
+			if (ret <= 0)
+				count = EROFS_BLKSIZ;
 		}
+		if (head + count > segsz)
+			*blocks += (double)(segsz - head) / count;
+		else
+			*blocks += 1;
+		head += count;
 	}
-	return db + nr;
+	return 0;
 }
 
-static void *write_compacted_indexes(u8 *out,
-				     struct z_erofs_compressindex_vec *cv,
-				     erofs_blk_t *blkaddr_ret,
-				     unsigned int destsize,
-				     unsigned int logical_clusterbits,
-				     bool final)
+/*
+ * estimate the compressed size of a large file from a stratified sample
+ * of its segments, and emit indexes for evenly-sized pclusters instead,
+ * so that the metadata size is still exact.  Returns -EAGAIN if the file
+ * should be compressed as a whole.
+ */
+static int z_erofs_estimate_compressed_file(struct erofs_inode *inode,
+					    int fd,
+					    struct z_erofs_vle_compress_ctx *ctx)
 {
-	unsigned int vcnt, encodebits, pos, i;
-	erofs_blk_t blkaddr;
+	const unsigned int segsz = Z_EROFS_ESTIMATE_SEGMENT_SIZE;
+	const u64 nsegs = inode->i_size / segsz;
+	const u64 nsamples = max_t(u64, Z_EROFS_ESTIMATE_MIN_SAMPLES,
+			DIV_ROUND_UP(nsegs * cfg.c_estimate_pct, 100));
+	static u64 seed = 0x9E3779B97F4A7C15ULL;
+	double sum = 0, sum2 = 0, mean, var, y = 0;
+	erofs_blk_t nblocks, i;
+	erofs_off_t base, rem;
+	int ret;
 
-	if (destsize == 4) {
-		vcnt = 2;
-	} else if (destsize == 2 && logical_clusterbits == 12) {
-		vcnt = 16;
-	} else {
-		return ERR_PTR(-EINVAL);
+	if (nsamples >= nsegs)
+		return -EAGAIN;
+
+	for (i = 0; i < nsamples; ++i) {
+		const u64 lo = nsegs * i / nsamples;
+		const u64 hi = nsegs * (i + 1) / nsamples;
+
+		/* one random segment in each stratum (xorshift64) */
+		seed ^= seed >> 12;
+		seed ^= seed << 25;
+		seed ^= seed >> 27;
+		ret = z_erofs_sample_segment(ctx, fd, (lo + seed % (hi - lo)) *
+					     segsz, segsz, &y);
+		if (ret)
+			return ret;
+		sum += y;
+		sum2 += y * y;
 	}
-	encodebits = (vcnt * destsize * 8 - 32) / vcnt;
-	blkaddr = *blkaddr_ret;
 
-	pos = 0;
-	for (i = 0; i < vcnt; ++i) {
-		unsigned int offset, v;
-		u8 ch, rem;
+	mean = sum / nsamples;
+	/* sample variance with the finite population correction */
+	var = (sum2 - sum * mean) / (nsamples - 1) / nsamples *
+		(1 - (double)nsamples / nsegs);
+	y = (double)inode->i_size / segsz;
+	nblocks = max_t(erofs_blk_t, mean * y + 0.5, 1);
 
-		if (cv[i].clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
-			if (i + 1 == vcnt)
-				offset = cv[i].u.delta[1];
-			else
-				offset = cv[i].u.delta[0];
-		} else {
-			offset = cv[i].clusterofs;
-			++blkaddr;
-			if (cv[i].u.blkaddr != blkaddr) {
-				if (i + 1 != vcnt)
-					DBG_BUGON(!final);
-				DBG_BUGON(cv[i].u.blkaddr);
-			}
-		}
-		v = (cv[i].clustertype << logical_clusterbits) | offset;
-		rem = pos & 7;
-		ch = out[pos / 8] & ((1 << rem) - 1);
-		out[pos / 8] = (v << rem) | ch;
-		out[pos / 8 + 1] = v >> (8 - rem);
-		out[pos / 8 + 2] = v >> (16 - rem);
-		pos += encodebits;
+	z_erofs_estimate.sampled += nsamples * segsz;
+	z_erofs_estimate.total += inode->i_size;
+
+	/* it will fall back to no compression mode */
+	if (nblocks >= BLK_ROUND_UP(inode->i_size)) {
+		ctx->blkaddr += nblocks;
+		return 0;
 	}
-	DBG_BUGON(destsize * vcnt * 8 != pos + 32);
-	*(__le32 *)(out + destsize * vcnt - 4) = cpu_to_le32(*blkaddr_ret);
-	*blkaddr_ret = blkaddr;
-	return out + destsize * vcnt;
+	z_erofs_estimate.var += var * y * y;
+
+	base = inode->i_size / nblocks;
+	rem = inode->i_size % nblocks;
+	for (i = 0; i < nblocks; ++i) {
+		ret = vle_write_indexes(ctx, base + (i < rem), false);
+		if (ret)
+			return ret;
+		++ctx->blkaddr;
+	}
+	return 0;
 }
 
-int z_erofs_convert_to_compacted_format(struct erofs_inode *inode,
-					erofs_blk_t blkaddr,
-					unsigned int legacymetasize,
-					unsigned int logical_clusterbits)
+static struct erofs_compress *z_erofs_get_compressor(const char *alg)
 {
-	const uint headerpos = Z_EROFS_VLE_EXTENT_ALIGN(inode->inode_isize +
-							inode->xattr_isize) +
-			       sizeof(struct z_erofs_map_header);
-	const uint totalidx = (legacymetasize -
-			       Z_EROFS_LEGACY_MAP_HEADER_SIZE) / 8;
-	u8 *out, *in;
-	struct z_erofs_compressindex_vec cv[16];
-	/* # of 8-byte units so that it can be aligned with 32 bytes */
-	unsigned int compacted_4b_initial, compacted_4b_end;
-	unsigned int compacted_2b;
-
-	if (logical_clusterbits < LOG_BLOCK_SIZE || LOG_BLOCK_SIZE < 12)
-		return -EINVAL;
-	if (logical_clusterbits > 14)	/* currently not supported */
-		return -ENOTSUP;
-	if (logical_clusterbits == 12) {
-		compacted_4b_initial = (32 - headerpos % 32) / 4;
-		if (compacted_4b_initial == 32 / 4)
-			compacted_4b_initial = 0;
-
-		if (compacted_4b_initial > totalidx) {
-			compacted_4b_initial = compacted_2b = 0;
-			compacted_4b_end = totalidx;
-		} else {
-			compacted_2b = rounddown(totalidx -
-						 compacted_4b_initial, 16);
-			compacted_4b_end = totalidx - compacted_4b_initial -
-					   compacted_2b;
-		}
-	} else {
-		compacted_2b = compacted_4b_initial = 0;
-		compacted_4b_end = totalidx;
+	struct erofs_compress *c;
+	const char *name;
+	unsigned int i;
+	int ret;
+
+	if (!alg || (cfg.c_compr_alg_master &&
+		     !strcmp(alg, cfg.c_compr_alg_master)))
+		return &compresshandle;
+
+	for (i = 0; (name = z_erofs_list_available_compressors(i)); ++i)
+		if (!strcmp(alg, name))
+			break;
+	if (!name || i >= ARRAY_SIZE(z_erofs_handles))
+		return ERR_PTR(-ENOTSUP);
+
+	c = &z_erofs_handles[i];
+	if (!c->alg) {
+		ret = erofs_compressor_init(c, (char *)alg);
+		if (ret)
+			return ERR_PTR(ret);
 	}
+	return c;
+}
+
+static int z_erofs_init_ctx(struct z_erofs_vle_compress_ctx *ctx,
+			    const char *alg, int level)
+{
+	ctx->handle = z_erofs_get_compressor(alg);
+	if (IS_ERR(ctx->handle))
+		return PTR_ERR(ctx->handle);
+
+	if (ctx->handle == &compresshandle && (!alg || level < 0))
+		ctx->level = compressionlevel;
+	else
+		ctx->level = level < 0 ? ctx->handle->alg->default_level :
+			level;
+	ctx->head = ctx->tail = 0;
+	ctx->clusterofs = 0;
+	ctx->pclusters = NULL;
+	ctx->nr_pclusters = ctx->max_pclusters = 0;
+	ctx->md = NULL;
+	return 0;
+}
+
+/*
+ * count the blocks which a file would be compressed into with the given
+ * algorithm and level, exactly as erofs_write_compressed_file() does.
+ */
+int z_erofs_measure_file(const char *path, erofs_off_t size,
+			 const char *alg, int level, erofs_blk_t *blocks)
+{
+	struct z_erofs_vle_compress_ctx ctx;
+	struct erofs_inode inode = { .i_size = size };
+	int ret, fd;
+
+	ret = z_erofs_init_ctx(&ctx, alg, level);
+	if (ret)
+		return ret;
+	ctx.measure = true;
+	ctx.blkaddr = 0;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -errno;
 
-	out = in = inode->compressmeta;
+	strncpy(inode.i_srcpath, path, PATH_MAX);
+	ret = vle_compress_file(&inode, fd, &ctx);
+	close(fd);
+	if (!ret)
+		*blocks = ctx.blkaddr;
+	return ret;
+}
 
-	/* write out compacted header */
-	memcpy(out, &mapheader, sizeof(mapheader));
-	out += sizeof(mapheader);
-	in += Z_EROFS_LEGACY_MAP_HEADER_SIZE;
+/* regenerate the indexes of pclusters reused from the previous image */
+static int vle_replay_indexes(struct z_erofs_vle_compress_ctx *ctx,
+			      const struct erofs_zcache_file *zf)
+{
+	unsigned int i;
+	int ret;
 
-	/* generate compacted_4b_initial */
-	while (compacted_4b_initial) {
-		in = parse_legacy_indexes(cv, 2, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, false);
-		compacted_4b_initial -= 2;
+	for (i = 0; i < zf->nr_pclusters; ++i) {
+		const u32 pcluster = zf->pclusters[i];
+
+		if (pcluster & EROFS_ZCACHE_PCLUSTER_RESET)
+			ctx->clusterofs = 0;
+		ret = vle_write_indexes(ctx,
+				EROFS_ZCACHE_PCLUSTER_COUNT(pcluster),
+				pcluster & EROFS_ZCACHE_PCLUSTER_RAW);
+		if (ret)
+			return ret;
+		++ctx->blkaddr;
 	}
-	DBG_BUGON(compacted_4b_initial);
-
-	/* generate compacted_2b */
-	while (compacted_2b) {
-		in = parse_legacy_indexes(cv, 16, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      2, logical_clusterbits, false);
-		compacted_2b -= 16;
+	ret = vle_write_indexes_final(ctx);
+	if (ret)
+		return ret;
+
+	/* the record doesn't cover the file exactly */
+	if (ctx->nr != ctx->totalidx ||
+	    ctx->spilled + ctx->metacur != ctx->metasize)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * the compressed size is unknown until the file is compressed, so estimate
+ * it by the pclusters so far, which is good enough to decide alignment.
+ */
+static erofs_blk_t z_erofs_estimate_blocks(struct erofs_inode *inode)
+{
+	const u64 pclusters = erofs_stats[EROFS_STAT_PCLUSTERS];
+	const u64 raw = erofs_stats[EROFS_STAT_BYTES_COMPRESSED] +
+		blknr_to_addr(erofs_stats[EROFS_STAT_RAW_PCLUSTERS]);
+
+	if (!pclusters || !raw)
+		return BLK_ROUND_UP(inode->i_size);
+	/* rounded up */
+	return (double)inode->i_size * pclusters / raw + 1;
+}
+
+/*
+ * copy the pclusters of the file from the previous image if it's unchanged,
+ * or return -EAGAIN with @digest calculated if it has been looked into.
+ */
+static int z_erofs_reuse_compressed_file(struct erofs_inode *inode, int fd,
+					 struct z_erofs_vle_compress_ctx *ctx,
+					 u8 *digest, bool *hashed)
+{
+	const char *alg = ctx->handle->alg->name;
+	struct erofs_zcache_file *zf;
+	struct erofs_buffer_head *bh;
+	erofs_blk_t blkaddr;
+	int ret;
+
+	zf = erofs_incremental_find(inode, alg, ctx->level);
+	if (!zf)
+		return -EAGAIN;
+
+	ret = erofs_incremental_digest(fd, inode->i_size, digest);
+	if (ret)
+		return ret;
+	*hashed = true;
+	if (memcmp(digest, zf->digest, sizeof(zf->digest)))
+		return -EAGAIN;
+
+	ret = erofs_balign_data(zf->nr_pclusters);
+	if (ret < 0)
+		return ret;
+
+	bh = erofs_balloc(DATA, 0, 0, 0);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
+	blkaddr = erofs_mapbh(bh->block, true);	/* start_blkaddr */
+	ctx->blkaddr = blkaddr;
+
+	ret = erofs_incremental_copy(zf->blkaddr, blkaddr, zf->nr_pclusters);
+	if (ret)
+		goto err_bdrop;
+
+	ret = vle_init_indexes(inode, ctx, blkaddr - 1);
+	if (!ret)
+		ret = vle_replay_indexes(ctx, zf);
+	if (ret) {
+		erofs_err("failed to reuse %s from the previous image: %s",
+			  inode->i_srcpath, erofs_strerror(ret));
+		goto err_bdrop;
 	}
-	DBG_BUGON(compacted_2b);
-
-	/* generate compacted_4b_end */
-	while (compacted_4b_end > 1) {
-		in = parse_legacy_indexes(cv, 2, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, false);
-		compacted_4b_end -= 2;
+	ret = vle_detach_indexes(inode, ctx);
+	if (ret)
+		goto err_bdrop;
+
+	if (lseek(fd, inode->i_size, SEEK_CUR) < 0) {
+		ret = -errno;
+		goto err_bdrop;
 	}
 
-	/* generate final compacted_4b_end if needed */
-	if (compacted_4b_end) {
-		memset(cv, 0, sizeof(cv));
-		in = parse_legacy_indexes(cv, 1, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, true);
+	if (erofs_cache_index_enabled) {
+		ret = erofs_cache_index_add(inode, digest, alg, ctx->level,
+					    blkaddr, zf->pclusters,
+					    zf->nr_pclusters);
+		if (ret)
+			goto err_bdrop;
 	}
-	inode->extent_isize = out - (u8 *)inode->compressmeta;
-	inode->datalayout = EROFS_INODE_FLAT_COMPRESSION;
+
+	erofs_info("reused %s (%llu bytes) of %u blocks", inode->i_srcpath,
+		   (unsigned long long)inode->i_size, zf->nr_pclusters);
+	erofs_stat_add(EROFS_STAT_REUSED_FILES, 1);
+	erofs_stat_add(EROFS_STAT_REUSED_BLOCKS, zf->nr_pclusters);
+
+	ret = erofs_bh_balloon(bh, blknr_to_addr(zf->nr_pclusters));
+	DBG_BUGON(ret);
+	erofs_bdrop(bh, false);
+	inode->idata_size = 0;
+	inode->u.i_blocks = zf->nr_pclusters;
 	return 0;
+
+err_bdrop:
+	if (erofs_blkcsum_enabled)
+		erofs_blkcsum_revoke(blkaddr, zf->nr_pclusters);
+	if (erofs_verity_enabled)
+		erofs_verity_revoke(blkaddr, zf->nr_pclusters);
+	erofs_bdrop(bh, true);
+	free(ctx->metabuf);
+	ctx->metabuf = NULL;
+	return ret;
 }
 
-int erofs_write_compressed_file(struct erofs_inode *inode)
+/*
+ * compress the file data from @fd.  If @fd can't seek back (e.g. a pipe),
+ * the data can't be re-read uncompressed, so it's kept compressed anyway.
+ */
+int erofs_write_compressed_file(struct erofs_inode *inode, int fd,
+				const char *alg, int level)
 {
 	struct erofs_buffer_head *bh;
 	struct z_erofs_vle_compress_ctx ctx;
-	erofs_off_t remaining;
+	struct erofs_sha256_state md;
+	u8 digest[EROFS_SHA256_DIGEST_SIZE];
 	erofs_blk_t blkaddr, compressed_blocks;
-	unsigned int legacymetasize;
-	int ret, fd;
-
-	u8 *compressmeta = malloc(vle_compressmeta_capacity(inode->i_size));
-	if (!compressmeta)
-		return -ENOMEM;
+	bool hashed = false;
+	int ret;
 
-	fd = open(inode->i_srcpath, O_RDONLY | O_BINARY);
-	if (fd < 0) {
-		ret = -errno;
-		goto err_free;
+	ret = z_erofs_init_ctx(&ctx, alg, level);
+	if (ret)
+		return ret;
+	ctx.measure = false;
+	ctx.metabuf = NULL;
+
+	if (erofs_incremental_enabled) {
+		ret = z_erofs_reuse_compressed_file(inode, fd, &ctx, digest,
+						    &hashed);
+		if (ret != -EAGAIN)
+			return ret;
 	}
+	if (erofs_cache_index_enabled && !hashed) {
+		erofs_sha256_init(&md);
+		ctx.md = &md;
+	}
+
+	ret = erofs_balign_data(z_erofs_estimate_blocks(inode));
+	if (ret < 0)
+		return ret;
 
 	/* allocate main data buffer */
 	bh = erofs_balloc(DATA, 0, 0, 0);
-	if (IS_ERR(bh)) {
-		ret = PTR_ERR(bh);
-		goto err_close;
-	}
-
-	memset(compressmeta, 0, Z_EROFS_LEGACY_MAP_HEADER_SIZE);
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
 
 	blkaddr = erofs_mapbh(bh->block, true);	/* start_blkaddr */
 	ctx.blkaddr = blkaddr;
-	ctx.metacur = compressmeta + Z_EROFS_LEGACY_MAP_HEADER_SIZE;
-	ctx.head = ctx.tail = 0;
-	ctx.clusterofs = 0;
-	remaining = inode->i_size;
 
-	while (remaining) {
-		const u64 readcount = min_t(u64, remaining,
-					    sizeof(ctx.queue) - ctx.tail);
+	ret = vle_init_indexes(inode, &ctx, blkaddr - 1);
+	if (ret)
+		goto err_bdrop;
 
-		ret = read(fd, ctx.queue + ctx.tail, readcount);
-		if (ret != readcount) {
-			ret = -errno;
-			goto err_bdrop;
+	ret = -EAGAIN;
+	if (cfg.c_estimate_pct)
+		ret = z_erofs_estimate_compressed_file(inode, fd, &ctx);
+	if (ret == -EAGAIN) {
+		ret = vle_compress_file(inode, fd, &ctx);
+		if (cfg.c_estimate_pct) {
+			z_erofs_estimate.sampled += inode->i_size;
+			z_erofs_estimate.total += inode->i_size;
 		}
-		remaining -= readcount;
-		ctx.tail += readcount;
-
-		/* do one compress round */
-		ret = vle_compress_one(inode, &ctx, false);
-		if (ret)
-			goto err_bdrop;
 	}
-
-	/* do the final round */
-	ret = vle_compress_one(inode, &ctx, true);
 	if (ret)
 		goto err_bdrop;
 
 	/* fall back to no compression mode */
 	compressed_blocks = ctx.blkaddr - blkaddr;
-	if (compressed_blocks >= BLK_ROUND_UP(inode->i_size)) {
+	if (compressed_blocks >= BLK_ROUND_UP(inode->i_size) &&
+	    lseek(fd, 0, SEEK_CUR) >= 0) {
 		ret = -ENOSPC;
 		goto err_bdrop;
 	}
 
-	vle_write_indexes_final(&ctx);
+	ret = vle_write_indexes_final(&ctx);
+	if (ret)
+		goto err_bdrop;
+	ret = vle_detach_indexes(inode, &ctx);
+	if (ret)
+		goto err_bdrop;
+
+	if (erofs_cache_index_enabled) {
+		if (ctx.md)
+			erofs_sha256_done(ctx.md, digest);
+		ret = erofs_cache_index_add(inode, digest,
+					    ctx.handle->alg->name, ctx.level,
+					    blkaddr, ctx.pclusters,
+					    ctx.nr_pclusters);
+		if (ret)
+			goto err_bdrop;
+	}
+	free(ctx.pclusters);
 
-	close(fd);
 	ret = erofs_bh_balloon(bh, blknr_to_addr(compressed_blocks));
 	DBG_BUGON(ret);
 
@@ -465,27 +983,18 @@ int erofs_write_compressed_file(struct erofs_inode *inode)
 	 *       when both mkfs & kernel support compression inline.
 	 */
 	erofs_bdrop(bh, false);
-	inode->compressmeta = compressmeta;
 	inode->idata_size = 0;
 	inode->u.i_blocks = compressed_blocks;
-
-	legacymetasize = ctx.metacur - compressmeta;
-	if (cfg.c_legacy_compress) {
-		inode->extent_isize = legacymetasize;
-		inode->datalayout = EROFS_INODE_FLAT_COMPRESSION_LEGACY;
-	} else {
-		ret = z_erofs_convert_to_compacted_format(inode, blkaddr - 1,
-							  legacymetasize, 12);
-		DBG_BUGON(ret);
-	}
 	return 0;
 
 err_bdrop:
+	if (erofs_blkcsum_enabled)
+		erofs_blkcsum_revoke(blkaddr, ctx.blkaddr - blkaddr);
+	if (erofs_verity_enabled)
+		erofs_verity_revoke(blkaddr, ctx.blkaddr - blkaddr);
 	erofs_bdrop(bh, true);	/* revoke buffer */
-err_close:
-	close(fd);
-err_free:
-	free(compressmeta);
+	free(ctx.metabuf);
+	free(ctx.pclusters);
 	return ret;
 }
 
@@ -528,7 +1037,9 @@ int z_erofs_compress_init(void)
 
 	algorithmtype[0] = ret;	/* primary algorithm (head 0) */
 	algorithmtype[1] = 0;	/* secondary algorithm (head 1) */
-	mapheader.h_advise |= Z_EROFS_ADVISE_COMPACTED_2B;
+	/* 2B compacted indexes can only be used for 4KiB lclusters */
+	if (LOG_BLOCK_SIZE == 12)
+		mapheader.h_advise |= Z_EROFS_ADVISE_COMPACTED_2B;
 	mapheader.h_algorithmtype = algorithmtype[1] << 4 |
 					  algorithmtype[0];
 	mapheader.h_clusterbits = LOG_BLOCK_SIZE - 12;
@@ -537,6 +1048,15 @@ int z_erofs_compress_init(void)
 
 int z_erofs_compress_exit(void)
 {
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(z_erofs_handles); ++i)
+		if (z_erofs_handles[i].alg)
+			erofs_compressor_exit(&z_erofs_handles[i]);
+	if (z_erofs_spillfd >= 0) {
+		close(z_erofs_spillfd);
+		z_erofs_spillfd = -1;
+	}
 	return erofs_compressor_exit(&compresshandle);
 }
 
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs_utils/lib/compress_internal.h
+ *
+ * The index writer of compress.c, shared with bench/microbench.c only.
+ */
+#ifndef __EROFS_LIB_COMPRESS_INTERNAL_H
+#define __EROFS_LIB_COMPRESS_INTERNAL_H
+
+#include "erofs/compress.h"
+#include "compressor.h"
+
+struct erofs_sha256_state;
+
+struct z_erofs_compressindex_vec {
+	union {
+		erofs_blk_t blkaddr;
+		u16 delta[2];
+	} u;
+	u16 clusterofs;
+	u8  clustertype;
+};
+
+struct z_erofs_vle_compress_ctx {
+	u8 *metabuf;
+	unsigned int metacur, metabufsz;
+	unsigned int metasize;		/* size of all on-disk indexes */
+	unsigned int spilled;		/* bytes spilled to a temporary file */
+
+	/* lclusters which have been generated in total */
+	unsigned int nr, totalidx;
+	/* # of lclusters in the leading 4B packs and in 2B packs */
+	unsigned int compacted_4b_initial, compacted_2b;
+	/* lclusters waiting for the rest of their compacted pack */
+	struct z_erofs_compressindex_vec cv[16];
+	unsigned int ncv;
+	erofs_blk_t packaddr;
+	bool compacted;
+
+	u8 queue[EROFS_CONFIG_COMPR_MAX_SZ * 2];
+	unsigned int head, tail;
+
+	erofs_blk_t blkaddr;	/* pointing to the next blkaddr */
+	u16 clusterofs;
+
+	struct erofs_compress *handle;
+	int level;
+	/* only count blocks, nothing is written */
+	bool measure;
+
+	/* pclusters and sha256 of the data recorded for the cache index */
+	u32 *pclusters;
+	unsigned int nr_pclusters, max_pclusters;
+	struct erofs_sha256_state *md;
+};
+
+int vle_init_indexes(struct erofs_inode *inode,
+		     struct z_erofs_vle_compress_ctx *ctx, erofs_blk_t blkaddr);
+int vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
+		      unsigned int count, bool raw);
+int vle_write_indexes_final(struct z_erofs_vle_compress_ctx *ctx);
+
+#endif
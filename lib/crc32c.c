@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/crc32c.c
+ *
+ * crc32c with slice-by-8 and hardware (SSE4.2 / ARMv8 CRC32)
+ * implementations, which is selected at runtime.
+ */
+#include <string.h>
+#include "erofs/crc32c.h"
+#ifdef HAVE_SYS_AUXV_H
+#include <sys/auxv.h>
+#endif
+
+#define CRC32C_POLY_LE	0x82F63B78
+
+static u32 crc32c_table[8][256];
+
+static u32 crc32c_resolve(u32 crc, const u8 *in, size_t len);
+static u32 (*crc32c_fn)(u32 crc, const u8 *in, size_t len) = crc32c_resolve;
+static const char *crc32c_name = "none";
+
+static void crc32c_init_tables(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		u32 crc = i;
+
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY_LE : 0);
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+static inline u32 crc32c_byte(u32 crc, u8 c)
+{
+	return (crc >> 8) ^ crc32c_table[0][(crc ^ c) & 0xff];
+}
+
+static u32 crc32c_slice8(u32 crc, const u8 *in, size_t len)
+{
+	while (len && ((uintptr_t)in & 7)) {
+		crc = crc32c_byte(crc, *in++);
+		--len;
+	}
+
+	while (len >= 8) {
+		u32 lo, hi;
+
+		memcpy(&lo, in, 4);
+		memcpy(&hi, in + 4, 4);
+		lo = le32_to_cpu(lo) ^ crc;
+		hi = le32_to_cpu(hi);
+
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^
+		      crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][hi >> 24];
+		in += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32c_byte(crc, *in++);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *in, size_t len)
+{
+	u64 crc64 = crc;
+
+	while (len && ((uintptr_t)in & 7)) {
+		crc64 = __builtin_ia32_crc32qi(crc64, *in++);
+		--len;
+	}
+
+	while (len >= 8) {
+		u64 v;
+
+		memcpy(&v, in, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		in += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc64 = __builtin_ia32_crc32qi(crc64, *in++);
+	return crc64;
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#define crc32c_hw		crc32c_sse42
+#define CRC32C_HW_NAME		"sse4.2"
+#elif defined(__aarch64__) && defined(HAVE_SYS_AUXV_H)
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32		(1 << 7)
+#endif
+
+static inline u32 __crc32cb(u32 crc, u8 v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1"
+		: "+r"(crc) : "r"(v));
+	return crc;
+}
+
+static inline u32 __crc32cd(u32 crc, u64 v)
+{
+	__asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1"
+		: "+r"(crc) : "r"(v));
+	return crc;
+}
+
+static u32 crc32c_armv8(u32 crc, const u8 *in, size_t len)
+{
+	while (len && ((uintptr_t)in & 7)) {
+		crc = __crc32cb(crc, *in++);
+		--len;
+	}
+
+	while (len >= 8) {
+		u64 v;
+
+		memcpy(&v, in, 8);
+		crc = __crc32cd(crc, le64_to_cpu(v));
+		in += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *in++);
+	return crc;
+}
+
+static bool crc32c_hw_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#define crc32c_hw		crc32c_armv8
+#define CRC32C_HW_NAME		"armv8-crc32"
+#endif
+
+static u32 crc32c_resolve(u32 crc, const u8 *in, size_t len)
+{
+#ifdef CRC32C_HW_NAME
+	if (crc32c_hw_supported()) {
+		crc32c_name = CRC32C_HW_NAME;
+		__atomic_store_n(&crc32c_fn, crc32c_hw, __ATOMIC_RELEASE);
+		return crc32c_hw(crc, in, len);
+	}
+#endif
+	crc32c_init_tables();
+	crc32c_name = "slice-by-8";
+	__atomic_store_n(&crc32c_fn, crc32c_slice8, __ATOMIC_RELEASE);
+	return crc32c_slice8(crc, in, len);
+}
+
+u32 erofs_crc32c(u32 crc, const void *in, size_t len)
+{
+	return __atomic_load_n(&crc32c_fn, __ATOMIC_ACQUIRE)(crc, in, len);
+}
+
+const char *erofs_crc32c_impl(void)
+{
+	if (crc32c_fn == crc32c_resolve)
+		(void)erofs_crc32c(0, NULL, 0);
+	return crc32c_name;
+}
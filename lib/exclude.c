@@ -4,6 +4,7 @@
  *
  * Created by Li Guifu <bluce.lee@aliyun.com>
  */
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdlib.h>
 #include "erofs/err.h"
@@ -19,6 +20,33 @@ static LIST_HEAD(regex_exclude_head);
 
 static unsigned int rpathlen;		/* root directory prefix length */
 
+/* a path component of literal exclude rules */
+struct exclude_trie_node {
+	struct list_head sibling, children;
+	/* non-NULL if some exact literal path ends here */
+	struct erofs_exclude_rule *rule;
+	unsigned int len;
+	char name[0];
+};
+
+static struct exclude_trie_node exclude_trie = {
+	.sibling = LIST_HEAD_INIT(exclude_trie.sibling),
+	.children = LIST_HEAD_INIT(exclude_trie.children),
+};
+
+/* all regex rules compiled into one alternation if possible */
+static regex_t combined_regex;
+static bool combined_regex_valid, combined_regex_dirty;
+
+/* the directory which is being looked up now */
+static struct {
+	char *dir;
+	struct exclude_trie_node *node;
+	/* relative path prefix (with the trailing '/') for regex matching */
+	unsigned int len;
+	char buf[PATH_MAX];
+} excl_cur;
+
 void erofs_exclude_set_root(const char *rootdir)
 {
 	rpathlen = strlen(rootdir);
@@ -32,6 +60,126 @@ static void dump_regerror(int errcode, const char *s, const regex_t *preg)
 	erofs_err("invalid regex %s (%s)\n", s, str);
 }
 
+static struct exclude_trie_node *exclude_trie_lookup(
+		struct exclude_trie_node *parent, const char *name,
+		unsigned int len)
+{
+	struct exclude_trie_node *node;
+
+	list_for_each_entry(node, &parent->children, sibling)
+		if (node->len == len && !memcmp(node->name, name, len))
+			return node;
+	return NULL;
+}
+
+static int exclude_trie_insert(struct erofs_exclude_rule *r)
+{
+	struct exclude_trie_node *node = &exclude_trie, *child;
+	const char *s = r->pattern, *e;
+
+	while (1) {
+		while (*s == '/')
+			++s;
+		if (*s == '\0')
+			break;
+
+		e = strchrnul(s, '/');
+		child = exclude_trie_lookup(node, s, e - s);
+		if (!child) {
+			child = malloc(sizeof(*child) + (e - s));
+			if (!child)
+				return -ENOMEM;
+			init_list_head(&child->children);
+			child->rule = NULL;
+			child->len = e - s;
+			memcpy(child->name, s, e - s);
+			list_add_tail(&child->sibling, &node->children);
+		}
+		node = child;
+		s = e;
+	}
+
+	/* an empty path never matches anything */
+	if (node != &exclude_trie && !node->rule)
+		node->rule = r;
+	return 0;
+}
+
+static void exclude_trie_free(struct exclude_trie_node *parent)
+{
+	struct exclude_trie_node *node, *n;
+
+	list_for_each_entry_safe(node, n, &parent->children, sibling) {
+		exclude_trie_free(node);
+		list_del(&node->sibling);
+		free(node);
+	}
+}
+
+static void exclude_reset_cursor(void)
+{
+	free(excl_cur.dir);
+	excl_cur.dir = NULL;
+	excl_cur.node = NULL;
+	excl_cur.len = 0;
+}
+
+static bool regex_has_backref(const char *s)
+{
+	for (; *s != '\0'; ++s) {
+		if (*s != '\\')
+			continue;
+		if (s[1] >= '1' && s[1] <= '9')
+			return true;
+		if (s[1] != '\0')
+			++s;
+	}
+	return false;
+}
+
+/* fold all regex rules into "(r1)|(r2)|..." so each path is matched once */
+static void exclude_compile_regexes(void)
+{
+	struct erofs_exclude_rule *r;
+	size_t len = 0;
+	char *s, *p;
+	int ret;
+
+	combined_regex_dirty = false;
+	if (combined_regex_valid) {
+		regfree(&combined_regex);
+		combined_regex_valid = false;
+	}
+
+	list_for_each_entry(r, &regex_exclude_head, list) {
+		/* group numbers would be shifted by the alternation */
+		if (regex_has_backref(r->pattern))
+			return;
+		len += strlen(r->pattern) + 3;
+	}
+
+	/* nothing can be gained for a single regex */
+	if (!len || regex_exclude_head.next->next == &regex_exclude_head)
+		return;
+
+	p = s = malloc(len);
+	if (!s)
+		return;
+
+	list_for_each_entry(r, &regex_exclude_head, list) {
+		if (p != s)
+			*p++ = '|';
+		p += sprintf(p, "(%s)", r->pattern);
+	}
+
+	ret = regcomp(&combined_regex, s, REG_EXTENDED|REG_NOSUB);
+	if (ret)
+		erofs_dbg("failed to combine exclude regexes, fall back to one by one");
+	else
+		combined_regex_valid = true;
+	free(s);
+}
+
 static struct erofs_exclude_rule *erofs_insert_exclude(const char *s,
 						       bool is_regex)
 {
@@ -57,11 +205,16 @@ static struct erofs_exclude_rule *erofs_insert_exclude(const char *s,
 			goto err_rule;
 		}
 		h = &regex_exclude_head;
+		combined_regex_dirty = true;
 	} else {
+		ret = exclude_trie_insert(r);
+		if (ret)
+			goto err_rule;
 		h = &exclude_head;
 	}
 
 	list_add_tail(&r->list, h);
+	exclude_reset_cursor();
 	erofs_info("insert exclude %s: %s\n",
 		   is_regex ? "regex" : "path", s);
 	return r;
@@ -78,6 +231,13 @@ void erofs_cleanup_exclude_rules(void)
 	struct erofs_exclude_rule *r, *n;
 	struct list_head *h;
 
+	exclude_trie_free(&exclude_trie);
+	exclude_reset_cursor();
+	if (combined_regex_valid) {
+		regfree(&combined_regex);
+		combined_regex_valid = false;
+	}
+
 	h = &exclude_head;
 	list_for_each_entry_safe(r, n, h, list) {
 		list_del(&r->list);
@@ -105,29 +265,20 @@ int erofs_parse_exclude_path(const char *args, bool is_regex)
 	return 0;
 }
 
-struct erofs_exclude_rule *erofs_is_exclude_path(const char *dir,
-						 const char *name)
+static struct erofs_exclude_rule *exclude_match_regex(const char *s)
 {
-	char buf[PATH_MAX];
-	const char *s;
 	struct erofs_exclude_rule *r;
 
-	if (!dir) {
-		/* no prefix */
-		s = name;
-	} else {
-		sprintf(buf, "%s/%s", dir, name);
-		s = buf;
-	}
+	if (list_empty(&regex_exclude_head))
+		return NULL;
 
-	s += rpathlen;
-	while (*s == '/')
-		s++;
+	if (combined_regex_dirty)
+		exclude_compile_regexes();
 
-	list_for_each_entry(r, &exclude_head, list) {
-		if (!strcmp(r->pattern, s))
-			return r;
-	}
+	/* one automaton pass to decide, find out the exact rule if matched */
+	if (combined_regex_valid &&
+	    regexec(&combined_regex, s, (size_t)0, NULL, 0))
+		return NULL;
 
 	list_for_each_entry(r, &regex_exclude_head, list) {
 		int ret = regexec(&r->reg, s, (size_t)0, NULL, 0);
@@ -140,3 +291,100 @@ struct erofs_exclude_rule *erofs_is_exclude_path(const char *dir,
 	return NULL;
 }
 
+/* walk the literal trie along a relative path (NULL if nothing below) */
+static struct exclude_trie_node *exclude_trie_walk(const char *s)
+{
+	struct exclude_trie_node *node = &exclude_trie;
+	const char *e;
+
+	while (node) {
+		while (*s == '/')
+			++s;
+		if (*s == '\0')
+			break;
+		e = strchrnul(s, '/');
+		node = exclude_trie_lookup(node, s, e - s);
+		s = e;
+	}
+	return node;
+}
+
+static const char *exclude_relpath(const char *path)
+{
+	if (strlen(path) < rpathlen)
+		return NULL;
+
+	path += rpathlen;
+	while (*path == '/')
+		path++;
+	return path;
+}
+
+/* resolve the directory once, so its entries are matched incrementally */
+static int exclude_set_cursor(const char *dir)
+{
+	const char *rel = exclude_relpath(dir);
+	unsigned int len;
+
+	exclude_reset_cursor();
+	if (!rel)
+		return -EINVAL;
+
+	len = strlen(rel);
+	if (len + 1 >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	excl_cur.dir = strdup(dir);
+	if (!excl_cur.dir)
+		return -ENOMEM;
+
+	excl_cur.node = exclude_trie_walk(rel);
+	memcpy(excl_cur.buf, rel, len);
+	if (len)
+		excl_cur.buf[len++] = '/';
+	excl_cur.len = len;
+	return 0;
+}
+
+struct erofs_exclude_rule *erofs_is_exclude_path(const char *dir,
+						 const char *name)
+{
+	struct exclude_trie_node *node;
+	unsigned int namelen;
+	const char *s;
+
+	if (list_empty(&exclude_head) && list_empty(&regex_exclude_head))
+		return NULL;
+
+	if (!dir) {
+		/* no prefix */
+		s = exclude_relpath(name);
+		if (!s)
+			return NULL;
+
+		node = exclude_trie_walk(s);
+		if (node && node->rule)
+			return node->rule;
+		return exclude_match_regex(s);
+	}
+
+	if (!excl_cur.dir || strcmp(excl_cur.dir, dir)) {
+		if (exclude_set_cursor(dir))
+			return NULL;
+	}
+
+	namelen = strlen(name);
+	/* no literal rule can match anything in this subtree */
+	if (excl_cur.node) {
+		node = exclude_trie_lookup(excl_cur.node, name, namelen);
+		if (node && node->rule)
+			return node->rule;
+	}
+
+	if (list_empty(&regex_exclude_head) ||
+	    excl_cur.len + namelen >= PATH_MAX)
+		return NULL;
+
+	memcpy(excl_cur.buf + excl_cur.len, name, namelen + 1);
+	return exclude_match_regex(excl_cur.buf);
+}
@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/incremental.c
+ *
+ * Reuse the pclusters of unchanged files from a previous image, which are
+ * found by the cache index written along with it.  A file is unchanged if
+ * its path, size, mtime and sha256 of the data all match, and it would be
+ * compressed with the same algorithm and level.  The pclusters are copied
+ * as they are, and the compression indexes are generated again for their
+ * new block addresses.
+ */
+#define _LARGEFILE64_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "erofs/print.h"
+#include "erofs/io.h"
+#include "erofs/incremental.h"
+
+bool erofs_incremental_enabled, erofs_cache_index_enabled;
+
+#define ZCACHE_HASHTABLE_BITS	16
+static DEFINE_HASHTABLE(zcache_files, ZCACHE_HASHTABLE_BITS);
+
+/* the previous image, whose pclusters are copied */
+static int zcache_imgfd = -1;
+static bool zcache_lz4_0padding;
+
+/* the cache index being written for this image */
+static FILE *zcache_out;
+static u32 zcache_out_files;
+
+static u8 zcache_buf[64 * 1024];
+
+static unsigned int zcache_hash(const char *path)
+{
+	unsigned int hash = 0;
+
+	while (*path)
+		hash = hash * 131 + (unsigned char)*path++;
+	return hash;
+}
+
+/* the path in the image, which is the key of cached files */
+static const char *zcache_path(struct erofs_inode *inode)
+{
+	/* i_srcpath is already "/path" in the image for manifests */
+	if (cfg.c_manifest_path)
+		return inode->i_srcpath;
+	return inode->i_srcpath + strlen(cfg.c_src_path);
+}
+
+static void zcache_free(struct erofs_zcache_file *zf)
+{
+	free(zf->path);
+	free(zf->alg);
+	free(zf->pclusters);
+	free(zf);
+}
+
+static struct erofs_zcache_file *zcache_read_record(FILE *f,
+						    erofs_blk_t blocks)
+{
+	struct erofs_zcache_record rec;
+	struct erofs_zcache_file *zf;
+	unsigned int i;
+
+	if (fread(&rec, sizeof(rec), 1, f) != 1)
+		return ERR_PTR(-EIO);
+
+	zf = calloc(1, sizeof(*zf));
+	if (!zf)
+		return ERR_PTR(-ENOMEM);
+	zf->size = le64_to_cpu(rec.size);
+	zf->mtime = le64_to_cpu(rec.mtime);
+	zf->mtime_nsec = le32_to_cpu(rec.mtime_nsec);
+	zf->blkaddr = le32_to_cpu(rec.blkaddr);
+	zf->nr_pclusters = le32_to_cpu(rec.pclusters);
+	zf->level = (int)le32_to_cpu(rec.level);
+	memcpy(zf->digest, rec.digest, sizeof(zf->digest));
+
+	zf->path = calloc(1, le16_to_cpu(rec.pathlen) + 1);
+	zf->alg = calloc(1, rec.alglen + 1);
+	if (zf->nr_pclusters <= blocks)
+		zf->pclusters = malloc(zf->nr_pclusters * sizeof(u32) + 1);
+	if (!zf->path || !zf->alg || !zf->pclusters)
+		goto err;
+
+	if (fread(zf->path, le16_to_cpu(rec.pathlen), 1, f) != 1 ||
+	    fread(zf->alg, rec.alglen, 1, f) != 1 ||
+	    (zf->nr_pclusters && fread(zf->pclusters, sizeof(u32),
+				       zf->nr_pclusters, f) !=
+	     zf->nr_pclusters))
+		goto err;
+
+	for (i = 0; i < zf->nr_pclusters; ++i)
+		zf->pclusters[i] = le32_to_cpu(zf->pclusters[i]);
+
+	/* the pclusters should be in the previous image */
+	if (zf->blkaddr > blocks || zf->nr_pclusters > blocks - zf->blkaddr)
+		goto err;
+	return zf;
+err:
+	zcache_free(zf);
+	return ERR_PTR(-EINVAL);
+}
+
+static int zcache_check_image(int fd, const struct erofs_zcache_header *h,
+			      erofs_blk_t *blocks)
+{
+	struct erofs_super_block sb;
+
+	if (pread64(fd, &sb, sizeof(sb), EROFS_SUPER_OFFSET) != sizeof(sb) ||
+	    le32_to_cpu(sb.magic) != EROFS_SUPER_MAGIC_V1) {
+		erofs_err("the previous image is not an EROFS image");
+		return -EINVAL;
+	}
+	if (memcmp(sb.uuid, h->uuid, sizeof(sb.uuid))) {
+		erofs_err("the cache index doesn't describe the previous image");
+		return -EINVAL;
+	}
+	*blocks = le32_to_cpu(sb.blocks);
+	return 0;
+}
+
+int erofs_incremental_open(const char *imgpath, const char *indexpath)
+{
+	struct erofs_zcache_header h;
+	struct erofs_zcache_file *zf;
+	erofs_blk_t blocks;
+	unsigned int i, files;
+	int ret;
+	FILE *f;
+
+	f = fopen(indexpath, "rb");
+	if (!f) {
+		ret = -errno;
+		erofs_err("failed to open cache index %s: %s", indexpath,
+			  erofs_strerror(ret));
+		return ret;
+	}
+
+	ret = -EINVAL;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    le32_to_cpu(h.magic) != EROFS_ZCACHE_MAGIC ||
+	    h.version != EROFS_ZCACHE_VERSION) {
+		erofs_err("%s is not a cache index", indexpath);
+		goto out;
+	}
+	if (h.blkszbits != LOG_BLOCK_SIZE) {
+		erofs_err("the previous image has %u-byte blocks",
+			  1U << h.blkszbits);
+		goto out;
+	}
+
+	zcache_imgfd = open(imgpath, O_RDONLY | O_BINARY);
+	if (zcache_imgfd < 0) {
+		ret = -errno;
+		erofs_err("failed to open the previous image %s: %s",
+			  imgpath, erofs_strerror(ret));
+		goto out;
+	}
+	ret = zcache_check_image(zcache_imgfd, &h, &blocks);
+	if (ret)
+		goto out;
+	zcache_lz4_0padding = h.lz4_0padding;
+
+	files = le32_to_cpu(h.files);
+	for (i = 0; i < files; ++i) {
+		zf = zcache_read_record(f, blocks);
+		if (IS_ERR(zf)) {
+			ret = PTR_ERR(zf);
+			erofs_err("corrupted cache index %s", indexpath);
+			goto out;
+		}
+		hash_add(zcache_files, &zf->node, zcache_hash(zf->path));
+	}
+	erofs_info("%u cached files loaded from %s", files, indexpath);
+	erofs_incremental_enabled = true;
+	ret = 0;
+out:
+	fclose(f);
+	return ret;
+}
+
+struct erofs_zcache_file *erofs_incremental_find(struct erofs_inode *inode,
+						 const char *alg, int level)
+{
+	const char *path = zcache_path(inode);
+	struct erofs_zcache_file *zf;
+
+	/* pclusters are encoded differently */
+	if (zcache_lz4_0padding != erofs_sb_has_lz4_0padding())
+		return NULL;
+
+	hash_for_each_possible(zcache_files, zf, node, zcache_hash(path)) {
+		if (strcmp(zf->path, path))
+			continue;
+		if (zf->size != inode->i_size || zf->mtime != inode->i_mtime ||
+		    zf->mtime_nsec != inode->i_mtime_nsec ||
+		    zf->level != level || strcmp(zf->alg, alg))
+			return NULL;
+		return zf;
+	}
+	return NULL;
+}
+
+/* calculate sha256 of @size bytes from the current position of @fd */
+int erofs_incremental_digest(int fd, erofs_off_t size, u8 *digest)
+{
+	struct erofs_sha256_state md;
+	off64_t pos = lseek64(fd, 0, SEEK_CUR);
+
+	if (pos < 0)
+		return -errno;
+
+	erofs_sha256_init(&md);
+	while (size) {
+		const unsigned int count = min_t(erofs_off_t, size,
+						 sizeof(zcache_buf));
+		ssize_t ret = pread64(fd, zcache_buf, count, pos);
+
+		if (ret != count)
+			return ret < 0 ? -errno : -EIO;
+		erofs_sha256_process(&md, zcache_buf, count);
+		pos += count;
+		size -= count;
+	}
+	erofs_sha256_done(&md, digest);
+	return 0;
+}
+
+int erofs_incremental_copy(erofs_blk_t from, erofs_blk_t to,
+			   erofs_blk_t nblocks)
+{
+	const erofs_blk_t chunk = sizeof(zcache_buf) / EROFS_BLKSIZ;
+
+	while (nblocks) {
+		const erofs_blk_t count = min(nblocks, chunk);
+		ssize_t ret = pread64(zcache_imgfd, zcache_buf,
+				      blknr_to_addr(count),
+				      blknr_to_addr(from));
+
+		if (ret != blknr_to_addr(count))
+			return ret < 0 ? -errno : -EIO;
+		ret = blk_write(zcache_buf, to, count);
+		if (ret)
+			return ret;
+		from += count;
+		to += count;
+		nblocks -= count;
+	}
+	return 0;
+}
+
+static int zcache_write_header(void)
+{
+	struct erofs_zcache_header h = {
+		.magic = cpu_to_le32(EROFS_ZCACHE_MAGIC),
+		.version = EROFS_ZCACHE_VERSION,
+		.blkszbits = LOG_BLOCK_SIZE,
+		.lz4_0padding = erofs_sb_has_lz4_0padding(),
+		.files = cpu_to_le32(zcache_out_files),
+	};
+
+	memcpy(h.uuid, sbi.uuid, sizeof(h.uuid));
+	if (fseek(zcache_out, 0, SEEK_SET) ||
+	    fwrite(&h, sizeof(h), 1, zcache_out) != 1)
+		return -EIO;
+	return 0;
+}
+
+/* the header is written again with all records on success */
+int erofs_cache_index_open(const char *path)
+{
+	zcache_out = fopen(path, "wb");
+	if (!zcache_out) {
+		erofs_err("failed to open %s for the cache index", path);
+		return -errno;
+	}
+	erofs_cache_index_enabled = true;
+	return zcache_write_header();
+}
+
+int erofs_cache_index_add(struct erofs_inode *inode, const u8 *digest,
+			  const char *alg, int level, erofs_blk_t blkaddr,
+			  const u32 *pclusters, unsigned int nr_pclusters)
+{
+	const char *path = zcache_path(inode);
+	struct erofs_zcache_record rec = {
+		.size = cpu_to_le64(inode->i_size),
+		.mtime = cpu_to_le64(inode->i_mtime),
+		.mtime_nsec = cpu_to_le32(inode->i_mtime_nsec),
+		.blkaddr = cpu_to_le32(blkaddr),
+		.pclusters = cpu_to_le32(nr_pclusters),
+		.level = cpu_to_le32(level),
+		.pathlen = cpu_to_le16(strlen(path)),
+		.alglen = strlen(alg),
+	};
+	unsigned int i;
+
+	memcpy(rec.digest, digest, sizeof(rec.digest));
+	if (fwrite(&rec, sizeof(rec), 1, zcache_out) != 1 ||
+	    fwrite(path, strlen(path), 1, zcache_out) != 1 ||
+	    fwrite(alg, rec.alglen, 1, zcache_out) != 1)
+		return -EIO;
+
+	for (i = 0; i < nr_pclusters; ++i) {
+		__le32 v = cpu_to_le32(pclusters[i]);
+
+		if (fwrite(&v, sizeof(v), 1, zcache_out) != 1)
+			return -EIO;
+	}
+	++zcache_out_files;
+	return 0;
+}
+
+int erofs_cache_index_close(void)
+{
+	int ret = zcache_write_header();
+
+	if (fclose(zcache_out) && !ret)
+		ret = -errno;
+	zcache_out = NULL;
+	if (ret)
+		erofs_err("failed to write the cache index");
+	else
+		erofs_info("%u compressed files written to the cache index",
+			   zcache_out_files);
+	return ret;
+}
+
+void erofs_incremental_exit(void)
+{
+	struct erofs_zcache_file *zf;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	hash_for_each_safe(zcache_files, bkt, tmp, zf, node) {
+		hash_del(&zf->node);
+		zcache_free(zf);
+	}
+	if (zcache_imgfd >= 0) {
+		close(zcache_imgfd);
+		zcache_imgfd = -1;
+	}
+	/* left with no record if mkfs fails */
+	if (zcache_out) {
+		fclose(zcache_out);
+		zcache_out = NULL;
+	}
+}
+
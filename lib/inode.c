@@ -21,8 +21,13 @@
 #include "erofs/compress.h"
 #include "erofs/xattr.h"
 #include "erofs/exclude.h"
+#include "erofs/stats.h"
+#include "erofs/budget.h"
+#include "erofs/hashtable.h"
 
-struct erofs_sb_info sbi;
+struct erofs_sb_info sbi = {
+	.blkszbits = EROFS_DEFAULT_BLKSZBITS,
+};
 
 #define S_SHIFT                 12
 static unsigned char erofs_type_by_mode[S_IFMT >> S_SHIFT] = {
@@ -39,12 +44,89 @@ static unsigned char erofs_type_by_mode[S_IFMT >> S_SHIFT] = {
 
 struct list_head inode_hashtable[NR_INODE_HASHTABLE];
 
+/*
+ * With --max-memory, buffers are flushed as soon as too many inodes are in
+ * memory, and written inodes are freed.  Hardlinked inodes are retired into
+ * small records instead, so that later links can still find them.
+ */
+struct erofs_retired_inode {
+	struct hlist_node node;
+	ino_t ino;
+	erofs_nid_t nid;
+	umode_t mode;
+	unsigned char inode_isize;
+	u32 nlink;
+};
+
+#define RETIRED_HASHTABLE_BITS	16
+static DEFINE_HASHTABLE(retired_hashtable, RETIRED_HASHTABLE_BITS);
+
+static unsigned int nr_inodes, max_inodes;
+
 void erofs_inode_manager_init(void)
 {
 	unsigned int i;
 
 	for (i = 0; i < NR_INODE_HASHTABLE; ++i)
 		init_list_head(&inode_hashtable[i]);
+
+	if (cfg.c_max_memory)
+		max_inodes = max_t(u64, cfg.c_max_memory /
+				   sizeof(struct erofs_inode), 64);
+}
+
+static struct erofs_retired_inode *erofs_find_retired(ino_t ino)
+{
+	struct erofs_retired_inode *ri;
+
+	hash_for_each_possible(retired_hashtable, ri, node, ino)
+		if (ri->ino == ino)
+			return ri;
+	return NULL;
+}
+
+static void erofs_retire_inode(struct erofs_inode *inode)
+{
+	struct erofs_retired_inode *ri = malloc(sizeof(*ri));
+
+	/* a later link will duplicate the inode, which is still valid */
+	if (!ri) {
+		erofs_warn("out of memory, %s may be duplicated",
+			   inode->i_srcpath);
+		return;
+	}
+	ri->ino = inode->i_ino[1];
+	ri->nid = inode->nid;
+	ri->mode = inode->i_mode;
+	ri->inode_isize = inode->inode_isize;
+	ri->nlink = inode->i_nlink;
+	hash_add(retired_hashtable, &ri->node, ri->ino);
+}
+
+/* the inode has been written, so update its i_nlink on disk */
+static int erofs_update_retired_nlink(struct erofs_inode *inode)
+{
+	struct erofs_retired_inode *ri = erofs_find_retired(inode->i_ino[1]);
+	erofs_off_t off;
+	union {
+		__le16 v16;
+		__le32 v32;
+	} u;
+
+	if (!ri || ri->nlink == inode->i_nlink)
+		return 0;
+
+	ri->nlink = inode->i_nlink;
+	off = blknr_to_addr(sbi.meta_blkaddr) +
+		(ri->nid << EROFS_ISLOTBITS);
+	if (ri->inode_isize == sizeof(struct erofs_inode_compact)) {
+		u.v16 = cpu_to_le16(ri->nlink);
+		return dev_write(&u.v16, off + offsetof(struct erofs_inode_compact,
+						       i_nlink), sizeof(u.v16));
+	}
+	u.v32 = cpu_to_le32(ri->nlink);
+	return dev_write(&u.v32, off + offsetof(struct erofs_inode_extended,
+					       i_nlink), sizeof(u.v32));
 }
 
 static struct erofs_inode *erofs_igrab(struct erofs_inode *inode)
@@ -88,11 +170,54 @@ unsigned int erofs_iput(struct erofs_inode *inode)
 	list_for_each_entry_safe(d, t, &inode->i_subdirs, d_child)
 		free(d);
 
+	if (inode->i_hardlinked && max_inodes &&
+	    erofs_update_retired_nlink(inode))
+		erofs_err("failed to update i_nlink of %s", inode->i_srcpath);
+
+	erofs_drop_xattr_ibody(inode);
 	list_del(&inode->i_hash);
+	free(inode->idata);
 	free(inode);
+	--nr_inodes;
 	return 0;
 }
 
+/* a new inode for a later link to a retired one, with i_parent set */
+static struct erofs_inode *erofs_revive_inode(ino_t ino)
+{
+	struct erofs_retired_inode *ri = erofs_find_retired(ino);
+	struct erofs_inode *inode;
+
+	if (!ri)
+		return NULL;
+
+	inode = erofs_new_inode();
+	if (IS_ERR(inode))
+		return inode;
+
+	inode->i_parent = inode;
+	inode->i_mode = ri->mode;
+	inode->i_nlink = ri->nlink;
+	inode->i_ino[1] = ino;
+	inode->nid = ri->nid;
+	inode->inode_isize = ri->inode_isize;
+	inode->i_hardlinked = true;
+	inode->i_srcpath[0] = '\0';
+	list_add(&inode->i_hash, &inode_hashtable[ino % NR_INODE_HASHTABLE]);
+	return inode;
+}
+
+/* flush all buffers which are ready if too many inodes are in memory */
+static void erofs_shrink_inodes(void)
+{
+	if (!max_inodes || nr_inodes <= max_inodes)
+		return;
+
+	erofs_dbg("flushing buffers with %u inodes in memory", nr_inodes);
+	erofs_bflush(NULL);
+	erofs_stat_add(EROFS_STAT_EARLY_FLUSHES, 1);
+}
+
 static int dentry_add_sorted(struct erofs_dentry *d, struct list_head *head)
 {
 	struct list_head *pos;
@@ -220,7 +345,7 @@ static void fill_dirblock(char *buf, unsigned int size, unsigned int q,
 static int write_dirblock(unsigned int q, struct erofs_dentry *head,
 			  struct erofs_dentry *end, erofs_blk_t blkaddr)
 {
-	char buf[EROFS_BLKSIZ];
+	char buf[EROFS_MAX_BLOCK_SIZE];
 
 	fill_dirblock(buf, EROFS_BLKSIZ, q, head, end);
 	return blk_write(buf, blkaddr, 1);
@@ -311,19 +436,32 @@ static int write_uncompressed_file_from_fd(struct erofs_inode *inode, int fd)
 	inode->datalayout = EROFS_INODE_FLAT_INLINE;
 	nblocks = inode->i_size / EROFS_BLKSIZ;
 
+	/* the tail-end data is likely inlined */
+	ret = erofs_balign_data(nblocks);
+	if (ret < 0)
+		return ret;
+
 	ret = __allocate_inode_bh_data(inode, nblocks);
 	if (ret)
 		return ret;
 
+	/* only the size matters when estimating, so skip to the tail */
+	if (cfg.c_estimate_pct) {
+		if (lseek(fd, blknr_to_addr(nblocks), SEEK_SET) < 0)
+			return -errno;
+		nblocks = 0;
+	}
+
 	for (i = 0; i < nblocks; ++i) {
-		char buf[EROFS_BLKSIZ];
+		char buf[EROFS_MAX_BLOCK_SIZE];
 
-		ret = read(fd, buf, EROFS_BLKSIZ);
+		ret = erofs_read_fully(fd, buf, EROFS_BLKSIZ);
 		if (ret != EROFS_BLKSIZ) {
 			if (ret < 0)
 				return -errno;
 			return -EAGAIN;
 		}
+		erofs_stat_add(EROFS_STAT_BYTES_READ, EROFS_BLKSIZ);
 
 		ret = blk_write(buf, inode->u.i_blkaddr + i, 1);
 		if (ret)
@@ -337,38 +475,64 @@ static int write_uncompressed_file_from_fd(struct erofs_inode *inode, int fd)
 		if (!inode->idata)
 			return -ENOMEM;
 
-		ret = read(fd, inode->idata, inode->idata_size);
+		ret = erofs_read_fully(fd, inode->idata, inode->idata_size);
 		if (ret < inode->idata_size) {
 			free(inode->idata);
 			inode->idata = NULL;
 			return -EIO;
 		}
+		erofs_stat_add(EROFS_STAT_BYTES_READ, inode->idata_size);
 	}
 	return 0;
 }
 
-int erofs_write_file(struct erofs_inode *inode)
+/* write i_size bytes of data from @fd, which is left at the end of them */
+int erofs_write_file_from_fd(struct erofs_inode *inode, int fd)
 {
-	int ret, fd;
+	const char *alg = cfg.c_compr_alg_master;
+	int ret, level = -1;
+	off_t pos;
 
 	if (!inode->i_size) {
 		inode->datalayout = EROFS_INODE_FLAT_PLAIN;
 		return 0;
 	}
 
-	if (cfg.c_compr_alg_master && erofs_file_is_compressible(inode)) {
-		ret = erofs_write_compressed_file(inode);
+	if (erofs_budget_enabled)
+		erofs_budget_lookup(inode, &alg, &level);
+
+	if (alg && erofs_file_is_compressible(inode)) {
+		pos = lseek(fd, 0, SEEK_CUR);
+
+		erofs_phase_begin(EROFS_PHASE_COMPRESS);
+		ret = erofs_write_compressed_file(inode, fd, alg, level);
+		erofs_phase_end(EROFS_PHASE_COMPRESS);
 
 		if (!ret || ret != -ENOSPC)
 			return ret;
+		erofs_stat_add(EROFS_STAT_RAW_FALLBACKS, 1);
+
+		/* fallback to all data uncompressed */
+		if (lseek(fd, pos, SEEK_SET) < 0)
+			return -errno;
+	}
+	return write_uncompressed_file_from_fd(inode, fd);
+}
+
+int erofs_write_file(struct erofs_inode *inode)
+{
+	int ret, fd;
+
+	if (!inode->i_size) {
+		inode->datalayout = EROFS_INODE_FLAT_PLAIN;
+		return 0;
 	}
 
-	/* fallback to all data uncompressed */
 	fd = open(inode->i_srcpath, O_RDONLY | O_BINARY);
 	if (fd < 0)
 		return -errno;
 
-	ret = write_uncompressed_file_from_fd(inode, fd);
+	ret = erofs_write_file_from_fd(inode, fd);
 	close(fd);
 	return ret;
 }
@@ -424,8 +588,8 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 
 		u.die.i_ino = cpu_to_le32(inode->i_ino[0]);
 
-		u.die.i_uid = cpu_to_le16(inode->i_uid);
-		u.die.i_gid = cpu_to_le16(inode->i_gid);
+		u.die.i_uid = cpu_to_le32(inode->i_uid);
+		u.die.i_gid = cpu_to_le32(inode->i_gid);
 
 		u.die.i_ctime = cpu_to_le64(inode->i_ctime);
 		u.die.i_ctime_nsec = cpu_to_le32(inode->i_ctime_nsec);
@@ -460,13 +624,9 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 	off += inode->inode_isize;
 
 	if (inode->xattr_isize) {
-		char *xattrs = erofs_export_xattr_ibody(&inode->i_xattrs,
-							inode->xattr_isize);
-		if (IS_ERR(xattrs))
-			return false;
+		const char *xattrs = erofs_export_xattr_ibody(inode);
 
 		ret = dev_write(xattrs, off, inode->xattr_isize);
-		free(xattrs);
 		if (ret)
 			return false;
 
@@ -476,12 +636,17 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 	if (inode->extent_isize) {
 		/* write compression metadata */
 		off = Z_EROFS_VLE_EXTENT_ALIGN(off);
-		ret = dev_write(inode->compressmeta, off, inode->extent_isize);
+		ret = z_erofs_write_compressmeta(inode, off);
 		if (ret)
 			return false;
-		free(inode->compressmeta);
 	}
 
+	/* it could be flushed before erofs_lookupnid() with --max-memory */
+	inode->nid = (erofs_btell(bh, false) -
+		      blknr_to_addr(sbi.meta_blkaddr)) >> EROFS_ISLOTBITS;
+	if (inode->i_hardlinked && max_inodes)
+		erofs_retire_inode(inode);
+
 	inode->bh = NULL;
 	erofs_iput(inode);
 	return erofs_bh_flush_generic_end(bh);
@@ -520,6 +685,17 @@ int erofs_prepare_tail_block(struct erofs_inode *inode)
 	return 0;
 }
 
+/* the on-disk inode with its inline xattrs and compression extents */
+static unsigned int erofs_inode_slot_size(struct erofs_inode *inode)
+{
+	unsigned int inodesize = inode->inode_isize + inode->xattr_isize;
+
+	if (inode->extent_isize)
+		inodesize = Z_EROFS_VLE_EXTENT_ALIGN(inodesize) +
+			    inode->extent_isize;
+	return inodesize;
+}
+
 int erofs_prepare_inode_buffer(struct erofs_inode *inode)
 {
 	unsigned int inodesize;
@@ -527,10 +703,7 @@ int erofs_prepare_inode_buffer(struct erofs_inode *inode)
 
 	DBG_BUGON(inode->bh || inode->bh_inline);
 
-	inodesize = inode->inode_isize + inode->xattr_isize;
-	if (inode->extent_isize)
-		inodesize = Z_EROFS_VLE_EXTENT_ALIGN(inodesize) +
-			    inode->extent_isize;
+	inodesize = erofs_inode_slot_size(inode);
 
 	if (is_inode_layout_compression(inode))
 		goto noinline;
@@ -650,6 +823,32 @@ out:
 	return 0;
 }
 
+/*
+ * The data of a file may be written long before its inode buffer is
+ * prepared (e.g. from a tar stream), when the tail-end block can't be
+ * appended to its data blocks any longer.  So decide if the tail-end data
+ * could be inlined now, and write it to the tail-end block otherwise.
+ */
+int erofs_settle_file_data(struct erofs_inode *inode)
+{
+	int ret;
+
+	if (inode->idata_size && inode->inode_isize + inode->xattr_isize +
+	    inode->idata_size > EROFS_BLKSIZ) {
+		ret = erofs_prepare_tail_block(inode);
+		if (ret)
+			return ret;
+		inode->datalayout = EROFS_INODE_FLAT_PLAIN;
+		return erofs_write_tail_end(inode);
+	}
+
+	if (inode->bh_data) {
+		erofs_bdrop(inode->bh_data, false);
+		inode->bh_data = NULL;
+	}
+	return 0;
+}
+
 static bool erofs_should_use_inode_extended(struct erofs_inode *inode)
 {
 	if (cfg.c_force_inodeversion == FORCE_INODE_EXTENDED)
@@ -682,6 +881,8 @@ int erofs_fill_inode(struct erofs_inode *inode,
 	inode->i_gid = st->st_gid;
 	inode->i_ctime = sbi.build_time;
 	inode->i_ctime_nsec = sbi.build_time_nsec;
+	inode->i_mtime = st->st_mtime;
+	inode->i_mtime_nsec = st->st_mtim.tv_nsec;
 	inode->i_nlink = 1;	/* fix up later if needed */
 
 	switch (inode->i_mode & S_IFMT) {
@@ -705,6 +906,7 @@ int erofs_fill_inode(struct erofs_inode *inode,
 	inode->i_srcpath[sizeof(inode->i_srcpath) - 1] = '\0';
 
 	inode->i_ino[1] = st->st_ino;
+	inode->i_hardlinked = !S_ISDIR(st->st_mode) && st->st_nlink > 1;
 
 	if (erofs_should_use_inode_extended(inode)) {
 		if (cfg.c_force_inodeversion == FORCE_INODE_COMPACT) {
@@ -735,9 +937,12 @@ struct erofs_inode *erofs_new_inode(void)
 
 	inode->i_ino[0] = counter++;	/* inode serial number */
 	inode->i_count = 1;
+	inode->i_hardlinked = false;
+	inode->i_data_written = false;
+	++nr_inodes;
 
 	init_list_head(&inode->i_subdirs);
-	init_list_head(&inode->i_xattrs);
+	inode->i_xattrs = NULL;
 
 	inode->idata_size = 0;
 	inode->xattr_isize = 0;
@@ -767,6 +972,12 @@ struct erofs_inode *erofs_iget_from_path(const char *path, bool is_src)
 	if (inode)
 		return inode;
 
+	if (max_inodes && st.st_nlink > 1) {
+		inode = erofs_revive_inode(st.st_ino);
+		if (inode)
+			return inode;
+	}
+
 	/* cannot find in the inode cache */
 	inode = erofs_new_inode();
 	if (IS_ERR(inode))
@@ -820,48 +1031,115 @@ void erofs_d_invalidate(struct erofs_dentry *d)
 	erofs_iput(inode);
 }
 
-struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
-{
-	int ret;
-	DIR *_dir;
-	struct dirent *dp;
-	struct erofs_dentry *d;
+/* metadata blocks touched by listing a directory, see erofs_d_commit() */
+struct erofs_dir_blocks {
+	erofs_blk_t *blks;
+	unsigned int nr, max;
+};
 
-	ret = erofs_prepare_xattr_ibody(dir->i_srcpath, &dir->i_xattrs);
-	if (ret < 0)
-		return ERR_PTR(ret);
-	dir->xattr_isize = ret;
+/* bytes of an on-disk inode with its xattrs, indexes or inline data */
+static unsigned int erofs_inode_meta_size(struct erofs_inode *inode,
+					  bool inlined)
+{
+	unsigned int size = erofs_inode_slot_size(inode);
 
-	if (!S_ISDIR(dir->i_mode)) {
-		if (S_ISLNK(dir->i_mode)) {
-			char *const symlink = malloc(dir->i_size);
-
-			if (!symlink)
-				return ERR_PTR(-ENOMEM);
-			ret = readlink(dir->i_srcpath, symlink, dir->i_size);
-			if (ret < 0) {
-				free(symlink);
-				return ERR_PTR(-errno);
-			}
+	if (inode->extent_isize)
+		return size;
+	if (inlined ? !!inode->bh_inline :
+	    size + inode->idata_size <= EROFS_BLKSIZ)
+		size += inode->idata_size;
+	return size;
+}
 
-			ret = erofs_write_file_from_buffer(dir, symlink);
-			free(symlink);
-			if (ret)
-				return ERR_PTR(ret);
-		} else {
-			erofs_write_file(dir);
+static void erofs_dir_blocks_add(struct erofs_dir_blocks *db,
+				 erofs_off_t off, erofs_off_t size)
+{
+	erofs_blk_t blkaddr;
+
+	if (!size)
+		return;
+	for (blkaddr = erofs_blknr(off);
+	     blkaddr <= erofs_blknr(off + size - 1); ++blkaddr) {
+		if (db->nr >= db->max) {
+			unsigned int nr = max(db->max * 2, 16U);
+			erofs_blk_t *blks = realloc(db->blks,
+						    nr * sizeof(*blks));
+
+			/* it's only a metric */
+			if (!blks)
+				return;
+			db->blks = blks;
+			db->max = nr;
 		}
-
-		erofs_prepare_inode_buffer(dir);
-		erofs_write_tail_end(dir);
-		return dir;
+		db->blks[db->nr++] = blkaddr;
 	}
+}
+
+static int erofs_blk_cmp(const void *a, const void *b)
+{
+	const erofs_blk_t x = *(const erofs_blk_t *)a;
+	const erofs_blk_t y = *(const erofs_blk_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* count distinct blocks of the dirents and the inodes of all children */
+static void erofs_dir_blocks_done(struct erofs_inode *dir,
+				  struct erofs_dir_blocks *db)
+{
+	const erofs_blk_t nblocks =
+		dir->datalayout == EROFS_INODE_FLAT_PLAIN ?
+		BLK_ROUND_UP(dir->i_size) : erofs_blknr(dir->i_size);
+	unsigned int i, n = 0;
+
+	if (nblocks)
+		erofs_dir_blocks_add(db, blknr_to_addr(dir->u.i_blkaddr),
+				     blknr_to_addr(nblocks));
+
+	qsort(db->blks, db->nr, sizeof(*db->blks), erofs_blk_cmp);
+	for (i = 0; i < db->nr; ++i)
+		if (!i || db->blks[i] != db->blks[i - 1])
+			++n;
+	erofs_stat_add(EROFS_STAT_DIRS, 1);
+	erofs_stat_add(EROFS_STAT_DIR_META_BLOCKS, n);
+	free(db->blks);
+}
+
+/* fill in the nid of an entry once the inode is allocated */
+static void erofs_d_commit(struct erofs_inode *dir, struct erofs_dentry *d,
+			   struct erofs_dir_blocks *db)
+{
+	struct erofs_inode *const inode = d->inode;
+	/* ".." is not read for listing the directory */
+	const unsigned int size = strcmp(d->name, "..") ?
+		erofs_inode_meta_size(inode, true) : 0;
+
+	if (!is_dot_dotdot(d->name))
+		d->type = erofs_type_by_mode[inode->i_mode >> S_SHIFT];
+	erofs_d_invalidate(d);
+	erofs_dir_blocks_add(db, blknr_to_addr(sbi.meta_blkaddr) +
+			     (d->nid << EROFS_ISLOTBITS), size);
+	if (is_dot_dotdot(d->name))
+		return;
+
+	erofs_info("add file %s/%s (nid %llu, type %d)",
+		   dir->i_srcpath, d->name, (unsigned long long)d->nid,
+		   d->type);
+	erofs_shrink_inodes();
+}
+
+static int erofs_mkfs_read_dir(struct erofs_inode *dir)
+{
+	struct erofs_dentry *d;
+	struct dirent *dp;
+	DIR *_dir;
+	int ret;
 
 	_dir = opendir(dir->i_srcpath);
 	if (!_dir) {
 		erofs_err("%s, failed to opendir at %s: %s",
 			  __func__, dir->i_srcpath, erofs_strerror(errno));
-		return ERR_PTR(-errno);
+		return -errno;
 	}
 
 	while (1) {
@@ -888,29 +1166,65 @@ struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 			goto err_closedir;
 		}
 	}
+	ret = -errno;
+err_closedir:
+	closedir(_dir);
+	return ret;
+}
+
+/* write the data of a file, or read the entries of a directory */
+static int erofs_mkfs_prepare_data(struct erofs_inode *inode)
+{
+	int ret;
+
+	/* hot files have been written with their xattrs sized */
+	if (inode->i_data_written)
+		return 0;
+
+	ret = erofs_prepare_xattr_ibody(inode);
+	if (ret < 0)
+		return ret;
+	inode->xattr_isize = ret;
 
-	if (errno) {
-		ret = -errno;
-		goto err_closedir;
+	if (S_ISDIR(inode->i_mode)) {
+		ret = erofs_mkfs_read_dir(inode);
+		if (ret)
+			return ret;
+		return erofs_prepare_dir_file(inode);
 	}
-	closedir(_dir);
 
-	ret = erofs_prepare_dir_file(dir);
-	if (ret)
-		goto err_closedir;
+	if (S_ISLNK(inode->i_mode)) {
+		char *const symlink = malloc(inode->i_size);
 
-	ret = erofs_prepare_inode_buffer(dir);
-	if (ret)
-		goto err_closedir;
+		if (!symlink)
+			return -ENOMEM;
+		ret = readlink(inode->i_srcpath, symlink, inode->i_size);
+		if (ret < 0) {
+			free(symlink);
+			return -errno;
+		}
 
-	if (IS_ROOT(dir))
-		erofs_fixup_meta_blkaddr(dir);
+		ret = erofs_write_file_from_buffer(inode, symlink);
+		free(symlink);
+		return ret;
+	}
+
+	return erofs_write_file(inode);
+}
+
+static int erofs_mkfs_build_dir(struct erofs_inode *dir);
+
+static int erofs_mkfs_build_children(struct erofs_inode *dir,
+				     struct erofs_dir_blocks *db)
+{
+	struct erofs_dentry *d;
+	int ret;
 
 	list_for_each_entry(d, &dir->i_subdirs, d_child) {
 		char buf[PATH_MAX];
 
 		if (is_dot_dotdot(d->name)) {
-			erofs_d_invalidate(d);
+			erofs_d_commit(dir, d, db);
 			continue;
 		}
 
@@ -923,25 +1237,259 @@ struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 
 		d->inode = erofs_mkfs_build_tree_from_path(dir, buf);
 		if (IS_ERR(d->inode)) {
-fail:
+			ret = PTR_ERR(d->inode);
 			d->inode = NULL;
-			d->type = EROFS_FT_UNKNOWN;
+			erofs_err("failed to build %s: %s", buf,
+				  erofs_strerror(ret));
+			return ret;
+		}
+		erofs_d_commit(dir, d, db);
+		continue;
+fail:
+		d->inode = NULL;
+		d->type = EROFS_FT_UNKNOWN;
+	}
+	return 0;
+}
+
+static unsigned int erofs_count_children(struct erofs_inode *dir)
+{
+	struct erofs_dentry *d;
+	unsigned int nr = 0;
+
+	list_for_each_entry(d, &dir->i_subdirs, d_child)
+		++nr;
+	return nr;
+}
+
+/*
+ * the tail-end block can't be appended to the data blocks of a child once
+ * the data of its siblings is written, so decide it in advance.
+ */
+static int erofs_settle_child(struct erofs_inode *inode)
+{
+	if (!S_ISDIR(inode->i_mode))
+		return erofs_settle_file_data(inode);
+
+	/* dirents aren't filled yet, so allocate such an inode right now */
+	if (inode->idata_size && inode->inode_isize + inode->xattr_isize +
+	    inode->idata_size > EROFS_BLKSIZ)
+		return erofs_prepare_inode_buffer(inode);
+	return 0;
+}
+
+/* larger inodes first, and then in the order of entries */
+static int erofs_dentry_meta_size_cmp(const void *a, const void *b)
+{
+	const struct erofs_dentry *da = *(const struct erofs_dentry **)a;
+	const struct erofs_dentry *db = *(const struct erofs_dentry **)b;
+	const unsigned int sa = erofs_inode_meta_size(da->inode, false);
+	const unsigned int sb = erofs_inode_meta_size(db->inode, false);
+
+	if (sa != sb)
+		return sa > sb ? -1 : 1;
+	return strcmp(da->name, db->name);
+}
+
+/*
+ * allocate the inodes of new children together once all their data is
+ * written, so that they're contiguous after the dirents of the parent
+ * with -E cluster-inodes, and/or packed into the fullest blocks in the
+ * best-fit-decreasing order with -E pack-inodes.
+ */
+static int erofs_prepare_inodes_clustered(struct erofs_dentry **news,
+					  unsigned int nr)
+{
+	struct erofs_dentry **order = news;
+	unsigned int i, size = 0;
+	int ret = 0;
+
+	for (i = 0; i < nr; ++i) {
+		struct erofs_inode *const inode = news[i]->inode;
+
+		if (inode->bh)
+			continue;
+		size += round_up(erofs_inode_meta_size(inode, false),
+				 sizeof(struct erofs_inode_compact));
+	}
+
+	if (cfg.c_pack_inodes && nr) {
+		/* @news should be kept in the order of entries */
+		order = malloc(nr * sizeof(*order));
+		if (!order)
+			return -ENOMEM;
+		memcpy(order, news, nr * sizeof(*order));
+		qsort(order, nr, sizeof(*order), erofs_dentry_meta_size_cmp);
+	}
+	if (cfg.c_cluster_inodes)
+		erofs_bcluster_begin(size);
+
+	for (i = 0; i < nr; ++i) {
+		struct erofs_inode *const inode = order[i]->inode;
+
+		if (inode->bh)
+			continue;
+		ret = erofs_prepare_inode_buffer(inode);
+		if (!ret && !S_ISDIR(inode->i_mode))
+			ret = erofs_write_tail_end(inode);
+		if (ret)
+			break;
+	}
+
+	if (cfg.c_cluster_inodes)
+		erofs_bcluster_end();
+	if (order != news)
+		free(order);
+	return ret;
+}
+
+/*
+ * commit all entries but new subdirectories, which are built later and
+ * left in @news, and return the number of them.
+ */
+static unsigned int erofs_commit_children_clustered(struct erofs_inode *dir,
+						    struct erofs_dentry **news,
+						    unsigned int nr,
+						    struct erofs_dir_blocks *db)
+{
+	struct erofs_dentry *d;
+	unsigned int i = 0, ndirs = 0;
+
+	list_for_each_entry(d, &dir->i_subdirs, d_child) {
+		/* @news is in the order of entries */
+		if (i < nr && news[i] == d) {
+			++i;
+			if (S_ISDIR(d->inode->i_mode)) {
+				news[ndirs++] = d;
+				continue;
+			}
+		} else if (!d->inode) {
 			continue;
 		}
+		erofs_d_commit(dir, d, db);
+	}
+	return ndirs;
+}
 
-		d->type = erofs_type_by_mode[d->inode->i_mode >> S_SHIFT];
-		erofs_d_invalidate(d);
-		erofs_info("add file %s/%s (nid %llu, type %d)",
-			   dir->i_srcpath, d->name, (unsigned long long)d->nid,
-			   d->type);
+static int erofs_mkfs_build_children_clustered(struct erofs_inode *dir,
+					       struct erofs_dir_blocks *db)
+{
+	struct erofs_dentry *d, **news;
+	unsigned int nr = 0, i;
+	int ret;
+
+	news = malloc(erofs_count_children(dir) * sizeof(*news));
+	if (!news)
+		return -ENOMEM;
+
+	list_for_each_entry(d, &dir->i_subdirs, d_child) {
+		struct erofs_inode *inode;
+		char buf[PATH_MAX];
+
+		if (is_dot_dotdot(d->name))
+			continue;
+
+		ret = snprintf(buf, PATH_MAX, "%s/%s",
+			       dir->i_srcpath, d->name);
+		if (ret < 0 || ret >= PATH_MAX) {
+			/* ignore the too long path */
+			goto fail;
+		}
+
+		inode = erofs_iget_from_path(buf, true);
+		if (IS_ERR(inode)) {
+			ret = PTR_ERR(inode);
+			goto err;
+		}
+		d->inode = inode;
+
+		/* a hardlink to the existed inode */
+		if (inode->i_parent) {
+			++inode->i_nlink;
+			continue;
+		}
+		inode->i_parent = dir;
+
+		ret = erofs_mkfs_prepare_data(inode);
+		if (!ret)
+			ret = erofs_settle_child(inode);
+		if (!ret) {
+			news[nr++] = d;
+			continue;
+		}
+err:
+		erofs_err("failed to build %s: %s", buf, erofs_strerror(ret));
+		d->inode = NULL;
+		goto out;
+fail:
+		d->inode = NULL;
+		d->type = EROFS_FT_UNKNOWN;
 	}
-	erofs_write_dir_file(dir);
-	erofs_write_tail_end(dir);
-	return dir;
 
-err_closedir:
-	closedir(_dir);
-	return ERR_PTR(ret);
+	ret = erofs_prepare_inodes_clustered(news, nr);
+	if (ret)
+		goto out;
+	nr = erofs_commit_children_clustered(dir, news, nr, db);
+
+	for (i = 0; i < nr; ++i) {
+		d = news[i];
+		ret = erofs_mkfs_build_dir(d->inode);
+		if (ret)
+			goto out;
+		erofs_d_commit(dir, d, db);
+	}
+out:
+	free(news);
+	return ret;
+}
+
+/* build all children of a directory whose inode has been allocated */
+static int erofs_mkfs_build_dir(struct erofs_inode *dir)
+{
+	struct erofs_dir_blocks db = { NULL };
+	int ret;
+
+	if (cfg.c_cluster_inodes || cfg.c_pack_inodes)
+		ret = erofs_mkfs_build_children_clustered(dir, &db);
+	else
+		ret = erofs_mkfs_build_children(dir, &db);
+	if (!ret)
+		ret = erofs_write_dir_file(dir);
+	if (!ret)
+		ret = erofs_write_tail_end(dir);
+	if (ret) {
+		free(db.blks);
+		return ret;
+	}
+	erofs_dir_blocks_done(dir, &db);
+	return 0;
+}
+
+struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
+{
+	int ret;
+
+	ret = erofs_mkfs_prepare_data(dir);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (!S_ISDIR(dir->i_mode)) {
+		erofs_prepare_inode_buffer(dir);
+		erofs_write_tail_end(dir);
+		return dir;
+	}
+
+	ret = erofs_prepare_inode_buffer(dir);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (IS_ROOT(dir))
+		erofs_fixup_meta_blkaddr(dir);
+
+	ret = erofs_mkfs_build_dir(dir);
+	if (ret)
+		return ERR_PTR(ret);
+	return dir;
 }
 
 struct erofs_inode *erofs_mkfs_build_tree_from_path(struct erofs_inode *parent,
@@ -967,3 +1515,133 @@ struct erofs_inode *erofs_mkfs_build_tree_from_path(struct erofs_inode *parent,
 	return erofs_mkfs_build_tree(inode);
 }
 
+static int erofs_mkfs_write_dir(struct erofs_inode *dir);
+
+static int erofs_mkfs_write_children(struct erofs_inode *dir,
+				     struct erofs_dir_blocks *db)
+{
+	struct erofs_dentry *d;
+	int ret;
+
+	list_for_each_entry(d, &dir->i_subdirs, d_child) {
+		struct erofs_inode *const inode = d->inode;
+
+		if (is_dot_dotdot(d->name)) {
+			erofs_d_commit(dir, d, db);
+			continue;
+		}
+
+		if (S_ISDIR(inode->i_mode)) {
+			struct erofs_inode *ret_inode = erofs_mkfs_write_tree(inode);
+
+			if (IS_ERR(ret_inode))
+				return PTR_ERR(ret_inode);
+		} else if (!inode->i_parent) {
+			inode->i_parent = dir;
+			ret = erofs_prepare_inode_buffer(inode);
+			if (ret)
+				return ret;
+			ret = erofs_write_tail_end(inode);
+			if (ret)
+				return ret;
+		}
+		erofs_d_commit(dir, d, db);
+	}
+	return 0;
+}
+
+static int erofs_mkfs_write_children_clustered(struct erofs_inode *dir,
+					       struct erofs_dir_blocks *db)
+{
+	struct erofs_dentry *d, **news;
+	unsigned int nr = 0, i;
+	int ret = 0;
+
+	news = malloc(erofs_count_children(dir) * sizeof(*news));
+	if (!news)
+		return -ENOMEM;
+
+	list_for_each_entry(d, &dir->i_subdirs, d_child) {
+		struct erofs_inode *const inode = d->inode;
+
+		if (is_dot_dotdot(d->name))
+			continue;
+
+		if (S_ISDIR(inode->i_mode)) {
+			ret = erofs_prepare_dir_file(inode);
+			if (!ret)
+				ret = erofs_settle_child(inode);
+			if (ret)
+				goto out;
+		} else if (!inode->i_parent) {
+			inode->i_parent = dir;
+		} else {
+			continue;
+		}
+		news[nr++] = d;
+	}
+
+	ret = erofs_prepare_inodes_clustered(news, nr);
+	if (ret)
+		goto out;
+	nr = erofs_commit_children_clustered(dir, news, nr, db);
+
+	for (i = 0; i < nr; ++i) {
+		d = news[i];
+		ret = erofs_mkfs_write_dir(d->inode);
+		if (ret)
+			goto out;
+		erofs_d_commit(dir, d, db);
+	}
+out:
+	free(news);
+	return ret;
+}
+
+/* write all children of a directory whose inode has been allocated */
+static int erofs_mkfs_write_dir(struct erofs_inode *dir)
+{
+	struct erofs_dir_blocks db = { NULL };
+	int ret;
+
+	if (cfg.c_cluster_inodes || cfg.c_pack_inodes)
+		ret = erofs_mkfs_write_children_clustered(dir, &db);
+	else
+		ret = erofs_mkfs_write_children(dir, &db);
+	if (!ret)
+		ret = erofs_write_dir_file(dir);
+	if (!ret)
+		ret = erofs_write_tail_end(dir);
+	if (ret) {
+		free(db.blks);
+		return ret;
+	}
+	erofs_dir_blocks_done(dir, &db);
+	return 0;
+}
+
+/*
+ * write out a tree which has been built in memory with the data of all
+ * files written (e.g. from a tar stream), where i_parent of non-directory
+ * inodes is unset until they're written, as for hardlinks above.
+ */
+struct erofs_inode *erofs_mkfs_write_tree(struct erofs_inode *dir)
+{
+	int ret;
+
+	ret = erofs_prepare_dir_file(dir);
+	if (ret)
+		return ERR_PTR(ret);
+
+	ret = erofs_prepare_inode_buffer(dir);
+	if (ret)
+		return ERR_PTR(ret);
+
+	if (IS_ROOT(dir))
+		erofs_fixup_meta_blkaddr(dir);
+
+	ret = erofs_mkfs_write_dir(dir);
+	if (ret)
+		return ERR_PTR(ret);
+	return dir;
+}
@@ -8,8 +8,10 @@
  */
 #define _LARGEFILE64_SOURCE
 #define _GNU_SOURCE
+#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include "erofs/io.h"
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
@@ -20,6 +22,9 @@
 
 #define pr_fmt(fmt) "EROFS IO: " FUNC_LINE_FMT fmt "\n"
 #include "erofs/print.h"
+#include "erofs/blkcsum.h"
+#include "erofs/verity.h"
+#include "erofs/stats.h"
 
 static const char *erofs_devname;
 static int erofs_devfd = -1;
@@ -109,6 +114,55 @@ u64 dev_length(void)
 	return erofs_devsz;
 }
 
+static unsigned int dev_sysfs_optimal_io_size(dev_t dev)
+{
+	/* partitions have no queue/ of their own */
+	static const char *const fmts[] = {
+		"/sys/dev/block/%u:%u/queue/optimal_io_size",
+		"/sys/dev/block/%u:%u/../queue/optimal_io_size",
+	};
+	unsigned int i, ioopt;
+	char path[64];
+
+	for (i = 0; i < ARRAY_SIZE(fmts); ++i) {
+		FILE *f;
+		int ret;
+
+		snprintf(path, sizeof(path), fmts[i], major(dev), minor(dev));
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		ret = fscanf(f, "%u", &ioopt);
+		fclose(f);
+		if (ret == 1)
+			return ioopt;
+	}
+	return 0;
+}
+
+/*
+ * the optimal I/O size in bytes of the device which the image is written to,
+ * or of the device under the filesystem of an image file; 0 if unknown.
+ */
+unsigned int dev_optimal_io_size(void)
+{
+	struct stat st;
+
+	if (fstat(erofs_devfd, &st))
+		return 0;
+
+	if (S_ISBLK(st.st_mode)) {
+#ifdef BLKIOOPT
+		unsigned int ioopt;
+
+		if (ioctl(erofs_devfd, BLKIOOPT, &ioopt) >= 0)
+			return ioopt;
+#endif
+		return dev_sysfs_optimal_io_size(st.st_rdev);
+	}
+	return dev_sysfs_optimal_io_size(st.st_dev);
+}
+
 int dev_write(const void *buf, u64 offset, size_t len)
 {
 	int ret;
@@ -128,6 +182,8 @@ int dev_write(const void *buf, u64 offset, size_t len)
 		return -EINVAL;
 	}
 
+	erofs_stat_add(EROFS_STAT_DEV_WRITES, 1);
+	erofs_stat_add(EROFS_STAT_DEV_WRITE_BYTES, len);
 	ret = pwrite64(erofs_devfd, buf, len, (off64_t)offset);
 	if (ret != (int)len) {
 		if (ret < 0) {
@@ -140,12 +196,17 @@ int dev_write(const void *buf, u64 offset, size_t len)
 			  erofs_devname, offset, len);
 		return -ERANGE;
 	}
+
+	if (erofs_blkcsum_enabled)
+		erofs_blkcsum_update(buf, offset, len);
+	if (erofs_verity_enabled)
+		erofs_verity_update(buf, offset, len);
 	return 0;
 }
 
 int dev_fillzero(u64 offset, size_t len, bool padding)
 {
-	static const char zero[EROFS_BLKSIZ] = {0};
+	static const char zero[EROFS_MAX_BLOCK_SIZE] = {0};
 	int ret;
 
 	if (cfg.c_dry_run)
@@ -153,8 +214,13 @@ int dev_fillzero(u64 offset, size_t len, bool padding)
 
 #if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
 	if (!padding && fallocate(erofs_devfd, FALLOC_FL_PUNCH_HOLE |
-				  FALLOC_FL_KEEP_SIZE, offset, len) >= 0)
+				  FALLOC_FL_KEEP_SIZE, offset, len) >= 0) {
+		if (erofs_blkcsum_enabled)
+			erofs_blkcsum_update(NULL, offset, len);
+		if (erofs_verity_enabled)
+			erofs_verity_update(NULL, offset, len);
 		return 0;
+	}
 #endif
 	while (len > EROFS_BLKSIZ) {
 		ret = dev_write(zero, offset, EROFS_BLKSIZ);
@@ -234,3 +300,23 @@ int dev_read(void *buf, u64 offset, size_t len)
 	}
 	return 0;
 }
+
+/* read() as much as asked unless EOF or an error, which matters for pipes */
+ssize_t erofs_read_fully(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = read(fd, (char *)buf + done, len - done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (!ret)
+			break;
+		done += ret;
+	}
+	return done;
+}
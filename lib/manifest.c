@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/manifest.c
+ *
+ * Build the inode tree from a manifest, which lists every path with all of
+ * its metadata, instead of a directory walk.  Nothing but the contents of
+ * regular files is read from the host, and each file is written as soon as
+ * its entry is parsed.
+ *
+ * Each line is a path followed by "keyword=value" pairs, e.g.
+ *	usr/bin/sh type=file mode=0755 uid=0 gid=0 contents=out/sh
+ *	dev/null type=char mode=0666 device=1,3
+ *	bin/sh type=link link=/usr/bin/sh
+ *	usr/bin/bash hardlink=usr/bin/sh
+ *	data type=dir mode=0771 uid=1000 xattr.security.selinux=u:r:d:s0
+ * where the path and values can contain "\ooo" octal escapes.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "erofs/print.h"
+#include "erofs/inode.h"
+#include "erofs/io.h"
+#include "erofs/xattr.h"
+#include "erofs/rebuild.h"
+#include "erofs/manifest.h"
+
+struct manifest_entry {
+	char *path;
+	umode_t type, mode;
+	bool has_mode;
+	u64 uid, gid;
+	unsigned int major, minor;
+	bool has_device;
+	char *link, *contents, *hardlink;
+	struct list_head xattrs;
+};
+
+static const struct {
+	const char *name;
+	umode_t type;
+} manifest_types[] = {
+	{ "file", S_IFREG },
+	{ "dir", S_IFDIR },
+	{ "link", S_IFLNK },
+	{ "char", S_IFCHR },
+	{ "block", S_IFBLK },
+	{ "fifo", S_IFIFO },
+	{ "socket", S_IFSOCK },
+};
+
+static int manifest_parse_u64(const char *value, int base, u64 *val)
+{
+	char *end;
+
+	if (!*value)
+		return -EINVAL;
+	*val = strtoull(value, &end, base);
+	return *end ? -EINVAL : 0;
+}
+
+static int manifest_parse_keyword(struct manifest_entry *me, char *key)
+{
+	char *value = strchr(key, '=');
+	unsigned int i;
+	int len;
+	u64 v;
+
+	if (!value)
+		return -EINVAL;
+	*value++ = '\0';
+
+	len = erofs_rebuild_unescape(value);
+	if (len < 0)
+		return len;
+
+	if (!strncmp(key, "xattr.", sizeof("xattr.") - 1)) {
+		/* xattrs are dropped later if they are disabled */
+		return erofs_xattr_list_add(&me->xattrs,
+					    key + sizeof("xattr.") - 1,
+					    value, len);
+	}
+	if ((unsigned int)len != strlen(value))
+		return -EINVAL;
+
+	if (!strcmp(key, "type")) {
+		for (i = 0; i < ARRAY_SIZE(manifest_types); ++i) {
+			if (!strcmp(value, manifest_types[i].name)) {
+				me->type = manifest_types[i].type;
+				return 0;
+			}
+		}
+		return -EINVAL;
+	}
+	if (!strcmp(key, "mode")) {
+		if (manifest_parse_u64(value, 8, &v) || v > 07777)
+			return -EINVAL;
+		me->mode = v;
+		me->has_mode = true;
+		return 0;
+	}
+	if (!strcmp(key, "uid"))
+		return manifest_parse_u64(value, 10, &me->uid);
+	if (!strcmp(key, "gid"))
+		return manifest_parse_u64(value, 10, &me->gid);
+	if (!strcmp(key, "device")) {
+		if (sscanf(value, "%u,%u%n", &me->major, &me->minor,
+			   &len) != 2 || value[len])
+			return -EINVAL;
+		me->has_device = true;
+		return 0;
+	}
+	if (!strcmp(key, "link")) {
+		me->link = value;
+		return 0;
+	}
+	if (!strcmp(key, "contents")) {
+		me->contents = value;
+		return 0;
+	}
+	if (!strcmp(key, "hardlink")) {
+		me->hardlink = value;
+		return 0;
+	}
+	/* e.g. time= or sha256digest= of mtree(5), which are meaningless */
+	erofs_dbg("ignore keyword %s of %s", key, me->path);
+	return 0;
+}
+
+static int manifest_parse_line(struct manifest_entry *me, char *line)
+{
+	char *p = line, *tok;
+	int ret;
+
+	tok = strsep(&p, " \t");
+	ret = erofs_rebuild_unescape(tok);
+	if (ret < 0 || (unsigned int)ret != strlen(tok))
+		return -EINVAL;
+	me->path = tok;
+
+	while ((tok = strsep(&p, " \t"))) {
+		if (!*tok)
+			continue;
+		ret = manifest_parse_keyword(me, tok);
+		if (ret)
+			return ret;
+	}
+
+	if (me->hardlink)
+		return 0;
+	if (S_ISLNK(me->type) && !me->link)
+		return -EINVAL;
+	if ((S_ISCHR(me->type) || S_ISBLK(me->type)) && !me->has_device)
+		return -EINVAL;
+	if (!me->has_mode)
+		me->mode = S_ISDIR(me->type) ? 0755 :
+			S_ISLNK(me->type) ? 0777 : 0644;
+	return 0;
+}
+
+/* open the contents of a regular file, which is @path under @srcdir if unset */
+static int manifest_open_contents(struct manifest_entry *me,
+				  const char *srcdir, struct stat64 *st)
+{
+	const char *contents = me->contents ? me->contents : me->path;
+	char buf[PATH_MAX];
+	int fd;
+
+	if (!me->contents && !srcdir) {
+		erofs_err("no contents of %s without a source directory",
+			  me->path);
+		return -EINVAL;
+	}
+	if (srcdir && *contents != '/') {
+		if (snprintf(buf, sizeof(buf), "%s/%s", srcdir, contents) >=
+		    sizeof(buf))
+			return -ENAMETOOLONG;
+		contents = buf;
+	}
+
+	fd = open(contents, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		erofs_err("failed to open %s for %s: %s", contents, me->path,
+			  erofs_strerror(-errno));
+		return -errno;
+	}
+	/* only the size (and mtime for --incremental) is taken from the host */
+	if (fstat64(fd, st) || !S_ISREG(st->st_mode)) {
+		erofs_err("contents %s of %s is not a regular file",
+			  contents, me->path);
+		close(fd);
+		return -EINVAL;
+	}
+	return fd;
+}
+
+static int manifest_write_data(struct manifest_entry *me,
+			       struct erofs_inode *inode, int fd)
+{
+	int ret;
+
+	/* the xattr ibody size is needed to lay out compression indexes */
+	ret = erofs_prepare_xattr_ibody_from_list(inode, &me->xattrs);
+	if (ret < 0)
+		return ret;
+	inode->xattr_isize = ret;
+
+	if (S_ISREG(inode->i_mode))
+		ret = erofs_write_file_from_fd(inode, fd);
+	else if (S_ISLNK(inode->i_mode))
+		ret = erofs_write_file_from_buffer(inode, me->link);
+	else
+		return 0;
+
+	if (ret) {
+		erofs_err("failed to write %s: %s", inode->i_srcpath,
+			  erofs_strerror(ret));
+		return ret;
+	}
+	return erofs_settle_file_data(inode);
+}
+
+static int manifest_add_hardlink(struct erofs_inode *root,
+				 struct erofs_inode *dir, const char *name,
+				 struct manifest_entry *me)
+{
+	struct erofs_inode *inode;
+	struct erofs_dentry *d;
+	char path[PATH_MAX];
+
+	if (strlen(me->hardlink) >= PATH_MAX)
+		return -ENAMETOOLONG;
+	strcpy(path, me->hardlink);
+	if (erofs_rebuild_normalize_path(path))
+		return -EINVAL;
+
+	inode = erofs_rebuild_lookup(root, path);
+	if (IS_ERR(inode)) {
+		/* the target could have been excluded on purpose */
+		if (erofs_rebuild_is_excluded(path))
+			return 0;
+		erofs_err("hardlink target %s of %s is not listed before",
+			  me->hardlink, me->path);
+		return PTR_ERR(inode);
+	}
+	if (S_ISDIR(inode->i_mode)) {
+		erofs_err("hardlink target %s of %s is a directory",
+			  me->hardlink, me->path);
+		return -EISDIR;
+	}
+
+	d = erofs_rebuild_add_dentry(dir, name, inode);
+	if (IS_ERR(d))
+		return PTR_ERR(d);
+	++inode->i_nlink;
+	++inode->i_count;
+	return 0;
+}
+
+static int manifest_add_entry(struct erofs_inode *root,
+			      struct manifest_entry *me, const char *srcdir)
+{
+	struct erofs_inode *dir, *inode;
+	struct erofs_dentry *d;
+	struct stat64 st = {0};
+	const char *name;
+	u64 size = 0;
+	int ret, fd = -1;
+
+	ret = erofs_rebuild_normalize_path(me->path);
+	if (ret)
+		return ret;
+
+	if (*me->path && erofs_rebuild_is_excluded(me->path))
+		return 0;
+
+	dir = erofs_rebuild_lookup_parent(root, me->path, true, &name);
+	if (IS_ERR(dir)) {
+		erofs_err("failed to look up the parent of %s: %s", me->path,
+			  erofs_strerror(PTR_ERR(dir)));
+		return PTR_ERR(dir);
+	}
+
+	d = *name ? erofs_rebuild_find(dir, name, strlen(name)) : NULL;
+	if (!*name || d) {
+		inode = d ? d->inode : root;
+		/* directories could have been created for their children */
+		if (me->hardlink || !S_ISDIR(me->type) ||
+		    !S_ISDIR(inode->i_mode)) {
+			erofs_err("%s appears more than once in the manifest",
+				  *me->path ? me->path : "/");
+			return -EEXIST;
+		}
+		list_del(&inode->i_hash);
+		ret = erofs_rebuild_fill_inode(inode, me->path,
+					       S_IFDIR | me->mode,
+					       me->uid, me->gid, 0, 0);
+		if (ret)
+			return ret;
+		erofs_drop_xattr_ibody(inode);
+		return manifest_write_data(me, inode, -1);
+	}
+
+	if (me->hardlink)
+		return manifest_add_hardlink(root, dir, name, me);
+
+	if (S_ISREG(me->type)) {
+		fd = manifest_open_contents(me, srcdir, &st);
+		if (fd < 0)
+			return fd;
+		size = st.st_size;
+	} else if (S_ISLNK(me->type)) {
+		size = strlen(me->link);
+	}
+
+	inode = erofs_rebuild_new_inode(me->path, me->type | me->mode,
+					me->uid, me->gid, size,
+					makedev(me->major, me->minor));
+	if (IS_ERR(inode)) {
+		ret = PTR_ERR(inode);
+		goto out;
+	}
+	inode->i_mtime = st.st_mtime;
+	inode->i_mtime_nsec = st.st_mtim.tv_nsec;
+
+	d = erofs_rebuild_add_dentry(dir, name, inode);
+	if (IS_ERR(d)) {
+		erofs_iput(inode);
+		ret = PTR_ERR(d);
+		goto out;
+	}
+	if (S_ISDIR(inode->i_mode))
+		inode->i_parent = dir;
+	ret = manifest_write_data(me, inode, fd);
+out:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int manifest_build_tree(FILE *fp, struct erofs_inode *root,
+			       const char *srcdir)
+{
+	struct manifest_entry me;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+	int ret = 0;
+
+	init_list_head(&me.xattrs);
+	while ((len = getline(&line, &n, fp)) >= 0) {
+		char *p = line;
+
+		++lineno;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		p += strspn(p, " \t");
+		if (!*p || *p == '#')
+			continue;
+
+		erofs_xattr_list_free(&me.xattrs);
+		memset(&me, 0, sizeof(me));
+		me.type = S_IFREG;
+		init_list_head(&me.xattrs);
+
+		ret = manifest_parse_line(&me, p);
+		if (ret) {
+			erofs_err("invalid manifest entry at line %u: %s",
+				  lineno, erofs_strerror(ret));
+			break;
+		}
+		ret = manifest_add_entry(root, &me, srcdir);
+		if (ret)
+			break;
+	}
+	if (!ret && ferror(fp)) {
+		erofs_err("failed to read the manifest");
+		ret = -EIO;
+	}
+	erofs_xattr_list_free(&me.xattrs);
+	free(line);
+	return ret;
+}
+
+struct erofs_inode *erofs_mkfs_build_tree_from_manifest(FILE *fp,
+							const char *srcdir)
+{
+	struct erofs_inode *root;
+	int ret;
+
+	root = erofs_rebuild_make_root();
+	if (IS_ERR(root))
+		return root;
+
+	ret = manifest_build_tree(fp, root, srcdir);
+	erofs_rebuild_cleanup();
+	if (ret)
+		return ERR_PTR(ret);
+	return erofs_mkfs_write_tree(root);
+}
+
@@ -0,0 +1,1319 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/reader.c
+ *
+ * Parse EROFS images from userspace: the superblock, compact and extended
+ * inodes, inline and shared xattrs, directories, and both legacy and
+ * compacted compression indexes.  The image is mmap()ed if possible so that
+ * uncompressed data can be accessed in place; otherwise blocks are read
+ * through a bounded LRU cache, which also keeps decompressed pclusters.
+ *
+ * All functions can be called from multiple threads at once, as long as
+ * each erofs_rinode is only released once.
+ */
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "erofs/io.h"
+#include "erofs/xattr.h"
+#include "erofs/print.h"
+#include "erofs/reader.h"
+#ifdef LZ4_ENABLED
+#include <lz4.h>
+#endif
+
+struct erofs_rcache_entry {
+	struct hlist_node node;
+	struct list_head lru;
+	u64 key;
+	unsigned int len;
+	u8 data[];
+};
+
+/* raw blocks and decompressed pclusters are cached apart */
+#define RCACHE_KEY_BLOCK(blkaddr)	((u64)(blkaddr))
+#define RCACHE_KEY_PCLUSTER(blkaddr)	((1ULL << 32) | (blkaddr))
+
+/* decompressed extents larger than this are considered as corrupted */
+#define Z_EROFS_MAX_EXTENT_BLOCKS	256
+
+/* stripe the cache only if each stripe can still hold large pclusters */
+#define RCACHE_MAX_STRIPEBITS		4
+#define RCACHE_MIN_STRIPE_SIZE		(2U << 20)
+
+static int rcache_init(struct erofs_rcache *c, u64 capacity)
+{
+	unsigned int i, j, nr;
+
+	c->capacity = capacity;
+	c->stripebits = 0;
+	while (c->stripebits < RCACHE_MAX_STRIPEBITS &&
+	       (capacity >> (c->stripebits + 1)) >= RCACHE_MIN_STRIPE_SIZE)
+		++c->stripebits;
+	nr = 1U << c->stripebits;
+	capacity >>= c->stripebits;
+	/* about one bucket for each 4KiB cached */
+	c->hashbits = 6;
+	while (c->hashbits < 20 && (capacity >> (12 + c->hashbits)))
+		++c->hashbits;
+
+	c->stripes = calloc(nr, sizeof(*c->stripes));
+	if (!c->stripes)
+		return -ENOMEM;
+	for (i = 0; i < nr; ++i) {
+		struct erofs_rcache_stripe *s = c->stripes + i;
+
+		s->capacity = capacity;
+		init_list_head(&s->lru);
+		s->hash = malloc(sizeof(*s->hash) << c->hashbits);
+		if (!s->hash)
+			return -ENOMEM;
+		for (j = 0; j < 1U << c->hashbits; ++j)
+			INIT_HLIST_HEAD(&s->hash[j]);
+		pthread_mutex_init(&s->lock, NULL);
+	}
+	return 0;
+}
+
+static void rcache_exit(struct erofs_rcache *c)
+{
+	struct erofs_rcache_entry *e, *n;
+	unsigned int i;
+
+	if (!c->stripes)
+		return;
+	for (i = 0; i < 1U << c->stripebits; ++i) {
+		struct erofs_rcache_stripe *s = c->stripes + i;
+
+		if (!s->hash)
+			break;
+		list_for_each_entry_safe(e, n, &s->lru, lru)
+			free(e);
+		free(s->hash);
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(c->stripes);
+	c->stripes = NULL;
+}
+
+/* the stripe of @key, and the bucket in it */
+static struct erofs_rcache_stripe *rcache_stripe(struct erofs_rcache *c,
+						 u64 key,
+						 struct hlist_head **bucket)
+{
+	const u32 hash = hash_64(key, c->stripebits + c->hashbits);
+	struct erofs_rcache_stripe *s = c->stripes + (hash >> c->hashbits);
+
+	*bucket = s->hash + (hash & ((1U << c->hashbits) - 1));
+	return s;
+}
+
+static struct erofs_rcache_entry *rcache_lookup(struct hlist_head *bucket,
+						u64 key)
+{
+	struct erofs_rcache_entry *e;
+
+	hlist_for_each_entry(e, bucket, node)
+		if (e->key == key)
+			return e;
+	return NULL;
+}
+
+/* copy [@off, @off + @len) of the cached @key to @buf if it's cached */
+static bool rcache_read(struct erofs_rcache *c, u64 key, void *buf,
+			unsigned int off, unsigned int len)
+{
+	struct erofs_rcache_stripe *s;
+	struct erofs_rcache_entry *e;
+	struct hlist_head *bucket;
+
+	if (!c->capacity)
+		return false;
+	s = rcache_stripe(c, key, &bucket);
+	pthread_mutex_lock(&s->lock);
+	e = rcache_lookup(bucket, key);
+	if (e) {
+		DBG_BUGON(off + len > e->len);
+		memcpy(buf, e->data + off, len);
+		list_del(&e->lru);
+		list_add(&e->lru, &s->lru);
+		++s->hits;
+	} else {
+		++s->misses;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return e;
+}
+
+static struct erofs_rcache_entry *rcache_alloc(struct erofs_rcache *c,
+					       unsigned int len)
+{
+	struct erofs_rcache_entry *e;
+
+	e = malloc(sizeof(*e) + len);
+	if (e)
+		e->len = len;
+	return e;
+}
+
+/* hand @e over to the cache, which evicts the least recently used ones */
+static void rcache_insert(struct erofs_rcache *c, u64 key,
+			  struct erofs_rcache_entry *e)
+{
+	struct erofs_rcache_entry *victim;
+	struct erofs_rcache_stripe *s;
+	struct hlist_head *bucket;
+
+	s = rcache_stripe(c, key, &bucket);
+	if (e->len > s->capacity) {
+		free(e);
+		return;
+	}
+	e->key = key;
+	pthread_mutex_lock(&s->lock);
+	/* another thread has filled it in the meantime */
+	if (rcache_lookup(bucket, key)) {
+		pthread_mutex_unlock(&s->lock);
+		free(e);
+		return;
+	}
+	hlist_add_head(&e->node, bucket);
+	list_add(&e->lru, &s->lru);
+	s->used += e->len;
+	while (s->used > s->capacity) {
+		victim = list_last_entry(&s->lru, struct erofs_rcache_entry,
+					 lru);
+		hlist_del(&victim->node);
+		list_del(&victim->lru);
+		s->used -= victim->len;
+		free(victim);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void erofs_image_cache_stats(struct erofs_image *img, u64 *hits,
+			     u64 *misses)
+{
+	struct erofs_rcache *c = &img->cache;
+	unsigned int i;
+
+	*hits = *misses = 0;
+	for (i = 0; i < 1U << c->stripebits; ++i) {
+		pthread_mutex_lock(&c->stripes[i].lock);
+		*hits += c->stripes[i].hits;
+		*misses += c->stripes[i].misses;
+		pthread_mutex_unlock(&c->stripes[i].lock);
+	}
+}
+
+static int image_pread(struct erofs_image *img, void *buf, size_t len,
+		       erofs_off_t off)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t ret = pread64(img->fd, (u8 *)buf + done, len - done,
+				      off + done);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO;
+		done += ret;
+	}
+	return 0;
+}
+
+const void *erofs_image_map(struct erofs_image *img, erofs_off_t off,
+			    size_t len)
+{
+	if (!img->map || off > img->size || len > img->size - off)
+		return NULL;
+	return img->map + off;
+}
+
+int erofs_image_read(struct erofs_image *img, void *buf, size_t len,
+		     erofs_off_t off)
+{
+	struct erofs_rcache *c = &img->cache;
+	int ret;
+
+	if (off > img->size || len > img->size - off) {
+		erofs_err("read %zu bytes at %llu beyond the end of image",
+			  len, off | 0ULL);
+		return -EFSCORRUPTED;
+	}
+	if (img->map) {
+		memcpy(buf, img->map + off, len);
+		return 0;
+	}
+	if (!c->capacity)
+		return image_pread(img, buf, len, off);
+
+	while (len) {
+		const erofs_blk_t blkaddr = off >> img->blkszbits;
+		const unsigned int bofs = off & (img->blksz - 1);
+		const unsigned int n = min_t(u64, len, img->blksz - bofs);
+		struct erofs_rcache_entry *e;
+
+		if (!rcache_read(c, RCACHE_KEY_BLOCK(blkaddr), buf, bofs, n)) {
+			const erofs_off_t pos =
+				(erofs_off_t)blkaddr << img->blkszbits;
+			const unsigned int valid =
+				min_t(u64, img->blksz, img->size - pos);
+
+			e = rcache_alloc(c, img->blksz);
+			if (!e)
+				return -ENOMEM;
+			ret = image_pread(img, e->data, valid, pos);
+			if (ret) {
+				free(e);
+				return ret;
+			}
+			memset(e->data + valid, 0, img->blksz - valid);
+			memcpy(buf, e->data + bofs, n);
+			rcache_insert(c, RCACHE_KEY_BLOCK(blkaddr), e);
+		}
+		buf = (u8 *)buf + n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+struct erofs_image *erofs_image_open(const char *path, u64 cache_size,
+				     unsigned int flags)
+{
+	struct erofs_super_block dsb;
+	struct erofs_image *img;
+	off64_t size;
+	int ret;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return ERR_PTR(-ENOMEM);
+
+	img->fd = open(path, O_RDONLY | O_BINARY);
+	if (img->fd < 0) {
+		ret = -errno;
+		erofs_err("failed to open %s: %s", path, erofs_strerror(ret));
+		goto err_free;
+	}
+	/* it works for both image files and block devices */
+	size = lseek64(img->fd, 0, SEEK_END);
+	if (size < 0) {
+		ret = -errno;
+		goto err_close;
+	}
+	img->size = size;
+
+	ret = -EINVAL;
+	if (img->size < EROFS_SUPER_OFFSET + sizeof(dsb)) {
+		erofs_err("%s is too small to be an EROFS image", path);
+		goto err_close;
+	}
+	ret = image_pread(img, &dsb, sizeof(dsb), EROFS_SUPER_OFFSET);
+	if (ret) {
+		erofs_err("failed to read the superblock of %s: %s", path,
+			  erofs_strerror(ret));
+		goto err_close;
+	}
+
+	ret = -EINVAL;
+	if (le32_to_cpu(dsb.magic) != EROFS_SUPER_MAGIC_V1) {
+		erofs_err("%s isn't an EROFS image (magic %08x)", path,
+			  le32_to_cpu(dsb.magic));
+		goto err_close;
+	}
+	img->blkszbits = dsb.blkszbits;
+	if (img->blkszbits < EROFS_DEFAULT_BLKSZBITS ||
+	    img->blkszbits > EROFS_MAX_BLKSZBITS) {
+		erofs_err("unsupported block size bits %u of %s",
+			  img->blkszbits, path);
+		goto err_close;
+	}
+	img->blksz = 1U << img->blkszbits;
+	img->feature_compat = le32_to_cpu(dsb.feature_compat);
+	img->feature_incompat = le32_to_cpu(dsb.feature_incompat);
+	if (img->feature_incompat & ~EROFS_ALL_FEATURE_INCOMPAT) {
+		erofs_err("unsupported incompatible features %x of %s",
+			  img->feature_incompat & ~EROFS_ALL_FEATURE_INCOMPAT,
+			  path);
+		ret = -EOPNOTSUPP;
+		goto err_close;
+	}
+	img->checksum = le32_to_cpu(dsb.checksum);
+	img->root_nid = le16_to_cpu(dsb.root_nid);
+	img->inos = le64_to_cpu(dsb.inos);
+	img->build_time = le64_to_cpu(dsb.build_time);
+	img->build_time_nsec = le32_to_cpu(dsb.build_time_nsec);
+	img->blocks = le32_to_cpu(dsb.blocks);
+	img->meta_blkaddr = le32_to_cpu(dsb.meta_blkaddr);
+	img->xattr_blkaddr = le32_to_cpu(dsb.xattr_blkaddr);
+	memcpy(img->uuid, dsb.uuid, sizeof(img->uuid));
+	memcpy(img->volume_name, dsb.volume_name, sizeof(dsb.volume_name));
+
+	/* e.g. a dm-verity hash tree could follow the filesystem */
+	if (((u64)img->blocks << img->blkszbits) > img->size) {
+		erofs_err("%s is truncated (%llu bytes, %u blocks expected)",
+			  path, img->size | 0ULL, img->blocks);
+		ret = -EFSCORRUPTED;
+		goto err_close;
+	}
+
+	ret = rcache_init(&img->cache, cache_size);
+	if (ret)
+		goto err_close;
+
+	if (!(flags & EROFS_READER_NOMMAP) && img->size == (size_t)img->size) {
+		void *map = mmap(NULL, img->size, PROT_READ, MAP_SHARED,
+				 img->fd, 0);
+
+		if (map != MAP_FAILED)
+			img->map = map;
+		else
+			erofs_dbg("failed to mmap %s, read it instead", path);
+	}
+	return img;
+
+err_close:
+	rcache_exit(&img->cache);
+	close(img->fd);
+err_free:
+	free(img);
+	return ERR_PTR(ret);
+}
+
+void erofs_image_close(struct erofs_image *img)
+{
+	u64 hits, misses;
+
+	erofs_image_cache_stats(img, &hits, &misses);
+	erofs_dbg("block cache: %llu hits, %llu misses", hits | 0ULL,
+		  misses | 0ULL);
+	if (img->map)
+		munmap((void *)img->map, img->size);
+	rcache_exit(&img->cache);
+	close(img->fd);
+	free(img);
+}
+
+static int z_add_head(struct erofs_rinode *vi, unsigned int lcn,
+		      unsigned int type, unsigned int clusterofs,
+		      erofs_blk_t blkaddr)
+{
+	const erofs_off_t lstart =
+		((erofs_off_t)lcn << vi->img->blkszbits) + clusterofs;
+	struct erofs_rextent *e = vi->extents + vi->nr_extents;
+
+	if (type == Z_EROFS_VLE_CLUSTER_TYPE_RESERVED) {
+		erofs_err("unknown lcluster type of nid %llu lcn %u",
+			  vi->nid | 0ULL, lcn);
+		return -EOPNOTSUPP;
+	}
+	if (clusterofs >= vi->img->blksz ||
+	    (!vi->nr_extents && lstart) ||
+	    (vi->nr_extents && lstart <= e[-1].lstart)) {
+		erofs_err("bogus clusterofs %u of nid %llu lcn %u",
+			  clusterofs, vi->nid | 0ULL, lcn);
+		return -EFSCORRUPTED;
+	}
+	/* the last lcluster could be ended exactly by the previous extent */
+	if (lstart >= vi->i_size)
+		return 0;
+	*e = (struct erofs_rextent) {
+		.lstart = lstart,
+		.blkaddr = blkaddr,
+		.type = type,
+	};
+	++vi->nr_extents;
+	return 0;
+}
+
+static int z_load_legacy_indexes(struct erofs_rinode *vi, const u8 *in,
+				 unsigned int totalidx)
+{
+	const struct z_erofs_vle_decompressed_index *di = (const void *)in;
+	unsigned int lcn;
+	int ret;
+
+	for (lcn = 0; lcn < totalidx; ++lcn, ++di) {
+		const unsigned int type = (le16_to_cpu(di->di_advise) >>
+				Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
+			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
+
+		if (type == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD)
+			continue;
+		ret = z_add_head(vi, lcn, type,
+				 le16_to_cpu(di->di_clusterofs),
+				 le32_to_cpu(di->di_u.blkaddr));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * a pack of @vcnt compacted indexes of @vcnt * @unit bytes, each of which
+ * is encoded in (lclusterbits + 2) bits, followed by the blkaddr before the
+ * first head lcluster; the pclusters of heads are consecutive.
+ */
+static int z_unpack_compacted(struct erofs_rinode *vi, const u8 *in,
+			      unsigned int vcnt, unsigned int unit,
+			      unsigned int lcn, unsigned int cnt)
+{
+	const unsigned int lclusterbits = vi->img->blkszbits;
+	const unsigned int encodebits = (vcnt * unit * 8 - 32) / vcnt;
+	const u8 *blk = in + vcnt * unit - 4;
+	erofs_blk_t blkaddr = blk[0] | blk[1] << 8 | blk[2] << 16 |
+		(u32)blk[3] << 24;
+	unsigned int i, pos;
+	int ret;
+
+	for (i = 0, pos = 0; i < cnt; ++i, pos += encodebits) {
+		const u8 *p = in + pos / 8;
+		const unsigned int v = (p[0] | p[1] << 8 | p[2] << 16) >>
+			(pos & 7);
+		const unsigned int type = (v >> lclusterbits) &
+			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
+
+		if (type == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD)
+			continue;
+		ret = z_add_head(vi, lcn + i, type,
+				 v & ((1 << lclusterbits) - 1), ++blkaddr);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int z_load_compacted_indexes(struct erofs_rinode *vi, const u8 *in,
+				    unsigned int totalidx,
+				    unsigned int initial, unsigned int c2)
+{
+	unsigned int lcn = 0, vcnt, unit;
+	int ret;
+
+	while (lcn < totalidx) {
+		if (lcn >= initial && lcn - initial < c2) {
+			vcnt = 16;
+			unit = 2;
+		} else {
+			vcnt = 2;
+			unit = 4;
+		}
+		ret = z_unpack_compacted(vi, in, vcnt, unit, lcn,
+					 min(vcnt, totalidx - lcn));
+		if (ret)
+			return ret;
+		in += vcnt * unit;
+		lcn += vcnt;
+	}
+	return 0;
+}
+
+static int z_load_extents(struct erofs_rinode *vi)
+{
+	struct erofs_image *img = vi->img;
+	const erofs_off_t hpos = round_up(vi->iloc + vi->inode_isize +
+					  vi->xattr_isize, 8);
+	const u64 nr = DIV_ROUND_UP(vi->i_size, img->blksz);
+	unsigned int totalidx = nr, initial = 0, c2 = 0, i;
+	struct z_erofs_map_header h;
+	erofs_off_t pos;
+	size_t size;
+	u8 *in;
+	int ret;
+
+	if (nr != totalidx)
+		return -EFSCORRUPTED;
+	ret = erofs_image_read(img, &h, sizeof(h), hpos);
+	if (ret)
+		return ret;
+
+	if (vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY) {
+		/* the legacy map header is unused, lclusters are blocks */
+		pos = hpos + sizeof(h) + Z_EROFS_VLE_LEGACY_HEADER_PADDING;
+		size = (size_t)totalidx *
+			sizeof(struct z_erofs_vle_decompressed_index);
+	} else {
+		vi->z_advise = le16_to_cpu(h.h_advise);
+		vi->z_algorithmtype = h.h_algorithmtype;
+		if ((h.h_clusterbits & 7) + 12 != img->blkszbits ||
+		    h.h_clusterbits >> 3) {
+			erofs_err("unsupported clusterbits %x of nid %llu",
+				  h.h_clusterbits, vi->nid | 0ULL);
+			return -EOPNOTSUPP;
+		}
+		pos = hpos + sizeof(h);
+		/* 2B packs are too small for lclusters larger than 4KiB */
+		if (vi->z_advise & Z_EROFS_ADVISE_COMPACTED_2B) {
+			if (img->blkszbits != 12)
+				return -EOPNOTSUPP;
+			initial = (32 - pos % 32) / 4;
+			if (initial == 32 / 4)
+				initial = 0;
+			initial = min(initial, totalidx);
+			c2 = rounddown(totalidx - initial, 16);
+		} else if (img->blkszbits + 2 > 16) {
+			return -EOPNOTSUPP;
+		}
+		size = (size_t)DIV_ROUND_UP(initial, 2) * 8 + c2 * 2 +
+			(size_t)DIV_ROUND_UP(totalidx - initial - c2, 2) * 8;
+	}
+
+	if ((vi->z_algorithmtype & 0xf) != Z_EROFS_COMPRESSION_LZ4) {
+		erofs_err("unsupported algorithm %u of nid %llu",
+			  vi->z_algorithmtype & 0xf, vi->nid | 0ULL);
+		return -EOPNOTSUPP;
+	}
+
+	in = malloc(size);
+	vi->extents = malloc(sizeof(*vi->extents) * max(totalidx, 1U));
+	if (!in || !vi->extents) {
+		free(in);
+		return -ENOMEM;
+	}
+	vi->z_idxsize = pos + size - hpos;
+	ret = erofs_image_read(img, in, size, pos);
+	if (!ret) {
+		if (vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY)
+			ret = z_load_legacy_indexes(vi, in, totalidx);
+		else
+			ret = z_load_compacted_indexes(vi, in, totalidx,
+						       initial, c2);
+	}
+	free(in);
+	if (ret)
+		return ret;
+
+	if (vi->i_size && !vi->nr_extents)
+		return -EFSCORRUPTED;
+	for (i = 0; i < vi->nr_extents; ++i) {
+		const unsigned int len = erofs_extent_length(vi, i);
+
+		if ((vi->extents[i].type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN &&
+		     len > img->blksz) ||
+		    len > Z_EROFS_MAX_EXTENT_BLOCKS * img->blksz) {
+			erofs_err("bogus extent %u of nid %llu (%u bytes)",
+				  i, vi->nid | 0ULL, len);
+			return -EFSCORRUPTED;
+		}
+	}
+	return 0;
+}
+
+static int erofs_do_read_inode(struct erofs_image *img, erofs_nid_t nid,
+			       struct erofs_rinode *vi, bool data)
+{
+	union {
+		struct erofs_inode_compact c;
+		struct erofs_inode_extended e;
+	} di;
+	unsigned int ifmt;
+	int ret;
+
+	memset(vi, 0, sizeof(*vi));
+	vi->img = img;
+	vi->nid = nid;
+	vi->iloc = ((erofs_off_t)img->meta_blkaddr << img->blkszbits) +
+		(nid << EROFS_ISLOTBITS);
+
+	ret = erofs_image_read(img, &di.c, sizeof(di.c), vi->iloc);
+	if (ret)
+		return ret;
+	ifmt = le16_to_cpu(di.c.i_format);
+	vi->datalayout = (ifmt >> EROFS_I_DATALAYOUT_BIT) &
+		((1 << EROFS_I_DATALAYOUT_BITS) - 1);
+	if (vi->datalayout >= EROFS_INODE_DATALAYOUT_MAX) {
+		erofs_err("unsupported datalayout %u of nid %llu",
+			  vi->datalayout, nid | 0ULL);
+		return -EOPNOTSUPP;
+	}
+	vi->xattr_isize = erofs_xattr_ibody_size(di.c.i_xattr_icount);
+	vi->i_mode = le16_to_cpu(di.c.i_mode);
+
+	switch ((ifmt >> EROFS_I_VERSION_BIT) &
+		((1 << EROFS_I_VERSION_BITS) - 1)) {
+	case EROFS_INODE_LAYOUT_EXTENDED:
+		vi->inode_isize = sizeof(di.e);
+		ret = erofs_image_read(img, (u8 *)&di.e + sizeof(di.c),
+				       sizeof(di.e) - sizeof(di.c),
+				       vi->iloc + sizeof(di.c));
+		if (ret)
+			return ret;
+		vi->i_size = le64_to_cpu(di.e.i_size);
+		vi->u.i_blkaddr = le32_to_cpu(di.e.i_u.raw_blkaddr);
+		vi->i_ino = le32_to_cpu(di.e.i_ino);
+		vi->i_uid = le32_to_cpu(di.e.i_uid);
+		vi->i_gid = le32_to_cpu(di.e.i_gid);
+		vi->i_mtime = le64_to_cpu(di.e.i_ctime);
+		vi->i_mtime_nsec = le32_to_cpu(di.e.i_ctime_nsec);
+		vi->i_nlink = le32_to_cpu(di.e.i_nlink);
+		break;
+	default:
+		vi->inode_isize = sizeof(di.c);
+		vi->i_size = le32_to_cpu(di.c.i_size);
+		vi->u.i_blkaddr = le32_to_cpu(di.c.i_u.raw_blkaddr);
+		vi->i_ino = le32_to_cpu(di.c.i_ino);
+		vi->i_uid = le16_to_cpu(di.c.i_uid);
+		vi->i_gid = le16_to_cpu(di.c.i_gid);
+		vi->i_mtime = img->build_time;
+		vi->i_mtime_nsec = img->build_time_nsec;
+		vi->i_nlink = le16_to_cpu(di.c.i_nlink);
+		break;
+	}
+
+	switch (vi->i_mode & S_IFMT) {
+	case S_IFREG:
+	case S_IFDIR:
+	case S_IFLNK:
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+	case S_IFSOCK:
+		vi->i_size = 0;
+		return 0;
+	default:
+		erofs_err("bogus i_mode %o of nid %llu", vi->i_mode,
+			  nid | 0ULL);
+		return -EFSCORRUPTED;
+	}
+
+	if (vi->datalayout == EROFS_INODE_FLAT_INLINE) {
+		const unsigned int tail = vi->i_size & (img->blksz - 1);
+		const erofs_off_t ipos = vi->iloc + vi->inode_isize +
+			vi->xattr_isize;
+
+		/* the tail-end data can't cross the block boundary */
+		if ((ipos & (img->blksz - 1)) + tail > img->blksz) {
+			erofs_err("inline data of nid %llu crosses blocks",
+				  nid | 0ULL);
+			return -EFSCORRUPTED;
+		}
+	} else if (erofs_inode_is_data_compressed(vi->datalayout)) {
+		if (S_ISDIR(vi->i_mode)) {
+			erofs_err("compressed directory nid %llu", nid | 0ULL);
+			return -EFSCORRUPTED;
+		}
+		if (!data)
+			return 0;
+		ret = z_load_extents(vi);
+		if (ret)
+			erofs_put_inode(vi);
+	}
+	return ret;
+}
+
+int erofs_read_inode(struct erofs_image *img, erofs_nid_t nid,
+		     struct erofs_rinode *vi)
+{
+	return erofs_do_read_inode(img, nid, vi, true);
+}
+
+/* without compression indexes, which are only needed to read the data */
+int erofs_read_inode_meta(struct erofs_image *img, erofs_nid_t nid,
+			  struct erofs_rinode *vi)
+{
+	return erofs_do_read_inode(img, nid, vi, false);
+}
+
+void erofs_put_inode(struct erofs_rinode *vi)
+{
+	free(vi->extents);
+	vi->extents = NULL;
+	vi->nr_extents = 0;
+}
+
+unsigned int erofs_extent_length(struct erofs_rinode *vi, unsigned int i)
+{
+	const erofs_off_t lend = i + 1 < vi->nr_extents ?
+		vi->extents[i + 1].lstart : vi->i_size;
+
+	return lend - vi->extents[i].lstart;
+}
+
+/* the last extent which starts at or before @off */
+unsigned int erofs_find_extent(struct erofs_rinode *vi, erofs_off_t off)
+{
+	unsigned int lo = 0, hi = vi->nr_extents;
+
+	while (hi - lo > 1) {
+		const unsigned int mid = lo + (hi - lo) / 2;
+
+		if (vi->extents[mid].lstart <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * if @exact, the whole pcluster must decode to exactly @outlen bytes, which
+ * can only be checked if compressed data is 0padded.
+ */
+static int z_decompress(struct erofs_rinode *vi, unsigned int i, void *out,
+			unsigned int outlen, bool exact)
+{
+#ifdef LZ4_ENABLED
+	struct erofs_image *img = vi->img;
+	const erofs_off_t pos =
+		(erofs_off_t)vi->extents[i].blkaddr << img->blkszbits;
+	const u8 *src = erofs_image_map(img, pos, img->blksz);
+	unsigned int srcsize = img->blksz;
+	u8 *buf = NULL;
+	int ret;
+
+	if (!src) {
+		buf = malloc(img->blksz);
+		if (!buf)
+			return -ENOMEM;
+		ret = erofs_image_read(img, buf, img->blksz, pos);
+		if (ret) {
+			free(buf);
+			return ret;
+		}
+		src = buf;
+	}
+	/* compressed data is aligned to the end of pcluster by 0padding */
+	if (img->feature_incompat & EROFS_FEATURE_INCOMPAT_LZ4_0PADDING) {
+		while (srcsize && !*src) {
+			++src;
+			--srcsize;
+		}
+	}
+	if (exact && (img->feature_incompat &
+		      EROFS_FEATURE_INCOMPAT_LZ4_0PADDING))
+		ret = LZ4_decompress_safe((const char *)src, out, srcsize,
+					  outlen);
+	else
+		ret = LZ4_decompress_safe_partial((const char *)src, out,
+						  srcsize, outlen, outlen);
+	free(buf);
+	if (ret != (int)outlen) {
+		erofs_err("failed to decompress pcluster %u of nid %llu: %d",
+			  vi->extents[i].blkaddr, vi->nid | 0ULL, ret);
+		return -EFSCORRUPTED;
+	}
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+int erofs_read_extent(struct erofs_rinode *vi, unsigned int i, void *buf)
+{
+	const unsigned int len = erofs_extent_length(vi, i);
+
+	if (vi->extents[i].type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN)
+		return erofs_image_read(vi->img, buf, len,
+					(erofs_off_t)vi->extents[i].blkaddr <<
+					vi->img->blkszbits);
+	return z_decompress(vi, i, buf, len, false);
+}
+
+/* read extent @i like erofs_read_extent(), but reject any trailing data */
+int erofs_verify_extent(struct erofs_rinode *vi, unsigned int i, void *buf)
+{
+	const unsigned int len = erofs_extent_length(vi, i);
+
+	if (vi->extents[i].type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN)
+		return erofs_read_extent(vi, i, buf);
+	return z_decompress(vi, i, buf, len, true);
+}
+
+/* read [@off, @off + @len) of extent @i through the pcluster cache */
+static int z_read_cached(struct erofs_rinode *vi, unsigned int i, void *buf,
+			 unsigned int off, unsigned int len)
+{
+	struct erofs_rcache *c = &vi->img->cache;
+	const u64 key = RCACHE_KEY_PCLUSTER(vi->extents[i].blkaddr);
+	const unsigned int elen = erofs_extent_length(vi, i);
+	struct erofs_rcache_entry *e;
+	int ret;
+
+	if (rcache_read(c, key, buf, off, len))
+		return 0;
+	e = rcache_alloc(c, elen);
+	if (!e)
+		return -ENOMEM;
+	ret = z_decompress(vi, i, e->data, elen, false);
+	if (ret) {
+		free(e);
+		return ret;
+	}
+	memcpy(buf, e->data + off, len);
+	rcache_insert(c, key, e);
+	return 0;
+}
+
+static int z_pread(struct erofs_rinode *vi, void *buf, size_t len,
+		   erofs_off_t off)
+{
+	unsigned int i = erofs_find_extent(vi, off);
+	int ret;
+
+	while (len) {
+		const struct erofs_rextent *e = vi->extents + i;
+		const unsigned int eofs = off - e->lstart;
+		const unsigned int n = min_t(u64, len,
+					erofs_extent_length(vi, i) - eofs);
+
+		if (e->type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN)
+			ret = erofs_image_read(vi->img, buf, n,
+				((erofs_off_t)e->blkaddr <<
+				 vi->img->blkszbits) + eofs);
+		else
+			ret = z_read_cached(vi, i, buf, eofs, n);
+		if (ret)
+			return ret;
+		buf = (u8 *)buf + n;
+		off += n;
+		len -= n;
+		++i;
+	}
+	return 0;
+}
+
+/* where the uncompressed data at @off is, and how long it's contiguous */
+static erofs_off_t erofs_map_plain(struct erofs_rinode *vi, erofs_off_t off,
+				   size_t *len)
+{
+	struct erofs_image *img = vi->img;
+	erofs_off_t tailstart;
+
+	if (vi->datalayout == EROFS_INODE_FLAT_INLINE) {
+		tailstart = round_down(vi->i_size, img->blksz);
+		if (off >= tailstart)
+			return vi->iloc + vi->inode_isize + vi->xattr_isize +
+				off - tailstart;
+		*len = min_t(u64, *len, tailstart - off);
+	}
+	return ((erofs_off_t)vi->u.i_blkaddr << img->blkszbits) + off;
+}
+
+ssize_t erofs_pread(struct erofs_rinode *vi, void *buf, size_t len,
+		    erofs_off_t off)
+{
+	size_t done = 0;
+	int ret;
+
+	if (off >= vi->i_size)
+		return 0;
+	len = min_t(u64, len, vi->i_size - off);
+
+	if (erofs_inode_is_data_compressed(vi->datalayout)) {
+		if (!vi->extents)
+			return -EINVAL;
+		ret = z_pread(vi, buf, len, off);
+		return ret ? ret : (ssize_t)len;
+	}
+
+	while (done < len) {
+		size_t n = len - done;
+		const erofs_off_t pos = erofs_map_plain(vi, off + done, &n);
+
+		ret = erofs_image_read(vi->img, (u8 *)buf + done, n, pos);
+		if (ret)
+			return ret;
+		done += n;
+	}
+	return len;
+}
+
+ssize_t erofs_map_data(struct erofs_rinode *vi, erofs_off_t off,
+		       size_t len, const void **ptr)
+{
+	erofs_off_t pos;
+
+	if (!vi->img->map)
+		return -EOPNOTSUPP;
+	if (off >= vi->i_size)
+		return 0;
+	len = min_t(u64, len, vi->i_size - off);
+
+	if (erofs_inode_is_data_compressed(vi->datalayout)) {
+		unsigned int i, eofs;
+		const struct erofs_rextent *e;
+
+		if (!vi->extents)
+			return -EINVAL;
+		i = erofs_find_extent(vi, off);
+		e = vi->extents + i;
+		eofs = off - e->lstart;
+		if (e->type != Z_EROFS_VLE_CLUSTER_TYPE_PLAIN)
+			return -EOPNOTSUPP;
+		len = min_t(u64, len, erofs_extent_length(vi, i) - eofs);
+		pos = ((erofs_off_t)e->blkaddr << vi->img->blkszbits) + eofs;
+	} else {
+		pos = erofs_map_plain(vi, off, &len);
+	}
+	*ptr = erofs_image_map(vi->img, pos, len);
+	return *ptr ? (ssize_t)len : -EFSCORRUPTED;
+}
+
+static int erofs_dirent_get(const u8 *blk, unsigned int size,
+			    unsigned int i, unsigned int n,
+			    struct erofs_rdirent *de)
+{
+	const struct erofs_dirent *d = (const void *)blk;
+	const unsigned int nameoff = le16_to_cpu(d[i].nameoff);
+	const unsigned int end = i + 1 < n ?
+		le16_to_cpu(d[i + 1].nameoff) : size;
+
+	if (nameoff < n * sizeof(*d) || end > size || nameoff >= end)
+		return -EFSCORRUPTED;
+	de->name = (const char *)blk + nameoff;
+	/* the name of the last dirent could be padded with '\0' */
+	de->namelen = strnlen(de->name, end - nameoff);
+	if (!de->namelen || de->namelen > EROFS_NAME_LEN)
+		return -EFSCORRUPTED;
+	de->nid = le64_to_cpu(d[i].nid);
+	de->file_type = d[i].file_type;
+	return 0;
+}
+
+/* read directory block @lblk and return the number of dirents in it */
+static int erofs_read_dirblk(struct erofs_rinode *dir, erofs_blk_t lblk,
+			     u8 *blk, unsigned int *size)
+{
+	const erofs_off_t off = (erofs_off_t)lblk << dir->img->blkszbits;
+	const struct erofs_dirent *d = (const void *)blk;
+	unsigned int nameoff;
+	ssize_t ret;
+
+	*size = min_t(u64, dir->img->blksz, dir->i_size - off);
+	ret = erofs_pread(dir, blk, *size, off);
+	if (ret < 0)
+		return ret;
+	if (*size < sizeof(*d))
+		goto corrupted;
+	nameoff = le16_to_cpu(d->nameoff);
+	if (nameoff < sizeof(*d) || nameoff >= *size ||
+	    nameoff % sizeof(*d))
+		goto corrupted;
+	return nameoff / sizeof(*d);
+corrupted:
+	erofs_err("bogus directory block %u of nid %llu", lblk,
+		  dir->nid | 0ULL);
+	return -EFSCORRUPTED;
+}
+
+int erofs_readdir(struct erofs_rinode *dir, u64 pos, erofs_readdir_t cb,
+		  void *arg)
+{
+	const erofs_blk_t nblocks = DIV_ROUND_UP(dir->i_size, dir->img->blksz);
+	struct erofs_rdirent de;
+	unsigned int size, i;
+	erofs_blk_t lblk;
+	u64 idx = 0;
+	int n, ret = 0;
+	u8 *blk;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	blk = malloc(dir->img->blksz);
+	if (!blk)
+		return -ENOMEM;
+
+	for (lblk = 0; lblk < nblocks && !ret; ++lblk) {
+		n = erofs_read_dirblk(dir, lblk, blk, &size);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		if (idx + n <= pos) {
+			idx += n;
+			continue;
+		}
+		for (i = 0; i < (unsigned int)n; ++i, ++idx) {
+			if (idx < pos)
+				continue;
+			ret = erofs_dirent_get(blk, size, i, n, &de);
+			if (ret) {
+				erofs_err("bogus dirent %u in block %u of nid %llu",
+					  i, lblk, dir->nid | 0ULL);
+				break;
+			}
+			de.pos = idx;
+			de.off = ((erofs_off_t)lblk << dir->img->blkszbits) +
+				i * sizeof(struct erofs_dirent);
+			ret = cb(arg, &de);
+			if (ret)
+				break;
+		}
+	}
+	free(blk);
+	return ret;
+}
+
+static int erofs_namecmp(const char *a, unsigned int alen,
+			 const struct erofs_rdirent *de)
+{
+	int ret = memcmp(a, de->name, min(alen, de->namelen));
+
+	if (ret)
+		return ret;
+	return alen < de->namelen ? -1 : alen > de->namelen;
+}
+
+/* dirents are sorted by name across blocks, so search binarily */
+int erofs_namei(struct erofs_rinode *dir, const char *name,
+		unsigned int namelen, erofs_nid_t *nid, u8 *file_type)
+{
+	erofs_blk_t lo = 0, hi = DIV_ROUND_UP(dir->i_size, dir->img->blksz);
+	struct erofs_rdirent de;
+	int n, ret = -ENOENT;
+	unsigned int size;
+	u8 *blk;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	blk = malloc(dir->img->blksz);
+	if (!blk)
+		return -ENOMEM;
+
+	while (lo < hi) {
+		const erofs_blk_t mid = lo + (hi - lo) / 2;
+		unsigned int l = 0, h;
+		int cmp;
+
+		n = erofs_read_dirblk(dir, mid, blk, &size);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		h = n;
+		while (l < h) {
+			const unsigned int m = l + (h - l) / 2;
+
+			ret = erofs_dirent_get(blk, size, m, n, &de);
+			if (ret)
+				goto out;
+			cmp = erofs_namecmp(name, namelen, &de);
+			if (!cmp) {
+				*nid = de.nid;
+				if (file_type)
+					*file_type = de.file_type;
+				ret = 0;
+				goto out;
+			}
+			if (cmp < 0)
+				h = m;
+			else
+				l = m + 1;
+		}
+		ret = -ENOENT;
+		/* not in this block, and which side it could be in */
+		if (!l)
+			hi = mid;
+		else if (l == (unsigned int)n)
+			lo = mid + 1;
+		else
+			break;
+	}
+out:
+	free(blk);
+	return ret;
+}
+
+int erofs_ilookup(struct erofs_image *img, const char *path,
+		  struct erofs_rinode *vi)
+{
+	erofs_nid_t nid = img->root_nid;
+	int ret;
+
+	while (1) {
+		unsigned int len;
+
+		path += strspn(path, "/");
+		if (!*path)
+			return erofs_read_inode(img, nid, vi);
+		ret = erofs_read_inode_meta(img, nid, vi);
+		if (ret)
+			return ret;
+		len = strcspn(path, "/");
+		ret = erofs_namei(vi, path, len, &nid, NULL);
+		erofs_put_inode(vi);
+		if (ret)
+			return ret;
+		path += len;
+	}
+}
+
+static const char *xattr_prefixes[] = {
+	[EROFS_XATTR_INDEX_USER] = XATTR_USER_PREFIX,
+	[EROFS_XATTR_INDEX_POSIX_ACL_ACCESS] = XATTR_NAME_POSIX_ACL_ACCESS,
+	[EROFS_XATTR_INDEX_POSIX_ACL_DEFAULT] = XATTR_NAME_POSIX_ACL_DEFAULT,
+	[EROFS_XATTR_INDEX_TRUSTED] = XATTR_TRUSTED_PREFIX,
+	[EROFS_XATTR_INDEX_LUSTRE] = "lustre.",
+	[EROFS_XATTR_INDEX_SECURITY] = XATTR_SECURITY_PREFIX,
+};
+
+/* @entry is followed by its name and value of @avail bytes */
+static int erofs_xattr_emit(struct erofs_rinode *vi, const u8 *entry,
+			    unsigned int avail, bool shared,
+			    erofs_xattr_iter_t cb, void *arg)
+{
+	const struct erofs_xattr_entry *e = (const void *)entry;
+	const unsigned int vsize = le16_to_cpu(e->e_value_size);
+	char name[EROFS_NAME_LEN + 32];
+	const char *prefix;
+
+	if (e->e_name_index >= ARRAY_SIZE(xattr_prefixes) ||
+	    !xattr_prefixes[e->e_name_index] ||
+	    e->e_name_len + vsize > avail) {
+		erofs_err("bogus xattr entry of nid %llu", vi->nid | 0ULL);
+		return -EFSCORRUPTED;
+	}
+	prefix = xattr_prefixes[e->e_name_index];
+	snprintf(name, sizeof(name), "%s%.*s", prefix, e->e_name_len,
+		 (const char *)e->e_name);
+	return cb(arg, name, e->e_name + e->e_name_len, vsize, shared);
+}
+
+static int erofs_shared_xattr_emit(struct erofs_rinode *vi, u32 id,
+				   erofs_xattr_iter_t cb, void *arg)
+{
+	struct erofs_image *img = vi->img;
+	const erofs_off_t pos = ((erofs_off_t)img->xattr_blkaddr <<
+				 img->blkszbits) + id * sizeof(u32);
+	struct erofs_xattr_entry e;
+	unsigned int size;
+	u8 *buf;
+	int ret;
+
+	ret = erofs_image_read(img, &e, sizeof(e), pos);
+	if (ret)
+		return ret;
+	size = sizeof(e) + e.e_name_len + le16_to_cpu(e.e_value_size);
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+	ret = erofs_image_read(img, buf, size, pos);
+	if (!ret)
+		ret = erofs_xattr_emit(vi, buf, size - sizeof(e), true,
+				       cb, arg);
+	free(buf);
+	return ret;
+}
+
+int erofs_xattr_iterate(struct erofs_rinode *vi, erofs_xattr_iter_t cb,
+			void *arg)
+{
+	const struct erofs_xattr_ibody_header *ih;
+	unsigned int pos, i;
+	u8 *buf;
+	int ret;
+
+	if (!vi->xattr_isize)
+		return 0;
+	buf = malloc(vi->xattr_isize);
+	if (!buf)
+		return -ENOMEM;
+	ret = erofs_image_read(vi->img, buf, vi->xattr_isize,
+			       vi->iloc + vi->inode_isize);
+	if (ret)
+		goto out;
+
+	ih = (const void *)buf;
+	pos = sizeof(*ih) + ih->h_shared_count * sizeof(u32);
+	if (pos > vi->xattr_isize) {
+		ret = -EFSCORRUPTED;
+		goto out;
+	}
+	for (i = 0; i < ih->h_shared_count && !ret; ++i)
+		ret = erofs_shared_xattr_emit(vi,
+				le32_to_cpu(ih->h_shared_xattrs[i]), cb, arg);
+
+	while (!ret && pos < vi->xattr_isize) {
+		const struct erofs_xattr_entry *e = (const void *)(buf + pos);
+
+		if (pos + sizeof(*e) > vi->xattr_isize) {
+			ret = -EFSCORRUPTED;
+			break;
+		}
+		ret = erofs_xattr_emit(vi, buf + pos,
+				       vi->xattr_isize - pos - sizeof(*e),
+				       false, cb, arg);
+		pos += erofs_xattr_entry_size((struct erofs_xattr_entry *)e);
+	}
+out:
+	if (ret == -EFSCORRUPTED)
+		erofs_err("bogus xattrs of nid %llu", vi->nid | 0ULL);
+	free(buf);
+	return ret;
+}
+
+struct erofs_xattr_buf {
+	const char *name;
+	char *buf;
+	size_t size, len;
+};
+
+static int erofs_listxattr_cb(void *arg, const char *name,
+			      const void *value, unsigned int size,
+			      bool shared)
+{
+	struct erofs_xattr_buf *xb = arg;
+	const size_t len = strlen(name) + 1;
+
+	if (xb->size) {
+		if (xb->len + len > xb->size)
+			return -ERANGE;
+		memcpy(xb->buf + xb->len, name, len);
+	}
+	xb->len += len;
+	return 0;
+}
+
+/* the same as listxattr(2) */
+ssize_t erofs_listxattr(struct erofs_rinode *vi, char *buf, size_t size)
+{
+	struct erofs_xattr_buf xb = { .buf = buf, .size = size };
+	int ret;
+
+	ret = erofs_xattr_iterate(vi, erofs_listxattr_cb, &xb);
+	return ret ? ret : (ssize_t)xb.len;
+}
+
+static int erofs_getxattr_cb(void *arg, const char *name,
+			     const void *value, unsigned int size,
+			     bool shared)
+{
+	struct erofs_xattr_buf *xb = arg;
+
+	if (strcmp(name, xb->name))
+		return 0;
+	if (xb->size) {
+		if (size > xb->size)
+			return -ERANGE;
+		memcpy(xb->buf, value, size);
+	}
+	xb->len = size;
+	return 1;
+}
+
+/* the same as getxattr(2) */
+ssize_t erofs_getxattr(struct erofs_rinode *vi, const char *name,
+		       void *buf, size_t size)
+{
+	struct erofs_xattr_buf xb = {
+		.name = name,
+		.buf = buf,
+		.size = size,
+	};
+	int ret;
+
+	ret = erofs_xattr_iterate(vi, erofs_getxattr_cb, &xb);
+	if (ret < 0)
+		return ret;
+	return ret ? (ssize_t)xb.len : -ENODATA;
+}
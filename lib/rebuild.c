@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/rebuild.c
+ *
+ * Build the inode tree from a list of paths, e.g. tar members or manifest
+ * entries, rather than a directory walk.  Inodes are filled in without any
+ * syscall, and parent directories are created on demand.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "erofs/print.h"
+#include "erofs/inode.h"
+#include "erofs/exclude.h"
+#include "erofs/hashtable.h"
+#include "erofs/rebuild.h"
+
+/* so that entries can be looked up by (parent, name) in O(1) */
+struct erofs_rebuild_dentry {
+	struct hlist_node node;
+	struct erofs_inode *dir;
+	struct erofs_dentry *d;
+};
+
+#define REBUILD_DENTRY_HASHTABLE_BITS	16
+static DEFINE_HASHTABLE(rebuild_dentries, REBUILD_DENTRY_HASHTABLE_BITS);
+
+static ino_t rebuild_ino;
+
+static unsigned long rebuild_dentry_hash(struct erofs_inode *dir,
+					 const char *name, unsigned int len)
+{
+	unsigned long hash = (unsigned long)dir;
+
+	while (len--)
+		hash = hash * 31 + (unsigned char)*name++;
+	return hash;
+}
+
+struct erofs_dentry *erofs_rebuild_find(struct erofs_inode *dir,
+					const char *name, unsigned int len)
+{
+	struct erofs_rebuild_dentry *rd;
+
+	hash_for_each_possible(rebuild_dentries, rd, node,
+			       rebuild_dentry_hash(dir, name, len)) {
+		if (rd->dir == dir && !strncmp(rd->d->name, name, len) &&
+		    !rd->d->name[len])
+			return rd->d;
+	}
+	return NULL;
+}
+
+struct erofs_dentry *erofs_rebuild_add_dentry(struct erofs_inode *dir,
+					      const char *name,
+					      struct erofs_inode *inode)
+{
+	struct erofs_rebuild_dentry *rd = malloc(sizeof(*rd));
+	struct erofs_dentry *d;
+
+	if (!rd)
+		return ERR_PTR(-ENOMEM);
+
+	d = erofs_d_alloc(dir, name);
+	if (IS_ERR(d)) {
+		free(rd);
+		return d;
+	}
+	d->inode = inode;
+	rd->dir = dir;
+	rd->d = d;
+	hash_add(rebuild_dentries, &rd->node,
+		 rebuild_dentry_hash(dir, name, strlen(name)));
+	return d;
+}
+
+void erofs_rebuild_cleanup(void)
+{
+	struct erofs_rebuild_dentry *rd;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	hash_for_each_safe(rebuild_dentries, bkt, tmp, rd, node) {
+		hash_del(&rd->node);
+		free(rd);
+	}
+}
+
+int erofs_rebuild_fill_inode(struct erofs_inode *inode, const char *path,
+			     umode_t mode, u64 uid, u64 gid, u64 size,
+			     dev_t rdev)
+{
+	struct stat64 st = {
+		.st_mode = mode,
+		.st_uid = uid,
+		.st_gid = gid,
+		.st_size = size,
+		.st_rdev = rdev,
+		.st_nlink = 1,
+		.st_ino = ++rebuild_ino,
+	};
+	char buf[PATH_MAX + 1];
+
+	/* i_srcpath is only used for messages, so make it look like one */
+	snprintf(buf, sizeof(buf), *path ? "/%s" : "", path);
+	return erofs_fill_inode(inode, &st, buf);
+}
+
+struct erofs_inode *erofs_rebuild_new_inode(const char *path, umode_t mode,
+					    u64 uid, u64 gid, u64 size,
+					    dev_t rdev)
+{
+	struct erofs_inode *inode = erofs_new_inode();
+	int ret;
+
+	if (IS_ERR(inode))
+		return inode;
+
+	ret = erofs_rebuild_fill_inode(inode, path, mode, uid, gid, size, rdev);
+	if (ret) {
+		erofs_iput(inode);
+		return ERR_PTR(ret);
+	}
+	return inode;
+}
+
+struct erofs_inode *erofs_rebuild_make_root(void)
+{
+	struct erofs_inode *root;
+
+	root = erofs_rebuild_new_inode("", S_IFDIR | 0755, 0, 0, 0, 0);
+	if (!IS_ERR(root))
+		root->i_parent = root;	/* rootdir mark */
+	return root;
+}
+
+/*
+ * normalize @path in place without leading "/" and any "." component, which
+ * is left untouched if it's invalid so that it can still be reported.
+ */
+int erofs_rebuild_normalize_path(char *path)
+{
+	char *p, *e, *q = path;
+
+	for (p = path; *p; p = *e ? e + 1 : e) {
+		unsigned int len;
+
+		e = strchrnul(p, '/');
+		len = e - p;
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			return -EINVAL;
+		if (len > EROFS_NAME_LEN)
+			return -ENAMETOOLONG;
+	}
+
+	for (p = path; *p; p = *e ? e + 1 : e) {
+		unsigned int len;
+
+		e = strchrnul(p, '/');
+		len = e - p;
+		if (!len || (len == 1 && *p == '.'))
+			continue;
+		if (q != path)
+			*q++ = '/';
+		memmove(q, p, len);
+		q += len;
+	}
+	*q = '\0';
+	return 0;
+}
+
+/* decode "\ooo" and "\\" escapes in place, and return the decoded length */
+int erofs_rebuild_unescape(char *s)
+{
+	char *p = s, *q = s;
+
+	while (*p) {
+		if (*p != '\\') {
+			*q++ = *p++;
+			continue;
+		}
+		if (p[1] == '\\') {
+			*q++ = '\\';
+			p += 2;
+		} else if (p[1] >= '0' && p[1] <= '3' &&
+			   p[2] >= '0' && p[2] <= '7' &&
+			   p[3] >= '0' && p[3] <= '7') {
+			*q++ = (p[1] - '0') << 6 | (p[2] - '0') << 3 |
+				(p[3] - '0');
+			p += 4;
+		} else {
+			return -EINVAL;
+		}
+	}
+	*q = '\0';
+	return q - s;
+}
+
+/* return true if the normalized path or any of its parents is excluded */
+bool erofs_rebuild_is_excluded(char *path)
+{
+	char *e = path;
+
+	while ((e = strchr(e, '/'))) {
+		bool excluded;
+
+		*e = '\0';
+		excluded = erofs_is_exclude_path(NULL, path);
+		*e++ = '/';
+		if (excluded)
+			return true;
+	}
+	return erofs_is_exclude_path(NULL, path);
+}
+
+/*
+ * look up the parent directory of the normalized @path, which could be
+ * created with default attributes if @create, and set @name to the last
+ * component ("" for the root directory).
+ */
+struct erofs_inode *erofs_rebuild_lookup_parent(struct erofs_inode *root,
+						char *path, bool create,
+						const char **name)
+{
+	struct erofs_inode *dir = root;
+	char *p = path, *e;
+
+	while ((e = strchr(p, '/'))) {
+		struct erofs_dentry *d = erofs_rebuild_find(dir, p, e - p);
+		struct erofs_inode *inode;
+
+		if (d) {
+			if (!S_ISDIR(d->inode->i_mode))
+				return ERR_PTR(-ENOTDIR);
+			dir = d->inode;
+			p = e + 1;
+			continue;
+		}
+		if (!create)
+			return ERR_PTR(-ENOENT);
+
+		*e = '\0';
+		inode = erofs_rebuild_new_inode(path, S_IFDIR | 0755,
+						0, 0, 0, 0);
+		if (!IS_ERR(inode)) {
+			d = erofs_rebuild_add_dentry(dir, p, inode);
+			if (IS_ERR(d))
+				inode = (void *)d;
+		}
+		*e = '/';
+		if (IS_ERR(inode))
+			return inode;
+		inode->i_parent = dir;
+		dir = inode;
+		p = e + 1;
+	}
+	*name = p;
+	return dir;
+}
+
+struct erofs_inode *erofs_rebuild_lookup(struct erofs_inode *root, char *path)
+{
+	struct erofs_inode *dir;
+	struct erofs_dentry *d;
+	const char *name;
+
+	dir = erofs_rebuild_lookup_parent(root, path, false, &name);
+	if (IS_ERR(dir))
+		return dir;
+	if (!*name)
+		return dir;
+	d = erofs_rebuild_find(dir, name, strlen(name));
+	return d ? d->inode : ERR_PTR(-ENOENT);
+}
+
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/sha256.c
+ *
+ * A straightforward FIPS 180-4 SHA-256 implementation.
+ */
+#include <string.h>
+#include "erofs/sha256.h"
+
+static const u32 K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define Ch(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define Maj(x, y, z)	((((x) | (y)) & (z)) | ((x) & (y)))
+#define Sigma0(x)	(ROR32(x, 2) ^ ROR32(x, 13) ^ ROR32(x, 22))
+#define Sigma1(x)	(ROR32(x, 6) ^ ROR32(x, 11) ^ ROR32(x, 25))
+#define Gamma0(x)	(ROR32(x, 7) ^ ROR32(x, 18) ^ ((x) >> 3))
+#define Gamma1(x)	(ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+
+static inline u32 load_be32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) |
+		((u32)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(u8 *p, u32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void sha256_compress(struct erofs_sha256_state *md, const u8 *buf)
+{
+	u32 S[8], W[64], t0, t1;
+	int i;
+
+	memcpy(S, md->state, sizeof(S));
+
+	for (i = 0; i < 16; i++)
+		W[i] = load_be32(buf + 4 * i);
+	for (i = 16; i < 64; i++)
+		W[i] = Gamma1(W[i - 2]) + W[i - 7] +
+			Gamma0(W[i - 15]) + W[i - 16];
+
+	for (i = 0; i < 64; ++i) {
+		t0 = S[7] + Sigma1(S[4]) + Ch(S[4], S[5], S[6]) + K[i] + W[i];
+		t1 = Sigma0(S[0]) + Maj(S[0], S[1], S[2]);
+		S[7] = S[6];
+		S[6] = S[5];
+		S[5] = S[4];
+		S[4] = S[3] + t0;
+		S[3] = S[2];
+		S[2] = S[1];
+		S[1] = S[0];
+		S[0] = t0 + t1;
+	}
+
+	for (i = 0; i < 8; i++)
+		md->state[i] += S[i];
+}
+
+void erofs_sha256_init(struct erofs_sha256_state *md)
+{
+	md->curlen = 0;
+	md->length = 0;
+	md->state[0] = 0x6A09E667UL;
+	md->state[1] = 0xBB67AE85UL;
+	md->state[2] = 0x3C6EF372UL;
+	md->state[3] = 0xA54FF53AUL;
+	md->state[4] = 0x510E527FUL;
+	md->state[5] = 0x9B05688CUL;
+	md->state[6] = 0x1F83D9ABUL;
+	md->state[7] = 0x5BE0CD19UL;
+}
+
+void erofs_sha256_process(struct erofs_sha256_state *md,
+			  const void *in, size_t inlen)
+{
+	const u8 *p = in;
+
+	while (inlen) {
+		size_t n;
+
+		if (!md->curlen && inlen >= 64) {
+			sha256_compress(md, p);
+			md->length += 64 * 8;
+			p += 64;
+			inlen -= 64;
+			continue;
+		}
+
+		n = min_t(size_t, inlen, 64 - md->curlen);
+		memcpy(md->buf + md->curlen, p, n);
+		md->curlen += n;
+		p += n;
+		inlen -= n;
+		if (md->curlen == 64) {
+			sha256_compress(md, md->buf);
+			md->length += 64 * 8;
+			md->curlen = 0;
+		}
+	}
+}
+
+void erofs_sha256_done(struct erofs_sha256_state *md, u8 *out)
+{
+	int i;
+
+	md->length += md->curlen * 8;
+	md->buf[md->curlen++] = 0x80;
+
+	/* no room for the 64-bit length, pad with zeroes and compress */
+	if (md->curlen > 56) {
+		memset(md->buf + md->curlen, 0, 64 - md->curlen);
+		sha256_compress(md, md->buf);
+		md->curlen = 0;
+	}
+	memset(md->buf + md->curlen, 0, 56 - md->curlen);
+
+	store_be32(md->buf + 56, md->length >> 32);
+	store_be32(md->buf + 60, md->length);
+	sha256_compress(md, md->buf);
+
+	for (i = 0; i < 8; i++)
+		store_be32(out + 4 * i, md->state[i]);
+}
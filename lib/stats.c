@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/stats.c
+ *
+ * Lightweight per-phase timers and counters, which can be dumped as a JSON
+ * report in order to track mkfs performance regressions.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "erofs/print.h"
+#include "erofs/stats.h"
+
+u64 erofs_stats[EROFS_STAT_MAX];
+
+static struct {
+	u64 start;
+	u64 elapsed;
+	unsigned int calls;
+} phases[EROFS_PHASE_MAX];
+
+static const char *phase_names[EROFS_PHASE_MAX] = {
+	[EROFS_PHASE_TOTAL] = "total",
+	[EROFS_PHASE_XATTR_PRESCAN] = "xattr_prescan",
+	[EROFS_PHASE_BUDGET] = "budget",
+	[EROFS_PHASE_HOT_DATA] = "hot_data",
+	[EROFS_PHASE_TREE_WALK] = "tree_walk",
+	[EROFS_PHASE_COMPRESS] = "compress",
+	[EROFS_PHASE_BFLUSH] = "bflush",
+	[EROFS_PHASE_RESIZE] = "resize",
+	[EROFS_PHASE_SB_CHECKSUM] = "sb_checksum",
+	[EROFS_PHASE_VERITY] = "verity",
+	[EROFS_PHASE_BLKCSUM] = "blkcsum",
+};
+
+static const char *stat_names[EROFS_STAT_MAX] = {
+	[EROFS_STAT_BYTES_READ] = "bytes_read",
+	[EROFS_STAT_BYTES_COMPRESSED] = "bytes_compressed",
+	[EROFS_STAT_COMPRESSED_SIZE] = "compressed_size",
+	[EROFS_STAT_PCLUSTERS] = "pclusters",
+	[EROFS_STAT_RAW_PCLUSTERS] = "raw_pclusters",
+	[EROFS_STAT_RAW_FALLBACKS] = "raw_fallbacks",
+	[EROFS_STAT_DEV_WRITES] = "dev_writes",
+	[EROFS_STAT_DEV_WRITE_BYTES] = "dev_write_bytes",
+	[EROFS_STAT_BUFFER_BLOCKS] = "buffer_blocks",
+	[EROFS_STAT_IMAGE_BLOCKS] = "image_blocks",
+	[EROFS_STAT_EARLY_FLUSHES] = "early_flushes",
+	[EROFS_STAT_INDEX_SPILLED] = "index_spilled",
+	[EROFS_STAT_REUSED_FILES] = "reused_files",
+	[EROFS_STAT_REUSED_BLOCKS] = "reused_blocks",
+	[EROFS_STAT_HOT_FILES] = "hot_files",
+	[EROFS_STAT_HOT_BYTES] = "hot_bytes",
+	[EROFS_STAT_HOT_SEQUENTIAL_BYTES] = "hot_sequential_bytes",
+	[EROFS_STAT_HOT_BLOCKS] = "hot_blocks",
+	[EROFS_STAT_DIRS] = "dirs",
+	[EROFS_STAT_DIR_META_BLOCKS] = "dir_meta_blocks",
+	[EROFS_STAT_META_BLOCKS] = "meta_blocks",
+	[EROFS_STAT_ALIGNED_FILES] = "aligned_files",
+	[EROFS_STAT_ALIGN_PADDING_BLOCKS] = "align_padding_blocks",
+};
+
+static u64 stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void erofs_phase_begin(enum erofs_phase phase)
+{
+	phases[phase].start = stats_now();
+}
+
+void erofs_phase_end(enum erofs_phase phase)
+{
+	phases[phase].elapsed += stats_now() - phases[phase].start;
+	++phases[phase].calls;
+}
+
+static double tv_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void erofs_json_write_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; ++s) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+int erofs_stats_report(const char *path, int err)
+{
+	struct rusage ru;
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		erofs_err("failed to open %s for the report", path);
+		return -errno;
+	}
+
+	fprintf(f, "{\n\t\"version\": 1,\n\t\"erofs_version\": ");
+	erofs_json_write_string(f, cfg.c_version);
+	fprintf(f, ",\n\t\"image\": ");
+	erofs_json_write_string(f, cfg.c_img_path);
+	fprintf(f, ",\n\t\"source\": ");
+	erofs_json_write_string(f, cfg.c_tar_path ? cfg.c_tar_path :
+			  cfg.c_manifest_path ? cfg.c_manifest_path :
+			  cfg.c_src_path);
+	fprintf(f, ",\n\t\"compressor\": ");
+	erofs_json_write_string(f, cfg.c_compr_alg_master);
+	fprintf(f, ",\n\t\"compression_level\": %d", cfg.c_compr_level_master);
+	fprintf(f, ",\n\t\"status\": %d", err);
+
+	fprintf(f, ",\n\t\"phases\": {");
+	for (i = 0; i < EROFS_PHASE_MAX; ++i)
+		fprintf(f, "%s\n\t\t\"%s\": { \"seconds\": %.6f, \"calls\": %u }",
+			i ? "," : "", phase_names[i],
+			phases[i].elapsed / 1e9, phases[i].calls);
+
+	fprintf(f, "\n\t},\n\t\"counters\": {");
+	for (i = 0; i < EROFS_STAT_MAX; ++i)
+		fprintf(f, "%s\n\t\t\"%s\": %llu", i ? "," : "",
+			stat_names[i], erofs_stats[i] | 0ULL);
+	fprintf(f, "\n\t}");
+
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(f, ",\n\t\"rusage\": { \"user_seconds\": %.6f, "
+			"\"system_seconds\": %.6f, \"max_rss_kb\": %ld }",
+			tv_seconds(&ru.ru_utime), tv_seconds(&ru.ru_stime),
+			ru.ru_maxrss);
+	fprintf(f, "\n}\n");
+
+	if (fclose(f)) {
+		erofs_err("failed to write the report to %s", path);
+		return -errno;
+	}
+	return 0;
+}
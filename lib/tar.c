@@ -0,0 +1,731 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/tar.c
+ *
+ * Build the inode tree from a tar stream (ustar, GNU or pax), which can be
+ * a pipe, instead of a directory.  The data of each member is written as
+ * soon as its header is parsed, and the whole tree is written at the end.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "erofs/print.h"
+#include "erofs/inode.h"
+#include "erofs/io.h"
+#include "erofs/xattr.h"
+#include "erofs/rebuild.h"
+#include "erofs/tar.h"
+
+#define TAR_BLOCKSIZE		512
+/* an upper bound of extended headers to reject broken archives early */
+#define TAR_MAX_EXTHDR_SIZE	(16 << 20)
+/* files from a pipe up to this size are spooled, see tar_write_file() */
+#define TAR_SPOOL_MAX_SIZE	(1 << 20)
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+/* attributes given by pax extended headers, which override the header */
+struct tar_meta {
+	char *path, *linkpath;
+	u64 size, uid, gid;
+	bool has_size, has_uid, has_gid, sparse;
+	struct list_head xattrs;
+};
+
+struct tar_stream {
+	int fd, spoolfd;
+	bool seekable;
+	erofs_off_t pos;
+	/* GNU long names, and pax headers of the next member ('x') or all ('g') */
+	char *longname, *longlink;
+	struct tar_meta local, global;
+};
+
+/* parse a numeric field in octal, or in GNU base-256 encoding */
+static int tar_parse_num(const char *p, unsigned int len, u64 *val)
+{
+	const char *end = p + len;
+	u64 v = 0;
+
+	if (*p & 0x80) {
+		/* negative numbers are never valid here */
+		if (*p & 0x40)
+			return -ERANGE;
+		v = *p++ & 0x3f;
+		for (; p < end; ++p) {
+			if (v >> 56)
+				return -ERANGE;
+			v = v << 8 | (unsigned char)*p;
+		}
+		*val = v;
+		return 0;
+	}
+
+	while (p < end && *p == ' ')
+		++p;
+	for (; p < end && *p >= '0' && *p <= '7'; ++p) {
+		if (v >> 61)
+			return -ERANGE;
+		v = v << 3 | (*p - '0');
+	}
+	if (p < end && *p != ' ' && *p != '\0')
+		return -EINVAL;
+	*val = v;
+	return 0;
+}
+
+static int tar_read(struct tar_stream *tar, void *buf, unsigned int len)
+{
+	ssize_t ret = erofs_read_fully(tar->fd, buf, len);
+
+	if (ret < 0)
+		return -errno;
+	tar->pos += ret;
+	return ret == len ? 0 : -EIO;
+}
+
+static char tar_buf[16 * TAR_BLOCKSIZE];
+
+static int tar_skip(struct tar_stream *tar, erofs_off_t len)
+{
+
+	if (tar->seekable) {
+		if (lseek(tar->fd, len, SEEK_CUR) < 0)
+			return -errno;
+		tar->pos += len;
+		return 0;
+	}
+
+	while (len) {
+		const unsigned int count = min_t(erofs_off_t, len,
+						 sizeof(tar_buf));
+		int ret = tar_read(tar, tar_buf, count);
+
+		if (ret)
+			return ret;
+		len -= count;
+	}
+	return 0;
+}
+
+/* skip the data of a member which isn't used, and the padding after it */
+static int tar_skip_data(struct tar_stream *tar, u64 size)
+{
+	return tar_skip(tar, round_up(size, TAR_BLOCKSIZE));
+}
+
+/* read the next header, and return 1 at the end of the archive */
+static int tar_read_header(struct tar_stream *tar, struct tar_header *th)
+{
+	const u8 *p = (const u8 *)th;
+	u64 chksum, sum = 0;
+	s64 ssum = 0;
+	unsigned int i;
+	int ret;
+
+	ret = tar_read(tar, th, TAR_BLOCKSIZE);
+	if (ret) {
+		erofs_err("unexpected end of tar stream at %llu",
+			  tar->pos | 0ULL);
+		return ret;
+	}
+
+	for (i = 0; i < TAR_BLOCKSIZE; ++i)
+		if (p[i])
+			break;
+	if (i >= TAR_BLOCKSIZE)
+		return 1;
+
+	/* the checksum is calculated as if the field were all spaces */
+	for (i = 0; i < TAR_BLOCKSIZE; ++i) {
+		const bool c = i >= offsetof(struct tar_header, chksum) &&
+			i < offsetof(struct tar_header, typeflag);
+
+		sum += c ? ' ' : p[i];
+		ssum += c ? ' ' : (signed char)p[i];
+	}
+	if (tar_parse_num(th->chksum, sizeof(th->chksum), &chksum) ||
+	    (chksum != sum && chksum != (u64)ssum)) {
+		erofs_err("invalid tar header at %llu",
+			  (tar->pos - TAR_BLOCKSIZE) | 0ULL);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void tar_reset_meta(struct tar_meta *meta)
+{
+	free(meta->path);
+	free(meta->linkpath);
+	meta->path = meta->linkpath = NULL;
+	meta->has_size = meta->has_uid = meta->has_gid = false;
+	meta->sparse = false;
+	erofs_xattr_list_free(&meta->xattrs);
+}
+
+static int tar_parse_pax_num(const char *key, const char *value, u64 *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(value, &end, 10);
+	if (errno || end == value || *end) {
+		erofs_err("invalid pax record %s=%s", key, value);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* parse "%d %s=%s\n" records of a pax extended header */
+static int tar_parse_pax(struct tar_meta *meta, char *buf, unsigned int size,
+			 bool global)
+{
+	char *p = buf, *const end = buf + size;
+	int ret;
+
+	while (p < end && *p) {
+		char *key, *value, *rec_end;
+		unsigned long len;
+		unsigned int vlen;
+
+		len = strtoul(p, &key, 10);
+		if (key == p || *key != ' ' || len > end - p ||
+		    key + 1 >= p + len || p[len - 1] != '\n')
+			goto err;
+		rec_end = p + len - 1;
+		++key;
+		value = memchr(key, '=', rec_end - key);
+		if (!value)
+			goto err;
+		*value++ = '\0';
+		vlen = rec_end - value;
+		*rec_end = '\0';
+		p += len;
+
+		if (!strncmp(key, "SCHILY.xattr.", 13)) {
+			if (global) {
+				erofs_warn("global xattr %s is ignored", key + 13);
+				continue;
+			}
+			ret = erofs_xattr_list_add(&meta->xattrs, key + 13,
+						   value, vlen);
+			if (ret == -ENODATA) {
+				erofs_warn("unsupported xattr %s is ignored",
+					   key + 13);
+				continue;
+			}
+			if (ret)
+				return ret;
+		} else if (!strcmp(key, "path")) {
+			free(meta->path);
+			meta->path = strdup(value);
+			if (!meta->path)
+				return -ENOMEM;
+		} else if (!strcmp(key, "linkpath")) {
+			free(meta->linkpath);
+			meta->linkpath = strdup(value);
+			if (!meta->linkpath)
+				return -ENOMEM;
+		} else if (!strcmp(key, "size")) {
+			ret = tar_parse_pax_num(key, value, &meta->size);
+			if (ret)
+				return ret;
+			meta->has_size = true;
+		} else if (!strcmp(key, "uid")) {
+			ret = tar_parse_pax_num(key, value, &meta->uid);
+			if (ret)
+				return ret;
+			meta->has_uid = true;
+		} else if (!strcmp(key, "gid")) {
+			ret = tar_parse_pax_num(key, value, &meta->gid);
+			if (ret)
+				return ret;
+			meta->has_gid = true;
+		} else if (!strncmp(key, "GNU.sparse.", 11)) {
+			meta->sparse = true;
+		} else {
+			erofs_dbg("pax record %s is ignored", key);
+		}
+	}
+	return 0;
+err:
+	erofs_err("invalid pax extended header");
+	return -EINVAL;
+}
+
+/* read the data of an extended header including the padding */
+static char *tar_read_exthdr(struct tar_stream *tar, u64 size)
+{
+	char *buf;
+	int ret;
+
+	if (size > TAR_MAX_EXTHDR_SIZE) {
+		erofs_err("too large extended header (%llu bytes) at %llu",
+			  size | 0ULL, tar->pos | 0ULL);
+		return ERR_PTR(-EFBIG);
+	}
+
+	buf = malloc(size + 1);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+	ret = tar_read(tar, buf, size);
+	if (!ret)
+		ret = tar_skip(tar, round_up(size, TAR_BLOCKSIZE) - size);
+	if (ret) {
+		free(buf);
+		return ERR_PTR(ret);
+	}
+	buf[size] = '\0';
+	return buf;
+}
+
+static int tar_replace_longname(struct tar_stream *tar, char **name, u64 size)
+{
+	char *buf = tar_read_exthdr(tar, size);
+
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	free(*name);
+	*name = buf;
+	return 0;
+}
+
+/* copy a header field which isn't always NUL-terminated */
+static void tar_copy_field(char *dst, const char *src, unsigned int len)
+{
+	len = strnlen(src, len);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+static int tar_get_path(struct tar_stream *tar, struct tar_header *th,
+			char *path)
+{
+	unsigned int len = 0;
+
+	if (tar->local.path)
+		len = strlen(tar->local.path);
+	else if (tar->longname)
+		len = strlen(tar->longname);
+	if (len >= PATH_MAX)
+		return -ENAMETOOLONG;
+	if (tar->local.path) {
+		strcpy(path, tar->local.path);
+		return 0;
+	}
+	if (tar->longname) {
+		strcpy(path, tar->longname);
+		return 0;
+	}
+
+	/* only POSIX ustar has the prefix field */
+	if (!memcmp(th->magic, "ustar", 6) && th->prefix[0]) {
+		tar_copy_field(path, th->prefix, sizeof(th->prefix));
+		len = strlen(path);
+		path[len++] = '/';
+	}
+	tar_copy_field(path + len, th->name, sizeof(th->name));
+	return 0;
+}
+
+static const char *tar_get_linkpath(struct tar_stream *tar,
+				    struct tar_header *th, char *buf)
+{
+	if (tar->local.linkpath)
+		return tar->local.linkpath;
+	if (tar->longlink)
+		return tar->longlink;
+	tar_copy_field(buf, th->linkname, sizeof(th->linkname));
+	return buf;
+}
+
+/* copy the data of the current member to the spool file */
+static int tar_spool(struct tar_stream *tar, u64 size)
+{
+	erofs_off_t pos;
+	int ret;
+
+	if (tar->spoolfd < 0) {
+		const char *tmpdir = getenv("TMPDIR");
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/erofs-tar.XXXXXX",
+			 tmpdir ? tmpdir : "/tmp");
+		tar->spoolfd = mkstemp(path);
+		if (tar->spoolfd < 0) {
+			ret = -errno;
+			erofs_err("failed to create a temporary file for tar: %s",
+				  erofs_strerror(ret));
+			return ret;
+		}
+		unlink(path);
+	}
+
+	for (pos = 0; pos < size; pos += sizeof(tar_buf)) {
+		const unsigned int count = min_t(u64, size - pos,
+						 sizeof(tar_buf));
+
+		ret = tar_read(tar, tar_buf, count);
+		if (ret)
+			return ret;
+		if (pwrite(tar->spoolfd, tar_buf, count, pos) != count)
+			return -errno;
+	}
+	return lseek(tar->spoolfd, 0, SEEK_SET) < 0 ? -errno : 0;
+}
+
+static int tar_write_file(struct tar_stream *tar, struct erofs_inode *inode,
+			  u64 size)
+{
+	int ret, fd = tar->fd;
+
+	/*
+	 * data from a pipe can't be read again uncompressed if it doesn't
+	 * compress.  It matters for small files, whose tail-end data could
+	 * be inlined then, so they're spooled to a temporary file first.
+	 */
+	if (!tar->seekable && cfg.c_compr_alg_master &&
+	    size <= TAR_SPOOL_MAX_SIZE) {
+		ret = tar_spool(tar, size);
+		if (ret)
+			return ret;
+		fd = tar->spoolfd;
+	}
+
+	ret = erofs_write_file_from_fd(inode, fd);
+	if (ret) {
+		erofs_err("failed to write %s: %s", inode->i_srcpath,
+			  erofs_strerror(ret));
+		return ret;
+	}
+	if (fd == tar->fd)
+		tar->pos += size;
+
+	ret = erofs_settle_file_data(inode);
+	if (ret)
+		return ret;
+	return tar_skip(tar, round_up(size, TAR_BLOCKSIZE) - size);
+}
+
+/* the file type of a member, or 0 if unsupported */
+static umode_t tar_typeflag_to_mode(char typeflag)
+{
+	switch (typeflag) {
+	case '0':
+	case '\0':
+	case '7':
+		return S_IFREG;
+	case '2':
+		return S_IFLNK;
+	case '3':
+		return S_IFCHR;
+	case '4':
+		return S_IFBLK;
+	case '5':
+		return S_IFDIR;
+	case '6':
+		return S_IFIFO;
+	}
+	return 0;
+}
+
+/* look up the target of a hardlink, which could have been excluded */
+static struct erofs_inode *tar_lookup_hardlink(struct erofs_inode *root,
+					       const char *target)
+{
+	struct erofs_inode *inode = ERR_PTR(-ENAMETOOLONG);
+	char path[PATH_MAX];
+
+	if (strlen(target) < PATH_MAX) {
+		strcpy(path, target);
+		inode = (void *)(long)erofs_rebuild_normalize_path(path);
+		if (!inode)
+			inode = erofs_rebuild_lookup(root, path);
+	}
+	if (IS_ERR(inode) || S_ISDIR(inode->i_mode)) {
+		erofs_warn("invalid hardlink target %s, skipped", target);
+		return NULL;
+	}
+	return inode;
+}
+
+static int tar_add_member(struct tar_stream *tar, struct erofs_inode *root,
+			  struct tar_header *th)
+{
+	struct tar_meta *const meta = &tar->local;
+	char path[PATH_MAX], linkbuf[sizeof(th->linkname) + 1];
+	u64 mode, uid, gid, size, major = 0, minor = 0;
+	struct erofs_inode *dir, *inode;
+	struct erofs_dentry *d;
+	const char *name, *linkpath;
+	umode_t type;
+	int ret;
+
+	ret = tar_get_path(tar, th, path);
+	if (ret)
+		return ret;
+
+	if (tar_parse_num(th->mode, sizeof(th->mode), &mode) ||
+	    tar_parse_num(th->uid, sizeof(th->uid), &uid) ||
+	    tar_parse_num(th->gid, sizeof(th->gid), &gid) ||
+	    tar_parse_num(th->size, sizeof(th->size), &size))
+		goto err_header;
+	if ((th->typeflag == '3' || th->typeflag == '4') &&
+	    (tar_parse_num(th->devmajor, sizeof(th->devmajor), &major) ||
+	     tar_parse_num(th->devminor, sizeof(th->devminor), &minor)))
+		goto err_header;
+
+	if (meta->has_size)
+		size = meta->size;
+	if (meta->has_uid)
+		uid = meta->uid;
+	else if (tar->global.has_uid)
+		uid = tar->global.uid;
+	if (meta->has_gid)
+		gid = meta->gid;
+	else if (tar->global.has_gid)
+		gid = tar->global.gid;
+	mode &= 07777;
+
+	type = tar_typeflag_to_mode(th->typeflag);
+	/* old archives mark directories with a trailing '/' only */
+	if (type == S_IFREG && *path && path[strlen(path) - 1] == '/')
+		type = S_IFDIR;
+
+	if (th->typeflag == 'S' || meta->sparse) {
+		erofs_warn("sparse file %s is unsupported, skipped", path);
+		return tar_skip_data(tar, size);
+	}
+	if (!type && th->typeflag != '1') {
+		erofs_warn("unsupported type '%c' of %s, skipped",
+			   th->typeflag, path);
+		return tar_skip_data(tar, size);
+	}
+
+	ret = erofs_rebuild_normalize_path(path);
+	if (ret) {
+		erofs_err("invalid path %s in tar stream", path);
+		return ret;
+	}
+
+	if (*path && erofs_rebuild_is_excluded(path))
+		return tar_skip_data(tar, size);
+
+	dir = erofs_rebuild_lookup_parent(root, path, true, &name);
+	if (IS_ERR(dir)) {
+		erofs_err("failed to look up the parent of %s: %s", path,
+			  erofs_strerror(PTR_ERR(dir)));
+		return PTR_ERR(dir);
+	}
+
+	/* the root directory itself */
+	if (!*name) {
+		if (type != S_IFDIR) {
+			erofs_err("the root of tar stream is not a directory");
+			return -ENOTDIR;
+		}
+		dir = root;
+		goto update_dir;
+	}
+
+	d = erofs_rebuild_find(dir, name, strlen(name));
+	if (d) {
+		inode = d->inode;
+		if (type == S_IFDIR && S_ISDIR(inode->i_mode)) {
+			dir = inode;
+			goto update_dir;
+		}
+		if (S_ISDIR(inode->i_mode)) {
+			erofs_err("directory %s cannot be replaced", path);
+			return -EISDIR;
+		}
+	}
+
+	linkpath = tar_get_linkpath(tar, th, linkbuf);
+	if (th->typeflag == '1') {
+		inode = tar_lookup_hardlink(root, linkpath);
+		if (!inode)
+			return tar_skip_data(tar, size);
+		++inode->i_nlink;
+		++inode->i_count;
+	} else {
+		if (type == S_IFLNK)
+			size = strlen(linkpath);
+		else if (type != S_IFREG)
+			size = 0;
+		inode = erofs_rebuild_new_inode(path, type | mode, uid, gid,
+						size, makedev(major, minor));
+		if (IS_ERR(inode))
+			return PTR_ERR(inode);
+	}
+
+	if (d) {
+		erofs_warn("%s appears more than once, the former is dropped",
+			   path);
+		--d->inode->i_nlink;
+		erofs_iput(d->inode);
+		d->inode = inode;
+	} else {
+		d = erofs_rebuild_add_dentry(dir, name, inode);
+		if (IS_ERR(d)) {
+			erofs_iput(inode);
+			return PTR_ERR(d);
+		}
+	}
+
+	if (th->typeflag == '1')
+		return tar_skip_data(tar, size);
+
+	if (S_ISDIR(inode->i_mode)) {
+		inode->i_parent = dir;
+		goto set_xattrs;
+	}
+
+	/* the xattr ibody size is needed to lay out compression indexes */
+	ret = erofs_prepare_xattr_ibody_from_list(inode, &meta->xattrs);
+	if (ret < 0)
+		return ret;
+	inode->xattr_isize = ret;
+
+	if (S_ISREG(inode->i_mode))
+		return tar_write_file(tar, inode, size);
+
+	if (S_ISLNK(inode->i_mode)) {
+		ret = erofs_write_file_from_buffer(inode, (char *)linkpath);
+		if (!ret)
+			ret = erofs_settle_file_data(inode);
+		if (ret)
+			return ret;
+		/* the data of a symlink member is always empty */
+		size = 0;
+	}
+	return tar_skip_data(tar, size);
+
+update_dir:
+	list_del(&dir->i_hash);
+	ret = erofs_rebuild_fill_inode(dir, path, S_IFDIR | mode, uid, gid,
+				       0, 0);
+	if (ret)
+		return ret;
+	erofs_drop_xattr_ibody(dir);
+	inode = dir;
+set_xattrs:
+	ret = erofs_prepare_xattr_ibody_from_list(inode, &meta->xattrs);
+	if (ret < 0)
+		return ret;
+	inode->xattr_isize = ret;
+	return tar_skip_data(tar, size);
+
+err_header:
+	erofs_err("invalid tar header of %s", path);
+	return -EIO;
+}
+
+static int tar_build_tree(struct tar_stream *tar, struct erofs_inode *root)
+{
+	struct tar_header th;
+	u64 size;
+	int ret;
+
+	while (1) {
+		ret = tar_read_header(tar, &th);
+		if (ret)
+			return ret < 0 ? ret : 0;
+
+		switch (th.typeflag) {
+		case 'x':
+		case 'g':
+		case 'L':
+		case 'K':
+			break;
+		default:
+			ret = tar_add_member(tar, root, &th);
+			free(tar->longname);
+			free(tar->longlink);
+			tar->longname = tar->longlink = NULL;
+			tar_reset_meta(&tar->local);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (tar_parse_num(th.size, sizeof(th.size), &size)) {
+			erofs_err("invalid tar header at %llu",
+				  (tar->pos - TAR_BLOCKSIZE) | 0ULL);
+			return -EIO;
+		}
+
+		if (th.typeflag == 'L') {
+			ret = tar_replace_longname(tar, &tar->longname, size);
+		} else if (th.typeflag == 'K') {
+			ret = tar_replace_longname(tar, &tar->longlink, size);
+		} else {
+			char *buf = tar_read_exthdr(tar, size);
+
+			if (IS_ERR(buf))
+				return PTR_ERR(buf);
+			ret = tar_parse_pax(th.typeflag == 'g' ? &tar->global :
+					    &tar->local, buf, size,
+					    th.typeflag == 'g');
+			free(buf);
+		}
+		if (ret)
+			return ret;
+	}
+}
+
+struct erofs_inode *erofs_mkfs_build_tree_from_tar(int fd)
+{
+	struct tar_stream tar = {
+		.fd = fd,
+		.spoolfd = -1,
+		.seekable = lseek(fd, 0, SEEK_CUR) >= 0,
+	};
+	struct erofs_inode *root;
+	int ret;
+
+	init_list_head(&tar.local.xattrs);
+	init_list_head(&tar.global.xattrs);
+
+	root = erofs_rebuild_make_root();
+	if (IS_ERR(root))
+		return root;
+
+	ret = tar_build_tree(&tar, root);
+	free(tar.longname);
+	free(tar.longlink);
+	tar_reset_meta(&tar.local);
+	tar_reset_meta(&tar.global);
+	erofs_rebuild_cleanup();
+	if (tar.spoolfd >= 0)
+		close(tar.spoolfd);
+	if (ret)
+		return ERR_PTR(ret);
+
+	/* drain the rest so that the writer of a pipe won't get EPIPE */
+	if (!tar.seekable)
+		while (erofs_read_fully(fd, tar_buf, sizeof(tar_buf)) > 0)
+			;
+	return erofs_mkfs_write_tree(root);
+}
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/trace.c
+ *
+ * Load a recorded access trace, and write the data of the traced (hot)
+ * files in the order of their first access ahead of the tree walk, so that
+ * it's laid out contiguously at the start of the data area instead of in
+ * the directory order.  Cold data and all metadata follow as usual.
+ *
+ * Each line is a path relative to the root followed by the offset and the
+ * length in bytes of an access, e.g.
+ *	system/bin/init 0 4096
+ *	system/lib/libc.so 8192 65536
+ *	etc/init.rc
+ * where the path can contain "\ooo" octal escapes, and a path alone stands
+ * for the whole file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "erofs/print.h"
+#include "erofs/cache.h"
+#include "erofs/inode.h"
+#include "erofs/exclude.h"
+#include "erofs/rebuild.h"
+#include "erofs/stats.h"
+#include "erofs/trace.h"
+#include "erofs/xattr.h"
+
+LIST_HEAD(erofs_trace_files);
+
+#define TRACE_HASHTABLE_BITS	12
+static DEFINE_HASHTABLE(trace_hashtable, TRACE_HASHTABLE_BITS);
+
+static unsigned int trace_hash(const char *path)
+{
+	unsigned int hash = 0;
+
+	while (*path)
+		hash = hash * 131 + (unsigned char)*path++;
+	return hash;
+}
+
+static struct erofs_trace_file *trace_get_file(const char *path)
+{
+	const unsigned int hash = trace_hash(path);
+	struct erofs_trace_file *tf;
+
+	hash_for_each_possible(trace_hashtable, tf, node, hash)
+		if (!strcmp(tf->path, path))
+			return tf;
+
+	tf = calloc(1, sizeof(*tf));
+	if (!tf)
+		return ERR_PTR(-ENOMEM);
+	tf->path = strdup(path);
+	if (!tf->path) {
+		free(tf);
+		return ERR_PTR(-ENOMEM);
+	}
+	hash_add(trace_hashtable, &tf->node, hash);
+	list_add_tail(&tf->list, &erofs_trace_files);
+	return tf;
+}
+
+static int trace_add_range(struct erofs_trace_file *tf, u64 start, u64 end)
+{
+	if (tf->nr_ranges >= tf->max_ranges) {
+		unsigned int nr = max(tf->max_ranges * 2, 4U);
+		struct erofs_trace_range *r =
+			realloc(tf->ranges, nr * sizeof(*r));
+
+		if (!r)
+			return -ENOMEM;
+		tf->ranges = r;
+		tf->max_ranges = nr;
+	}
+	tf->ranges[tf->nr_ranges++] = (struct erofs_trace_range) {
+		.start = start,
+		.end = end,
+	};
+	return 0;
+}
+
+/*
+ * parse a trace entry in place into the normalized path and the accessed
+ * range [@start, @end), which is the whole file if there is a path alone
+ */
+int erofs_trace_parse_entry(char *line, char **path, u64 *start, u64 *end)
+{
+	char *p = line, *tok, *endp;
+	u64 len = ~0ULL;
+	int ret;
+
+	*path = strsep(&p, " \t");
+	ret = erofs_rebuild_unescape(*path);
+	if (ret < 0 || (unsigned int)ret != strlen(*path))
+		return -EINVAL;
+	ret = erofs_rebuild_normalize_path(*path);
+	if (ret)
+		return ret;
+
+	*start = 0;
+	if (p)
+		p += strspn(p, " \t");
+	if (p && *p) {
+		tok = strsep(&p, " \t");
+		*start = strtoull(tok, &endp, 0);
+		if (*endp || !p)
+			return -EINVAL;
+		p += strspn(p, " \t");
+		tok = strsep(&p, " \t");
+		len = strtoull(tok, &endp, 0);
+		if (!*tok || *endp || (p && p[strspn(p, " \t")]))
+			return -EINVAL;
+	}
+	*end = *start + len < *start ? ~0ULL : *start + len;
+	return 0;
+}
+
+static int trace_parse_line(char *line)
+{
+	struct erofs_trace_file *tf;
+	u64 start, end;
+	char *path;
+	int ret;
+
+	ret = erofs_trace_parse_entry(line, &path, &start, &end);
+	/* the root directory has no data */
+	if (ret || !*path || start == end)
+		return ret;
+
+	tf = trace_get_file(path);
+	if (IS_ERR(tf))
+		return PTR_ERR(tf);
+	return trace_add_range(tf, start, end);
+}
+
+static int trace_range_cmp(const void *a, const void *b)
+{
+	const struct erofs_trace_range *ra = a, *rb = b;
+
+	if (ra->start != rb->start)
+		return ra->start < rb->start ? -1 : 1;
+	return 0;
+}
+
+/* sort and merge overlapping ranges of each file */
+static void trace_merge_ranges(struct erofs_trace_file *tf)
+{
+	unsigned int i, n = 0;
+
+	qsort(tf->ranges, tf->nr_ranges, sizeof(*tf->ranges),
+	      trace_range_cmp);
+	for (i = 0; i < tf->nr_ranges; ++i) {
+		if (n && tf->ranges[i].start <= tf->ranges[n - 1].end) {
+			tf->ranges[n - 1].end = max(tf->ranges[n - 1].end,
+						    tf->ranges[i].end);
+			continue;
+		}
+		tf->ranges[n++] = tf->ranges[i];
+	}
+	tf->nr_ranges = n;
+}
+
+int erofs_trace_load(const char *path)
+{
+	struct erofs_trace_file *tf;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+	int ret = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		ret = -errno;
+		erofs_err("failed to open access trace %s: %s", path,
+			  erofs_strerror(ret));
+		return ret;
+	}
+
+	while ((len = getline(&line, &n, fp)) >= 0) {
+		char *p = line;
+
+		++lineno;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		p += strspn(p, " \t");
+		if (!*p || *p == '#')
+			continue;
+
+		ret = trace_parse_line(p);
+		if (ret) {
+			erofs_err("invalid access trace entry at line %u: %s",
+				  lineno, erofs_strerror(ret));
+			break;
+		}
+	}
+	if (!ret && ferror(fp)) {
+		erofs_err("failed to read access trace %s", path);
+		ret = -EIO;
+	}
+	free(line);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	n = 0;
+	list_for_each_entry(tf, &erofs_trace_files, list) {
+		trace_merge_ranges(tf);
+		++n;
+	}
+	erofs_info("%u traced files loaded from %s", (unsigned int)n, path);
+	return 0;
+}
+
+/* bytes of the file in [@start, @end) which are accessed */
+u64 erofs_trace_bytes(struct erofs_trace_file *tf, u64 start, u64 end)
+{
+	u64 bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < tf->nr_ranges; ++i) {
+		const u64 s = max(tf->ranges[i].start, start);
+		const u64 e = min(tf->ranges[i].end, end);
+
+		if (s < e)
+			bytes += e - s;
+	}
+	return bytes;
+}
+
+/*
+ * check if the regular file at @path will be found by the tree walk, i.e.
+ * none of its components is excluded, and its parents are all directories.
+ */
+static bool trace_file_in_tree(char *path, unsigned int rootlen,
+			       struct stat64 *st)
+{
+	char *p = path + rootlen + 1, *e;
+
+	while (1) {
+		bool skip;
+
+		e = strchr(p, '/');
+		if (e)
+			*e = '\0';
+		skip = !strncmp(p, "lost+found", strlen("lost+found")) ||
+			erofs_is_exclude_path(NULL, path) ||
+			lstat64(path, st);
+		if (!e)
+			return !skip && S_ISREG(st->st_mode);
+		*e = '/';
+		if (skip || !S_ISDIR(st->st_mode))
+			return false;
+		p = e + 1;
+	}
+}
+
+int erofs_trace_write_hot_files(const char *srcpath)
+{
+	const unsigned int rootlen = strlen(srcpath);
+	struct erofs_trace_file *tf;
+	u64 hot = 0, sequential = 0;
+	unsigned int files = 0;
+	erofs_blk_t start;
+	int ret;
+
+	start = erofs_mapbh(NULL, true);
+	list_for_each_entry(tf, &erofs_trace_files, list) {
+		struct erofs_inode *inode;
+		char path[PATH_MAX];
+		struct stat64 st;
+
+		ret = snprintf(path, PATH_MAX, "%s/%s", srcpath, tf->path);
+		if (ret < 0 || ret >= PATH_MAX ||
+		    !trace_file_in_tree(path, rootlen, &st) || !st.st_size) {
+			erofs_dbg("skip traced file %s", tf->path);
+			continue;
+		}
+
+		inode = erofs_iget_from_path(path, true);
+		if (IS_ERR(inode))
+			return PTR_ERR(inode);
+		/* another link to the same data */
+		if (inode->i_data_written) {
+			erofs_iput(inode);
+			continue;
+		}
+
+		/* compression indexes are laid out right after xattrs */
+		ret = erofs_prepare_xattr_ibody(inode);
+		if (ret >= 0) {
+			inode->xattr_isize = ret;
+			ret = erofs_write_file(inode);
+		}
+		if (!ret)
+			ret = erofs_settle_file_data(inode);
+		if (ret) {
+			erofs_err("failed to write hot file %s: %s", path,
+				  erofs_strerror(ret));
+			erofs_iput(inode);
+			return ret;
+		}
+		inode->i_data_written = true;
+		/* held until the tree walk finds it */
+		tf->inode = inode;
+
+		hot += erofs_trace_bytes(tf, 0, inode->i_size);
+		/* the inline tail-end data is read along with the inode */
+		sequential += erofs_trace_bytes(tf, 0,
+					inode->i_size - inode->idata_size);
+		++files;
+	}
+
+	erofs_stat_add(EROFS_STAT_HOT_FILES, files);
+	erofs_stat_add(EROFS_STAT_HOT_BYTES, hot);
+	erofs_stat_add(EROFS_STAT_HOT_SEQUENTIAL_BYTES, sequential);
+	erofs_stat_add(EROFS_STAT_HOT_BLOCKS, erofs_mapbh(NULL, true) - start);
+	erofs_info("%u hot files written from block %u", files, start);
+	return 0;
+}
+
+void erofs_trace_exit(void)
+{
+	struct erofs_trace_file *tf, *n;
+
+	list_for_each_entry_safe(tf, n, &erofs_trace_files, list) {
+		if (tf->inode)
+			erofs_iput(tf->inode);
+		hash_del(&tf->node);
+		list_del(&tf->list);
+		free(tf->ranges);
+		free(tf->path);
+		free(tf);
+	}
+}
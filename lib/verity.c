@@ -0,0 +1,405 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/verity.c
+ *
+ * Build the dm-verity hash tree (format 1, sha256) while the image is being
+ * written, so that `veritysetup format' and its full read of the image are
+ * no longer needed.  Hashes of the data blocks are calculated as soon as
+ * they are completely written; only blocks overwritten later are re-read.
+ */
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "erofs/io.h"
+#include "erofs/print.h"
+#include "erofs/hashtable.h"
+#include "erofs/sha256.h"
+#include "erofs/verity.h"
+
+#define VERITY_DEFAULT_SALT_SIZE	32
+#define VERITY_DIGEST_SIZE		EROFS_SHA256_DIGEST_SIZE
+
+/* the block has been overwritten, so its hash has to be recalculated */
+#define VERITY_DIRTY	((u32)-1)
+
+struct verity_state {
+	/* bytes which have been written sequentially from the block start */
+	u32 filled;
+	/* revoked after written, so unwritten ranges aren't zeroed anymore */
+	bool stale;
+};
+
+/* hash contexts of the data blocks which are partially written */
+struct verity_pending {
+	struct hlist_node node;
+	u64 blkaddr;
+	struct erofs_sha256_state ctx;
+};
+
+bool erofs_verity_enabled;
+static unsigned int verity_blkszbits;
+static u8 verity_salt[EROFS_VERITY_MAX_SALT_SIZE];
+static unsigned int verity_saltsize;
+
+static struct verity_state *verity;
+static u8 (*verity_digests)[VERITY_DIGEST_SIZE];
+static u64 verity_nr;
+/* tracking failed, so all hashes have to be calculated from the image */
+static bool verity_broken;
+
+#define VERITY_PENDING_HASHTABLE_BITS	8
+static DEFINE_HASHTABLE(verity_pending_hashtable,
+			VERITY_PENDING_HASHTABLE_BITS);
+
+static const u8 zeroed[EROFS_MAX_BLOCK_SIZE];
+
+int erofs_verity_init(unsigned int blksize, const u8 *salt, int saltsize)
+{
+	unsigned int bits = ilog2(blksize);
+
+	if (blksize != 1U << bits || bits < 9 || bits > LOG_BLOCK_SIZE) {
+		erofs_err("invalid verity block size %u", blksize);
+		return -EINVAL;
+	}
+	verity_blkszbits = bits;
+
+	if (saltsize > EROFS_VERITY_MAX_SALT_SIZE) {
+		erofs_err("verity salt is too long (%d bytes)", saltsize);
+		return -EINVAL;
+	}
+
+	if (saltsize < 0) {
+		int fd = open("/dev/urandom", O_RDONLY);
+
+		if (fd < 0) {
+			erofs_err("failed to open /dev/urandom for verity salt");
+			return -errno;
+		}
+		saltsize = VERITY_DEFAULT_SALT_SIZE;
+		if (read(fd, verity_salt, saltsize) != saltsize) {
+			close(fd);
+			erofs_err("failed to generate verity salt");
+			return -EIO;
+		}
+		close(fd);
+	} else {
+		memcpy(verity_salt, salt, saltsize);
+	}
+	verity_saltsize = saltsize;
+	erofs_verity_enabled = true;
+	return 0;
+}
+
+static void verity_hash_begin(struct erofs_sha256_state *ctx)
+{
+	erofs_sha256_init(ctx);
+	erofs_sha256_process(ctx, verity_salt, verity_saltsize);
+}
+
+static void verity_hash(const void *in, size_t len, u8 *out)
+{
+	struct erofs_sha256_state ctx;
+
+	verity_hash_begin(&ctx);
+	erofs_sha256_process(&ctx, in, len);
+	erofs_sha256_done(&ctx, out);
+}
+
+static int verity_grow(u64 blkaddr)
+{
+	u64 nr = max_t(u64, verity_nr * 2, 256);
+	struct verity_state *n;
+	void *d;
+
+	while (nr <= blkaddr)
+		nr *= 2;
+
+	n = realloc(verity, nr * sizeof(*n));
+	if (!n)
+		return -ENOMEM;
+	memset(n + verity_nr, 0, (nr - verity_nr) * sizeof(*n));
+	verity = n;
+
+	d = realloc(verity_digests, nr * VERITY_DIGEST_SIZE);
+	if (!d)
+		return -ENOMEM;
+	verity_digests = d;
+	verity_nr = nr;
+	return 0;
+}
+
+static struct verity_pending *verity_find_pending(u64 blkaddr)
+{
+	struct verity_pending *p;
+
+	hash_for_each_possible(verity_pending_hashtable, p, node, blkaddr)
+		if (p->blkaddr == blkaddr)
+			return p;
+	return NULL;
+}
+
+static void verity_drop_pending(u64 blkaddr)
+{
+	struct verity_pending *p = verity_find_pending(blkaddr);
+
+	if (p) {
+		hash_del(&p->node);
+		free(p);
+	}
+}
+
+static void verity_feed(u64 blkaddr, const u8 *in,
+			unsigned int off, unsigned int cnt)
+{
+	const unsigned int blksz = 1U << verity_blkszbits;
+	struct verity_state *s = verity + blkaddr;
+	struct verity_pending *p;
+
+	if (s->filled == VERITY_DIRTY)
+		return;
+
+	/* overwritten, or the hole may still keep revoked data */
+	if (off < s->filled || (s->stale && off > s->filled)) {
+		verity_drop_pending(blkaddr);
+		s->filled = VERITY_DIRTY;
+		return;
+	}
+
+	/* the common case, the whole block is written at once */
+	if (!off && cnt == blksz) {
+		verity_hash(in ? in : zeroed, blksz, verity_digests[blkaddr]);
+		s->filled = blksz;
+		return;
+	}
+
+	if (!s->filled) {
+		p = malloc(sizeof(*p));
+		if (!p) {
+			erofs_warn("out of memory, verity hashes will be calculated by reading the image");
+			verity_broken = true;
+			return;
+		}
+		p->blkaddr = blkaddr;
+		verity_hash_begin(&p->ctx);
+		hash_add(verity_pending_hashtable, &p->node, blkaddr);
+	} else {
+		p = verity_find_pending(blkaddr);
+		DBG_BUGON(!p);
+	}
+
+	/* holes between two writes are zeroed */
+	if (off > s->filled)
+		erofs_sha256_process(&p->ctx, zeroed, off - s->filled);
+	erofs_sha256_process(&p->ctx, in ? in : zeroed, cnt);
+	s->filled = off + cnt;
+
+	if (s->filled == blksz) {
+		erofs_sha256_done(&p->ctx, verity_digests[blkaddr]);
+		hash_del(&p->node);
+		free(p);
+	}
+}
+
+/* called for each dev_write(), NULL buf means zeroed data */
+void erofs_verity_update(const void *buf, u64 offset, size_t len)
+{
+	const unsigned int blksz = 1U << verity_blkszbits;
+	const u8 *in = buf;
+
+	while (len && !verity_broken) {
+		const u64 blkaddr = offset >> verity_blkszbits;
+		const unsigned int off = offset & (blksz - 1);
+		const unsigned int cnt = min_t(u64, len, blksz - off);
+
+		if (blkaddr >= verity_nr && verity_grow(blkaddr)) {
+			erofs_warn("out of memory, verity hashes will be calculated by reading the image");
+			verity_broken = true;
+			return;
+		}
+
+		verity_feed(blkaddr, in, off, cnt);
+		offset += cnt;
+		len -= cnt;
+		if (in)
+			in += cnt;
+	}
+}
+
+/* blocks written before will be reused, e.g. by the uncompressed fallback */
+void erofs_verity_revoke(erofs_blk_t blkaddr, erofs_blk_t nblocks)
+{
+	const unsigned int shift = LOG_BLOCK_SIZE - verity_blkszbits;
+	u64 i = (u64)blkaddr << shift;
+	u64 end = min_t(u64, (u64)(blkaddr + nblocks) << shift, verity_nr);
+
+	for (; i < end; ++i) {
+		if (verity[i].filled) {
+			if (verity[i].filled != VERITY_DIRTY)
+				verity_drop_pending(i);
+			verity[i].filled = 0;
+			verity[i].stale = true;
+		}
+	}
+}
+
+static int verity_finalize(u64 blkaddr, u8 *digest, unsigned int *reread)
+{
+	const unsigned int blksz = 1U << verity_blkszbits;
+	struct verity_state *s = blkaddr < verity_nr ? verity + blkaddr : NULL;
+	struct verity_pending *p;
+	u8 buf[EROFS_MAX_BLOCK_SIZE];
+	int ret;
+
+	if (verity_broken)
+		goto reread;
+
+	if (s && s->stale && s->filled != blksz)
+		goto reread;
+
+	if (!s || !s->filled) {
+		verity_hash(zeroed, blksz, digest);
+		return 0;
+	}
+
+	if (s->filled == blksz) {
+		memcpy(digest, verity_digests[blkaddr], VERITY_DIGEST_SIZE);
+		return 0;
+	}
+
+	if (s->filled != VERITY_DIRTY) {
+		p = verity_find_pending(blkaddr);
+		DBG_BUGON(!p);
+		erofs_sha256_process(&p->ctx, zeroed, blksz - s->filled);
+		erofs_sha256_done(&p->ctx, digest);
+		hash_del(&p->node);
+		free(p);
+		return 0;
+	}
+
+reread:
+	ret = dev_read(buf, blkaddr << verity_blkszbits, blksz);
+	if (ret)
+		return ret;
+	++*reread;
+	verity_hash(buf, blksz, digest);
+	return 0;
+}
+
+static void verity_print_hex(const char *title, const u8 *in, unsigned int len)
+{
+	unsigned int i;
+
+	fputs(title, stdout);
+	if (!len)
+		fputc('-', stdout);
+	for (i = 0; i < len; ++i)
+		fprintf(stdout, "%02x", in[i]);
+	fputc('\n', stdout);
+}
+
+/*
+ * write the verity superblock and hash tree right after the image, i.e.
+ * the same layout as `veritysetup format --hash-offset=<image size>'.
+ */
+int erofs_verity_write(erofs_blk_t blocks)
+{
+	const unsigned int blksz = 1U << verity_blkszbits;
+	/* all digests are 32 bytes, so there are 2^bits digests per block */
+	const unsigned int bits = verity_blkszbits - ilog2(VERITY_DIGEST_SIZE);
+	const u64 datablocks = (u64)blocks << (LOG_BLOCK_SIZE - verity_blkszbits);
+	const u64 hashoff = blknr_to_addr(blocks);
+	u64 levelpos[64], levelsize[64], treeblocks, i, j;
+	u8 roothash[VERITY_DIGEST_SIZE];
+	struct erofs_verity_sb *sb;
+	unsigned int levels, reread = 0;
+	u8 *tree;
+	int ret;
+
+	/* don't track hash tree writes */
+	erofs_verity_enabled = false;
+
+	levels = 0;
+	while (bits * levels < 64 && (datablocks - 1) >> (bits * levels))
+		++levels;
+
+	/* the highest level is at the beginning of the hash area */
+	treeblocks = 0;
+	for (i = levels; i; --i) {
+		levelpos[i - 1] = treeblocks;
+		levelsize[i - 1] = (datablocks + (1ULL << (i * bits)) - 1) >>
+			(i * bits);
+		treeblocks += levelsize[i - 1];
+	}
+
+	/* the first block is the verity superblock */
+	tree = calloc(treeblocks + 1, blksz);
+	if (!tree)
+		return -ENOMEM;
+	sb = (struct erofs_verity_sb *)tree;
+
+	for (i = 0; i < datablocks; ++i) {
+		u8 *digest = levels ? tree + (levelpos[0] + 1) * blksz +
+			i * VERITY_DIGEST_SIZE : roothash;
+
+		ret = verity_finalize(i, digest, &reread);
+		if (ret)
+			goto out;
+	}
+
+	for (i = 1; i < levels; ++i) {
+		u8 *src = tree + (levelpos[i - 1] + 1) * blksz;
+		u8 *dst = tree + (levelpos[i] + 1) * blksz;
+
+		for (j = 0; j < levelsize[i - 1]; ++j)
+			verity_hash(src + j * blksz, blksz,
+				    dst + j * VERITY_DIGEST_SIZE);
+	}
+	if (levels)
+		verity_hash(tree + (levelpos[levels - 1] + 1) * blksz, blksz,
+			    roothash);
+
+	memcpy(sb->signature, "verity\0\0", sizeof(sb->signature));
+	sb->version = cpu_to_le32(1);
+	sb->hash_type = cpu_to_le32(1);
+	memcpy(sb->uuid, sbi.uuid, sizeof(sb->uuid));
+	strcpy((char *)sb->algorithm, "sha256");
+	sb->data_block_size = cpu_to_le32(blksz);
+	sb->hash_block_size = cpu_to_le32(blksz);
+	sb->data_blocks = cpu_to_le64(datablocks);
+	sb->salt_size = cpu_to_le16(verity_saltsize);
+	memcpy(sb->salt, verity_salt, verity_saltsize);
+
+	ret = dev_write(tree, hashoff, (treeblocks + 1) * blksz);
+	if (ret)
+		goto out;
+
+	erofs_info("verity hash tree: %u level(s), %llu blocks, %u blocks re-read",
+		   levels, treeblocks | 0ULL, reread);
+	fprintf(stdout, "Verity hash offset:\t%llu\n", hashoff | 0ULL);
+	fprintf(stdout, "Verity data blocks:\t%llu\n", datablocks | 0ULL);
+	fprintf(stdout, "Verity block size:\t%u\n", blksz);
+	verity_print_hex("Verity salt:\t\t", verity_salt, verity_saltsize);
+	verity_print_hex("Verity root hash:\t", roothash, sizeof(roothash));
+out:
+	free(tree);
+	return ret;
+}
+
+void erofs_verity_exit(void)
+{
+	struct verity_pending *p;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(verity_pending_hashtable, bkt, tmp, p, node) {
+		hash_del(&p->node);
+		free(p);
+	}
+	free(verity);
+	free(verity_digests);
+	verity = NULL;
+	verity_digests = NULL;
+	verity_nr = 0;
+	verity_broken = false;
+	erofs_verity_enabled = false;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs_utils/lib/workqueue.c
+ *
+ * A minimal thread pool for tools which read images, e.g. to decompress
+ * pclusters in parallel.  The queue is bounded so that the producer blocks
+ * rather than buffering works without limit.
+ */
+#include <stdlib.h>
+#include "erofs/print.h"
+#include "erofs/workqueue.h"
+
+static void *erofs_workqueue_fn(void *arg)
+{
+	struct erofs_workqueue *wq = arg;
+	struct erofs_work *work;
+
+	pthread_mutex_lock(&wq->lock);
+	while (1) {
+		while (list_empty(&wq->head) && !wq->shutdown)
+			pthread_cond_wait(&wq->cond_work, &wq->lock);
+		if (list_empty(&wq->head))
+			break;
+		work = list_first_entry(&wq->head, struct erofs_work, list);
+		list_del(&work->list);
+		if (wq->nr_queued-- == wq->max_queued)
+			pthread_cond_signal(&wq->cond_space);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->fn(work);
+		pthread_mutex_lock(&wq->lock);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+/* with no workers, works are run by erofs_queue_work() itself */
+int erofs_workqueue_init(struct erofs_workqueue *wq, unsigned int nr_workers,
+			 unsigned int max_queued)
+{
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond_work, NULL);
+	pthread_cond_init(&wq->cond_space, NULL);
+	init_list_head(&wq->head);
+	wq->nr_queued = 0;
+	wq->max_queued = max(max_queued, 1U);
+	wq->shutdown = false;
+	wq->nr_workers = 0;
+	wq->workers = NULL;
+	if (!nr_workers)
+		return 0;
+
+	wq->workers = calloc(nr_workers, sizeof(*wq->workers));
+	if (!wq->workers)
+		return -ENOMEM;
+	for (i = 0; i < nr_workers; ++i) {
+		ret = -pthread_create(&wq->workers[i], NULL,
+				      erofs_workqueue_fn, wq);
+		if (ret) {
+			erofs_err("failed to create worker %u: %s", i,
+				  erofs_strerror(ret));
+			erofs_workqueue_exit(wq);
+			return ret;
+		}
+		++wq->nr_workers;
+	}
+	return 0;
+}
+
+void erofs_queue_work(struct erofs_workqueue *wq, struct erofs_work *work)
+{
+	if (!wq->nr_workers) {
+		work->fn(work);
+		return;
+	}
+	pthread_mutex_lock(&wq->lock);
+	while (wq->nr_queued >= wq->max_queued)
+		pthread_cond_wait(&wq->cond_space, &wq->lock);
+	list_add_tail(&work->list, &wq->head);
+	++wq->nr_queued;
+	pthread_cond_signal(&wq->cond_work);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* wait for all queued works to finish, and stop the workers */
+void erofs_workqueue_exit(struct erofs_workqueue *wq)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->shutdown = true;
+	pthread_cond_broadcast(&wq->cond_work);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nr_workers; ++i)
+		pthread_join(wq->workers[i], NULL);
+	free(wq->workers);
+	wq->workers = NULL;
+	wq->nr_workers = 0;
+	pthread_cond_destroy(&wq->cond_space);
+	pthread_cond_destroy(&wq->cond_work);
+	pthread_mutex_destroy(&wq->lock);
+}
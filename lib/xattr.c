@@ -20,6 +20,7 @@
 #include "erofs/cache.h"
 
 #define EA_HASHTABLE_BITS 16
+#define EA_SETS_HASHTABLE_BITS 12
 
 struct xattr_item {
 	const char *kvbuf;
@@ -34,7 +35,17 @@ struct inode_xattr_node {
 	struct xattr_item *item;
 };
 
+/* an interned inline xattr ibody shared by inodes with the same xattrs */
+struct inode_xattr_set {
+	struct hlist_node node;
+	unsigned int hash, count;
+	unsigned int nr, size;
+	char *ibody;
+	struct xattr_item *items[0];
+};
+
 static DECLARE_HASHTABLE(ea_hashtable, EA_HASHTABLE_BITS);
+static DECLARE_HASHTABLE(ea_sets_hashtable, EA_SETS_HASHTABLE_BITS);
 
 static LIST_HEAD(shared_xattrs_list);
 static unsigned int shared_xattrs_count, shared_xattrs_size;
@@ -86,6 +97,8 @@ static unsigned int put_xattritem(struct xattr_item *item)
 {
 	if (item->count > 1)
 		return --item->count;
+	hash_del(&item->node);
+	free((char *)item->kvbuf);
 	free(item);
 	return 0;
 }
@@ -275,37 +288,283 @@ err:
 
 }
 
-int erofs_prepare_xattr_ibody(const char *path, struct list_head *ixattrs)
+static int xattr_item_cmp(const void *a, const void *b)
 {
+	const struct xattr_item *ia = *(const struct xattr_item **)a;
+	const struct xattr_item *ib = *(const struct xattr_item **)b;
 	int ret;
-	struct inode_xattr_node *node;
 
-	/* check if xattr is disabled */
-	if (cfg.c_inline_xattr_tolerance < 0)
-		return 0;
+	if (ia->prefix != ib->prefix)
+		return ia->prefix < ib->prefix ? -1 : 1;
 
-	ret = read_xattrs_from_file(path, ixattrs);
-	if (ret < 0)
+	ret = memcmp(ia->kvbuf, ib->kvbuf, min(ia->len[0], ib->len[0]));
+	if (ret)
 		return ret;
+	return cmpsgn(ia->len[0], ib->len[0]);
+}
 
-	if (list_empty(ixattrs))
-		return 0;
+static unsigned int xattr_set_hash(struct xattr_item **items, unsigned int nr)
+{
+	unsigned int i, hash = nr;
 
-	/* get xattr ibody size */
-	ret = sizeof(struct erofs_xattr_ibody_header);
-	list_for_each_entry(node, ixattrs, list) {
-		const struct xattr_item *item = node->item;
+	for (i = 0; i < nr; ++i)
+		hash = hash * 31 + (items[i]->prefix ^ items[i]->hash[0] ^
+				    items[i]->hash[1]);
+	return hash;
+}
+
+static unsigned int xattr_set_ibody_size(struct xattr_item **items,
+					 unsigned int nr)
+{
+	unsigned int i, size = sizeof(struct erofs_xattr_ibody_header);
+
+	for (i = 0; i < nr; ++i) {
+		const struct xattr_item *item = items[i];
 
 		if (item->shared_xattr_id >= 0) {
-			ret += sizeof(__le32);
+			size += sizeof(__le32);
 			continue;
 		}
-		ret += sizeof(struct erofs_xattr_entry);
-		ret = EROFS_XATTR_ALIGN(ret + item->len[0] + item->len[1]);
+		size += sizeof(struct erofs_xattr_entry);
+		size = EROFS_XATTR_ALIGN(size + item->len[0] + item->len[1]);
+	}
+	return size;
+}
+
+static char *xattr_set_export(struct xattr_item **items, unsigned int nr,
+			      unsigned int size)
+{
+	struct erofs_xattr_ibody_header *header;
+	unsigned int i, p;
+	char *buf = calloc(1, size);
+
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	header = (struct erofs_xattr_ibody_header *)buf;
+	header->h_shared_count = 0;
+
+	/* shared xattr ids go first, followed by all inline xattrs */
+	p = sizeof(struct erofs_xattr_ibody_header);
+	for (i = 0; i < nr; ++i) {
+		if (items[i]->shared_xattr_id < 0)
+			continue;
+
+		*(__le32 *)(buf + p) = cpu_to_le32(items[i]->shared_xattr_id);
+		p += sizeof(__le32);
+		++header->h_shared_count;
+	}
+
+	for (i = 0; i < nr; ++i) {
+		const struct xattr_item *item = items[i];
+		const struct erofs_xattr_entry entry = {
+			.e_name_index = item->prefix,
+			.e_name_len = item->len[0],
+			.e_value_size = cpu_to_le16(item->len[1])
+		};
+
+		if (item->shared_xattr_id >= 0)
+			continue;
+
+		memcpy(buf + p, &entry, sizeof(entry));
+		p += sizeof(struct erofs_xattr_entry);
+		memcpy(buf + p, item->kvbuf, item->len[0] + item->len[1]);
+		p = EROFS_XATTR_ALIGN(p + item->len[0] + item->len[1]);
+	}
+	DBG_BUGON(p > size);
+	return buf;
+}
+
+/*
+ * look up the interned set of the given (sorted) xattr items, or create
+ * one.  References of items are always consumed by this function.
+ */
+static struct inode_xattr_set *get_xattrset(struct xattr_item **items,
+					    unsigned int nr)
+{
+	const unsigned int hash = xattr_set_hash(items, nr);
+	struct inode_xattr_set *set;
+	unsigned int i;
+	char *ibody;
+
+	hash_for_each_possible(ea_sets_hashtable, set, node, hash) {
+		if (set->hash != hash || set->nr != nr)
+			continue;
+
+		for (i = 0; i < nr; ++i)
+			if (set->items[i] != items[i])
+				break;
+		if (i < nr)
+			continue;
+
+		for (i = 0; i < nr; ++i)
+			put_xattritem(items[i]);
+		++set->count;
+		return set;
+	}
+
+	set = malloc(sizeof(*set) + nr * sizeof(items[0]));
+	if (!set) {
+		ibody = ERR_PTR(-ENOMEM);
+		goto err;
+	}
+	set->size = xattr_set_ibody_size(items, nr);
+	ibody = xattr_set_export(items, nr, set->size);
+	if (IS_ERR(ibody)) {
+		free(set);
+		goto err;
+	}
+	INIT_HLIST_NODE(&set->node);
+	set->ibody = ibody;
+	set->hash = hash;
+	set->count = 1;
+	set->nr = nr;
+	memcpy(set->items, items, nr * sizeof(items[0]));
+	hash_add(ea_sets_hashtable, &set->node, hash);
+	return set;
+err:
+	for (i = 0; i < nr; ++i)
+		put_xattritem(items[i]);
+	return (void *)ibody;
+}
+
+static void put_xattrset(struct inode_xattr_set *set)
+{
+	unsigned int i;
+
+	if (--set->count)
+		return;
+
+	hash_del(&set->node);
+	for (i = 0; i < set->nr; ++i)
+		put_xattritem(set->items[i]);
+	free(set->ibody);
+	free(set);
+}
+
+/* add an xattr of the full name @key, replacing the one of the same name */
+int erofs_xattr_list_add(struct list_head *ixattrs, const char *key,
+			 const char *value, unsigned int size)
+{
+	struct inode_xattr_node *node;
+	struct xattr_item *item;
+	unsigned int len[2];
+	u16 prefixlen;
+	char *kvbuf;
+	u8 prefix;
+	int ret;
+
+	if (!match_prefix(key, &prefix, &prefixlen))
+		return -ENODATA;
+
+	len[0] = strlen(key) - prefixlen;
+	len[1] = size;
+	if (len[0] > EROFS_NAME_LEN || len[1] > USHRT_MAX)
+		return -ERANGE;
+
+	kvbuf = malloc(len[0] + len[1]);
+	if (!kvbuf)
+		return -ENOMEM;
+	memcpy(kvbuf, key + prefixlen, len[0]);
+	memcpy(kvbuf + len[0], value, len[1]);
+
+	item = get_xattritem(prefix, kvbuf, len);
+	if (IS_ERR(item))
+		return PTR_ERR(item);
+
+	list_for_each_entry(node, ixattrs, list) {
+		if (node->item->prefix != prefix ||
+		    node->item->len[0] != len[0] ||
+		    memcmp(node->item->kvbuf, item->kvbuf, len[0]))
+			continue;
+		put_xattritem(node->item);
+		node->item = item;
+		return 0;
 	}
+
+	ret = inode_xattr_add(ixattrs, item);
+	if (ret)
+		put_xattritem(item);
 	return ret;
 }
 
+void erofs_xattr_list_free(struct list_head *ixattrs)
+{
+	struct inode_xattr_node *node, *n;
+
+	list_for_each_entry_safe(node, n, ixattrs, list) {
+		list_del(&node->list);
+		put_xattritem(node->item);
+		free(node);
+	}
+}
+
+/* set up the inline xattr ibody of @inode from @ixattrs, which is emptied */
+int erofs_prepare_xattr_ibody_from_list(struct erofs_inode *inode,
+					struct list_head *ixattrs)
+{
+	struct xattr_item *onstack[16], **items = onstack;
+	struct inode_xattr_node *node, *n;
+	struct inode_xattr_set *set;
+	unsigned int nr;
+
+	/* check if xattr is disabled */
+	if (cfg.c_inline_xattr_tolerance < 0) {
+		erofs_xattr_list_free(ixattrs);
+		return 0;
+	}
+
+	nr = 0;
+	list_for_each_entry(node, ixattrs, list)
+		++nr;
+	if (!nr)
+		return 0;
+
+	if (nr > ARRAY_SIZE(onstack)) {
+		items = malloc(nr * sizeof(*items));
+		if (!items) {
+			erofs_xattr_list_free(ixattrs);
+			return -ENOMEM;
+		}
+	}
+
+	nr = 0;
+	list_for_each_entry_safe(node, n, ixattrs, list) {
+		items[nr++] = node->item;
+		list_del(&node->list);
+		free(node);
+	}
+
+	/* so that the same xattrs in any order will share one ibody */
+	qsort(items, nr, sizeof(*items), xattr_item_cmp);
+
+	set = get_xattrset(items, nr);
+	if (items != onstack)
+		free(items);
+	if (IS_ERR(set))
+		return PTR_ERR(set);
+
+	inode->i_xattrs = set;
+	return set->size;
+}
+
+int erofs_prepare_xattr_ibody(struct erofs_inode *inode)
+{
+	LIST_HEAD(ixattrs);
+	int ret;
+
+	/* check if xattr is disabled */
+	if (cfg.c_inline_xattr_tolerance < 0)
+		return 0;
+
+	ret = read_xattrs_from_file(inode->i_srcpath, &ixattrs);
+	if (ret < 0) {
+		erofs_xattr_list_free(&ixattrs);
+		return ret;
+	}
+	return erofs_prepare_xattr_ibody_from_list(inode, &ixattrs);
+}
+
 static int erofs_count_all_xattrs_from_path(const char *path)
 {
 	int ret;
@@ -375,12 +634,14 @@ static void erofs_cleanxattrs(bool sharedxattrs)
 {
 	unsigned int i;
 	struct xattr_item *item;
+	struct hlist_node *tmp;
 
-	hash_for_each(ea_hashtable, i, item, node) {
+	hash_for_each_safe(ea_hashtable, i, tmp, item, node) {
 		if (sharedxattrs && item->shared_xattr_id >= 0)
 			continue;
 
 		hash_del(&item->node);
+		free((char *)item->kvbuf);
 		free(item);
 	}
 
@@ -460,57 +721,17 @@ out:
 	return 0;
 }
 
-char *erofs_export_xattr_ibody(struct list_head *ixattrs, unsigned int size)
+const char *erofs_export_xattr_ibody(struct erofs_inode *inode)
 {
-	struct inode_xattr_node *node, *n;
-	struct erofs_xattr_ibody_header *header;
-	LIST_HEAD(ilst);
-	unsigned int p;
-	char *buf = calloc(1, size);
-
-	if (!buf)
-		return ERR_PTR(-ENOMEM);
-
-	header = (struct erofs_xattr_ibody_header *)buf;
-	header->h_shared_count = 0;
-
-	p = sizeof(struct erofs_xattr_ibody_header);
-	list_for_each_entry_safe(node, n, ixattrs, list) {
-		struct xattr_item *const item = node->item;
-
-		list_del(&node->list);
-
-		/* move inline xattrs to the onstack list */
-		if (item->shared_xattr_id < 0) {
-			list_add(&node->list, &ilst);
-			continue;
-		}
-
-		*(__le32 *)(buf + p) = cpu_to_le32(item->shared_xattr_id);
-		p += sizeof(__le32);
-		++header->h_shared_count;
-		free(node);
-		put_xattritem(item);
-	}
-
-	list_for_each_entry_safe(node, n, &ilst, list) {
-		struct xattr_item *const item = node->item;
-		const struct erofs_xattr_entry entry = {
-			.e_name_index = item->prefix,
-			.e_name_len = item->len[0],
-			.e_value_size = cpu_to_le16(item->len[1])
-		};
-
-		memcpy(buf + p, &entry, sizeof(entry));
-		p += sizeof(struct erofs_xattr_entry);
-		memcpy(buf + p, item->kvbuf, item->len[0] + item->len[1]);
-		p = EROFS_XATTR_ALIGN(p + item->len[0] + item->len[1]);
-
-		list_del(&node->list);
-		free(node);
-		put_xattritem(item);
-	}
-	DBG_BUGON(p > size);
-	return buf;
+	DBG_BUGON(!inode->i_xattrs);
+	DBG_BUGON(inode->i_xattrs->size != inode->xattr_isize);
+	return inode->i_xattrs->ibody;
 }
 
+void erofs_drop_xattr_ibody(struct erofs_inode *inode)
+{
+	if (!inode->i_xattrs)
+		return;
+	put_xattrset(inode->i_xattrs);
+	inode->i_xattrs = NULL;
+}
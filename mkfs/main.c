@@ -11,7 +11,9 @@
 #include <sys/time.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <math.h>
 #include <libgen.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <getopt.h>
 #include "erofs/config.h"
@@ -22,17 +24,40 @@
 #include "erofs/compress.h"
 #include "erofs/xattr.h"
 #include "erofs/exclude.h"
+#include "erofs/crc32c.h"
+#include "erofs/blkcsum.h"
+#include "erofs/verity.h"
+#include "erofs/stats.h"
+#include "erofs/budget.h"
+#include "erofs/tar.h"
+#include "erofs/manifest.h"
+#include "erofs/incremental.h"
+#include "erofs/trace.h"
 
 #ifdef HAVE_LIBUUID
 #include <uuid/uuid.h>
 #endif
 
 #define EROFS_SUPER_END (EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block))
+/* larger I/O units only pad files with more zeroes */
+#define EROFS_DATA_ALIGN_MAX	(1U << 30)
 
 static struct option long_options[] = {
 	{"help", no_argument, 0, 1},
 	{"exclude-path", required_argument, NULL, 2},
 	{"exclude-regex", required_argument, NULL, 3},
+	{"blkcsum", required_argument, NULL, 4},
+	{"verity", optional_argument, NULL, 5},
+	{"report", required_argument, NULL, 6},
+	{"estimate", optional_argument, NULL, 7},
+	{"max-size", required_argument, NULL, 8},
+	{"max-memory", required_argument, NULL, 9},
+	{"tar", required_argument, NULL, 10},
+	{"manifest", required_argument, NULL, 11},
+	{"cache-index", required_argument, NULL, 12},
+	{"incremental", required_argument, NULL, 13},
+	{"access-trace", required_argument, NULL, 14},
+	{"align-data", optional_argument, NULL, 15},
 	{0, 0, 0, 0},
 };
 
@@ -51,15 +76,37 @@ static void print_available_compressors(FILE *f, const char *delim)
 
 static void usage(void)
 {
-	fputs("usage: [options] FILE DIRECTORY\n\n"
+	fputs("usage: [options] FILE DIRECTORY\n"
+	      "       --estimate[=#] [options] DIRECTORY\n"
+	      "       --tar=X [options] FILE\n"
+	      "       --manifest=X [options] FILE [DIRECTORY]\n\n"
 	      "Generate erofs image from DIRECTORY to FILE, and [options] are:\n"
 	      " -zX[,Y]           X=compressor (Y=compression level, optional)\n"
 	      " -d#               set output message level to # (maximum 9)\n"
 	      " -x#               set xattr tolerance to # (< 0, disable xattrs; default 2)\n"
 	      " -EX[,...]         X=extended options\n"
 	      " -T#               set a fixed UNIX timestamp # to all files\n"
+	      " -b#               set block size to # (a power of 2 from 4096 to 65536)\n"
 	      " --exclude-path=X  avoid including file X (X = exact literal path)\n"
 	      " --exclude-regex=X avoid including files that match X (X = regular expression)\n"
+	      " --blkcsum=X       write crc32c checksums of all image blocks to file X\n"
+	      " --verity[=X[,Y]]  append dm-verity hash tree (X=hex salt or -, Y=block size,\n"
+	      "                   default: the filesystem block size)\n"
+	      " --report=X        write a JSON report of phase timings and counters to X\n"
+	      " --estimate[=#]    estimate the image size by compressing # percent of data\n"
+	      "                   (default 10) without writing the image\n"
+	      " --max-size=#      choose per-file compression so that the image fits # bytes\n"
+	      " --max-memory=#    flush buffers early to keep inodes in memory under # MiB\n"
+	      " --tar=X           build from the tar archive X (- for stdin) instead of DIRECTORY\n"
+	      " --manifest=X      build from the manifest X (- for stdin), where the contents\n"
+	      "                   of files are relative to DIRECTORY if given\n"
+	      " --cache-index=X   write the cache index of compressed files to X\n"
+	      " --incremental=X,Y reuse unchanged compressed files of the previous image X\n"
+	      "                   with its cache index Y\n"
+	      " --access-trace=X  lay out the data of files in the access trace X first,\n"
+	      "                   in the order of their first access\n"
+	      " --align-data[=#]  align file data to I/O units of # bytes (default: the\n"
+	      "                   optimal I/O size of the device)\n"
 	      " --help            display this help and exit\n"
 	      "\nAvailable compressors are: ", stderr);
 	print_available_compressors(stderr, ", ");
@@ -118,6 +165,18 @@ static int parse_extended_opts(const char *opts)
 			cfg.c_force_inodeversion = FORCE_INODE_EXTENDED;
 		}
 
+		if (MATCH_EXTENTED_OPT("cluster-inodes", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_cluster_inodes = true;
+		}
+
+		if (MATCH_EXTENTED_OPT("pack-inodes", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_pack_inodes = true;
+		}
+
 		if (MATCH_EXTENTED_OPT("nosbcrc", token, keylen)) {
 			if (vallen)
 				return -EINVAL;
@@ -127,12 +186,75 @@ static int parse_extended_opts(const char *opts)
 	return 0;
 }
 
+static int parse_verity_opts(const char *opts)
+{
+	u8 salt[EROFS_VERITY_MAX_SALT_SIZE];
+	unsigned int blksize = EROFS_BLKSIZ;
+	int saltsize = -1;
+	const char *p;
+	char *endptr;
+
+	if (!opts)
+		return erofs_verity_init(blksize, NULL, -1);
+
+	p = strchr(opts, ',');
+	if (p) {
+		blksize = strtoul(p + 1, &endptr, 0);
+		if (*endptr != '\0')
+			return -EINVAL;
+	} else {
+		p = opts + strlen(opts);
+	}
+
+	if (p - opts == 1 && *opts == '-') {
+		saltsize = 0;
+	} else if (p > opts) {
+		if ((p - opts) & 1 || p - opts > 2 * sizeof(salt))
+			return -EINVAL;
+		for (saltsize = 0; opts < p; opts += 2, ++saltsize) {
+			char hex[3] = { opts[0], opts[1], '\0' };
+
+			salt[saltsize] = strtoul(hex, &endptr, 16);
+			if (*endptr != '\0')
+				return -EINVAL;
+		}
+	}
+	return erofs_verity_init(blksize, salt, saltsize);
+}
+
+/* open "IMAGE,INDEX" of the previous build before FILE is truncated */
+static int mkfs_open_incremental(char *opts, const char *imgpath)
+{
+	char *index = strrchr(opts, ',');
+	struct stat64 st[2];
+
+	if (!index) {
+		erofs_err("invalid incremental options: %s", opts);
+		return -EINVAL;
+	}
+	*index++ = '\0';
+
+	if (!stat64(opts, &st[0]) && !stat64(imgpath, &st[1]) &&
+	    st[0].st_dev == st[1].st_dev && st[0].st_ino == st[1].st_ino) {
+		erofs_err("the previous image %s cannot be overwritten", opts);
+		return -EINVAL;
+	}
+	return erofs_incremental_open(opts, index);
+}
+
+/* query the optimal I/O size of the device once it's opened */
+static bool mkfs_align_data_auto;
+
 static int mkfs_parse_options_cfg(int argc, char *argv[])
 {
+	const char *verity_opts = NULL;
+	char *incremental = NULL;
+	bool verity = false;
+	unsigned long align;
 	char *endptr;
 	int opt, i;
 
-	while((opt = getopt_long(argc, argv, "d:x:z:E:T:",
+	while((opt = getopt_long(argc, argv, "d:x:z:E:T:b:",
 				 long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'z':
@@ -182,6 +304,15 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 				return -EINVAL;
 			}
 			break;
+		case 'b':
+			i = strtol(optarg, &endptr, 0);
+			if (*endptr != '\0' || i < PAGE_SIZE ||
+			    i > EROFS_MAX_BLOCK_SIZE || (i & (i - 1))) {
+				erofs_err("invalid block size %s", optarg);
+				return -EINVAL;
+			}
+			sbi.blkszbits = ffs(i) - 1;
+			break;
 		case 2:
 			opt = erofs_parse_exclude_path(optarg, false);
 			if (opt) {
@@ -198,6 +329,73 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 				return opt;
 			}
 			break;
+		case 4:
+			cfg.c_blkcsum_path = optarg;
+			erofs_blkcsum_enabled = true;
+			break;
+		case 5:
+			/* parsed later since it depends on the block size */
+			verity_opts = optarg;
+			verity = true;
+			break;
+		case 6:
+			cfg.c_report_path = optarg;
+			break;
+		case 7:
+			cfg.c_estimate_pct = 10;
+			if (optarg) {
+				cfg.c_estimate_pct = strtoul(optarg, &endptr, 0);
+				if (*endptr != '\0' || !cfg.c_estimate_pct ||
+				    cfg.c_estimate_pct > 100) {
+					erofs_err("invalid sample percentage %s",
+						  optarg);
+					return -EINVAL;
+				}
+			}
+			cfg.c_dry_run = true;
+			break;
+		case 8:
+			cfg.c_max_size = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || !cfg.c_max_size) {
+				erofs_err("invalid image size %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 9:
+			cfg.c_max_memory = strtoull(optarg, &endptr, 0) << 20;
+			if (*endptr != '\0' || !cfg.c_max_memory) {
+				erofs_err("invalid memory size %s", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 10:
+			cfg.c_tar_path = optarg;
+			break;
+		case 11:
+			cfg.c_manifest_path = optarg;
+			break;
+		case 12:
+			cfg.c_cache_index_path = optarg;
+			break;
+		case 13:
+			incremental = optarg;
+			break;
+		case 14:
+			cfg.c_access_trace_path = optarg;
+			break;
+		case 15:
+			if (!optarg) {
+				mkfs_align_data_auto = true;
+				break;
+			}
+			align = strtoul(optarg, &endptr, 0);
+			if (*endptr != '\0' || !align ||
+			    align > EROFS_DATA_ALIGN_MAX) {
+				erofs_err("invalid I/O unit %s", optarg);
+				return -EINVAL;
+			}
+			cfg.c_data_align = align;
+			break;
 		case 1:
 			usage();
 			exit(0);
@@ -210,22 +408,97 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 	if (optind >= argc)
 		return -EINVAL;
 
-	cfg.c_img_path = strdup(argv[optind++]);
-	if (!cfg.c_img_path)
-		return -ENOMEM;
+	if (verity) {
+		opt = parse_verity_opts(verity_opts);
+		if (opt) {
+			erofs_err("failed to parse verity options: %s",
+				  verity_opts ? verity_opts : "(default)");
+			return opt;
+		}
+	}
+
+	/* checked here since it depends on the block size */
+	if (cfg.c_data_align % EROFS_BLKSIZ) {
+		erofs_err("I/O unit %u isn't a multiple of the block size %u",
+			  cfg.c_data_align, EROFS_BLKSIZ);
+		return -EINVAL;
+	}
+
+	/* compacted indexes can encode lclusters of up to 16KiB */
+	if (LOG_BLOCK_SIZE > 14 && !cfg.c_legacy_compress) {
+		erofs_info("use legacy indexes for %u-byte blocks",
+			   EROFS_BLKSIZ);
+		cfg.c_legacy_compress = true;
+	}
+
+	if (cfg.c_cache_index_path || incremental) {
+		/* the data from a tar stream can't be hashed in advance */
+		if (cfg.c_tar_path || cfg.c_estimate_pct) {
+			erofs_err("--cache-index and --incremental cannot be used with --tar or --estimate");
+			return -EINVAL;
+		}
+		if (incremental) {
+			opt = mkfs_open_incremental(incremental, argv[optind]);
+			if (opt)
+				return opt;
+		}
+	}
+
+	if (cfg.c_tar_path || cfg.c_manifest_path) {
+		/* files are already written in the order they're listed */
+		if (cfg.c_access_trace_path) {
+			erofs_err("--access-trace cannot be used with --%s",
+				  cfg.c_tar_path ? "tar" : "manifest");
+			return -EINVAL;
+		}
+		/* both read source files more than once */
+		if (cfg.c_estimate_pct || cfg.c_max_size) {
+			erofs_err("--%s cannot be used with --estimate or --max-size",
+				  cfg.c_tar_path ? "tar" : "manifest");
+			return -EINVAL;
+		}
+		if (cfg.c_tar_path && cfg.c_manifest_path) {
+			erofs_err("--tar cannot be used with --manifest");
+			return -EINVAL;
+		}
+		cfg.c_img_path = strdup(argv[optind++]);
+		if (!cfg.c_img_path)
+			return -ENOMEM;
+		/* the contents of files in a manifest could be relative */
+		if (cfg.c_manifest_path && optind < argc)
+			goto srcpath;
+		goto out;
+	}
+
+	if (cfg.c_estimate_pct) {
+		if (erofs_verity_enabled || cfg.c_blkcsum_path) {
+			erofs_err("--estimate cannot be used with --verity or --blkcsum");
+			return -EINVAL;
+		}
+		/* the image isn't written, so FILE would be silently ignored */
+		if (optind + 1 != argc) {
+			erofs_err("--estimate doesn't write an image, so FILE must be omitted");
+			return -EINVAL;
+		}
+		goto srcpath;
+	} else {
+		cfg.c_img_path = strdup(argv[optind++]);
+		if (!cfg.c_img_path)
+			return -ENOMEM;
+	}
 
 	if (optind >= argc) {
 		erofs_err("Source directory is missing");
 		return -EINVAL;
 	}
-
+srcpath:
 	cfg.c_src_path = realpath(argv[optind++], NULL);
 	if (!cfg.c_src_path) {
 		erofs_err("Failed to parse source directory: %s",
 			  erofs_strerror(-errno));
 		return -ENOENT;
 	}
-
+out:
 	if (optind < argc) {
 		erofs_err("Unexpected argument: %s\n", argv[optind]);
 		return -EINVAL;
@@ -233,6 +506,24 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 	return 0;
 }
 
+/*
+ * write the superblock with its own size rather than up to the next buffer,
+ * which could have been flushed and freed early with --max-memory.
+ */
+static bool erofs_mkfs_flush_super_block(struct erofs_buffer_head *bh)
+{
+	int err = dev_write(bh->fsprivate, 0, EROFS_SUPER_END);
+
+	if (err)
+		return false;
+	free(bh->fsprivate);
+	return erofs_bh_flush_generic_end(bh);
+}
+
+static struct erofs_bhops erofs_mkfs_super_block_bhops = {
+	.flush = erofs_mkfs_flush_super_block,
+};
+
 int erofs_mkfs_update_super_block(struct erofs_buffer_head *bh,
 				  erofs_nid_t root_nid,
 				  erofs_blk_t *blocks)
@@ -268,27 +559,51 @@ int erofs_mkfs_update_super_block(struct erofs_buffer_head *bh,
 	memcpy(buf + EROFS_SUPER_OFFSET, &sb, sizeof(sb));
 
 	bh->fsprivate = buf;
-	bh->op = &erofs_buf_write_bhops;
+	bh->op = &erofs_mkfs_super_block_bhops;
 	return 0;
 }
 
-#define CRC32C_POLY_LE	0x82F63B78
-static inline u32 crc32c(u32 crc, const u8 *in, size_t len)
+static void erofs_mkfs_print_estimate(erofs_blk_t nblocks)
 {
-	int i;
+	const struct z_erofs_estimate *e = &z_erofs_estimate;
+	/* 95% confidence interval of the normal approximation */
+	const double delta = 1.96 * sqrt(e->var);
+	const erofs_blk_t lo = nblocks > delta ? nblocks - delta : 0;
+	const erofs_blk_t hi = nblocks + delta + 0.5;
+
+	fprintf(stdout, "Estimated image size:\t%llu bytes (%u blocks)\n",
+		blknr_to_addr(nblocks) | 0ULL, nblocks);
+	fprintf(stdout, "95%% confidence:\t\t[%llu, %llu] bytes\n",
+		blknr_to_addr(lo) | 0ULL, blknr_to_addr(hi) | 0ULL);
+	fprintf(stdout, "Compressed samples:\t%llu of %llu bytes\n",
+		e->sampled | 0ULL, e->total | 0ULL);
+}
 
-	while (len--) {
-		crc ^= *in++;
-		for (i = 0; i < 8; i++)
-			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY_LE : 0);
-	}
-	return crc;
+static void erofs_mkfs_print_hot_data(void)
+{
+	fprintf(stdout, "Hot data:\t%llu of %llu traced bytes laid out sequentially\n",
+		erofs_stats[EROFS_STAT_HOT_SEQUENTIAL_BYTES] | 0ULL,
+		erofs_stats[EROFS_STAT_HOT_BYTES] | 0ULL);
+	fprintf(stdout, "Hot files:\t%llu in %llu blocks\n",
+		erofs_stats[EROFS_STAT_HOT_FILES] | 0ULL,
+		erofs_stats[EROFS_STAT_HOT_BLOCKS] | 0ULL);
+}
+
+static void erofs_mkfs_print_alignment(erofs_blk_t nblocks)
+{
+	const u64 padding = erofs_stats[EROFS_STAT_ALIGN_PADDING_BLOCKS];
+
+	fprintf(stdout, "Alignment padding:\t%llu blocks (%.2f%%) for %llu files "
+		"aligned to %u bytes\n",
+		padding | 0ULL, nblocks ? 100.0 * padding / nblocks : 0,
+		erofs_stats[EROFS_STAT_ALIGNED_FILES] | 0ULL,
+		cfg.c_data_align);
 }
 
 static int erofs_mkfs_superblock_csum_set(void)
 {
 	int ret;
-	u8 buf[EROFS_BLKSIZ];
+	u8 buf[EROFS_MAX_BLOCK_SIZE];
 	u32 crc;
 	struct erofs_super_block *sb;
 
@@ -313,7 +628,7 @@ static int erofs_mkfs_superblock_csum_set(void)
 	/* turn on checksum feature */
 	sb->feature_compat = cpu_to_le32(le32_to_cpu(sb->feature_compat) |
 					 EROFS_FEATURE_COMPAT_SB_CHKSUM);
-	crc = crc32c(~0, (u8 *)sb, EROFS_BLKSIZ - EROFS_SUPER_OFFSET);
+	crc = erofs_crc32c(~0, (u8 *)sb, EROFS_BLKSIZ - EROFS_SUPER_OFFSET);
 
 	/* set up checksum field to erofs_super_block */
 	sb->checksum = cpu_to_le32(crc);
@@ -352,7 +667,10 @@ int main(int argc, char **argv)
 	struct stat64 st;
 	erofs_blk_t nblocks;
 	struct timeval t;
+	int tarfd = -1;
+	FILE *manifest = NULL;
 
+	erofs_phase_begin(EROFS_PHASE_TOTAL);
 	erofs_init_configure();
 	fprintf(stderr, "%s %s\n", basename(argv[0]), cfg.c_version);
 
@@ -367,10 +685,35 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	err = lstat64(cfg.c_src_path, &st);
-	if (err)
+	if (cfg.c_tar_path) {
+		tarfd = STDIN_FILENO;
+		if (strcmp(cfg.c_tar_path, "-")) {
+			tarfd = open(cfg.c_tar_path, O_RDONLY | O_BINARY);
+			if (tarfd < 0) {
+				erofs_err("failed to open %s: %s",
+					  cfg.c_tar_path,
+					  erofs_strerror(-errno));
+				return 1;
+			}
+		}
+	} else if (cfg.c_manifest_path) {
+		manifest = stdin;
+		if (strcmp(cfg.c_manifest_path, "-")) {
+			manifest = fopen(cfg.c_manifest_path, "r");
+			if (!manifest) {
+				erofs_err("failed to open %s: %s",
+					  cfg.c_manifest_path,
+					  erofs_strerror(-errno));
+				return 1;
+			}
+		}
+	}
+
+	if (!cfg.c_src_path) {
+		/* nothing to check for a tar stream or a manifest only */
+	} else if (lstat64(cfg.c_src_path, &st)) {
 		return 1;
-	if ((st.st_mode & S_IFMT) != S_IFDIR) {
+	} else if ((st.st_mode & S_IFMT) != S_IFDIR) {
 		erofs_err("root of the filesystem is not a directory - %s",
 			  cfg.c_src_path);
 		usage();
@@ -385,14 +728,32 @@ int main(int argc, char **argv)
 		sbi.build_time_nsec = t.tv_usec;
 	}
 
-	err = dev_open(cfg.c_img_path);
-	if (err) {
-		usage();
-		return 1;
+	if (!cfg.c_estimate_pct) {
+		err = dev_open(cfg.c_img_path);
+		if (err) {
+			usage();
+			return 1;
+		}
+	}
+
+	if (mkfs_align_data_auto) {
+		const unsigned int ioopt = dev_optimal_io_size();
+
+		if (ioopt > EROFS_BLKSIZ && ioopt <= EROFS_DATA_ALIGN_MAX &&
+		    !(ioopt % EROFS_BLKSIZ)) {
+			cfg.c_data_align = ioopt;
+			erofs_info("align file data to the optimal I/O size %u",
+				   ioopt);
+		} else {
+			erofs_warn("no usable optimal I/O size (%u), file data isn't aligned",
+				   ioopt);
+		}
 	}
 
 	erofs_show_config();
-	erofs_exclude_set_root(cfg.c_src_path);
+	/* paths in a tar stream or a manifest are relative to its root */
+	erofs_exclude_set_root(cfg.c_tar_path || cfg.c_manifest_path ? "" :
+			       cfg.c_src_path);
 
 	sb_bh = erofs_buffer_init();
 	if (IS_ERR(sb_bh)) {
@@ -407,6 +768,13 @@ int main(int argc, char **argv)
 			  erofs_strerror(err));
 		goto exit;
 	}
+	/*
+	 * the heaviest compressor available is used if none is given, or
+	 * files are just left uncompressed if there is no compressor
+	 */
+	if (cfg.c_max_size && !cfg.c_compr_alg_master)
+		cfg.c_compr_alg_master =
+			(char *)erofs_budget_heaviest_compressor();
 
 	err = z_erofs_compress_init();
 	if (err) {
@@ -418,14 +786,67 @@ int main(int argc, char **argv)
 	erofs_mkfs_generate_uuid();
 	erofs_inode_manager_init();
 
+	if (cfg.c_cache_index_path) {
+		err = erofs_cache_index_open(cfg.c_cache_index_path);
+		if (err)
+			goto exit;
+	}
+
+	if (cfg.c_tar_path || cfg.c_manifest_path) {
+		/*
+		 * the root inode is written after all data, so no inode
+		 * should be placed before it in the superblock block.
+		 */
+		err = erofs_bh_balloon(sb_bh, EROFS_BLKSIZ - EROFS_SUPER_END);
+		if (err < 0) {
+			erofs_err("Failed to balloon erofs_super_block: %s",
+				  erofs_strerror(err));
+			goto exit;
+		}
+
+		erofs_phase_begin(EROFS_PHASE_TREE_WALK);
+		if (cfg.c_tar_path)
+			root_inode = erofs_mkfs_build_tree_from_tar(tarfd);
+		else
+			root_inode = erofs_mkfs_build_tree_from_manifest(manifest,
+							cfg.c_src_path);
+		erofs_phase_end(EROFS_PHASE_TREE_WALK);
+		goto root_built;
+	}
+
+	erofs_phase_begin(EROFS_PHASE_XATTR_PRESCAN);
 	err = erofs_build_shared_xattrs_from_path(cfg.c_src_path);
+	erofs_phase_end(EROFS_PHASE_XATTR_PRESCAN);
 	if (err) {
 		erofs_err("Failed to build shared xattrs: %s",
 			  erofs_strerror(err));
 		goto exit;
 	}
 
+	if (cfg.c_max_size) {
+		erofs_phase_begin(EROFS_PHASE_BUDGET);
+		err = erofs_budget_plan(cfg.c_src_path, cfg.c_max_size);
+		erofs_phase_end(EROFS_PHASE_BUDGET);
+		if (err)
+			goto exit;
+	}
+
+	if (cfg.c_access_trace_path) {
+		erofs_phase_begin(EROFS_PHASE_HOT_DATA);
+		err = erofs_trace_load(cfg.c_access_trace_path);
+		if (!err)
+			err = erofs_trace_write_hot_files(cfg.c_src_path);
+		erofs_phase_end(EROFS_PHASE_HOT_DATA);
+		if (err)
+			goto exit;
+	}
+
+	erofs_phase_begin(EROFS_PHASE_TREE_WALK);
 	root_inode = erofs_mkfs_build_tree_from_path(NULL, cfg.c_src_path);
+	erofs_phase_end(EROFS_PHASE_TREE_WALK);
+	/* all hot files have been found by the tree walk */
+	erofs_trace_exit();
+root_built:
 	if (IS_ERR(root_inode)) {
 		err = PTR_ERR(root_inode);
 		goto exit;
@@ -438,18 +859,83 @@ int main(int argc, char **argv)
 	if (err)
 		goto exit;
 
+	erofs_stats[EROFS_STAT_IMAGE_BLOCKS] = nblocks;
+
+	if (cfg.c_max_size && blknr_to_addr(nblocks) > cfg.c_max_size) {
+		erofs_err("image size %llu bytes exceeds --max-size %llu bytes",
+			  blknr_to_addr(nblocks) | 0ULL, cfg.c_max_size | 0ULL);
+		err = -ENOSPC;
+		goto exit;
+	}
+
 	/* flush all remaining buffers */
+	erofs_phase_begin(EROFS_PHASE_BFLUSH);
 	if (!erofs_bflush(NULL))
 		err = -EIO;
-	else
+	erofs_phase_end(EROFS_PHASE_BFLUSH);
+
+	if (!err) {
+		erofs_phase_begin(EROFS_PHASE_RESIZE);
 		err = dev_resize(nblocks);
+		erofs_phase_end(EROFS_PHASE_RESIZE);
+	}
 
-	if (!err && erofs_sb_has_sb_chksum())
+	if (!err && cfg.c_estimate_pct)
+		erofs_mkfs_print_estimate(nblocks);
+	else if (!err && erofs_sb_has_sb_chksum()) {
+		erofs_phase_begin(EROFS_PHASE_SB_CHECKSUM);
 		err = erofs_mkfs_superblock_csum_set();
+		erofs_phase_end(EROFS_PHASE_SB_CHECKSUM);
+	}
+
+	if (!err && erofs_verity_enabled) {
+		erofs_phase_begin(EROFS_PHASE_VERITY);
+		err = erofs_verity_write(nblocks);
+		erofs_phase_end(EROFS_PHASE_VERITY);
+	}
+
+	if (!err && cfg.c_blkcsum_path) {
+		erofs_phase_begin(EROFS_PHASE_BLKCSUM);
+		err = erofs_blkcsum_write(cfg.c_blkcsum_path, nblocks);
+		erofs_phase_end(EROFS_PHASE_BLKCSUM);
+	}
+
+	if (!err && erofs_cache_index_enabled)
+		err = erofs_cache_index_close();
+
+	if (!err && cfg.c_access_trace_path)
+		erofs_mkfs_print_hot_data();
+	if (!err && cfg.c_cluster_inodes)
+		fprintf(stdout, "Metadata blocks per directory:\t%.2f\n",
+			erofs_stats[EROFS_STAT_DIRS] ?
+			(double)erofs_stats[EROFS_STAT_DIR_META_BLOCKS] /
+			erofs_stats[EROFS_STAT_DIRS] : 0);
+	if (!err && cfg.c_pack_inodes)
+		fprintf(stdout, "Metadata blocks:\t%llu\n",
+			erofs_stats[EROFS_STAT_META_BLOCKS] | 0ULL);
+	if (!err && cfg.c_data_align)
+		erofs_mkfs_print_alignment(nblocks);
+	else if (!err && mkfs_align_data_auto)
+		fprintf(stdout,
+			"Alignment padding:\tnone, no usable optimal I/O size\n");
 exit:
 	z_erofs_compress_exit();
+	erofs_blkcsum_exit();
+	erofs_verity_exit();
+	erofs_budget_exit();
+	erofs_incremental_exit();
+	erofs_trace_exit();
 	dev_close();
+	if (tarfd > STDIN_FILENO)
+		close(tarfd);
+	if (manifest && manifest != stdin)
+		fclose(manifest);
 	erofs_cleanup_exclude_rules();
+
+	erofs_phase_end(EROFS_PHASE_TOTAL);
+	if (cfg.c_report_path && erofs_stats_report(cfg.c_report_path, err) &&
+	    !err)
+		err = -EIO;
 	erofs_exit_configure();
 
 	if (err) {